@@ -7,14 +7,52 @@ typedef enum {
     RECORD_MODE_STANDARD = 0,
     RECORD_MODE_SEQUENTIAL,
     RECORD_MODE_FRAGMENTED,
+    /* Index-free streams: MPEG-TS, or the raw H.265 stream with a timestamp file. */
+    RECORD_MODE_TS,
+    RECORD_MODE_ANNEXB,
 } RecordMode;
 
+typedef enum {
+    PACING_MODE_LATENCY = 0,
+    PACING_MODE_SMOOTH,
+    /* Async flips: no vblank wait at all, tearing accepted. */
+    PACING_MODE_TEARING,
+} PacingMode;
+
+typedef enum {
+    MODE_POLICY_MAX = 0,
+    MODE_POLICY_STREAM,
+    MODE_POLICY_FIXED,
+} ModePolicy;
+
 typedef struct {
     int enable;
     char output_path[PATH_MAX];
     RecordMode mode;
+    /* Fragmented mode: longest fragment; 0 ends fragments only at keyframes. */
+    int fragment_ms;
+    /* Start a new file at the first keyframe past either limit; 0 = no limit. */
+    int segment_s;
+    int segment_mb;
+    /* Delete the oldest recordings to keep them within this many MB; 0 = keep everything. */
+    int budget_mb;
+    /* Instant replay: a recording starts with up to this much of the stream before it; 0 = off. */
+    int preroll_s;
+    int preroll_mb;
+    /* Storage pressure: IRAP pictures only below twice this much free space, pause below it; 0 = ignore. */
+    int min_free_mb;
+    /* Run the recorder in a helper process fed through a shared-memory ring. */
+    int helper;
 } RecordCfg;
 
+/* Extra outputs showing the same video; the first head is connector_name/plane_id. */
+#define APP_MAX_MIRRORS 3
+
+typedef struct {
+    char connector_name[32];
+    int plane_id;
+} MirrorCfg;
+
 typedef struct {
     char card_path[64];
     char connector_name[32];
@@ -26,6 +64,19 @@ typedef struct {
     int  jitter_buffer_ms;
     int appsink_max_buffers;
     int gst_log;
+    PacingMode pacing_mode;
+    ModePolicy mode_policy;
+    /* MODE_POLICY_FIXED only; mode_hz 0 takes the highest refresh at that size. */
+    int mode_w;
+    int mode_h;
+    int mode_hz;
+    /* Enable variable refresh when the sink reports vrr_capable. */
+    int vrr;
+    MirrorCfg mirrors[APP_MAX_MIRRORS];
+    int mirror_count;
+    /* Link stats overlay; osd_plane 0 picks a free ARGB plane on the video CRTC. */
+    int osd;
+    int osd_plane_id;
 
     RecordCfg record;
 } AppCfg;
@@ -35,5 +86,11 @@ void cfg_defaults(AppCfg *cfg);
 int cfg_load_file(const char *path, AppCfg *cfg);
 int cfg_parse_record_mode(const char *value, RecordMode *mode_out);
 const char *cfg_record_mode_name(RecordMode mode);
+int cfg_parse_pacing_mode(const char *value, PacingMode *mode_out);
+const char *cfg_pacing_mode_name(PacingMode mode);
+int cfg_parse_mode_policy(const char *value, AppCfg *cfg);
+const char *cfg_mode_policy_name(ModePolicy policy);
+/* Adds one or more comma-separated CONNECTOR:PLANE mirror heads. */
+int cfg_add_mirrors(const char *value, AppCfg *cfg);
 
 #endif // CONFIG_H
@@ -0,0 +1,157 @@
+#ifndef DRM_DISPLAY_H
+#define DRM_DISPLAY_H
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "drm_modeset.h"
+#include "frame_pacer.h"
+
+typedef struct DrmDisplay DrmDisplay;
+
+typedef enum {
+    /* Frames wait for the fixed vblank the pacer assigns them. */
+    DRM_PRESENT_FIXED = 0,
+    /* Variable refresh: a frame is committed as soon as it is ready, no faster than the sink's maximum rate. */
+    DRM_PRESENT_VRR,
+    /* Async page flips: the new buffer is latched mid-scanout, tearing accepted. */
+    DRM_PRESENT_ASYNC,
+    DRM_PRESENT_MODE_COUNT,
+} DrmPresentMode;
+
+/* Where the OSD plane goes; zpos properties left at 0 are not written. */
+typedef struct {
+    uint32_t plane_id;
+    int x;
+    int y;
+    int w;
+    int h;
+    uint32_t zpos_prop;
+    uint64_t zpos;
+    /* Lowers the video plane when the OSD plane cannot be stacked above it otherwise. */
+    uint32_t video_zpos_prop;
+    uint64_t video_zpos;
+} DrmOverlayPlacement;
+
+/*
+ * Called once the display no longer needs the buffer behind a submitted fb:
+ * either the next flip retired it from scanout or a newer frame replaced it
+ * before it was ever committed.
+ */
+typedef void (*DrmDisplayReleaseFn)(void *token);
+
+/* Flips per CRTC; for lock-step mirrors also how far their flip landed from the lead's. */
+typedef struct {
+    uint32_t connector_id;
+    uint32_t crtc_id;
+    guint64 flips;
+    guint64 last_flip_ns;
+    guint64 skew_ns;
+    guint64 skew_max_ns;
+} DrmHeadStats;
+
+typedef struct {
+    guint64 frames_submitted;
+    guint64 frames_presented;
+    guint64 frames_superseded;
+    guint64 missed_vblanks;
+    guint64 commit_failures;
+    guint64 commit_busy;
+    guint64 last_flip_ns;
+    guint64 last_flip_interval_ns;
+    guint32 last_flip_sequence;
+    /* Commits that only patched FB_ID versus ones that (re)placed the plane. */
+    guint64 commits_fast;
+    guint64 commits_full;
+    guint64 commit_build_ns;
+    guint64 commit_build_max_ns;
+    guint64 commit_ioctl_ns;
+    guint64 commit_ioctl_max_ns;
+    guint64 mode_changes;
+    guint64 mode_change_failures;
+    /* Decoded (submitted) to on screen (flip event), per present mode. */
+    DrmPresentMode present_mode;
+    guint64 flip_latency_frames[DRM_PRESENT_MODE_COUNT];
+    guint64 flip_latency_ns[DRM_PRESENT_MODE_COUNT];
+    guint64 flip_latency_max_ns[DRM_PRESENT_MODE_COUNT];
+    /* Async flips and how many of them landed while the panel was scanning out (i.e. tore). */
+    guint64 async_flips;
+    guint64 async_flips_torn;
+    guint64 async_flips_unmeasured;
+    guint64 async_fallbacks;
+    /* heads[0] is the lead CRTC, the rest its lock-step mirrors. */
+    guint head_count;
+    DrmHeadStats heads[DRM_MAX_HEADS];
+    /* OSD updates that rode on a video commit, went out alone because the video stalled, or were refused. */
+    guint64 overlay_commits_shared;
+    guint64 overlay_commits_alone;
+    guint64 overlay_failures;
+    FramePacerStats pacing;
+} DrmDisplayStats;
+
+DrmDisplay *drm_display_new(int drm_fd, const AppCfg *cfg, const ModesetResult *ms, DrmDisplayReleaseFn release);
+void drm_display_free(DrmDisplay *d);
+
+int drm_display_start(DrmDisplay *d);
+void drm_display_stop(DrmDisplay *d);
+
+/*
+ * Adds a head that shows every frame in the same atomic commit as the lead
+ * (same fb, no copy). Only heads at the lead's refresh rate qualify, and only
+ * under fixed-refresh pacing without the stream mode policy; otherwise -1 is
+ * returned and the head needs a display of its own. Call before
+ * drm_display_start.
+ */
+int drm_display_add_mirror(DrmDisplay *d, const ModesetResult *ms);
+
+/*
+ * A primary plane filling the screen behind the video. It is resized with the
+ * CRTC when the mode policy changes the mode; the fb stays the one allocated
+ * by the caller (fb_w x fb_h), so it should cover the largest mode. Call
+ * before drm_display_start.
+ */
+void drm_display_set_background(DrmDisplay *d, uint32_t plane_id, int fb_w, int fb_h);
+/*
+ * OSD plane updated in the same atomic request as the next video frame, so it
+ * never costs a vblank of its own while video flows. Call before
+ * drm_display_start. The owner double-buffers: it posts an fb and draws into
+ * the other one only once drm_display_overlay_idle says the posted one is on
+ * screen. If the kernel refuses the plane, the OSD is dropped and idle stays
+ * FALSE.
+ */
+int drm_display_set_overlay(DrmDisplay *d, const DrmOverlayPlacement *placement);
+void drm_display_post_overlay(DrmDisplay *d, uint32_t fb_id);
+gboolean drm_display_overlay_idle(DrmDisplay *d, uint32_t *on_screen_fb);
+
+/* Current CRTC mode size and refresh. */
+void drm_display_get_mode(DrmDisplay *d, int *w, int *h, int *hz);
+/* Decoded picture size; feeds the stream mode policy together with the PTS-measured frame rate. */
+void drm_display_note_stream(DrmDisplay *d, int width, int height);
+
+/* Records when the bitstream for pts_us (microseconds) entered the decoder, for decode-time prediction. */
+void drm_display_note_feed(DrmDisplay *d, gint64 pts_us, guint64 feed_ns);
+void drm_display_submit(DrmDisplay *d, uint32_t fb_id, uint32_t src_w, uint32_t src_h, gint64 pts_us,
+                        void *token);
+/*
+ * Drops the queued frames and waits for a pending flip. The frame on screen
+ * stays held until a later flip replaces it or drm_display_free switches the
+ * plane off.
+ */
+void drm_display_flush(DrmDisplay *d);
+
+/*
+ * Hotplug: hold stops committing (decoded frames keep replacing the queued
+ * ones) and returns once no flip is pending, so the caller may run its own
+ * modeset. Rebind adopts the new output, releases the hold and puts the
+ * newest frame on screen with the next commit. Lock-step mirrors are matched
+ * by connector in mirrors; those missing are switched off.
+ */
+void drm_display_hold(DrmDisplay *d);
+void drm_display_rebind(DrmDisplay *d, const ModesetResult *ms, const ModesetResult *mirrors, int mirror_count);
+
+/* Frames the display may keep at once: queued for pacing, in flight and on screen. */
+guint drm_display_max_held_frames(DrmDisplay *d);
+void drm_display_get_stats(DrmDisplay *d, DrmDisplayStats *stats);
+
+#endif // DRM_DISPLAY_H
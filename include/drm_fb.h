@@ -14,6 +14,8 @@ struct DumbFB {
 };
 
 int create_argb_fb(int fd, int w, int h, uint32_t argb_fill, struct DumbFB *out);
+/* XRGB8888 fb left as the kernel hands it out: dumb buffers come zeroed, which is black. Not mapped. */
+int create_black_fb(int fd, int w, int h, struct DumbFB *out);
 void destroy_dumb_fb(int fd, struct DumbFB *fb);
 
 #endif // DRM_FB_H
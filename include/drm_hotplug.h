@@ -0,0 +1,26 @@
+#ifndef DRM_HOTPLUG_H
+#define DRM_HOTPLUG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Watches kernel uevents for connector hotplug on one DRM card. A raw
+ * NETLINK_KOBJECT_UEVENT socket is used, so no libudev dependency is needed.
+ */
+typedef struct DrmHotplug DrmHotplug;
+
+DrmHotplug *drm_hotplug_new(const char *card_path);
+void drm_hotplug_free(DrmHotplug *h);
+
+/* Readable when uevents are waiting; poll it from the main loop. */
+int drm_hotplug_fd(const DrmHotplug *h);
+/* Reads every pending uevent. Returns 1 if one was a hotplug on our card, 0 if none was, -1 on error. */
+int drm_hotplug_drain(DrmHotplug *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DRM_HOTPLUG_H
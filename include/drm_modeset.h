@@ -2,18 +2,56 @@
 #define DRM_MODESET_H
 
 #include <stdint.h>
+#include <xf86drmMode.h>
 
 #include "config.h"
 
+/* The primary head plus APP_MAX_MIRRORS mirrors. */
+#define DRM_MAX_HEADS (1 + APP_MAX_MIRRORS)
+
 typedef struct {
     uint32_t connector_id;
     uint32_t crtc_id;
+    uint32_t plane_id;
     int mode_w;
     int mode_h;
     int mode_hz;
+    drmModeModeInfo mode;
+    /* The CRTC already ran this mode, so only the plane was touched. */
+    int mode_reused;
+    /* VRR_ENABLED was set on the CRTC; the sink refreshes between vrr_min_hz and vrr_max_hz. */
+    int vrr_active;
+    int vrr_min_hz;
+    int vrr_max_hz;
 } ModesetResult;
 
+/* What the stream mode policy knows about the video; zero fields are unknown. */
+typedef struct {
+    int width;
+    int height;
+    int fps_mhz;
+} ModesetStreamInfo;
+
 int atomic_modeset_maxhz(int fd, const AppCfg *cfg, ModesetResult *out);
+/*
+ * heads[0] holds the primary head's result; the configured mirrors are
+ * modeset on other CRTCs into heads[1..]. Mirrors that are missing or cannot
+ * get a CRTC are skipped. Returns the number of heads now in heads.
+ */
+int drm_modeset_mirrors(int fd, const AppCfg *cfg, ModesetResult *heads);
 int is_any_connected(int fd, const AppCfg *cfg);
 
+/*
+ * Picks the connector mode that suits the stream: a refresh rate that is an
+ * integer multiple of the frame rate first, then the smallest mode that holds
+ * the picture, then the highest refresh. Uses the connector's cached mode list
+ * (no probe). Returns -1 if the connector has no modes.
+ */
+int drm_modeset_pick_stream_mode(int fd, uint32_t connector_id, const ModesetStreamInfo *stream,
+                                 drmModeModeInfo *out);
+/* Largest width and height over all modes of the connector. */
+int drm_modeset_max_mode_size(int fd, uint32_t connector_id, int *w, int *h);
+int drm_mode_refresh_hz(const drmModeModeInfo *m);
+int drm_mode_refresh_mhz(const drmModeModeInfo *m);
+
 #endif // DRM_MODESET_H
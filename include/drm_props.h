@@ -3,6 +3,35 @@
 
 #include <stdint.h>
 
+/*
+ * Property metadata is fetched once per KMS object and kept in a table hashed
+ * by name, shared by every caller in the process. IDs, ranges and enum values
+ * do not change while the device is up, so the cache is only dropped when the
+ * display topology changes (hotplug). Object IDs are the key: the process
+ * drives a single DRM device.
+ */
+typedef struct {
+    uint32_t id;
+    uint32_t flags;
+    uint64_t min;
+    uint64_t max;
+    /* Value at fetch time; only meaningful for DRM_MODE_PROP_IMMUTABLE properties. */
+    uint64_t immutable_value;
+} DrmPropInfo;
+
+typedef struct {
+    uint64_t ioctls;
+    uint64_t tables_built;
+    uint64_t lookups;
+    uint64_t invalidations;
+} DrmPropsStats;
+
+int drm_prop_lookup(int fd, uint32_t obj_id, uint32_t obj_type, const char *name, DrmPropInfo *out);
+int drm_prop_enum_value(int fd, uint32_t obj_id, uint32_t obj_type, const char *name, const char *enum_name,
+                        uint64_t *out);
+void drm_props_invalidate(void);
+void drm_props_get_stats(DrmPropsStats *stats);
+
 int drm_get_prop_id(int fd, uint32_t obj_id, uint32_t obj_type, const char *name, uint32_t *out);
 int drm_get_prop_id_and_range_ci(int fd, uint32_t obj_id, uint32_t obj_type,
                                  const char *name1, uint32_t *out_id,
@@ -0,0 +1,49 @@
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+#include <glib.h>
+
+#include "config.h"
+
+/*
+ * Decides when a decoded frame should be committed to the display. It learns
+ * the vblank phase from page-flip timestamps, the decode time from feed/ready
+ * pairs keyed by PTS and the network jitter from PTS versus arrival time.
+ * PTS are in microseconds, so the jitter estimate keeps sub-millisecond detail.
+ *
+ * Not thread-safe; the owner serialises calls.
+ */
+typedef struct FramePacer FramePacer;
+
+typedef struct {
+    guint64 vblank_period_ns;
+    guint64 frame_interval_ns;
+    guint64 decode_time_ns;
+    guint64 decode_time_dev_ns;
+    guint64 jitter_ns;
+    guint64 playout_delay_ns;
+    guint64 commit_lead_ns;
+    guint64 frames_held;
+    guint64 frames_immediate;
+    guint64 frames_late;
+} FramePacerStats;
+
+FramePacer *frame_pacer_new(PacingMode mode, int refresh_hz);
+void frame_pacer_free(FramePacer *p);
+/* After a mode change: new nominal refresh, vblank phase unknown. */
+void frame_pacer_set_refresh(FramePacer *p, int refresh_hz);
+
+PacingMode frame_pacer_mode(const FramePacer *p);
+/* How many decoded frames the display may hold back waiting for their slot. */
+guint frame_pacer_queue_depth(const FramePacer *p);
+
+void frame_pacer_note_feed(FramePacer *p, gint64 pts_us, guint64 now_ns);
+void frame_pacer_note_flip(FramePacer *p, guint64 flip_ns);
+void frame_pacer_note_commit_cost(FramePacer *p, guint64 cost_ns);
+
+/* Returns the CLOCK_MONOTONIC time at which the frame should be committed. */
+guint64 frame_pacer_frame_ready(FramePacer *p, gint64 pts_us, guint64 ready_ns, guint64 now_ns);
+
+void frame_pacer_get_stats(const FramePacer *p, FramePacerStats *stats);
+
+#endif // FRAME_PACER_H
@@ -0,0 +1,69 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <glib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_POOL_MAX_BUFFERS 32
+
+/*
+ * Scanout-capable frame buffers (dumb BO + PRIME fd + KMS fb) for one decoder
+ * output geometry. Pools are built on a helper thread and cached by geometry
+ * so a format change back to a known layout, or a pipeline restart, does not
+ * allocate again.
+ */
+typedef struct FramePool FramePool;
+typedef struct FramePoolCache FramePoolCache;
+
+typedef struct {
+    uint32_t format; /* decoder pixel format, opaque to the cache */
+    uint32_t drm_fourcc;
+    uint32_t width;
+    uint32_t height;
+    uint32_t hor_stride;
+    uint32_t ver_stride;
+    size_t frame_size;
+    guint count;
+} FramePoolGeometry;
+
+typedef struct {
+    int prime_fd;
+    uint32_t handle;
+    uint32_t fb_id;
+    size_t size;
+} FramePoolBuffer;
+
+typedef struct {
+    guint64 pools_built;
+    guint64 cache_hits;
+    guint64 prefetch_hits;
+    guint64 evictions;
+    guint64 build_ns_last;
+    guint64 build_ns_max;
+    guint64 bytes_resident;
+} FramePoolCacheStats;
+
+FramePoolCache *frame_pool_cache_new(int drm_fd);
+void frame_pool_cache_free(FramePoolCache *cache);
+
+/*
+ * Returns a pool for geo with at least geo->count buffers, waiting for the
+ * helper thread if it has to be built. NULL if no buffer could be allocated.
+ */
+FramePool *frame_pool_cache_acquire(FramePoolCache *cache, const FramePoolGeometry *geo);
+/* Hands a pool back. It stays allocated, and idle, until evicted. */
+void frame_pool_cache_release(FramePoolCache *cache, FramePool *pool);
+
+/* Remembers which geometry the decoder produced for a stream layout key. */
+void frame_pool_cache_learn(FramePoolCache *cache, guint64 stream_key, const FramePoolGeometry *geo);
+/* Starts building a pool for a previously learned layout; TRUE if a build was queued. */
+gboolean frame_pool_cache_prefetch(FramePoolCache *cache, guint64 stream_key, guint count);
+
+guint frame_pool_size(const FramePool *pool);
+const FramePoolBuffer *frame_pool_buffer(const FramePool *pool, guint index);
+guint64 frame_pool_bytes(const FramePool *pool);
+
+void frame_pool_cache_get_stats(FramePoolCache *cache, FramePoolCacheStats *stats);
+
+#endif // FRAME_POOL_H
@@ -0,0 +1,32 @@
+#ifndef HEVC_PARSE_H
+#define HEVC_PARSE_H
+
+#include <glib.h>
+#include <stddef.h>
+
+#define HEVC_NAL_SPS 33
+
+typedef struct {
+    guint width;
+    guint height;
+    guint chroma_format_idc;
+    guint bit_depth_luma;
+    guint bit_depth_chroma;
+    guint general_profile_idc;
+    guint general_level_idc;
+    /* Values for the highest temporal sub-layer. */
+    guint max_dec_pic_buffering;
+    guint max_num_reorder;
+} HevcSpsInfo;
+
+/*
+ * Finds the SPS NAL unit (header included) among the parameter sets that lead
+ * an Annex-B access unit. The scan stops at the first slice, so access units
+ * without an SPS cost a handful of bytes.
+ */
+gboolean hevc_find_sps(const guint8 *data, size_t size, const guint8 **nal_out, size_t *nal_size_out);
+
+/* Parses the SPS fields up to the sub-layer ordering info; returns 0 on success. */
+int hevc_parse_sps(const guint8 *nal, size_t size, HevcSpsInfo *out);
+
+#endif // HEVC_PARSE_H
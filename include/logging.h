@@ -1,9 +1,13 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include <stdint.h>
 #include <stdio.h>
 
 const char *log_timestamp(void);
+/* CLOCK_MONOTONIC time since log_startup_begin(), for startup-latency reporting. */
+void log_startup_begin(void);
+uint64_t log_startup_elapsed_ns(void);
 int log_is_verbose(void);
 void log_set_verbose(int enabled);
 
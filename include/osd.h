@@ -0,0 +1,34 @@
+#ifndef OSD_H
+#define OSD_H
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "drm_display.h"
+#include "drm_modeset.h"
+
+/*
+ * Link statistics drawn on an ARGB plane stacked above the video plane. The
+ * panel is double-buffered: each update redraws, in the buffer not on screen,
+ * only the character cells that differ from what that buffer already holds,
+ * then hands it to the display, which commits it with the next video frame.
+ */
+typedef struct Osd Osd;
+
+typedef struct {
+    double bitrate_mbps;
+    double loss_pct;
+    guint64 lost_packets;
+    /* Decode to flip; negative when no frame was presented in the interval. */
+    double latency_ms;
+    double fps;
+} OsdValues;
+
+/* Call before drm_display_start. cfg->osd_plane_id 0 picks a free ARGB plane on the CRTC of ms. */
+Osd *osd_new(int drm_fd, DrmDisplay *display, const ModesetResult *ms, const AppCfg *cfg);
+void osd_free(Osd *osd);
+/* Single caller thread; skipped while the previous panel has not reached the screen. */
+void osd_update(Osd *osd, const OsdValues *values);
+
+#endif // OSD_H
@@ -6,6 +6,10 @@
 
 #include "config.h"
 #include "drm_modeset.h"
+#include "frame_pool.h"
+#include "osd.h"
+#include "record_helper.h"
+#include "record_preroll.h"
 #include "udp_receiver.h"
 #include "video_decoder.h"
 #include "video_recorder.h"
@@ -31,14 +35,29 @@ typedef struct {
     gboolean encountered_error;
 
     VideoDecoder *decoder;
+    /* Outlives individual start/stop cycles so a restart reuses the decoder's frame buffers. */
+    FramePoolCache *frame_pools;
     gboolean decoder_initialized;
     gboolean decoder_running;
 
     gboolean appsink_thread_running;
 
     VideoRecorder *recorder;
+    /* With record.helper the recorder runs in its own process instead; also under recorder_lock. */
+    RecordHelper *record_helper;
+    /* Live samples held back while a new helper takes the pre-roll; also under recorder_lock. */
+    GPtrArray *record_backlog;
+    /* A helper spawned but not installed yet, for the stats; also under recorder_lock. */
+    RecordHelper *record_helper_starting;
+    /* Last seconds of the stream while no recorder is active; also under recorder_lock. */
+    RecordPreroll *preroll;
     GMutex recorder_lock;
 
+    Osd *osd;
+    GThread *osd_thread;
+    gboolean osd_stop;
+    GCond osd_cond;
+
     const AppCfg *cfg;
 } PipelineState;
 
@@ -48,13 +67,24 @@ typedef struct PipelineRecordingStats {
     guint64 elapsed_ns;
     guint64 media_duration_ns;
     char output_path[PATH_MAX];
+    guint queue_depth;
+    guint64 dropped_aus;
+    guint64 write_latency_avg_ns;
+    guint64 write_latency_max_ns;
 } PipelineRecordingStats;
 
-int pipeline_start(const AppCfg *cfg, const ModesetResult *ms, int drm_fd, PipelineState *ps);
+/* ms holds head_count display heads, the primary first. */
+int pipeline_start(const AppCfg *cfg, const ModesetResult *ms, int head_count, int drm_fd, PipelineState *ps);
 void pipeline_stop(PipelineState *ps, int wait_ms_total);
 void pipeline_poll_child(PipelineState *ps);
 int pipeline_enable_recording(PipelineState *ps, const RecordCfg *cfg);
 void pipeline_disable_recording(PipelineState *ps);
 int pipeline_get_recording_stats(const PipelineState *ps, PipelineRecordingStats *stats);
+int pipeline_get_decoder_stats(const PipelineState *ps, VideoDecoderStats *stats);
+/* Connector hotplug: hold presentation while the output is down, rebind once a modeset brought it back. */
+void pipeline_display_hold(PipelineState *ps);
+void pipeline_display_rebind(PipelineState *ps, const ModesetResult *ms, int head_count);
+/* Frees state kept across restarts; call once the pipeline is stopped for good. */
+void pipeline_release_frame_pools(PipelineState *ps);
 
 #endif // PIPELINE_H
@@ -0,0 +1,39 @@
+#ifndef RECORD_HELPER_H
+#define RECORD_HELPER_H
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "config.h"
+#include "record_preroll.h"
+#include "video_recorder.h"
+
+/*
+ * Recording in a separate process. The appsink thread copies each AU once
+ * into a shared-memory ring (record_ring.h), and a helper process consumes
+ * it at its own pace. The helper is this binary started again with
+ * RECORD_HELPER_ARG, and it runs the usual VideoRecorder. A muxer crash or
+ * a hung filesystem then stays in the helper: the main process never waits
+ * on it and does not wait for its exit either.
+ */
+#define RECORD_HELPER_ARG "--record-helper-child"
+
+typedef struct RecordHelper RecordHelper;
+
+RecordHelper *record_helper_start(const RecordCfg *cfg);
+/* Appsink thread: never blocks. */
+void record_helper_publish(RecordHelper *helper, GstSample *sample, GstBuffer *buffer);
+/* Publishes the AUs held in preroll, emptying it; the caller holds live AUs back until it returns. */
+void record_helper_prime(RecordHelper *helper, RecordPreroll *preroll);
+/* Ends the recording; the helper finalises the file and exits on its own. */
+void record_helper_stop(RecordHelper *helper);
+/* FALSE once the helper process is gone. */
+gboolean record_helper_is_running(const RecordHelper *helper);
+void record_helper_get_stats(const RecordHelper *helper, VideoRecorderStats *stats);
+/* Waits for helpers still finalising after record_helper_stop; FALSE on timeout. */
+gboolean record_helper_wait_exited(guint timeout_ms);
+
+/* Entry point of the helper process: main() hands over when argv[1] is RECORD_HELPER_ARG. */
+int record_helper_main(int argc, char **argv);
+
+#endif // RECORD_HELPER_H
@@ -0,0 +1,39 @@
+#ifndef RECORD_IO_H
+#define RECORD_IO_H
+
+#include <glib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * File sink behind the MP4 muxer. Appends are gathered into large aligned
+ * blocks that a helper thread writes with O_DIRECT (where the filesystem
+ * allows it), a few blocks in flight, while extents are preallocated ahead of
+ * the write position. Writes behind the blocks already handed off (minimp4
+ * patching box sizes) go out as positioned writes. Close pads the last block,
+ * then truncates the file to the bytes actually written.
+ */
+typedef struct RecordIo RecordIo;
+
+typedef struct {
+    gboolean direct;
+    gboolean preallocating;
+    guint64 blocks;
+    guint64 block_bytes;
+    guint64 patches;
+    /* Caller waited for a free block because every one was in flight. */
+    guint64 stalls;
+    guint64 write_ns;
+    guint64 write_max_ns;
+} RecordIoStats;
+
+RecordIo *record_io_open(const char *path);
+/* minimp4 write-callback semantics: returns 0 on success, -1 once the file is unusable. */
+int record_io_write(RecordIo *io, int64_t offset, const void *data, size_t size);
+/* Puts what was written so far into the file without giving up the block being filled. */
+int record_io_flush(RecordIo *io);
+/* Completes all writes and closes the file; returns -1 if any write failed. stats may be NULL. */
+int record_io_close(RecordIo *io, RecordIoStats *stats);
+void record_io_get_stats(RecordIo *io, RecordIoStats *stats);
+
+#endif // RECORD_IO_H
@@ -0,0 +1,45 @@
+#ifndef RECORD_POLICY_H
+#define RECORD_POLICY_H
+
+#include <glib.h>
+
+/*
+ * How much of the stream goes into the recording when the card cannot keep
+ * up or fills up. Each level leaves out more, and every level still decodes:
+ * non-reference pictures have nothing depending on them, and IRAP pictures
+ * depend on nothing.
+ */
+typedef enum {
+    RECORD_LEVEL_FULL = 0,
+    RECORD_LEVEL_REFERENCE_ONLY,
+    RECORD_LEVEL_IRAP_ONLY,
+    RECORD_LEVEL_PAUSED,
+    RECORD_LEVEL_COUNT,
+} RecordLevel;
+
+/* What the recorder saw over one window (about a second). */
+typedef struct {
+    /* Writer queue use, 0..1, of whichever bound (AUs or bytes) is closer. */
+    double queue_fill;
+    /* Bytes queued for the writer, and bytes the writer took off the queue. */
+    guint64 queued_bytes;
+    guint64 drained_bytes;
+    /* Free space on the recording's filesystem; -1 when not known. */
+    gint64 free_bytes;
+} RecordPressure;
+
+/*
+ * Queue and throughput move the level one step per window: up while the
+ * writer falls behind, down after several calm windows. Free space sets a
+ * floor on its own: IRAP pictures only below twice min_free_bytes, paused
+ * below it (min_free_bytes 0 ignores free space).
+ */
+typedef struct RecordPolicy RecordPolicy;
+
+RecordPolicy *record_policy_new(guint64 min_free_bytes);
+void record_policy_free(RecordPolicy *policy);
+/* Takes one window's measurements and returns the level to record at. */
+RecordLevel record_policy_update(RecordPolicy *policy, const RecordPressure *pressure);
+const char *record_level_name(RecordLevel level);
+
+#endif // RECORD_POLICY_H
@@ -0,0 +1,27 @@
+#ifndef RECORD_PREROLL_H
+#define RECORD_PREROLL_H
+
+#include <glib.h>
+#include <gst/gst.h>
+
+/*
+ * Instant replay: while nothing is recorded, the appsink thread keeps the
+ * last seconds of the stream here, starting at a keyframe, as references to
+ * the received buffers. Whole GOPs fall off the front once the GOPs after
+ * them still cover the time span, or when the ring holds more than max_bytes.
+ * Not thread-safe; the caller serialises push and pop.
+ */
+typedef struct RecordPreroll RecordPreroll;
+
+RecordPreroll *record_preroll_new(guint seconds, gsize max_bytes);
+void record_preroll_free(RecordPreroll *preroll);
+/* Takes a reference to buffer; the stream caps (may be NULL) are kept alongside. */
+void record_preroll_push(RecordPreroll *preroll, GstCaps *caps, GstBuffer *buffer);
+/* Hands out the oldest AU with the ring's reference; NULL once the ring is empty. */
+GstBuffer *record_preroll_pop(RecordPreroll *preroll);
+/* Caps of the latest AU pushed, with a new reference; NULL if none were seen. */
+GstCaps *record_preroll_get_caps(const RecordPreroll *preroll);
+/* AUs held, and the wall-clock time they span. */
+guint record_preroll_get_depth(const RecordPreroll *preroll, gsize *bytes, guint64 *span_ns);
+
+#endif // RECORD_PREROLL_H
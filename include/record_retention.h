@@ -0,0 +1,17 @@
+#ifndef RECORD_RETENTION_H
+#define RECORD_RETENTION_H
+
+#include <glib.h>
+
+/*
+ * Disk budget for recordings: the files in dir whose names start with prefix
+ * and end with suffix are deleted oldest first (by modification time) until
+ * what remains, plus reserve bytes for the file still being written, fits in
+ * budget bytes. keep (any path to the file being written) is never deleted;
+ * its current size counts against the budget. Returns the number of bytes
+ * deleted.
+ */
+guint64 record_retention_enforce(const char *dir, const char *prefix, const char *suffix, guint64 budget,
+                                 guint64 reserve, const char *keep);
+
+#endif // RECORD_RETENTION_H
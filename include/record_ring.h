@@ -0,0 +1,58 @@
+#ifndef RECORD_RING_H
+#define RECORD_RING_H
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "config.h"
+
+/*
+ * Single-producer, single-consumer AU ring in a memfd, shared with the
+ * recorder helper process. Each AU takes a metadata slot and a stretch of
+ * the data area; both wrap around. The producer never waits for the
+ * consumer. Slots are seqlocked (the count is odd while a slot is being
+ * rewritten), and the producer announces which data bytes it is about to
+ * overwrite before writing them. A consumer that fell behind therefore
+ * notices once it has copied an AU out, drops the copy, and skips ahead to
+ * the next IRAP picture. An AU the producer has to turn away takes the rest
+ * of its GOP with it, and the next IRAP picture is marked so the consumer
+ * resynchronises there the same way. Caps travel as strings beside the
+ * slots, written when they change; the last few are kept, so AUs still in
+ * the ring come out with the caps they went in with.
+ */
+typedef struct RecordRing RecordRing;
+
+typedef struct {
+    /* Producer: AUs put in the ring, and AUs turned away (too large for it, or in a GOP that lost one). */
+    guint64 published;
+    guint64 rejected;
+    /* Consumer: times it was overrun, and AUs lost to overruns or skipped up to the next IRAP picture. */
+    guint64 overruns;
+    guint64 skipped;
+} RecordRingStats;
+
+/* Producer side; cfg is handed to the consumer with the ring. */
+RecordRing *record_ring_new(gsize data_bytes, guint slots, const RecordCfg *cfg);
+/* The memfd and the eventfd that signals new AUs, to pass on to the consumer. */
+int record_ring_get_fd(const RecordRing *ring);
+int record_ring_get_event_fd(const RecordRing *ring);
+/* Copies the AU into the ring; never blocks. FALSE if it was turned away. */
+gboolean record_ring_publish(RecordRing *ring, GstCaps *caps, GstBuffer *buffer);
+/* No more AUs follow; the consumer finishes once it has read the rest. */
+void record_ring_close(RecordRing *ring);
+
+/* Consumer side; takes over both descriptors. */
+RecordRing *record_ring_attach(int fd, int event_fd);
+const RecordCfg *record_ring_get_cfg(const RecordRing *ring);
+/*
+ * Waits up to timeout_ms for the next AU. Returns 1 with a buffer of its
+ * own (timestamps and keyframe flag set, GST_BUFFER_FLAG_DISCONT when AUs
+ * were lost before it) and, when the caps changed, a caps reference (NULL
+ * otherwise); 0 on timeout; -1 once the ring is closed and drained.
+ */
+int record_ring_next(RecordRing *ring, GstBuffer **buffer, GstCaps **caps, int timeout_ms);
+
+void record_ring_get_stats(const RecordRing *ring, RecordRingStats *stats);
+void record_ring_free(RecordRing *ring);
+
+#endif // RECORD_RING_H
@@ -0,0 +1,42 @@
+#ifndef RECORD_STREAM_H
+#define RECORD_STREAM_H
+
+#include <glib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Index-free recording formats: nothing is kept per AU and nothing is
+ * written behind the append position, so a file cut short by a power loss
+ * plays up to its last packet.
+ *
+ * - MPEG-TS: one H.265 program; PAT and PMT ahead of every keyframe, a PCR
+ *   with every AU. Packet headers are built in place and handed over with
+ *   the AU payload as an iovec list, so the AU itself is not copied.
+ * - Annex B: the elementary stream as received, plus an mkvmerge timestamp
+ *   file (format v2, one line per AU) next to it.
+ */
+typedef enum {
+    RECORD_STREAM_TS = 0,
+    RECORD_STREAM_ANNEXB,
+} RecordStreamFormat;
+
+/* Suffix of the Annex B timestamp file, appended to the recording's path. */
+#define RECORD_STREAM_TIMESTAMPS_SUFFIX ".timestamps.txt"
+
+/* Appends iovcnt pieces at offset; returns 0 on success, -1 once the file is unusable. */
+typedef int (*RecordStreamWritevFn)(int64_t offset, const struct iovec *iov, int iovcnt, void *token);
+
+typedef struct RecordStream RecordStream;
+
+/* path is the recording itself; Annex B puts its timestamp file next to it. */
+RecordStream *record_stream_new(RecordStreamFormat format, const char *path, RecordStreamWritevFn writev, void *token);
+/* data is one Annex B AU; pts_90k counts from the start of the file. Returns -1 on a write failure. */
+int record_stream_write_au(RecordStream *stream, const guint8 *data, size_t size, guint64 pts_90k, gboolean keyframe);
+/* Pushes the timestamp file to disk; the recording itself goes through writev. */
+void record_stream_flush(RecordStream *stream);
+/* Returns -1 if the timestamp file could not be completed. */
+int record_stream_close(RecordStream *stream);
+
+#endif // RECORD_STREAM_H
@@ -12,10 +12,19 @@ extern "C" {
 
 typedef struct UdpReceiver UdpReceiver;
 
+typedef struct {
+    guint64 packets;        // video packets received (payload type matched)
+    guint64 bytes;
+    guint64 lost_packets;   // RTP sequence gaps
+    guint64 dropped;        // discarded because appsrc was backed up
+} UdpReceiverStats;
+
 UdpReceiver *udp_receiver_create(int udp_port, int vid_pt, GstAppSrc *video_appsrc);
 int udp_receiver_start(UdpReceiver *ur);
 void udp_receiver_stop(UdpReceiver *ur);
 void udp_receiver_destroy(UdpReceiver *ur);
+// Running totals; updated by the receiver thread about once per packet.
+void udp_receiver_get_stats(UdpReceiver *ur, UdpReceiverStats *stats);
 
 #ifdef __cplusplus
 }
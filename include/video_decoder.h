@@ -8,22 +8,43 @@
 #include <gst/gst.h>
 
 #include "config.h"
+#include "drm_display.h"
 #include "drm_modeset.h"
+#include "frame_pool.h"
 
 typedef struct VideoDecoder VideoDecoder;
 
+typedef struct {
+    guint64 packets_fed;
+    guint64 put_retries;
+    guint64 put_wait_ns;
+    guint64 put_wait_max_ns;
+    guint pool_buffers;
+    guint64 pool_bytes;
+} VideoDecoderStats;
+
 VideoDecoder *video_decoder_new(void);
 void video_decoder_free(VideoDecoder *vd);
 
-int video_decoder_init(VideoDecoder *vd, const AppCfg *cfg, const ModesetResult *ms, int drm_fd);
+/*
+ * ms holds head_count heads, the primary first; the others mirror it.
+ * pools may be NULL, in which case the decoder keeps a private cache.
+ */
+int video_decoder_init(VideoDecoder *vd, const AppCfg *cfg, const ModesetResult *ms, int head_count, int drm_fd,
+                       FramePoolCache *pools);
 void video_decoder_deinit(VideoDecoder *vd);
 
 int video_decoder_start(VideoDecoder *vd);
 void video_decoder_stop(VideoDecoder *vd);
 
-int video_decoder_feed(VideoDecoder *vd, const guint8 *data, size_t size, GstClockTime pts);
+int video_decoder_feed_buffer(VideoDecoder *vd, GstBuffer *buffer, GstClockTime pts);
 void video_decoder_send_eos(VideoDecoder *vd);
+void video_decoder_get_stats(VideoDecoder *vd, VideoDecoderStats *stats);
 
-size_t video_decoder_max_packet_size(const VideoDecoder *vd);
+/* Connector hotplug: pause presentation while decoding goes on, then move to the new output. */
+void video_decoder_display_hold(VideoDecoder *vd);
+void video_decoder_display_rebind(VideoDecoder *vd, const ModesetResult *ms, int head_count);
+/* The primary head's display, valid between init and deinit. */
+DrmDisplay *video_decoder_display(VideoDecoder *vd);
 
 #endif // VIDEO_DECODER_H
@@ -5,6 +5,8 @@
 #include <gst/gst.h>
 
 #include "config.h"
+#include "record_policy.h"
+#include "record_preroll.h"
 
 typedef struct VideoRecorder VideoRecorder;
 
@@ -14,12 +16,36 @@ typedef struct {
     guint64 elapsed_ns;
     guint64 media_duration_ns;
     char output_path[PATH_MAX];
+    /* AUs waiting for the writer thread, and those dropped (a GOP remainder at a time) because it fell behind. */
+    guint queue_depth;
+    guint64 queue_bytes;
+    guint queue_max_depth;
+    guint64 dropped_aus;
+    guint64 dropped_gops;
+    /* Storage pressure: the level in effect, how often it changed, and the AUs it left out. */
+    RecordLevel level;
+    guint64 level_changes;
+    guint64 degraded_aus;
+    /* Time spent in each seek+write of the muxer output. */
+    guint64 writes;
+    guint64 write_latency_avg_ns;
+    guint64 write_latency_max_ns;
 } VideoRecorderStats;
 
+/*
+ * Muxing and file I/O run on a low-priority writer thread; handle_sample only
+ * queues a reference to the AU and never waits on the disk.
+ */
 VideoRecorder *video_recorder_new(const RecordCfg *cfg);
 void video_recorder_handle_sample(VideoRecorder *recorder, GstSample *sample, GstBuffer *buffer, const guint8 *data, size_t size);
+/* Queues the AUs held in preroll ahead of any live AU; call before the first handle_sample. */
+void video_recorder_prime(VideoRecorder *recorder, RecordPreroll *preroll);
+/* Asks the writer to push what it has written so far to the file. */
 void video_recorder_flush(VideoRecorder *recorder);
+/* Returns at once; the writer drains the queue, finalises the file and frees the recorder. */
 void video_recorder_free(VideoRecorder *recorder);
+/* Waits for recorders still finalising after video_recorder_free; FALSE on timeout. */
+gboolean video_recorder_wait_finalized(guint timeout_ms);
 void video_recorder_get_stats(const VideoRecorder *recorder, VideoRecorderStats *stats);
 
 #endif // VIDEO_RECORDER_H
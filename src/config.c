@@ -35,8 +35,22 @@ static void usage(const char *prog) {
             "  --vid-pt N                  RTP payload type for video (default: 97)\n"
             "  --appsink-max-buffers N     Max buffers queued on the appsink (default: 4)\n"
             "  --jitter-buffer-ms N        Enable RTP jitterbuffer with N ms latency (0 disables; default 0)\n"
+            "  --pacing MODE               Frame pacing policy (latency|smooth|tearing; default: latency)\n"
+            "  --mode-policy POLICY        Display mode choice (max|stream|WxH[@Hz]; default: max)\n"
+            "  --no-vrr                    Keep a fixed refresh rate even on VRR-capable sinks\n"
+            "  --mirror CONNECTOR:PLANE    Also show the video on another connector via PLANE (repeatable, max 3)\n"
+            "  --osd                       Show bitrate, loss, latency and fps on an overlay plane\n"
+            "  --osd-plane N               Plane ID for the OSD (default: auto)\n"
             "  --record-video [PATH]       Enable MP4 recording (optional output path)\n"
-            "  --record-mode MODE          MP4 recording mode (standard|sequential|fragmented)\n"
+            "  --record-mode MODE          Recording mode (standard|sequential|fragmented|ts|annexb)\n"
+            "  --record-fragment-ms N      Longest fragment in fragmented mode (0 = one per GOP; default: 1000)\n"
+            "  --record-segment-s N        Start a new file at the first keyframe after N seconds (0 = off)\n"
+            "  --record-segment-mb N       Start a new file at the first keyframe after N MB (0 = off)\n"
+            "  --record-budget-mb N        Delete the oldest recordings to stay within N MB (0 = off)\n"
+            "  --record-preroll-s N        Start recordings with the last N seconds of video (0 = off)\n"
+            "  --record-preroll-mb N       Memory for the pre-roll (default: 32)\n"
+            "  --record-min-free-mb N      Pause recording below N MB free on the card (0 = off; default: 256)\n"
+            "  --record-helper             Record in a helper process so a stalled card cannot stall the video\n"
             "  --no-record-video           Disable MP4 recording\n"
             "  --gst-log                   Export GST_DEBUG=3 when not already set\n"
             "  --verbose                   Enable verbose logging\n"
@@ -57,6 +71,9 @@ void cfg_defaults(AppCfg *cfg) {
     cfg->vid_pt = 97;
     cfg->appsink_max_buffers = 4;
     cfg->gst_log = 0;
+    cfg->pacing_mode = PACING_MODE_LATENCY;
+    cfg->mode_policy = MODE_POLICY_MAX;
+    cfg->vrr = 1;
 
     // NEW: jitterbuffer disabled by default
     cfg->jitter_buffer_ms = 0;
@@ -64,6 +81,14 @@ void cfg_defaults(AppCfg *cfg) {
     cfg->record.enable = 0;
     strcpy(cfg->record.output_path, "/media");
     cfg->record.mode = RECORD_MODE_SEQUENTIAL;
+    cfg->record.fragment_ms = 1000;
+    cfg->record.segment_s = 0;
+    cfg->record.segment_mb = 0;
+    cfg->record.budget_mb = 0;
+    cfg->record.preroll_s = 0;
+    cfg->record.preroll_mb = 32;
+    cfg->record.min_free_mb = 256;
+    cfg->record.helper = 0;
 }
 
 static int parse_int_arg(const char *opt, const char *value, int *out) {
@@ -178,6 +203,38 @@ int parse_cli(int argc, char **argv, AppCfg *cfg) {
             if (cfg->jitter_buffer_ms < 0) cfg->jitter_buffer_ms = 0;
             ++i;
 
+        } else if (strcmp(arg, "--pacing") == 0) {
+            if (i + 1 >= argc) {
+                LOGE("--pacing requires a value");
+                return -1;
+            }
+            PacingMode mode = cfg->pacing_mode;
+            if (cfg_parse_pacing_mode(argv[i + 1], &mode) != 0) {
+                LOGE("Unknown pacing mode: %s", argv[i + 1]);
+                return -1;
+            }
+            cfg->pacing_mode = mode;
+            ++i;
+        } else if (strcmp(arg, "--mode-policy") == 0) {
+            if (i + 1 >= argc) {
+                LOGE("--mode-policy requires a value");
+                return -1;
+            }
+            if (cfg_parse_mode_policy(argv[i + 1], cfg) != 0) {
+                LOGE("Unknown mode policy: %s", argv[i + 1]);
+                return -1;
+            }
+            ++i;
+        } else if (strcmp(arg, "--mirror") == 0) {
+            if (i + 1 >= argc) {
+                LOGE("--mirror requires a value");
+                return -1;
+            }
+            if (cfg_add_mirrors(argv[i + 1], cfg) != 0) {
+                LOGE("Invalid mirror head: %s", argv[i + 1]);
+                return -1;
+            }
+            ++i;
         } else if (strcmp(arg, "--record-video") == 0) {
             cfg->record.enable = 1;
             if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
@@ -195,8 +252,54 @@ int parse_cli(int argc, char **argv, AppCfg *cfg) {
             }
             cfg->record.mode = mode;
             ++i;
+        } else if (strcmp(arg, "--record-fragment-ms") == 0) {
+            if (i + 1 >= argc || parse_int_arg("--record-fragment-ms", argv[i + 1], &cfg->record.fragment_ms) != 0) {
+                return -1;
+            }
+            ++i;
+        } else if (strcmp(arg, "--record-segment-s") == 0) {
+            if (i + 1 >= argc || parse_int_arg("--record-segment-s", argv[i + 1], &cfg->record.segment_s) != 0) {
+                return -1;
+            }
+            ++i;
+        } else if (strcmp(arg, "--record-segment-mb") == 0) {
+            if (i + 1 >= argc || parse_int_arg("--record-segment-mb", argv[i + 1], &cfg->record.segment_mb) != 0) {
+                return -1;
+            }
+            ++i;
+        } else if (strcmp(arg, "--record-budget-mb") == 0) {
+            if (i + 1 >= argc || parse_int_arg("--record-budget-mb", argv[i + 1], &cfg->record.budget_mb) != 0) {
+                return -1;
+            }
+            ++i;
+        } else if (strcmp(arg, "--record-preroll-s") == 0) {
+            if (i + 1 >= argc || parse_int_arg("--record-preroll-s", argv[i + 1], &cfg->record.preroll_s) != 0) {
+                return -1;
+            }
+            ++i;
+        } else if (strcmp(arg, "--record-preroll-mb") == 0) {
+            if (i + 1 >= argc || parse_int_arg("--record-preroll-mb", argv[i + 1], &cfg->record.preroll_mb) != 0) {
+                return -1;
+            }
+            ++i;
+        } else if (strcmp(arg, "--record-min-free-mb") == 0) {
+            if (i + 1 >= argc || parse_int_arg("--record-min-free-mb", argv[i + 1], &cfg->record.min_free_mb) != 0) {
+                return -1;
+            }
+            ++i;
+        } else if (strcmp(arg, "--record-helper") == 0) {
+            cfg->record.helper = 1;
         } else if (strcmp(arg, "--no-record-video") == 0) {
             cfg->record.enable = 0;
+        } else if (strcmp(arg, "--no-vrr") == 0) {
+            cfg->vrr = 0;
+        } else if (strcmp(arg, "--osd") == 0) {
+            cfg->osd = 1;
+        } else if (strcmp(arg, "--osd-plane") == 0) {
+            if (i + 1 >= argc || parse_int_arg("--osd-plane", argv[i + 1], &cfg->osd_plane_id) != 0) {
+                return -1;
+            }
+            ++i;
         } else if (strcmp(arg, "--gst-log") == 0) {
             cfg->gst_log = 1;
         } else if (strcmp(arg, "--verbose") == 0) {
@@ -227,6 +330,10 @@ static const RecordModeAlias kRecordModeAliases[] = {
     {"append",     RECORD_MODE_SEQUENTIAL},
     {"fragmented", RECORD_MODE_FRAGMENTED},
     {"fragment",   RECORD_MODE_FRAGMENTED},
+    {"ts",         RECORD_MODE_TS},
+    {"mpegts",     RECORD_MODE_TS},
+    {"annexb",     RECORD_MODE_ANNEXB},
+    {"raw",        RECORD_MODE_ANNEXB},
 };
 
 int cfg_parse_record_mode(const char *value, RecordMode *mode_out) {
@@ -250,7 +357,146 @@ const char *cfg_record_mode_name(RecordMode mode) {
         return "sequential";
     case RECORD_MODE_FRAGMENTED:
         return "fragmented";
+    case RECORD_MODE_TS:
+        return "ts";
+    case RECORD_MODE_ANNEXB:
+        return "annexb";
     default:
         return "unknown";
     }
 }
+
+typedef struct {
+    const char *name;
+    PacingMode mode;
+} PacingModeAlias;
+
+static const PacingModeAlias kPacingModeAliases[] = {
+    {"latency",   PACING_MODE_LATENCY},
+    {"lowest",    PACING_MODE_LATENCY},
+    {"smooth",    PACING_MODE_SMOOTH},
+    {"smoothest", PACING_MODE_SMOOTH},
+    {"tearing",   PACING_MODE_TEARING},
+    {"async",     PACING_MODE_TEARING},
+};
+
+int cfg_parse_pacing_mode(const char *value, PacingMode *mode_out) {
+    if (value == NULL || mode_out == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(kPacingModeAliases) / sizeof(kPacingModeAliases[0]); ++i) {
+        if (strcasecmp(value, kPacingModeAliases[i].name) == 0) {
+            *mode_out = kPacingModeAliases[i].mode;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *cfg_pacing_mode_name(PacingMode mode) {
+    switch (mode) {
+    case PACING_MODE_LATENCY:
+        return "latency";
+    case PACING_MODE_SMOOTH:
+        return "smooth";
+    case PACING_MODE_TEARING:
+        return "tearing";
+    default:
+        return "unknown";
+    }
+}
+
+int cfg_parse_mode_policy(const char *value, AppCfg *cfg) {
+    if (value == NULL || cfg == NULL) {
+        return -1;
+    }
+    if (strcasecmp(value, "max") == 0) {
+        cfg->mode_policy = MODE_POLICY_MAX;
+        return 0;
+    }
+    if (strcasecmp(value, "stream") == 0 || strcasecmp(value, "auto") == 0) {
+        cfg->mode_policy = MODE_POLICY_STREAM;
+        return 0;
+    }
+
+    int w = 0, h = 0, hz = 0;
+    char tail = '\0';
+    int n = sscanf(value, "%dx%d@%d%c", &w, &h, &hz, &tail);
+    if (n == 2) {
+        // "WxH" alone: sscanf stops at the end of the string, so nothing may follow.
+        char check[32];
+        snprintf(check, sizeof(check), "%dx%d", w, h);
+        if (strcasecmp(check, value) != 0) {
+            return -1;
+        }
+        hz = 0;
+    } else if (n != 3) {
+        return -1;
+    }
+    if (w <= 0 || h <= 0 || hz < 0) {
+        return -1;
+    }
+    cfg->mode_policy = MODE_POLICY_FIXED;
+    cfg->mode_w = w;
+    cfg->mode_h = h;
+    cfg->mode_hz = hz;
+    return 0;
+}
+
+const char *cfg_mode_policy_name(ModePolicy policy) {
+    switch (policy) {
+    case MODE_POLICY_MAX:
+        return "max";
+    case MODE_POLICY_STREAM:
+        return "stream";
+    case MODE_POLICY_FIXED:
+        return "fixed";
+    default:
+        return "unknown";
+    }
+}
+
+int cfg_add_mirrors(const char *value, AppCfg *cfg) {
+    if (value == NULL || cfg == NULL) {
+        return -1;
+    }
+    const char *p = value;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == ',') {
+            ++p;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        size_t len = strcspn(p, ",");
+        char item[64];
+        if (len >= sizeof(item)) {
+            return -1;
+        }
+        memcpy(item, p, len);
+        item[len] = '\0';
+        p += len;
+        while (len > 0 && item[len - 1] == ' ') {
+            item[--len] = '\0';
+        }
+
+        char *colon = strrchr(item, ':');
+        if (colon == NULL || colon == item) {
+            return -1;
+        }
+        *colon = '\0';
+        char *end = NULL;
+        long plane = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end != '\0' || plane <= 0 || strlen(item) >= sizeof(cfg->mirrors[0].connector_name)) {
+            return -1;
+        }
+        if (cfg->mirror_count >= APP_MAX_MIRRORS) {
+            LOGW("Ignoring mirror %s: at most %d mirror heads", item, APP_MAX_MIRRORS);
+            continue;
+        }
+        MirrorCfg *m = &cfg->mirrors[cfg->mirror_count++];
+        cli_copy_string(m->connector_name, sizeof(m->connector_name), item);
+        m->plane_id = (int)plane;
+    }
+    return 0;
+}
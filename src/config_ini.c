@@ -97,9 +97,41 @@ static int handle_global_key(const char *key, const char *value, AppCfg *cfg) {
         return -1;
     }
 
+    if (strcasecmp(key, "vrr") == 0) {
+        return parse_bool("vrr", value, &cfg->vrr);
+    }
+    if (strcasecmp(key, "osd") == 0) {
+        return parse_bool("osd", value, &cfg->osd);
+    }
+    if (strcasecmp(key, "osd_plane") == 0 || strcasecmp(key, "osd_plane_id") == 0) {
+        return parse_int("osd_plane", value, &cfg->osd_plane_id);
+    }
     if (strcasecmp(key, "gst_log") == 0) {
         return parse_bool("gst_log", value, &cfg->gst_log);
     }
+    if (strcasecmp(key, "pacing") == 0 || strcasecmp(key, "pacing_mode") == 0) {
+        PacingMode mode = cfg->pacing_mode;
+        if (cfg_parse_pacing_mode(value, &mode) == 0) {
+            cfg->pacing_mode = mode;
+            return 0;
+        }
+        LOGW("config: invalid pacing value: %s", value);
+        return -1;
+    }
+    if (strcasecmp(key, "mirror") == 0 || strcasecmp(key, "mirrors") == 0) {
+        if (cfg_add_mirrors(value, cfg) == 0) {
+            return 0;
+        }
+        LOGW("config: invalid mirror value: %s", value);
+        return -1;
+    }
+    if (strcasecmp(key, "mode_policy") == 0) {
+        if (cfg_parse_mode_policy(value, cfg) == 0) {
+            return 0;
+        }
+        LOGW("config: invalid mode_policy value: %s", value);
+        return -1;
+    }
     if (strncasecmp(key, "record.", 7) == 0) {
         const char *sub = key + 7;
         if (strcasecmp(sub, "enable") == 0) {
@@ -118,6 +150,30 @@ static int handle_global_key(const char *key, const char *value, AppCfg *cfg) {
             LOGW("config: invalid record.mode value: %s", value);
             return -1;
         }
+        if (strcasecmp(sub, "fragment_ms") == 0) {
+            return parse_int("record.fragment_ms", value, &cfg->record.fragment_ms);
+        }
+        if (strcasecmp(sub, "segment_s") == 0) {
+            return parse_int("record.segment_s", value, &cfg->record.segment_s);
+        }
+        if (strcasecmp(sub, "segment_mb") == 0) {
+            return parse_int("record.segment_mb", value, &cfg->record.segment_mb);
+        }
+        if (strcasecmp(sub, "budget_mb") == 0) {
+            return parse_int("record.budget_mb", value, &cfg->record.budget_mb);
+        }
+        if (strcasecmp(sub, "preroll_s") == 0) {
+            return parse_int("record.preroll_s", value, &cfg->record.preroll_s);
+        }
+        if (strcasecmp(sub, "preroll_mb") == 0) {
+            return parse_int("record.preroll_mb", value, &cfg->record.preroll_mb);
+        }
+        if (strcasecmp(sub, "min_free_mb") == 0) {
+            return parse_int("record.min_free_mb", value, &cfg->record.min_free_mb);
+        }
+        if (strcasecmp(sub, "helper") == 0) {
+            return parse_bool("record.helper", value, &cfg->record.helper);
+        }
     }
     return -1;
 }
@@ -149,6 +205,30 @@ static int handle_section_key(const char *section, const char *key, const char *
             LOGW("config: invalid record.mode value: %s", value);
             return -1;
         }
+        if (strcasecmp(key, "fragment_ms") == 0) {
+            return parse_int("record.fragment_ms", value, &cfg->record.fragment_ms);
+        }
+        if (strcasecmp(key, "segment_s") == 0) {
+            return parse_int("record.segment_s", value, &cfg->record.segment_s);
+        }
+        if (strcasecmp(key, "segment_mb") == 0) {
+            return parse_int("record.segment_mb", value, &cfg->record.segment_mb);
+        }
+        if (strcasecmp(key, "budget_mb") == 0) {
+            return parse_int("record.budget_mb", value, &cfg->record.budget_mb);
+        }
+        if (strcasecmp(key, "preroll_s") == 0) {
+            return parse_int("record.preroll_s", value, &cfg->record.preroll_s);
+        }
+        if (strcasecmp(key, "preroll_mb") == 0) {
+            return parse_int("record.preroll_mb", value, &cfg->record.preroll_mb);
+        }
+        if (strcasecmp(key, "min_free_mb") == 0) {
+            return parse_int("record.min_free_mb", value, &cfg->record.min_free_mb);
+        }
+        if (strcasecmp(key, "helper") == 0) {
+            return parse_bool("record.helper", value, &cfg->record.helper);
+        }
         return -1;
     }
 
@@ -0,0 +1,1738 @@
+#define _GNU_SOURCE
+
+#include "drm_display.h"
+
+#include "drm_props.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#ifndef DRM_PLANE_TYPE_PRIMARY
+#define DRM_PLANE_TYPE_PRIMARY 1
+#endif
+#ifndef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+#define DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP 0x15
+#endif
+
+/* Give up on a flip event after this long and treat the commit as retired. */
+#define DISPLAY_FLIP_TIMEOUT_MS 500
+/* Retry interval when the kernel still has a foreign commit queued. */
+#define DISPLAY_BUSY_RETRY_MS 2
+/* Upper bound on decoded frames waiting for their scheduled commit time. */
+#define DISPLAY_QUEUE_MAX 4
+/* A flip that carries a mode change waits for the sink to resynchronise. */
+#define DISPLAY_MODESET_FLIP_TIMEOUT_MS 2000
+/* PTS span over which the stream frame rate is measured for the mode policy. */
+#define DISPLAY_RATE_WINDOW_MS 2000
+/* A PTS step backwards or larger than this restarts the measurement. */
+#define DISPLAY_RATE_MAX_GAP_MS 500
+/* Without video commits to ride on, an OSD update goes out on its own after this long. */
+#define DISPLAY_OVERLAY_IDLE_MS 100
+
+struct DisplayFrame {
+    uint32_t fb_id;
+    uint32_t src_w;
+    uint32_t src_h;
+    gint64 pts_us;
+    guint64 ready_ns;
+    guint64 commit_at_ns;
+    gboolean held;
+    void *token;
+};
+
+/* A flip event read off the DRM fd, waiting for the display it belongs to. */
+struct FlipEvent {
+    guint64 flip_ns;
+    uint32_t sequence;
+    uint32_t crtc_id;
+};
+
+/* Plane placement for one source size, letterboxed into the mode. */
+struct PlaneGeometry {
+    uint32_t src_w;
+    uint32_t src_h;
+    uint32_t dst_x;
+    uint32_t dst_y;
+    uint32_t dst_w;
+    uint32_t dst_h;
+};
+
+struct PlaneProps {
+    uint32_t fb_id;
+    uint32_t crtc_id;
+    uint32_t crtc_x;
+    uint32_t crtc_y;
+    uint32_t crtc_w;
+    uint32_t crtc_h;
+    uint32_t src_x;
+    uint32_t src_y;
+    uint32_t src_w;
+    uint32_t src_h;
+};
+
+/*
+ * Another CRTC scanning out the same fb in lock-step: its plane rides on every
+ * commit of the lead head, and the commit completes once all CRTCs flipped.
+ * Display thread only.
+ */
+struct MirrorHead {
+    uint32_t plane_id;
+    uint32_t crtc_id;
+    uint32_t connector_id;
+    int mode_w;
+    int mode_h;
+    struct PlaneProps props;
+    struct PlaneGeometry geometry;
+    gboolean plane_state_current;
+    /* Connector gone after a hotplug: the plane is switched off once, then left out. */
+    gboolean active;
+    gboolean disable_pending;
+    gboolean in_commit;
+    guint64 flip_ns;
+};
+
+struct DrmDisplay {
+    int drm_fd;
+    int wake_fd;
+    uint32_t plane_id;
+    uint32_t crtc_id;
+    uint32_t connector_id;
+    /* Written by the display thread under lock, so the thread itself may read them bare. */
+    drmModeModeInfo mode;
+    int mode_w;
+    int mode_h;
+    int mode_hz;
+    guint64 vblank_period_ns;
+
+    DrmPresentMode present_mode;
+    /* VRR: upper refresh bound of the sink, and the matching minimum flip spacing (lock). */
+    int vrr_max_hz;
+    guint64 vrr_min_interval_ns;
+    /*
+     * Async: FB_ID-only updates go out with DRM_MODE_PAGE_FLIP_ASYNC, through
+     * the atomic API or, when only the legacy cap exists and the video plane is
+     * the primary one, through drmModePageFlip.
+     */
+    gboolean async_legacy;
+    gboolean async_in_flight;
+
+    ModePolicy mode_policy;
+    uint32_t prop_mode_id;
+    uint32_t prop_active;
+
+    struct PlaneProps plane_props;
+    struct MirrorHead mirrors[DRM_MAX_HEADS - 1];
+    guint mirror_count;
+    /*
+     * OSD plane riding on the video commits. Its owner posts an fb (lock);
+     * the display thread adds it to the next commit, and the flip moves it
+     * from in flight to on screen (lock).
+     */
+    DrmOverlayPlacement overlay;
+    struct PlaneProps overlay_props;
+    gboolean overlay_enabled;
+    gboolean overlay_placed;
+    uint32_t overlay_pending_fb;
+    uint32_t overlay_in_flight_fb;
+    uint32_t overlay_on_screen_fb;
+    guint64 last_commit_ns;
+
+    /* Flip events for our commits, read by whichever display thread drained the fd (lock). */
+    struct FlipEvent flip_events[DRM_MAX_HEADS];
+    guint flip_event_count;
+    /* CRTCs of the in-flight commit that have not reported their flip yet, and the lead's flip. */
+    guint flips_outstanding;
+    guint64 lead_flip_ns;
+    uint32_t lead_flip_sequence;
+
+    /* Black primary plane behind the video, resized on mode changes. */
+    uint32_t bg_plane_id;
+    int bg_fb_w;
+    int bg_fb_h;
+    uint32_t bg_prop_crtc_w;
+    uint32_t bg_prop_crtc_h;
+    uint32_t bg_prop_src_w;
+    uint32_t bg_prop_src_h;
+
+    /*
+     * Display thread only. Atomic state persists between commits, so once the
+     * plane has been placed for the current geometry a flip only needs FB_ID.
+     * The request is reused and rewound rather than allocated per frame.
+     */
+    drmModeAtomicReq *req;
+    struct PlaneGeometry geometry;
+    gboolean geometry_valid;
+    gboolean plane_state_current;
+    /* Mode the next commit switches to, and whether the in-flight commit did (display thread). */
+    drmModeModeInfo next_mode;
+    gboolean mode_change_pending;
+    gboolean modeset_in_flight;
+
+    DrmDisplayReleaseFn release;
+
+    guint64 created_ns;
+    gboolean first_commit_logged;
+    gboolean first_flip_logged;
+
+    GMutex lock;
+    GCond cond;
+    GThread *thread;
+    gboolean running;
+    gboolean stop_requested;
+    gboolean flush_requested;
+    /*
+     * Connector gone or being reconfigured: nothing is committed, newer frames
+     * keep replacing queued ones. hold_idle acknowledges no flip is pending;
+     * rebind carries the new output to the display thread (lock).
+     */
+    gboolean hold;
+    gboolean hold_idle;
+    gboolean rebind_pending;
+    ModesetResult rebind;
+    ModesetResult rebind_mirrors[DRM_MAX_HEADS - 1];
+    int rebind_mirror_count;
+
+    /* Submitted frames in presentation order, not committed yet (lock). */
+    struct DisplayFrame queue[DISPLAY_QUEUE_MAX];
+    guint queue_len;
+    guint queue_depth;
+    FramePacer *pacer;
+    /* Stream shape for the mode policy, frame rate measured from submitted PTS (lock). */
+    ModesetStreamInfo stream;
+    gboolean mode_eval_pending;
+    gint64 rate_start_pts;
+    gint64 rate_last_pts;
+    guint rate_frames;
+    int rate_candidate_mhz;
+    /* Committed and waiting for its flip event (display thread). */
+    struct DisplayFrame in_flight;
+    gboolean flip_pending;
+    guint64 commit_ns;
+    /*
+     * Currently scanned out; released when the next flip replaces it or the
+     * plane is switched off, never while the CRTC may still read it (display thread).
+     */
+    struct DisplayFrame on_screen;
+
+    DrmDisplayStats stats;
+};
+
+/*
+ * Displays on one DRM fd share its event queue, so a display thread may read
+ * flip events of another display. Reads happen under event_lock, and each
+ * event is posted to the display named in its user data if that one is still
+ * registered.
+ */
+static GMutex event_lock;
+static GPtrArray *event_displays;
+
+static inline guint64 monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (guint64)ts.tv_sec * 1000000000ull + (guint64)ts.tv_nsec;
+}
+
+static int query_plane_props(int fd, uint32_t plane_id, struct PlaneProps *p) {
+    if (drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "FB_ID", &p->fb_id) != 0 ||
+        drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_ID", &p->crtc_id) != 0 ||
+        drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_X", &p->crtc_x) != 0 ||
+        drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_Y", &p->crtc_y) != 0 ||
+        drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_W", &p->crtc_w) != 0 ||
+        drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_H", &p->crtc_h) != 0 ||
+        drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_X", &p->src_x) != 0 ||
+        drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_Y", &p->src_y) != 0 ||
+        drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_W", &p->src_w) != 0 ||
+        drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_H", &p->src_h) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void add_plane_placement(drmModeAtomicReq *req, uint32_t plane_id, const struct PlaneProps *p,
+                                uint32_t crtc_id, const struct PlaneGeometry *g) {
+    drmModeAtomicAddProperty(req, plane_id, p->crtc_id, crtc_id);
+    drmModeAtomicAddProperty(req, plane_id, p->crtc_x, g->dst_x);
+    drmModeAtomicAddProperty(req, plane_id, p->crtc_y, g->dst_y);
+    drmModeAtomicAddProperty(req, plane_id, p->crtc_w, g->dst_w);
+    drmModeAtomicAddProperty(req, plane_id, p->crtc_h, g->dst_h);
+    drmModeAtomicAddProperty(req, plane_id, p->src_x, 0);
+    drmModeAtomicAddProperty(req, plane_id, p->src_y, 0);
+    drmModeAtomicAddProperty(req, plane_id, p->src_w, (uint64_t)g->src_w << 16);
+    drmModeAtomicAddProperty(req, plane_id, p->src_h, (uint64_t)g->src_h << 16);
+}
+
+static void release_frame(DrmDisplay *d, struct DisplayFrame *frame) {
+    if (frame->token != NULL && d->release != NULL) {
+        d->release(frame->token);
+    }
+    memset(frame, 0, sizeof(*frame));
+}
+
+static void wake_display_thread(DrmDisplay *d) {
+    uint64_t one = 1;
+    if (d->wake_fd >= 0) {
+        ssize_t ret = write(d->wake_fd, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+static void drain_wake_fd(DrmDisplay *d) {
+    uint64_t value = 0;
+    ssize_t ret = read(d->wake_fd, &value, sizeof(value));
+    (void)ret;
+}
+
+/* Drops the first count entries of the queue; lock held. */
+static void queue_remove_head(DrmDisplay *d, guint count) {
+    if (count >= d->queue_len) {
+        d->queue_len = 0;
+        return;
+    }
+    memmove(&d->queue[0], &d->queue[count], (d->queue_len - count) * sizeof(d->queue[0]));
+    d->queue_len -= count;
+}
+
+static const char *present_mode_name(DrmPresentMode pm) {
+    switch (pm) {
+    case DRM_PRESENT_VRR:
+        return "VRR";
+    case DRM_PRESENT_ASYNC:
+        return "async flips";
+    default:
+        return "fixed refresh";
+    }
+}
+
+/*
+ * Async flips need either the atomic cap or, for the primary plane only, the
+ * legacy one. Returns FALSE when neither applies.
+ */
+static gboolean detect_async_support(DrmDisplay *d) {
+    uint64_t cap = 0;
+    if (drmGetCap(d->drm_fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap) == 0 && cap != 0) {
+        d->async_legacy = FALSE;
+        return TRUE;
+    }
+    cap = 0;
+    if (drmGetCap(d->drm_fd, DRM_CAP_ASYNC_PAGE_FLIP, &cap) != 0 || cap == 0) {
+        LOGW("Display: kernel has no async page flips");
+        return FALSE;
+    }
+    DrmPropInfo type;
+    if (drm_prop_lookup(d->drm_fd, d->plane_id, DRM_MODE_OBJECT_PLANE, "type", &type) != 0 ||
+        type.immutable_value != DRM_PLANE_TYPE_PRIMARY) {
+        LOGW("Display: only legacy async flips available, and plane %u is not primary", d->plane_id);
+        return FALSE;
+    }
+    d->async_legacy = TRUE;
+    return TRUE;
+}
+
+/*
+ * Where in the refresh cycle an async flip landed. The CRTC's last vblank
+ * timestamp marks the start of active scanout; a flip that lands before the
+ * last active line has passed splits the picture.
+ */
+static void account_async_flip(DrmDisplay *d, guint64 flip_ns) {
+    uint64_t seq = 0, vblank_ns = 0;
+    guint64 period = d->vblank_period_ns;
+    int vtotal = d->mode.vtotal, vdisplay = d->mode.vdisplay;
+    gboolean measured = drmCrtcGetSequence(d->drm_fd, d->crtc_id, &seq, &vblank_ns) == 0 && vblank_ns != 0 &&
+                        period != 0 && vtotal > 0 && vdisplay > 0 && vdisplay <= vtotal;
+    gboolean torn = FALSE;
+    if (measured) {
+        guint64 phase = flip_ns >= vblank_ns ? (flip_ns - vblank_ns) % period
+                                             : period - (vblank_ns - flip_ns) % period;
+        guint64 line_ns = period / (guint64)vtotal;
+        guint64 active_ns = period * (guint64)vdisplay / (guint64)vtotal;
+        torn = phase >= line_ns && phase + line_ns < active_ns;
+    }
+    g_mutex_lock(&d->lock);
+    d->stats.async_flips++;
+    if (!measured) {
+        d->stats.async_flips_unmeasured++;
+    } else if (torn) {
+        d->stats.async_flips_torn++;
+    }
+    g_mutex_unlock(&d->lock);
+}
+
+/* Async flips were refused at runtime: present synchronously from now on. */
+static void disable_async(DrmDisplay *d, int err) {
+    LOGW("Display: async flip rejected (%s); falling back to vblank-synchronised flips", g_strerror(err));
+    g_mutex_lock(&d->lock);
+    d->present_mode = d->vrr_min_interval_ns != 0 ? DRM_PRESENT_VRR : DRM_PRESENT_FIXED;
+    d->stats.present_mode = d->present_mode;
+    d->stats.async_fallbacks++;
+    g_mutex_unlock(&d->lock);
+}
+
+static guint64 flip_timeout_ns(const DrmDisplay *d) {
+    int ms = d->modeset_in_flight ? DISPLAY_MODESET_FLIP_TIMEOUT_MS : DISPLAY_FLIP_TIMEOUT_MS;
+    return (guint64)ms * 1000000ull;
+}
+
+static gboolean same_timing(const drmModeModeInfo *a, const drmModeModeInfo *b) {
+    return a->hdisplay == b->hdisplay && a->vdisplay == b->vdisplay && a->clock == b->clock &&
+           a->htotal == b->htotal && a->vtotal == b->vtotal && a->flags == b->flags;
+}
+
+static gboolean rates_close(int a_mhz, int b_mhz) {
+    int diff = a_mhz > b_mhz ? a_mhz - b_mhz : b_mhz - a_mhz;
+    return (gint64)diff * 100 <= (gint64)b_mhz;
+}
+
+/*
+ * Measures the frame rate over DISPLAY_RATE_WINDOW_MS of PTS and asks for a
+ * mode re-evaluation when it moves. Packet loss thins out a single window, so
+ * only two windows in agreement count. Lock held.
+ */
+static void track_stream_rate(DrmDisplay *d, gint64 pts_us) {
+    if (d->rate_frames == 0 || pts_us <= d->rate_last_pts ||
+        pts_us - d->rate_last_pts > DISPLAY_RATE_MAX_GAP_MS * 1000ll) {
+        d->rate_start_pts = pts_us;
+        d->rate_last_pts = pts_us;
+        d->rate_frames = 1;
+        return;
+    }
+    d->rate_last_pts = pts_us;
+    d->rate_frames++;
+    gint64 span = pts_us - d->rate_start_pts;
+    if (span < DISPLAY_RATE_WINDOW_MS * 1000ll) {
+        return;
+    }
+
+    int fps_mhz = (int)(((gint64)(d->rate_frames - 1) * 1000000000ll + span / 2) / span);
+    d->rate_start_pts = pts_us;
+    d->rate_frames = 1;
+    gboolean confirmed = d->rate_candidate_mhz > 0 && rates_close(fps_mhz, d->rate_candidate_mhz);
+    d->rate_candidate_mhz = fps_mhz;
+    if (confirmed && (d->stream.fps_mhz == 0 || !rates_close(fps_mhz, d->stream.fps_mhz))) {
+        d->stream.fps_mhz = fps_mhz;
+        d->mode_eval_pending = TRUE;
+    }
+}
+
+/* Display thread: picks the mode for the stream and arms the switch if it differs. */
+static void evaluate_mode(DrmDisplay *d) {
+    g_mutex_lock(&d->lock);
+    gboolean pending = d->mode_eval_pending;
+    ModesetStreamInfo stream = d->stream;
+    d->mode_eval_pending = FALSE;
+    g_mutex_unlock(&d->lock);
+    if (!pending) {
+        return;
+    }
+
+    drmModeModeInfo mode;
+    if (drm_modeset_pick_stream_mode(d->drm_fd, d->connector_id, &stream, &mode) != 0) {
+        LOGW("Display: no modes on connector %u; keeping %dx%d@%d", d->connector_id, d->mode_w, d->mode_h,
+             d->mode_hz);
+        return;
+    }
+    d->mode_change_pending = !same_timing(&mode, &d->mode);
+    if (!d->mode_change_pending) {
+        LOGV("Display: %dx%d@%.3f stream stays on %dx%d@%d", stream.width, stream.height, stream.fps_mhz / 1e3,
+             d->mode_w, d->mode_h, d->mode_hz);
+        return;
+    }
+    d->next_mode = mode;
+    LOGI("Display: %dx%d@%.3f stream, switching %dx%d@%d -> %dx%d@%.3f", stream.width, stream.height,
+         stream.fps_mhz / 1e3, d->mode_w, d->mode_h, d->mode_hz, mode.hdisplay, mode.vdisplay,
+         drm_mode_refresh_mhz(&mode) / 1e3);
+}
+
+/* Display thread, after the kernel accepted a commit carrying next_mode or a rebind. */
+static void apply_mode(DrmDisplay *d, const drmModeModeInfo *mode, gboolean count_change) {
+    int hz = drm_mode_refresh_hz(mode);
+    g_mutex_lock(&d->lock);
+    d->mode = *mode;
+    d->mode_w = mode->hdisplay;
+    d->mode_h = mode->vdisplay;
+    d->mode_hz = hz;
+    d->vblank_period_ns = hz > 0 ? 1000000000ull / (guint64)hz : 0;
+    if (d->present_mode == DRM_PRESENT_VRR) {
+        int max_hz = hz > 0 ? MIN(d->vrr_max_hz, hz) : d->vrr_max_hz;
+        d->vrr_min_interval_ns = max_hz > 0 ? 1000000000ull / (guint64)max_hz : 0;
+    }
+    frame_pacer_set_refresh(d->pacer, hz);
+    if (count_change) {
+        d->stats.mode_changes++;
+    }
+    // The old mode's flip timestamps say nothing about the new vblank phase.
+    d->stats.last_flip_ns = 0;
+    g_mutex_unlock(&d->lock);
+}
+
+/*
+ * Display thread: adopt the output a hotplug modeset produced. The plane is
+ * placed from scratch on the next commit and the newest frame goes out right
+ * away; if nothing newer is queued, the one on screen before the unplug is
+ * committed again so the link comes back with a picture.
+ */
+static void apply_rebind(DrmDisplay *d, const ModesetResult *ms, const ModesetResult *mirrors, int mirror_count) {
+    d->crtc_id = ms->crtc_id;
+    d->connector_id = ms->connector_id;
+    d->mode_change_pending = FALSE;
+    d->plane_state_current = FALSE;
+    d->geometry_valid = FALSE;
+    d->overlay_placed = FALSE;
+
+    int lead_mhz = drm_mode_refresh_mhz(&ms->mode);
+    for (guint i = 0; i < d->mirror_count; ++i) {
+        struct MirrorHead *m = &d->mirrors[i];
+        const ModesetResult *r = NULL;
+        for (int j = 0; j < mirror_count; ++j) {
+            if (mirrors[j].connector_id == m->connector_id && mirrors[j].plane_id == m->plane_id) {
+                r = &mirrors[j];
+            }
+        }
+        // Lock-step only holds while both heads refresh at the same rate.
+        gboolean keep = r != NULL && abs(drm_mode_refresh_mhz(&r->mode) - lead_mhz) * 1000 <= lead_mhz;
+        if (keep) {
+            m->crtc_id = r->crtc_id;
+            m->mode_w = r->mode_w;
+            m->mode_h = r->mode_h;
+            m->active = TRUE;
+            m->disable_pending = FALSE;
+        } else if (m->active) {
+            LOGW("Display: mirror on connector %u dropped after hotplug", m->connector_id);
+            m->active = FALSE;
+            m->disable_pending = TRUE;
+        }
+        m->plane_state_current = FALSE;
+        g_mutex_lock(&d->lock);
+        d->stats.heads[i + 1].crtc_id = m->crtc_id;
+        g_mutex_unlock(&d->lock);
+    }
+
+    if (d->mode_policy == MODE_POLICY_STREAM &&
+        (drm_get_prop_id(d->drm_fd, d->crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID", &d->prop_mode_id) != 0 ||
+         drm_get_prop_id(d->drm_fd, d->crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE", &d->prop_active) != 0)) {
+        LOGW("Display: CRTC %u has no MODE_ID/ACTIVE; the mode stays fixed", d->crtc_id);
+        d->mode_policy = MODE_POLICY_MAX;
+    }
+
+    g_mutex_lock(&d->lock);
+    d->stats.heads[0].connector_id = d->connector_id;
+    d->stats.heads[0].crtc_id = d->crtc_id;
+    if (d->present_mode != DRM_PRESENT_ASYNC) {
+        // Lock-step mirrors need the fixed grid they were grouped on.
+        d->present_mode = ms->vrr_active && d->mirror_count == 0 ? DRM_PRESENT_VRR : DRM_PRESENT_FIXED;
+        d->stats.present_mode = d->present_mode;
+    }
+    d->vrr_max_hz = ms->vrr_max_hz > 0 ? ms->vrr_max_hz : ms->mode_hz;
+    d->vrr_min_interval_ns = 0;
+    // A different sink may prefer a different mode for the same stream.
+    if (d->mode_policy == MODE_POLICY_STREAM && d->stream.fps_mhz > 0) {
+        d->mode_eval_pending = TRUE;
+    }
+    if (d->queue_len == 0 && d->on_screen.fb_id != 0) {
+        d->queue[0] = d->on_screen;
+        d->queue[0].commit_at_ns = 0;
+        d->queue[0].held = FALSE;
+        d->queue_len = 1;
+        memset(&d->on_screen, 0, sizeof(d->on_screen));
+    } else {
+        for (guint i = 0; i < d->queue_len; ++i) {
+            d->queue[i].commit_at_ns = 0;
+        }
+    }
+    g_mutex_unlock(&d->lock);
+
+    apply_mode(d, &ms->mode, FALSE);
+    LOGI("Display: rebound to connector %u on CRTC %u, %dx%d@%d, %s", d->connector_id, d->crtc_id, d->mode_w,
+         d->mode_h, d->mode_hz, present_mode_name(d->present_mode));
+}
+
+static void compute_geometry(int mode_width, int mode_height, uint32_t src_w, uint32_t src_h,
+                             struct PlaneGeometry *g) {
+    uint64_t mode_w = (uint64_t)MAX(mode_width, 0);
+    uint64_t mode_h = (uint64_t)MAX(mode_height, 0);
+    uint64_t dst_w = mode_w;
+    uint64_t dst_h = mode_h;
+
+    if (src_w != 0 && src_h != 0 && mode_w != 0 && mode_h != 0) {
+        if ((uint64_t)src_w * mode_h > mode_w * (uint64_t)src_h) {
+            // Wider than the mode: full width, bars top and bottom.
+            dst_h = (mode_w * src_h + src_w / 2) / src_w;
+        } else {
+            dst_w = (mode_h * src_w + src_h / 2) / src_h;
+        }
+    }
+    dst_w = CLAMP(dst_w, 1, MAX(mode_w, 1));
+    dst_h = CLAMP(dst_h, 1, MAX(mode_h, 1));
+
+    g->src_w = src_w;
+    g->src_h = src_h;
+    g->dst_w = (uint32_t)dst_w;
+    g->dst_h = (uint32_t)dst_h;
+    g->dst_x = dst_w < mode_w ? (uint32_t)((mode_w - dst_w) / 2) : 0;
+    g->dst_y = dst_h < mode_h ? (uint32_t)((mode_h - dst_h) / 2) : 0;
+}
+
+/* Display thread: the posted OSD fb, if any, now belongs to the commit being built. */
+static uint32_t take_overlay_fb(DrmDisplay *d) {
+    g_mutex_lock(&d->lock);
+    uint32_t fb = d->overlay_enabled ? d->overlay_pending_fb : 0;
+    d->overlay_pending_fb = 0;
+    g_mutex_unlock(&d->lock);
+    return fb;
+}
+
+/* A commit carrying fb failed without being refused; the next one carries it unless a newer fb was posted. */
+static void requeue_overlay_fb(DrmDisplay *d, uint32_t fb) {
+    g_mutex_lock(&d->lock);
+    if (d->overlay_pending_fb == 0) {
+        d->overlay_pending_fb = fb;
+    }
+    g_mutex_unlock(&d->lock);
+}
+
+static void overlay_refused(DrmDisplay *d, int err) {
+    LOGW("Display: OSD plane %u refused (%s); continuing without it", d->overlay.plane_id, g_strerror(err));
+    g_mutex_lock(&d->lock);
+    d->overlay_enabled = FALSE;
+    d->overlay_pending_fb = 0;
+    d->stats.overlay_failures++;
+    g_mutex_unlock(&d->lock);
+}
+
+static void add_overlay(DrmDisplay *d, uint32_t fb) {
+    const DrmOverlayPlacement *o = &d->overlay;
+    drmModeAtomicAddProperty(d->req, o->plane_id, d->overlay_props.fb_id, fb);
+    if (d->overlay_placed) {
+        return;
+    }
+    struct PlaneGeometry g = {.src_w = (uint32_t)o->w, .src_h = (uint32_t)o->h, .dst_x = (uint32_t)o->x,
+                              .dst_y = (uint32_t)o->y, .dst_w = (uint32_t)o->w, .dst_h = (uint32_t)o->h};
+    add_plane_placement(d->req, o->plane_id, &d->overlay_props, d->crtc_id, &g);
+    if (o->zpos_prop != 0) {
+        drmModeAtomicAddProperty(d->req, o->plane_id, o->zpos_prop, o->zpos);
+    }
+    if (o->video_zpos_prop != 0) {
+        drmModeAtomicAddProperty(d->req, d->plane_id, o->video_zpos_prop, o->video_zpos);
+    }
+}
+
+/* Display thread, after a commit carrying fb was accepted. */
+static void overlay_committed(DrmDisplay *d, uint32_t fb, gboolean alone) {
+    d->overlay_placed = TRUE;
+    g_mutex_lock(&d->lock);
+    d->overlay_in_flight_fb = fb;
+    if (alone) {
+        d->stats.overlay_commits_alone++;
+    } else {
+        d->stats.overlay_commits_shared++;
+    }
+    g_mutex_unlock(&d->lock);
+}
+
+/* The video has stalled but the OSD still has news: commit its plane by itself. */
+static int commit_overlay_only(DrmDisplay *d) {
+    uint32_t fb = take_overlay_fb(d);
+    if (fb == 0) {
+        return 0;
+    }
+    drmModeAtomicSetCursor(d->req, 0);
+    add_overlay(d, fb);
+    if (drmModeAtomicCommit(d->drm_fd, d->req, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, d) != 0) {
+        int err = errno;
+        if (err == EBUSY) {
+            requeue_overlay_fb(d, fb);
+        } else {
+            overlay_refused(d, err);
+        }
+        return -err;
+    }
+    overlay_committed(d, fb, TRUE);
+    d->flip_pending = TRUE;
+    d->flips_outstanding = 1;
+    d->commit_ns = monotonic_ns();
+    d->last_commit_ns = d->commit_ns;
+    return 0;
+}
+
+static int commit_frame(DrmDisplay *d, const struct DisplayFrame *frame) {
+    guint64 build_start_ns = monotonic_ns();
+
+    // A mode change rides on this frame's commit so the picture never drops to black in between.
+    uint32_t mode_blob = 0;
+    gboolean modeset = FALSE;
+    if (d->mode_change_pending) {
+        d->mode_change_pending = FALSE;
+        if (drmModeCreatePropertyBlob(d->drm_fd, &d->next_mode, sizeof(d->next_mode), &mode_blob) == 0) {
+            modeset = TRUE;
+            d->geometry_valid = FALSE;
+        } else {
+            LOGW("Display: drmModeCreatePropertyBlob failed: %s", g_strerror(errno));
+        }
+    }
+    int mode_w = modeset ? d->next_mode.hdisplay : d->mode_w;
+    int mode_h = modeset ? d->next_mode.vdisplay : d->mode_h;
+
+    uint32_t src_w = frame->src_w ? frame->src_w : (uint32_t)mode_w;
+    uint32_t src_h = frame->src_h ? frame->src_h : (uint32_t)mode_h;
+
+    if (!d->geometry_valid || d->geometry.src_w != src_w || d->geometry.src_h != src_h) {
+        compute_geometry(mode_w, mode_h, src_w, src_h, &d->geometry);
+        d->geometry_valid = TRUE;
+        d->plane_state_current = FALSE;
+    }
+
+    drmModeAtomicSetCursor(d->req, 0);
+    drmModeAtomicAddProperty(d->req, d->plane_id, d->plane_props.fb_id, frame->fb_id);
+    gboolean full = !d->plane_state_current;
+    if (full) {
+        add_plane_placement(d->req, d->plane_id, &d->plane_props, d->crtc_id, &d->geometry);
+    }
+    // Lock-step mirrors take the same fb in the same request; each is letterboxed into its own mode.
+    for (guint i = 0; i < d->mirror_count; ++i) {
+        struct MirrorHead *m = &d->mirrors[i];
+        m->in_commit = FALSE;
+        if (m->disable_pending) {
+            drmModeAtomicAddProperty(d->req, m->plane_id, m->props.fb_id, 0);
+            drmModeAtomicAddProperty(d->req, m->plane_id, m->props.crtc_id, 0);
+            full = TRUE;
+            continue;
+        }
+        if (!m->active) {
+            continue;
+        }
+        if (!m->plane_state_current || m->geometry.src_w != src_w || m->geometry.src_h != src_h) {
+            compute_geometry(m->mode_w, m->mode_h, src_w, src_h, &m->geometry);
+            m->plane_state_current = FALSE;
+        }
+        drmModeAtomicAddProperty(d->req, m->plane_id, m->props.fb_id, frame->fb_id);
+        if (!m->plane_state_current) {
+            add_plane_placement(d->req, m->plane_id, &m->props, m->crtc_id, &m->geometry);
+            full = TRUE;
+        }
+        m->in_commit = TRUE;
+    }
+    uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+    if (modeset) {
+        drmModeAtomicAddProperty(d->req, d->crtc_id, d->prop_mode_id, mode_blob);
+        drmModeAtomicAddProperty(d->req, d->crtc_id, d->prop_active, 1);
+        if (d->bg_plane_id != 0) {
+            uint64_t bg_w = (uint64_t)MIN(d->bg_fb_w, mode_w);
+            uint64_t bg_h = (uint64_t)MIN(d->bg_fb_h, mode_h);
+            drmModeAtomicAddProperty(d->req, d->bg_plane_id, d->bg_prop_crtc_w, bg_w);
+            drmModeAtomicAddProperty(d->req, d->bg_plane_id, d->bg_prop_crtc_h, bg_h);
+            drmModeAtomicAddProperty(d->req, d->bg_plane_id, d->bg_prop_src_w, bg_w << 16);
+            drmModeAtomicAddProperty(d->req, d->bg_plane_id, d->bg_prop_src_h, bg_h << 16);
+        }
+        flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+    }
+
+    // The OSD goes in last, so a refusal can be rewound without losing the video frame.
+    int overlay_cursor = drmModeAtomicGetCursor(d->req);
+    uint32_t overlay_fb = take_overlay_fb(d);
+    if (overlay_fb != 0) {
+        add_overlay(d, overlay_fb);
+    }
+
+    // Async flips may only change FB_ID; anything that (re)places the plane goes through a vblank.
+    gboolean async = d->present_mode == DRM_PRESENT_ASYNC && !full && !modeset && overlay_fb == 0;
+
+    guint64 ioctl_start_ns = monotonic_ns();
+    int ret;
+    if (async && d->async_legacy) {
+        ret = drmModePageFlip(d->drm_fd, d->crtc_id, frame->fb_id,
+                              DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_PAGE_FLIP_ASYNC, d);
+    } else {
+        ret = drmModeAtomicCommit(d->drm_fd, d->req, flags | (async ? DRM_MODE_PAGE_FLIP_ASYNC : 0), d);
+    }
+    int err = (ret != 0) ? errno : 0;
+    if (async && ret != 0 && err != EBUSY) {
+        disable_async(d, err);
+        async = FALSE;
+        ret = drmModeAtomicCommit(d->drm_fd, d->req, flags, d);
+        err = (ret != 0) ? errno : 0;
+    }
+    if (overlay_fb != 0 && ret != 0 && err != EBUSY) {
+        overlay_refused(d, err);
+        drmModeAtomicSetCursor(d->req, overlay_cursor);
+        overlay_fb = 0;
+        ret = drmModeAtomicCommit(d->drm_fd, d->req, flags, d);
+        err = (ret != 0) ? errno : 0;
+    }
+    if (overlay_fb != 0) {
+        if (ret == 0) {
+            overlay_committed(d, overlay_fb, FALSE);
+        } else {
+            requeue_overlay_fb(d, overlay_fb);
+        }
+    }
+    d->async_in_flight = async && ret == 0;
+    guint64 ioctl_end_ns = monotonic_ns();
+    if (ret == 0) {
+        d->last_commit_ns = ioctl_end_ns;
+    }
+
+    // After a failure we no longer know what the plane holds; place it again next time.
+    d->plane_state_current = (ret == 0);
+    d->flips_outstanding = ret == 0 ? 1 : 0;
+    for (guint i = 0; i < d->mirror_count; ++i) {
+        struct MirrorHead *m = &d->mirrors[i];
+        if (ret == 0 && m->disable_pending) {
+            m->disable_pending = FALSE;
+        }
+        m->plane_state_current = ret == 0 && m->in_commit;
+        if (ret == 0 && m->in_commit) {
+            d->flips_outstanding++;
+        } else {
+            m->in_commit = FALSE;
+        }
+    }
+
+    if (modeset) {
+        // The committed state holds its own reference to the blob.
+        drmModeDestroyPropertyBlob(d->drm_fd, mode_blob);
+        if (ret == 0) {
+            apply_mode(d, &d->next_mode, TRUE);
+            d->modeset_in_flight = TRUE;
+            LOGI("Display: mode %dx%d@%d committed", d->mode_w, d->mode_h, d->mode_hz);
+        } else if (err == EBUSY) {
+            // Not rejected, just not now: the retry of this frame carries the switch again.
+            d->mode_change_pending = TRUE;
+            d->geometry_valid = FALSE;
+        } else {
+            // Stay in the current mode; the policy only tries again when the stream changes.
+            d->geometry_valid = FALSE;
+            g_mutex_lock(&d->lock);
+            d->stats.mode_change_failures++;
+            g_mutex_unlock(&d->lock);
+            LOGW("Display: mode change to %dx%d rejected: %s", mode_w, mode_h, g_strerror(err));
+        }
+    }
+
+    if (ret == 0 && !d->first_commit_logged) {
+        d->first_commit_logged = TRUE;
+        DrmPropsStats props;
+        drm_props_get_stats(&props);
+        LOGI("Display: first frame committed %.1f ms after startup, %.1f ms after display setup; "
+             "%" PRIu64 " property ioctls so far (%" PRIu64 " objects, %" PRIu64 " lookups)",
+             log_startup_elapsed_ns() / 1e6, (ioctl_end_ns - d->created_ns) / 1e6, props.ioctls,
+             props.tables_built, props.lookups);
+    }
+
+    guint64 build_ns = ioctl_start_ns - build_start_ns;
+    guint64 ioctl_ns = ioctl_end_ns - ioctl_start_ns;
+    g_mutex_lock(&d->lock);
+    if (full) {
+        d->stats.commits_full++;
+    } else {
+        d->stats.commits_fast++;
+    }
+    d->stats.commit_build_ns += build_ns;
+    d->stats.commit_build_max_ns = MAX(d->stats.commit_build_max_ns, build_ns);
+    d->stats.commit_ioctl_ns += ioctl_ns;
+    d->stats.commit_ioctl_max_ns = MAX(d->stats.commit_ioctl_max_ns, ioctl_ns);
+    g_mutex_unlock(&d->lock);
+
+    return ret != 0 ? -err : 0;
+}
+
+static void retire_in_flight(DrmDisplay *d, guint64 flip_ns, uint32_t sequence, gboolean timed_out) {
+    if (!d->flip_pending) {
+        return;
+    }
+
+    g_mutex_lock(&d->lock);
+    if (d->overlay_in_flight_fb != 0) {
+        d->overlay_on_screen_fb = d->overlay_in_flight_fb;
+        d->overlay_in_flight_fb = 0;
+    }
+    g_mutex_unlock(&d->lock);
+    if (d->in_flight.fb_id == 0) {
+        // An OSD-only commit: the video frame on screen stays there.
+        d->flip_pending = FALSE;
+        return;
+    }
+
+    struct DisplayFrame old = d->on_screen;
+    d->on_screen = d->in_flight;
+    memset(&d->in_flight, 0, sizeof(d->in_flight));
+    d->flip_pending = FALSE;
+
+    /*
+     * A commit should land on the first vblank after it was issued. Use the
+     * previous flip as the phase reference to find that vblank and count any
+     * whole refresh periods the flip slipped past it.
+     */
+    guint64 missed = 0;
+    guint64 period = d->vblank_period_ns;
+    g_mutex_lock(&d->lock);
+    guint64 last_flip_ns = d->stats.last_flip_ns;
+    g_mutex_unlock(&d->lock);
+    gboolean modeset = d->modeset_in_flight;
+    d->modeset_in_flight = FALSE;
+    if (d->async_in_flight) {
+        d->async_in_flight = FALSE;
+        if (!timed_out) {
+            account_async_flip(d, flip_ns);
+        }
+    }
+    // With variable refresh there is no fixed vblank grid to miss.
+    if (!timed_out && !modeset && d->present_mode == DRM_PRESENT_FIXED && period != 0 && flip_ns > d->commit_ns) {
+        guint64 first_vblank;
+        if (last_flip_ns != 0 && d->commit_ns >= last_flip_ns) {
+            first_vblank = last_flip_ns + ((d->commit_ns - last_flip_ns) / period + 1) * period;
+        } else {
+            first_vblank = d->commit_ns + period;
+        }
+        if (flip_ns > first_vblank + period / 2) {
+            missed = (flip_ns - first_vblank + period / 2) / period;
+        }
+    }
+
+    if (!timed_out && !d->first_flip_logged) {
+        d->first_flip_logged = TRUE;
+        LOGI("Display: first frame on screen %.1f ms after startup", log_startup_elapsed_ns() / 1e6);
+    }
+
+    struct DisplayFrame *shown = &d->on_screen;
+    g_mutex_lock(&d->lock);
+    if (!timed_out && shown->ready_ns != 0 && flip_ns > shown->ready_ns) {
+        guint64 latency = flip_ns - shown->ready_ns;
+        DrmPresentMode pm = d->present_mode;
+        d->stats.flip_latency_frames[pm]++;
+        d->stats.flip_latency_ns[pm] += latency;
+        d->stats.flip_latency_max_ns[pm] = MAX(d->stats.flip_latency_max_ns[pm], latency);
+    }
+    d->stats.frames_presented++;
+    d->stats.missed_vblanks += missed;
+    for (guint i = 0; i < d->mirror_count; ++i) {
+        struct MirrorHead *m = &d->mirrors[i];
+        if (!timed_out && m->flip_ns != 0) {
+            DrmHeadStats *hs = &d->stats.heads[i + 1];
+            guint64 skew = m->flip_ns > flip_ns ? m->flip_ns - flip_ns : flip_ns - m->flip_ns;
+            hs->skew_ns += skew;
+            hs->skew_max_ns = MAX(hs->skew_max_ns, skew);
+        }
+        m->flip_ns = 0;
+        m->in_commit = FALSE;
+    }
+    if (!timed_out) {
+        d->stats.heads[0].flips++;
+        d->stats.heads[0].last_flip_ns = flip_ns;
+        if (last_flip_ns != 0 && flip_ns > last_flip_ns) {
+            d->stats.last_flip_interval_ns = flip_ns - last_flip_ns;
+        }
+        d->stats.last_flip_ns = flip_ns;
+        d->stats.last_flip_sequence = sequence;
+        frame_pacer_note_flip(d->pacer, flip_ns);
+    }
+    g_mutex_unlock(&d->lock);
+
+    // The buffer that was on screen until this flip is no longer scanned out.
+    release_frame(d, &old);
+}
+
+/* One CRTC of the in-flight commit flipped. Kernels before 4.12 report crtc_id 0; that counts as the lead. */
+static void note_head_flip(DrmDisplay *d, uint32_t crtc_id, guint64 flip_ns, uint32_t sequence) {
+    for (guint i = 0; i < d->mirror_count; ++i) {
+        struct MirrorHead *m = &d->mirrors[i];
+        if (m->in_commit && m->flip_ns == 0 && m->crtc_id == crtc_id) {
+            m->flip_ns = flip_ns;
+            g_mutex_lock(&d->lock);
+            d->stats.heads[i + 1].flips++;
+            d->stats.heads[i + 1].last_flip_ns = flip_ns;
+            g_mutex_unlock(&d->lock);
+            return;
+        }
+    }
+    d->lead_flip_ns = flip_ns;
+    d->lead_flip_sequence = sequence;
+}
+
+/* Display thread: one CRTC of our in-flight commit flipped. */
+static void handle_flip(DrmDisplay *d, const struct FlipEvent *ev) {
+    if (!d->flip_pending) {
+        return;
+    }
+    note_head_flip(d, ev->crtc_id, ev->flip_ns, ev->sequence);
+    // A commit spanning several CRTCs is done when the last of them flipped; pacing follows the lead.
+    if (d->flips_outstanding > 1) {
+        d->flips_outstanding--;
+        return;
+    }
+    d->flips_outstanding = 0;
+    guint64 lead_ns = d->lead_flip_ns != 0 ? d->lead_flip_ns : ev->flip_ns;
+    uint32_t lead_seq = d->lead_flip_ns != 0 ? d->lead_flip_sequence : ev->sequence;
+    d->lead_flip_ns = 0;
+    retire_in_flight(d, lead_ns, lead_seq, FALSE);
+}
+
+/* Runs on whichever display thread read the event; event_lock held. */
+static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec,
+                              unsigned int crtc_id, void *user_data) {
+    (void)fd;
+    DrmDisplay *d = (DrmDisplay *)user_data;
+    gboolean registered = FALSE;
+    for (guint i = 0; event_displays != NULL && i < event_displays->len && !registered; ++i) {
+        registered = g_ptr_array_index(event_displays, i) == d;
+    }
+    if (d == NULL || !registered) {
+        return;
+    }
+    g_mutex_lock(&d->lock);
+    if (d->flip_event_count < G_N_ELEMENTS(d->flip_events)) {
+        struct FlipEvent *ev = &d->flip_events[d->flip_event_count++];
+        ev->flip_ns = (guint64)tv_sec * 1000000000ull + (guint64)tv_usec * 1000ull;
+        ev->sequence = sequence;
+        ev->crtc_id = crtc_id;
+    }
+    wake_display_thread(d);
+    g_mutex_unlock(&d->lock);
+}
+
+static void dispatch_drm_events(DrmDisplay *d, drmEventContext *evctx) {
+    g_mutex_lock(&event_lock);
+    // Another display's thread may have drained the event that woke us; don't block in read().
+    struct pollfd pfd = {.fd = d->drm_fd, .events = POLLIN, .revents = 0};
+    if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+        drmHandleEvent(d->drm_fd, evctx);
+    }
+    g_mutex_unlock(&event_lock);
+}
+
+static void process_flip_events(DrmDisplay *d) {
+    struct FlipEvent events[DRM_MAX_HEADS];
+    g_mutex_lock(&d->lock);
+    guint count = d->flip_event_count;
+    memcpy(events, d->flip_events, count * sizeof(events[0]));
+    d->flip_event_count = 0;
+    g_mutex_unlock(&d->lock);
+    for (guint i = 0; i < count; ++i) {
+        handle_flip(d, &events[i]);
+    }
+}
+
+static gpointer display_thread_func(gpointer data) {
+    DrmDisplay *d = (DrmDisplay *)data;
+
+    drmEventContext evctx;
+    memset(&evctx, 0, sizeof(evctx));
+    evctx.version = 3;
+    evctx.page_flip_handler2 = page_flip_handler;
+
+    while (TRUE) {
+        struct DisplayFrame next;
+        memset(&next, 0, sizeof(next));
+        struct DisplayFrame dropped[DISPLAY_QUEUE_MAX];
+        guint dropped_count = 0;
+        guint64 wait_until_ns = 0;
+        guint64 picked_ns = 0;
+
+        g_mutex_lock(&d->lock);
+        gboolean rebind = d->rebind_pending && !d->flip_pending;
+        ModesetResult rebind_ms = d->rebind;
+        ModesetResult rebind_mirrors[DRM_MAX_HEADS - 1];
+        int rebind_mirror_count = d->rebind_mirror_count;
+        memcpy(rebind_mirrors, d->rebind_mirrors, sizeof(rebind_mirrors));
+        if (rebind) {
+            d->rebind_pending = FALSE;
+        }
+        g_mutex_unlock(&d->lock);
+        if (rebind) {
+            apply_rebind(d, &rebind_ms, rebind_mirrors, rebind_mirror_count);
+        }
+
+        if (!d->flip_pending) {
+            evaluate_mode(d);
+        }
+
+        g_mutex_lock(&d->lock);
+        gboolean stop = d->stop_requested;
+        gboolean flush = d->flush_requested;
+        gboolean overlay_waiting = d->overlay_pending_fb != 0 && d->overlay_enabled && !d->hold;
+        if (d->hold && !d->flip_pending && !d->hold_idle) {
+            d->hold_idle = TRUE;
+            g_cond_broadcast(&d->cond);
+        }
+        if (!d->flip_pending && !stop && !flush && !d->hold && d->queue_len > 0) {
+            // Of the frames whose slot has come, only the newest goes out.
+            picked_ns = monotonic_ns();
+            guint due = 0;
+            while (due < d->queue_len && d->queue[due].commit_at_ns <= picked_ns) {
+                ++due;
+            }
+            if (due > 0) {
+                for (guint i = 0; i + 1 < due; ++i) {
+                    dropped[dropped_count++] = d->queue[i];
+                }
+                next = d->queue[due - 1];
+                queue_remove_head(d, due);
+                d->stats.frames_superseded += dropped_count;
+            } else {
+                wait_until_ns = d->queue[0].commit_at_ns;
+            }
+        }
+        g_mutex_unlock(&d->lock);
+
+        for (guint i = 0; i < dropped_count; ++i) {
+            release_frame(d, &dropped[i]);
+        }
+
+        if ((stop || flush) && !d->flip_pending) {
+            if (stop) {
+                break;
+            }
+            // The frame on screen stays referenced; the next flip or drm_display_free retires it.
+            g_mutex_lock(&d->lock);
+            d->flush_requested = FALSE;
+            g_cond_broadcast(&d->cond);
+            g_mutex_unlock(&d->lock);
+            continue;
+        }
+
+        gint64 timeout_ns = -1;
+        if (next.fb_id != 0) {
+            int ret = commit_frame(d, &next);
+            guint64 done_ns = monotonic_ns();
+            if (ret == 0) {
+                d->in_flight = next;
+                d->flip_pending = TRUE;
+                d->commit_ns = done_ns;
+                // For held frames the wake-up lateness counts too: both eat into the vblank lead.
+                guint64 cost_from = next.held ? MIN(next.commit_at_ns, picked_ns) : picked_ns;
+                g_mutex_lock(&d->lock);
+                frame_pacer_note_commit_cost(d->pacer, done_ns - cost_from);
+                g_mutex_unlock(&d->lock);
+            } else if (ret == -EBUSY) {
+                // Someone else's commit is still queued; retry shortly unless the queue moved on.
+                struct DisplayFrame busy_drop;
+                memset(&busy_drop, 0, sizeof(busy_drop));
+                g_mutex_lock(&d->lock);
+                d->stats.commit_busy++;
+                if (d->queue_len < d->queue_depth) {
+                    memmove(&d->queue[1], &d->queue[0], d->queue_len * sizeof(d->queue[0]));
+                    next.commit_at_ns = done_ns + (guint64)DISPLAY_BUSY_RETRY_MS * 1000000ull;
+                    next.held = FALSE;
+                    d->queue[0] = next;
+                    d->queue_len++;
+                } else {
+                    busy_drop = next;
+                    d->stats.frames_superseded++;
+                }
+                g_mutex_unlock(&d->lock);
+                release_frame(d, &busy_drop);
+                timeout_ns = (gint64)DISPLAY_BUSY_RETRY_MS * 1000000ll;
+            } else {
+                g_mutex_lock(&d->lock);
+                guint64 failures = ++d->stats.commit_failures;
+                g_mutex_unlock(&d->lock);
+                if (failures == 1 || failures % 100 == 0) {
+                    LOGW("Display: atomic commit failed: %s (%" G_GUINT64_FORMAT " failures)",
+                         g_strerror(-ret), failures);
+                }
+                release_frame(d, &next);
+            }
+        } else if (wait_until_ns != 0) {
+            guint64 now = monotonic_ns();
+            timeout_ns = wait_until_ns > now ? (gint64)(wait_until_ns - now) : 0;
+        }
+        if (next.fb_id == 0 && overlay_waiting && !d->flip_pending && !stop && !flush) {
+            guint64 now = monotonic_ns();
+            guint64 due = d->last_commit_ns + (guint64)DISPLAY_OVERLAY_IDLE_MS * 1000000ull;
+            gint64 wait_ns = -1;
+            if (now < due) {
+                wait_ns = (gint64)(due - now);
+            } else if (commit_overlay_only(d) == -EBUSY) {
+                wait_ns = (gint64)DISPLAY_BUSY_RETRY_MS * 1000000ll;
+            }
+            if (wait_ns >= 0 && (timeout_ns < 0 || wait_ns < timeout_ns)) {
+                timeout_ns = wait_ns;
+            }
+        }
+        if (d->flip_pending) {
+            timeout_ns = (gint64)flip_timeout_ns(d);
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = d->drm_fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = d->wake_fd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        // ppoll: a just-in-time commit needs better than millisecond wake-ups.
+        struct timespec ts;
+        ts.tv_sec = timeout_ns / 1000000000ll;
+        ts.tv_nsec = timeout_ns % 1000000000ll;
+        int n = ppoll(fds, 2, timeout_ns >= 0 ? &ts : NULL, NULL);
+        if (n < 0) {
+            if (errno != EINTR) {
+                LOGW("Display: poll failed: %s", g_strerror(errno));
+            }
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            dispatch_drm_events(d, &evctx);
+        }
+        if (fds[1].revents & POLLIN) {
+            drain_wake_fd(d);
+        }
+        process_flip_events(d);
+        if (d->flip_pending && monotonic_ns() - d->commit_ns > flip_timeout_ns(d)) {
+            LOGW("Display: no flip event within %d ms; retiring commit", (int)(flip_timeout_ns(d) / 1000000ull));
+            d->flips_outstanding = 0;
+            d->lead_flip_ns = 0;
+            retire_in_flight(d, monotonic_ns(), 0, TRUE);
+        }
+    }
+
+    g_mutex_lock(&d->lock);
+    d->running = FALSE;
+    g_cond_broadcast(&d->cond);
+    g_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+/*
+ * Takes the video plane and the lock-step mirrors' planes off their CRTCs. The
+ * commit blocks, so once it succeeds nothing scans out the frames we hold.
+ */
+static int disable_video_planes(DrmDisplay *d) {
+    drmModeAtomicSetCursor(d->req, 0);
+    drmModeAtomicAddProperty(d->req, d->plane_id, d->plane_props.fb_id, 0);
+    drmModeAtomicAddProperty(d->req, d->plane_id, d->plane_props.crtc_id, 0);
+    for (guint i = 0; i < d->mirror_count; ++i) {
+        struct MirrorHead *m = &d->mirrors[i];
+        if (m->active || m->disable_pending) {
+            drmModeAtomicAddProperty(d->req, m->plane_id, m->props.fb_id, 0);
+            drmModeAtomicAddProperty(d->req, m->plane_id, m->props.crtc_id, 0);
+        }
+    }
+    if (drmModeAtomicCommit(d->drm_fd, d->req, 0, NULL) != 0) {
+        return -errno;
+    }
+    d->plane_state_current = FALSE;
+    return 0;
+}
+
+DrmDisplay *drm_display_new(int drm_fd, const AppCfg *cfg, const ModesetResult *ms, DrmDisplayReleaseFn release) {
+    if (drm_fd < 0 || cfg == NULL || ms == NULL) {
+        return NULL;
+    }
+
+    uint32_t plane_id = ms->plane_id != 0 ? ms->plane_id : (uint32_t)cfg->plane_id;
+    DrmDisplay *d = g_new0(DrmDisplay, 1);
+    d->created_ns = monotonic_ns();
+    d->drm_fd = drm_fd;
+    d->wake_fd = -1;
+    d->plane_id = plane_id;
+    d->crtc_id = ms->crtc_id;
+    d->connector_id = ms->connector_id;
+    d->mode = ms->mode;
+    // A mode picked by an earlier pipeline's policy outlives it; start from what the CRTC shows.
+    drmModeCrtc *crtc = drmModeGetCrtc(drm_fd, ms->crtc_id);
+    if (crtc != NULL) {
+        if (crtc->mode_valid) {
+            d->mode = crtc->mode;
+        }
+        drmModeFreeCrtc(crtc);
+    }
+    if (d->mode.hdisplay != 0 && d->mode.vdisplay != 0) {
+        d->mode_w = d->mode.hdisplay;
+        d->mode_h = d->mode.vdisplay;
+        d->mode_hz = drm_mode_refresh_hz(&d->mode);
+    } else {
+        d->mode_w = ms->mode_w;
+        d->mode_h = ms->mode_h;
+        d->mode_hz = ms->mode_hz;
+    }
+    d->vblank_period_ns = d->mode_hz > 0 ? 1000000000ull / (guint64)d->mode_hz : 0;
+    d->release = release;
+
+    d->present_mode = ms->vrr_active ? DRM_PRESENT_VRR : DRM_PRESENT_FIXED;
+    d->vrr_max_hz = ms->vrr_max_hz > 0 ? ms->vrr_max_hz : d->mode_hz;
+    if (d->present_mode == DRM_PRESENT_VRR) {
+        int max_hz = d->mode_hz > 0 ? MIN(d->vrr_max_hz, d->mode_hz) : d->vrr_max_hz;
+        d->vrr_min_interval_ns = max_hz > 0 ? 1000000000ull / (guint64)max_hz : 0;
+    }
+    if (cfg->pacing_mode == PACING_MODE_TEARING) {
+        if (detect_async_support(d)) {
+            d->present_mode = DRM_PRESENT_ASYNC;
+            LOGI("Display: async flips via %s", d->async_legacy ? "legacy page flip" : "atomic commit");
+        } else {
+            LOGW("Display: tearing mode unavailable; using %s with latency pacing",
+                 present_mode_name(d->present_mode));
+        }
+    }
+    d->stats.present_mode = d->present_mode;
+    d->stats.head_count = 1;
+    d->stats.heads[0].connector_id = d->connector_id;
+    d->stats.heads[0].crtc_id = d->crtc_id;
+
+    d->mode_policy = cfg->mode_policy;
+    if (d->mode_policy == MODE_POLICY_STREAM &&
+        (drm_get_prop_id(drm_fd, d->crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID", &d->prop_mode_id) != 0 ||
+         drm_get_prop_id(drm_fd, d->crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE", &d->prop_active) != 0)) {
+        LOGW("Display: CRTC %u has no MODE_ID/ACTIVE; the mode stays fixed", d->crtc_id);
+        d->mode_policy = MODE_POLICY_MAX;
+    }
+
+    if (query_plane_props(drm_fd, plane_id, &d->plane_props) != 0) {
+        LOGE("Display: failed to query plane %u properties", plane_id);
+        g_free(d);
+        return NULL;
+    }
+
+    d->req = drmModeAtomicAlloc();
+    if (d->req == NULL) {
+        LOGE("Display: drmModeAtomicAlloc failed");
+        g_free(d);
+        return NULL;
+    }
+
+    d->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (d->wake_fd < 0) {
+        LOGE("Display: eventfd failed: %s", g_strerror(errno));
+        drmModeAtomicFree(d->req);
+        g_free(d);
+        return NULL;
+    }
+
+    d->pacer = frame_pacer_new(cfg->pacing_mode, d->mode_hz);
+    d->queue_depth = MIN(frame_pacer_queue_depth(d->pacer), DISPLAY_QUEUE_MAX);
+    LOGI("Display: %dx%d@%d, %s, %s pacing, up to %u queued frame(s), %s mode policy", d->mode_w, d->mode_h,
+         d->mode_hz, present_mode_name(d->present_mode), cfg_pacing_mode_name(cfg->pacing_mode), d->queue_depth,
+         cfg_mode_policy_name(d->mode_policy));
+
+    g_mutex_init(&d->lock);
+    g_cond_init(&d->cond);
+
+    g_mutex_lock(&event_lock);
+    if (event_displays == NULL) {
+        event_displays = g_ptr_array_new();
+    }
+    g_ptr_array_add(event_displays, d);
+    g_mutex_unlock(&event_lock);
+    return d;
+}
+
+int drm_display_start(DrmDisplay *d) {
+    if (d == NULL) {
+        return -1;
+    }
+    g_mutex_lock(&d->lock);
+    if (d->running) {
+        g_mutex_unlock(&d->lock);
+        return 0;
+    }
+    d->running = TRUE;
+    d->stop_requested = FALSE;
+    d->flush_requested = FALSE;
+    d->hold = FALSE;
+    d->hold_idle = FALSE;
+    d->flip_event_count = 0;
+    g_mutex_unlock(&d->lock);
+
+    // Someone else may have touched the plane since our last commit.
+    d->plane_state_current = FALSE;
+    d->overlay_placed = FALSE;
+    for (guint i = 0; i < d->mirror_count; ++i) {
+        d->mirrors[i].plane_state_current = FALSE;
+    }
+
+    d->thread = g_thread_new("drm-display", display_thread_func, d);
+    if (d->thread == NULL) {
+        g_mutex_lock(&d->lock);
+        d->running = FALSE;
+        g_mutex_unlock(&d->lock);
+        return -1;
+    }
+    return 0;
+}
+
+void drm_display_stop(DrmDisplay *d) {
+    if (d == NULL) {
+        return;
+    }
+
+    g_mutex_lock(&d->lock);
+    d->stop_requested = TRUE;
+    wake_display_thread(d);
+    g_mutex_unlock(&d->lock);
+
+    if (d->thread != NULL) {
+        g_thread_join(d->thread);
+        d->thread = NULL;
+    }
+
+    // Frames that never reached the screen go straight back to their owner.
+    g_mutex_lock(&d->lock);
+    struct DisplayFrame dropped[DISPLAY_QUEUE_MAX];
+    guint dropped_count = d->queue_len;
+    memcpy(dropped, d->queue, dropped_count * sizeof(dropped[0]));
+    d->queue_len = 0;
+    d->stop_requested = FALSE;
+    g_mutex_unlock(&d->lock);
+    for (guint i = 0; i < dropped_count; ++i) {
+        release_frame(d, &dropped[i]);
+    }
+}
+
+void drm_display_free(DrmDisplay *d) {
+    if (d == NULL) {
+        return;
+    }
+
+    drm_display_stop(d);
+    // The frame pools outlive us, so a buffer released while still scanned out could be decoded into on screen.
+    if (d->in_flight.fb_id != 0 || d->on_screen.fb_id != 0) {
+        int ret = disable_video_planes(d);
+        if (ret != 0) {
+            LOGW("Display: failed to switch plane %u off: %s", d->plane_id, g_strerror(-ret));
+        }
+    }
+    release_frame(d, &d->in_flight);
+    release_frame(d, &d->on_screen);
+
+    g_mutex_lock(&d->lock);
+    LOGI("Display: %" G_GUINT64_FORMAT " submitted, %" G_GUINT64_FORMAT " presented, %" G_GUINT64_FORMAT
+         " superseded, %" G_GUINT64_FORMAT " missed vblanks, %" G_GUINT64_FORMAT " commit failures",
+         d->stats.frames_submitted, d->stats.frames_presented, d->stats.frames_superseded,
+         d->stats.missed_vblanks, d->stats.commit_failures);
+    FramePacerStats pacing;
+    frame_pacer_get_stats(d->pacer, &pacing);
+    LOGI("Display pacing: decode %.2f ms (+/- %.2f), jitter %.2f ms, playout delay %.2f ms, lead %.2f ms, %"
+         G_GUINT64_FORMAT " held, %" G_GUINT64_FORMAT " immediate, %" G_GUINT64_FORMAT " late",
+         pacing.decode_time_ns / 1e6, pacing.decode_time_dev_ns / 1e6, pacing.jitter_ns / 1e6,
+         pacing.playout_delay_ns / 1e6, pacing.commit_lead_ns / 1e6, pacing.frames_held,
+         pacing.frames_immediate, pacing.frames_late);
+    guint64 commits = d->stats.commits_fast + d->stats.commits_full;
+    if (commits > 0) {
+        LOGI("Display commits: %" G_GUINT64_FORMAT " FB_ID-only, %" G_GUINT64_FORMAT " full; build %.1f us avg"
+             " (max %.1f), ioctl %.1f us avg (max %.1f)",
+             d->stats.commits_fast, d->stats.commits_full, d->stats.commit_build_ns / 1e3 / commits,
+             d->stats.commit_build_max_ns / 1e3, d->stats.commit_ioctl_ns / 1e3 / commits,
+             d->stats.commit_ioctl_max_ns / 1e3);
+    }
+    for (int pm = 0; pm < DRM_PRESENT_MODE_COUNT; ++pm) {
+        guint64 n = d->stats.flip_latency_frames[pm];
+        if (n > 0) {
+            LOGI("Display latency (%s): decode to flip %.2f ms avg, %.2f ms max over %" G_GUINT64_FORMAT " frames",
+                 present_mode_name((DrmPresentMode)pm), d->stats.flip_latency_ns[pm] / 1e6 / n,
+                 d->stats.flip_latency_max_ns[pm] / 1e6, n);
+        }
+    }
+    guint64 measured = d->stats.async_flips - d->stats.async_flips_unmeasured;
+    if (d->stats.async_flips > 0) {
+        LOGI("Display async: %" G_GUINT64_FORMAT " flips, %" G_GUINT64_FORMAT " landed mid-scanout (%.1f%% of %"
+             G_GUINT64_FORMAT " measured), %" G_GUINT64_FORMAT " fallbacks",
+             d->stats.async_flips, d->stats.async_flips_torn,
+             measured ? 100.0 * d->stats.async_flips_torn / measured : 0.0, measured, d->stats.async_fallbacks);
+    }
+    for (guint i = 1; i < d->stats.head_count; ++i) {
+        const DrmHeadStats *hs = &d->stats.heads[i];
+        LOGI("Display mirror connector %u (CRTC %u): %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+             " lead flips, skew to lead %.2f ms avg (max %.2f)", hs->connector_id, hs->crtc_id, hs->flips,
+             d->stats.heads[0].flips, hs->flips ? hs->skew_ns / 1e6 / hs->flips : 0.0, hs->skew_max_ns / 1e6);
+    }
+    if (d->overlay.plane_id != 0) {
+        LOGI("Display OSD plane %u: %" G_GUINT64_FORMAT " updates with video, %" G_GUINT64_FORMAT
+             " alone, %" G_GUINT64_FORMAT " refused", d->overlay.plane_id, d->stats.overlay_commits_shared,
+             d->stats.overlay_commits_alone, d->stats.overlay_failures);
+    }
+    if (d->mode_policy == MODE_POLICY_STREAM) {
+        LOGI("Display modes: %" G_GUINT64_FORMAT " changes, %" G_GUINT64_FORMAT " rejected; ended on %dx%d@%d",
+             d->stats.mode_changes, d->stats.mode_change_failures, d->mode_w, d->mode_h, d->mode_hz);
+    }
+    g_mutex_unlock(&d->lock);
+
+    // A late flip event read by another display thread must not find us any more.
+    g_mutex_lock(&event_lock);
+    g_ptr_array_remove(event_displays, d);
+    if (event_displays->len == 0) {
+        g_ptr_array_free(event_displays, TRUE);
+        event_displays = NULL;
+    }
+    g_mutex_unlock(&event_lock);
+
+    if (d->wake_fd >= 0) {
+        close(d->wake_fd);
+        d->wake_fd = -1;
+    }
+    frame_pacer_free(d->pacer);
+    drmModeAtomicFree(d->req);
+    g_mutex_clear(&d->lock);
+    g_cond_clear(&d->cond);
+    g_free(d);
+}
+
+int drm_display_add_mirror(DrmDisplay *d, const ModesetResult *ms) {
+    if (d == NULL || ms == NULL || ms->plane_id == 0) {
+        return -1;
+    }
+    if (d->running || d->mirror_count >= G_N_ELEMENTS(d->mirrors)) {
+        return -1;
+    }
+    // Pacing, VRR, async flips and mode switches are all per CRTC; lock-step needs one fixed grid.
+    int lead_mhz = drm_mode_refresh_mhz(&d->mode);
+    int mhz = drm_mode_refresh_mhz(&ms->mode);
+    if (d->present_mode != DRM_PRESENT_FIXED || d->mode_policy == MODE_POLICY_STREAM || lead_mhz <= 0 ||
+        abs(mhz - lead_mhz) * 1000 > lead_mhz) {
+        return -1;
+    }
+
+    struct MirrorHead *m = &d->mirrors[d->mirror_count];
+    memset(m, 0, sizeof(*m));
+    if (query_plane_props(d->drm_fd, ms->plane_id, &m->props) != 0) {
+        LOGW("Display: failed to query mirror plane %u properties", ms->plane_id);
+        return -1;
+    }
+    m->plane_id = ms->plane_id;
+    m->crtc_id = ms->crtc_id;
+    m->connector_id = ms->connector_id;
+    m->mode_w = ms->mode_w;
+    m->mode_h = ms->mode_h;
+    m->active = TRUE;
+    d->mirror_count++;
+    g_mutex_lock(&d->lock);
+    DrmHeadStats *hs = &d->stats.heads[d->stats.head_count++];
+    hs->connector_id = m->connector_id;
+    hs->crtc_id = m->crtc_id;
+    g_mutex_unlock(&d->lock);
+    LOGI("Display: connector %u (plane %u, %dx%d) mirrors connector %u in lock-step", m->connector_id, m->plane_id,
+         m->mode_w, m->mode_h, d->connector_id);
+    return 0;
+}
+
+int drm_display_set_overlay(DrmDisplay *d, const DrmOverlayPlacement *placement) {
+    if (d == NULL || placement == NULL || placement->plane_id == 0 || d->running) {
+        return -1;
+    }
+    if (query_plane_props(d->drm_fd, placement->plane_id, &d->overlay_props) != 0) {
+        LOGW("Display: failed to query OSD plane %u properties", placement->plane_id);
+        return -1;
+    }
+    d->overlay = *placement;
+    d->overlay_enabled = TRUE;
+    d->overlay_placed = FALSE;
+    return 0;
+}
+
+void drm_display_post_overlay(DrmDisplay *d, uint32_t fb_id) {
+    if (d == NULL || fb_id == 0) {
+        return;
+    }
+    g_mutex_lock(&d->lock);
+    if (d->overlay_enabled) {
+        d->overlay_pending_fb = fb_id;
+        wake_display_thread(d);
+    }
+    g_mutex_unlock(&d->lock);
+}
+
+gboolean drm_display_overlay_idle(DrmDisplay *d, uint32_t *on_screen_fb) {
+    if (d == NULL) {
+        return FALSE;
+    }
+    g_mutex_lock(&d->lock);
+    gboolean idle = d->overlay_enabled && d->overlay_pending_fb == 0 && d->overlay_in_flight_fb == 0;
+    if (on_screen_fb) {
+        *on_screen_fb = d->overlay_on_screen_fb;
+    }
+    g_mutex_unlock(&d->lock);
+    return idle;
+}
+
+void drm_display_set_background(DrmDisplay *d, uint32_t plane_id, int fb_w, int fb_h) {
+    if (d == NULL || plane_id == 0) {
+        return;
+    }
+    if (drm_get_prop_id(d->drm_fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_W", &d->bg_prop_crtc_w) != 0 ||
+        drm_get_prop_id(d->drm_fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_H", &d->bg_prop_crtc_h) != 0 ||
+        drm_get_prop_id(d->drm_fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_W", &d->bg_prop_src_w) != 0 ||
+        drm_get_prop_id(d->drm_fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_H", &d->bg_prop_src_h) != 0) {
+        LOGW("Display: failed to query background plane %u properties", plane_id);
+        return;
+    }
+    d->bg_plane_id = plane_id;
+    d->bg_fb_w = fb_w;
+    d->bg_fb_h = fb_h;
+}
+
+void drm_display_get_mode(DrmDisplay *d, int *w, int *h, int *hz) {
+    if (d == NULL) {
+        return;
+    }
+    g_mutex_lock(&d->lock);
+    if (w) {
+        *w = d->mode_w;
+    }
+    if (h) {
+        *h = d->mode_h;
+    }
+    if (hz) {
+        *hz = d->mode_hz;
+    }
+    g_mutex_unlock(&d->lock);
+}
+
+void drm_display_note_stream(DrmDisplay *d, int width, int height) {
+    if (d == NULL || d->mode_policy != MODE_POLICY_STREAM) {
+        return;
+    }
+    g_mutex_lock(&d->lock);
+    if (d->stream.width != width || d->stream.height != height) {
+        d->stream.width = width;
+        d->stream.height = height;
+        // Without a frame rate yet, the rate measurement triggers the first evaluation.
+        if (d->stream.fps_mhz > 0) {
+            d->mode_eval_pending = TRUE;
+            wake_display_thread(d);
+        }
+    }
+    g_mutex_unlock(&d->lock);
+}
+
+void drm_display_note_feed(DrmDisplay *d, gint64 pts_us, guint64 feed_ns) {
+    if (d == NULL) {
+        return;
+    }
+    g_mutex_lock(&d->lock);
+    frame_pacer_note_feed(d->pacer, pts_us, feed_ns);
+    g_mutex_unlock(&d->lock);
+}
+
+void drm_display_submit(DrmDisplay *d, uint32_t fb_id, uint32_t src_w, uint32_t src_h, gint64 pts_us,
+                        void *token) {
+    if (d == NULL) {
+        return;
+    }
+
+    struct DisplayFrame frame = {.fb_id = fb_id, .src_w = src_w, .src_h = src_h, .pts_us = pts_us, .token = token};
+    struct DisplayFrame dropped;
+    memset(&dropped, 0, sizeof(dropped));
+
+    g_mutex_lock(&d->lock);
+    if (!d->running || d->stop_requested || fb_id == 0) {
+        g_mutex_unlock(&d->lock);
+        release_frame(d, &frame);
+        return;
+    }
+    if (d->mode_policy == MODE_POLICY_STREAM) {
+        track_stream_rate(d, pts_us);
+    }
+    guint64 now = monotonic_ns();
+    frame.ready_ns = now;
+    if (d->present_mode == DRM_PRESENT_ASYNC) {
+        frame.commit_at_ns = now;
+    } else if (d->present_mode == DRM_PRESENT_VRR) {
+        // The sink waits for us, so go now unless that would outrun its maximum refresh.
+        guint64 earliest = d->stats.last_flip_ns != 0 ? d->stats.last_flip_ns + d->vrr_min_interval_ns : 0;
+        frame.commit_at_ns = MAX(now, earliest);
+    } else {
+        frame.commit_at_ns = frame_pacer_frame_ready(d->pacer, pts_us, now, now);
+    }
+    frame.held = frame.commit_at_ns > now;
+    if (d->queue_len >= d->queue_depth) {
+        // Full queue: the oldest frame loses its slot (with depth 1, latest wins).
+        dropped = d->queue[0];
+        queue_remove_head(d, 1);
+        d->stats.frames_superseded++;
+    }
+    d->queue[d->queue_len++] = frame;
+    d->stats.frames_submitted++;
+    wake_display_thread(d);
+    g_mutex_unlock(&d->lock);
+
+    release_frame(d, &dropped);
+}
+
+void drm_display_flush(DrmDisplay *d) {
+    if (d == NULL) {
+        return;
+    }
+
+    g_mutex_lock(&d->lock);
+    struct DisplayFrame dropped[DISPLAY_QUEUE_MAX];
+    guint dropped_count = d->queue_len;
+    memcpy(dropped, d->queue, dropped_count * sizeof(dropped[0]));
+    d->queue_len = 0;
+    if (d->running) {
+        d->flush_requested = TRUE;
+        wake_display_thread(d);
+        while (d->flush_requested && d->running) {
+            g_cond_wait(&d->cond, &d->lock);
+        }
+    }
+    d->flush_requested = FALSE;
+    g_mutex_unlock(&d->lock);
+
+    for (guint i = 0; i < dropped_count; ++i) {
+        release_frame(d, &dropped[i]);
+    }
+}
+
+void drm_display_hold(DrmDisplay *d) {
+    if (d == NULL) {
+        return;
+    }
+    g_mutex_lock(&d->lock);
+    if (!d->hold) {
+        d->hold = TRUE;
+        d->hold_idle = FALSE;
+        wake_display_thread(d);
+    }
+    // A flip that never lands on a dead link is retired by the flip timeout.
+    while (d->hold && !d->hold_idle && d->running) {
+        g_cond_wait(&d->cond, &d->lock);
+    }
+    g_mutex_unlock(&d->lock);
+}
+
+void drm_display_rebind(DrmDisplay *d, const ModesetResult *ms, const ModesetResult *mirrors, int mirror_count) {
+    if (d == NULL || ms == NULL) {
+        return;
+    }
+    g_mutex_lock(&d->lock);
+    d->rebind = *ms;
+    d->rebind_mirror_count = mirrors != NULL ? MIN(mirror_count, DRM_MAX_HEADS - 1) : 0;
+    for (int i = 0; i < d->rebind_mirror_count; ++i) {
+        d->rebind_mirrors[i] = mirrors[i];
+    }
+    d->rebind_pending = TRUE;
+    d->hold = FALSE;
+    d->hold_idle = FALSE;
+    wake_display_thread(d);
+    g_mutex_unlock(&d->lock);
+}
+
+guint drm_display_max_held_frames(DrmDisplay *d) {
+    if (d == NULL) {
+        return 0;
+    }
+    return d->queue_depth + 2;
+}
+
+void drm_display_get_stats(DrmDisplay *d, DrmDisplayStats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    memset(stats, 0, sizeof(*stats));
+    if (d == NULL) {
+        return;
+    }
+    g_mutex_lock(&d->lock);
+    *stats = d->stats;
+    frame_pacer_get_stats(d->pacer, &stats->pacing);
+    g_mutex_unlock(&d->lock);
+}
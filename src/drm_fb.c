@@ -81,6 +81,36 @@ int create_argb_fb(int fd, int w, int h, uint32_t argb_fill, struct DumbFB *out)
     return 0;
 }
 
+int create_black_fb(int fd, int w, int h, struct DumbFB *out) {
+    struct drm_mode_create_dumb creq = {0};
+    creq.width = w;
+    creq.height = h;
+    creq.bpp = 32;
+    if (ioctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq) < 0) {
+        return -1;
+    }
+
+    uint32_t handles[4] = {creq.handle, 0, 0, 0};
+    uint32_t pitches[4] = {creq.pitch, 0, 0, 0};
+    uint32_t offsets[4] = {0, 0, 0, 0};
+    uint32_t fb_id = 0;
+
+    if (drmModeAddFB2(fd, w, h, DRM_FORMAT_XRGB8888, handles, pitches, offsets, &fb_id, 0) != 0) {
+        struct drm_mode_destroy_dumb dreq = {.handle = creq.handle};
+        ioctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+        return -1;
+    }
+
+    out->fb_id = fb_id;
+    out->handle = creq.handle;
+    out->pitch = creq.pitch;
+    out->size = creq.size;
+    out->map = NULL;
+    out->w = w;
+    out->h = h;
+    return 0;
+}
+
 void destroy_dumb_fb(int fd, struct DumbFB *fb) {
     if (!fb) {
         return;
@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+
+#include "drm_hotplug.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/netlink.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Kernel broadcast group; udev re-broadcasts on group 2 with its own framing. */
+#define UEVENT_GROUP_KERNEL 1u
+#define UEVENT_RCVBUF_BYTES (256 * 1024)
+#define UEVENT_MSG_MAX      8192
+
+struct DrmHotplug {
+    int fd;
+    /* "card0" and friends, matched against the uevent's DEVNAME=dri/<name>. */
+    char devname[64];
+};
+
+DrmHotplug *drm_hotplug_new(const char *card_path) {
+    if (card_path == NULL) {
+        return NULL;
+    }
+
+    // /dev/dri/by-path links resolve to the cardN node the kernel names in its events.
+    char resolved[PATH_MAX];
+    const char *path = realpath(card_path, resolved) != NULL ? resolved : card_path;
+    const char *base = strrchr(path, '/');
+    base = base != NULL ? base + 1 : path;
+    if (*base == '\0' || strlen(base) >= sizeof(((DrmHotplug *)0)->devname)) {
+        LOGW("Hotplug: cannot derive device name from %s", card_path);
+        return NULL;
+    }
+
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        LOGW("Hotplug: uevent socket: %s", strerror(errno));
+        return NULL;
+    }
+    int rcvbuf = UEVENT_RCVBUF_BYTES;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) != 0) {
+        (void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = UEVENT_GROUP_KERNEL;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        LOGW("Hotplug: uevent bind: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    DrmHotplug *h = calloc(1, sizeof(*h));
+    if (h == NULL) {
+        close(fd);
+        return NULL;
+    }
+    h->fd = fd;
+    strcpy(h->devname, base);
+    LOGI("Hotplug: watching uevents for %s", h->devname);
+    return h;
+}
+
+void drm_hotplug_free(DrmHotplug *h) {
+    if (h == NULL) {
+        return;
+    }
+    if (h->fd >= 0) {
+        close(h->fd);
+    }
+    free(h);
+}
+
+int drm_hotplug_fd(const DrmHotplug *h) {
+    return h != NULL ? h->fd : -1;
+}
+
+/* Message is "action@devpath" followed by NUL-separated KEY=value pairs. */
+static int is_card_hotplug(const DrmHotplug *h, const char *msg, size_t len) {
+    int drm = 0;
+    int hotplug = 0;
+    int ours = 0;
+    for (size_t off = strnlen(msg, len) + 1; off < len;) {
+        const char *kv = msg + off;
+        size_t kv_len = strnlen(kv, len - off);
+        if (strcmp(kv, "SUBSYSTEM=drm") == 0) {
+            drm = 1;
+        } else if (strcmp(kv, "HOTPLUG=1") == 0) {
+            hotplug = 1;
+        } else if (strncmp(kv, "DEVNAME=dri/", 12) == 0 && strcmp(kv + 12, h->devname) == 0) {
+            ours = 1;
+        }
+        off += kv_len + 1;
+    }
+    return drm && hotplug && ours;
+}
+
+int drm_hotplug_drain(DrmHotplug *h) {
+    if (h == NULL || h->fd < 0) {
+        return -1;
+    }
+
+    int found = 0;
+    char buf[UEVENT_MSG_MAX];
+    for (;;) {
+        struct sockaddr_nl from;
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(h->fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&from, &from_len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == ENOBUFS) {
+                // Events were lost; one of them may have been ours.
+                LOGW("Hotplug: uevent socket overrun; rechecking connectors");
+                found = 1;
+                continue;
+            }
+            LOGW("Hotplug: uevent recv: %s", strerror(errno));
+            return found ? found : -1;
+        }
+        // Only the kernel (port 0) speaks for hardware; ignore anything a process sent.
+        if (from.nl_pid != 0 || n == 0) {
+            continue;
+        }
+        buf[n] = '\0';
+        if (is_card_hotplug(h, buf, (size_t)n)) {
+            found = 1;
+        }
+    }
+    return found;
+}
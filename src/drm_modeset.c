@@ -64,6 +64,38 @@ static int vrefresh(const drmModeModeInfo *m) {
     return 0;
 }
 
+/* A refresh within this of a whole multiple of the frame rate shows every frame for the same number of vblanks. */
+#define MODE_CADENCE_TOLERANCE_PPM 5000
+/* Cadence errors closer than this are a tie; the frame rate is measured from millisecond PTS. */
+#define MODE_CADENCE_STEP_PPM 500
+
+int drm_mode_refresh_hz(const drmModeModeInfo *m) {
+    return vrefresh(m);
+}
+
+int drm_mode_refresh_mhz(const drmModeModeInfo *m) {
+    if (m->htotal && m->vtotal) {
+        uint64_t mhz = ((uint64_t)m->clock * 1000000ull * 2 + (uint64_t)m->htotal * m->vtotal) /
+                       ((uint64_t)m->htotal * m->vtotal * 2);
+        return (int)mhz;
+    }
+    return vrefresh(m) * 1000;
+}
+
+/* Distance of the mode's refresh from the nearest whole multiple of the frame rate, in ppm. */
+static int cadence_error_ppm(const drmModeModeInfo *m, int fps_mhz) {
+    int64_t mode_mhz = drm_mode_refresh_mhz(m);
+    if (mode_mhz <= 0 || fps_mhz <= 0 || mode_mhz < fps_mhz - fps_mhz / 100) {
+        return INT32_MAX;
+    }
+    int64_t k = (mode_mhz + fps_mhz / 2) / fps_mhz;
+    int64_t err = mode_mhz - k * fps_mhz;
+    if (err < 0) {
+        err = -err;
+    }
+    return (int)(err * 1000000 / mode_mhz);
+}
+
 static int better_mode(const drmModeModeInfo *a, const drmModeModeInfo *b) {
     int ahz = vrefresh(a), bhz = vrefresh(b);
     if (ahz != bhz) {
@@ -82,7 +114,229 @@ static int better_mode(const drmModeModeInfo *a, const drmModeModeInfo *b) {
     return a->clock > b->clock;
 }
 
-int atomic_modeset_maxhz(int fd, const AppCfg *cfg, ModesetResult *out) {
+static int same_timing(const drmModeModeInfo *a, const drmModeModeInfo *b) {
+    return a->hdisplay == b->hdisplay && a->vdisplay == b->vdisplay && a->clock == b->clock &&
+           a->htotal == b->htotal && a->vtotal == b->vtotal && a->hsync_start == b->hsync_start &&
+           a->hsync_end == b->hsync_end && a->vsync_start == b->vsync_start && a->vsync_end == b->vsync_end &&
+           a->flags == b->flags;
+}
+
+/* Live value of a property; the cached tables only know the ID. */
+static int read_prop_value(int fd, uint32_t obj_id, uint32_t obj_type, const char *name, uint64_t *out) {
+    uint32_t prop_id = 0;
+    if (drm_get_prop_id(fd, obj_id, obj_type, name, &prop_id) != 0) {
+        return -1;
+    }
+    drmModeObjectProperties *props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+    if (!props) {
+        return -1;
+    }
+    int found = -1;
+    for (uint32_t i = 0; i < props->count_props; ++i) {
+        if (props->props[i] == prop_id) {
+            *out = props->prop_values[i];
+            found = 0;
+            break;
+        }
+    }
+    drmModeFreeObjectProperties(props);
+    return found;
+}
+
+/* A CRTC can keep its mode while switched off. */
+static int crtc_is_active(int fd, uint32_t crtc_id) {
+    uint64_t active = 0;
+    return read_prop_value(fd, crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE", &active) == 0 && active != 0;
+}
+
+#ifndef DRM_MODE_LINK_STATUS_GOOD
+#define DRM_MODE_LINK_STATUS_GOOD 0
+#define DRM_MODE_LINK_STATUS_BAD 1
+#endif
+
+/* After a link training failure the kernel marks the link bad and expects a fresh modeset. */
+static int link_is_bad(int fd, uint32_t connector_id) {
+    uint64_t status = 0;
+    return read_prop_value(fd, connector_id, DRM_MODE_OBJECT_CONNECTOR, "link-status", &status) == 0 &&
+           status == DRM_MODE_LINK_STATUS_BAD;
+}
+
+/*
+ * Vertical refresh limits from the EDID display range descriptor (tag 0xFD).
+ * Returns -1 when the sink does not publish one.
+ */
+static int edid_refresh_range(int fd, uint32_t connector_id, int *min_hz, int *max_hz) {
+    uint64_t blob_id = 0;
+    if (read_prop_value(fd, connector_id, DRM_MODE_OBJECT_CONNECTOR, "EDID", &blob_id) != 0 || blob_id == 0) {
+        return -1;
+    }
+    drmModePropertyBlobRes *blob = drmModeGetPropertyBlob(fd, (uint32_t)blob_id);
+    if (!blob) {
+        return -1;
+    }
+    int ret = -1;
+    const uint8_t *edid = (const uint8_t *)blob->data;
+    if (blob->length >= 128) {
+        for (int off = 54; off + 18 <= 126; off += 18) {
+            const uint8_t *desc = edid + off;
+            if (desc[0] != 0 || desc[1] != 0 || desc[2] != 0 || desc[3] != 0xFD) {
+                continue;
+            }
+            // Byte 4 bits 0/1 add 255 to the minimum/maximum vertical rate (EDID 1.4).
+            int lo = desc[5] + ((desc[4] & 0x01) ? 255 : 0);
+            int hi = desc[6] + ((desc[4] & 0x02) ? 255 : 0);
+            if (lo > 0 && hi >= lo) {
+                *min_hz = lo;
+                *max_hz = hi;
+                ret = 0;
+            }
+            break;
+        }
+    }
+    drmModeFreePropertyBlob(blob);
+    return ret;
+}
+
+static int better_mode_for_stream(const drmModeModeInfo *a, const drmModeModeInfo *b,
+                                  const ModesetStreamInfo *s) {
+    int ai = (a->flags & DRM_MODE_FLAG_INTERLACE) ? 1 : 0;
+    int bi = (b->flags & DRM_MODE_FLAG_INTERLACE) ? 1 : 0;
+    if (ai != bi) {
+        return ai < bi;
+    }
+
+    int aerr = cadence_error_ppm(a, s->fps_mhz);
+    int berr = cadence_error_ppm(b, s->fps_mhz);
+    if (s->fps_mhz > 0) {
+        int am = aerr <= MODE_CADENCE_TOLERANCE_PPM;
+        int bm = berr <= MODE_CADENCE_TOLERANCE_PPM;
+        if (am != bm) {
+            return am > bm;
+        }
+    }
+
+    if (s->width > 0 && s->height > 0) {
+        // Smallest mode that holds the picture; if none does, the biggest one.
+        int af = a->hdisplay >= s->width && a->vdisplay >= s->height;
+        int bf = b->hdisplay >= s->width && b->vdisplay >= s->height;
+        if (af != bf) {
+            return af > bf;
+        }
+        long long aa = (long long)a->hdisplay * a->vdisplay;
+        long long bb = (long long)b->hdisplay * b->vdisplay;
+        if (aa != bb) {
+            return af ? aa < bb : aa > bb;
+        }
+    }
+
+    if (s->fps_mhz > 0 && aerr / MODE_CADENCE_STEP_PPM != berr / MODE_CADENCE_STEP_PPM) {
+        return aerr < berr;
+    }
+    return better_mode(a, b);
+}
+
+static void select_mode(const drmModeConnector *c, const AppCfg *cfg, drmModeModeInfo *out) {
+    if (cfg->mode_policy == MODE_POLICY_FIXED) {
+        int found = 0;
+        for (int m = 0; m < c->count_modes; ++m) {
+            const drmModeModeInfo *mi = &c->modes[m];
+            if (mi->hdisplay != cfg->mode_w || mi->vdisplay != cfg->mode_h ||
+                (cfg->mode_hz > 0 && vrefresh(mi) != cfg->mode_hz)) {
+                continue;
+            }
+            if (!found || better_mode(mi, out)) {
+                *out = *mi;
+                found = 1;
+            }
+        }
+        if (found) {
+            return;
+        }
+        LOGW("Mode %dx%d@%d not offered by the connector; using the highest refresh mode", cfg->mode_w,
+             cfg->mode_h, cfg->mode_hz);
+    }
+
+    // The stream policy starts here too: nothing is known about the stream until it arrives.
+    *out = c->modes[0];
+    for (int m = 1; m < c->count_modes; ++m) {
+        if (better_mode(&c->modes[m], out)) {
+            *out = c->modes[m];
+        }
+    }
+}
+
+int drm_modeset_pick_stream_mode(int fd, uint32_t connector_id, const ModesetStreamInfo *stream,
+                                 drmModeModeInfo *out) {
+    if (stream == NULL || out == NULL) {
+        return -1;
+    }
+    drmModeConnector *c = drmModeGetConnectorCurrent(fd, connector_id);
+    if (!c) {
+        return -1;
+    }
+    if (c->connection != DRM_MODE_CONNECTED || c->count_modes <= 0) {
+        drmModeFreeConnector(c);
+        return -1;
+    }
+    *out = c->modes[0];
+    for (int m = 1; m < c->count_modes; ++m) {
+        if (better_mode_for_stream(&c->modes[m], out, stream)) {
+            *out = c->modes[m];
+        }
+    }
+    drmModeFreeConnector(c);
+    return 0;
+}
+
+int drm_modeset_max_mode_size(int fd, uint32_t connector_id, int *w, int *h) {
+    drmModeConnector *c = drmModeGetConnectorCurrent(fd, connector_id);
+    if (!c) {
+        return -1;
+    }
+    int max_w = 0, max_h = 0;
+    for (int m = 0; m < c->count_modes; ++m) {
+        if (c->modes[m].hdisplay > max_w) {
+            max_w = c->modes[m].hdisplay;
+        }
+        if (c->modes[m].vdisplay > max_h) {
+            max_h = c->modes[m].vdisplay;
+        }
+    }
+    drmModeFreeConnector(c);
+    if (max_w <= 0 || max_h <= 0) {
+        return -1;
+    }
+    *w = max_w;
+    *h = max_h;
+    return 0;
+}
+
+static int crtc_taken(uint32_t crtc_id, const ModesetResult *taken, int n_taken) {
+    for (int i = 0; i < n_taken; ++i) {
+        if (taken[i].crtc_id == crtc_id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int connector_taken(uint32_t connector_id, const ModesetResult *taken, int n_taken) {
+    for (int i = 0; i < n_taken; ++i) {
+        if (taken[i].connector_id == connector_id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Modesets one head: connector_name (or the first connected one when empty)
+ * on a CRTC, with plane_id as its video plane. Connectors and CRTCs of the
+ * heads in taken are never touched; naming one of those connectors returns -6
+ * before anything is committed.
+ */
+static int modeset_head(int fd, const AppCfg *cfg, const char *connector_name, uint32_t plane_id,
+                        const ModesetResult *taken, int n_taken, ModesetResult *out) {
     if (drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) != 0) {
         LOGW("Failed to enable UNIVERSAL_PLANES");
     }
@@ -99,9 +353,15 @@ int atomic_modeset_maxhz(int fd, const AppCfg *cfg, ModesetResult *out) {
     drmModeConnector *conn = NULL;
     drmModeCrtc *crtc = NULL;
     drmModeModeInfo best = {0};
+    int crtc_from_encoder = 0;
 
     for (int i = 0; i < res->count_connectors; ++i) {
-        drmModeConnector *c = drmModeGetConnector(fd, res->connectors[i]);
+        // The kernel probes on hotplug; only force an EDID read when it has no modes yet.
+        drmModeConnector *c = drmModeGetConnectorCurrent(fd, res->connectors[i]);
+        if (c && c->count_modes == 0) {
+            drmModeFreeConnector(c);
+            c = drmModeGetConnector(fd, res->connectors[i]);
+        }
         if (!c) {
             continue;
         }
@@ -109,24 +369,28 @@ int atomic_modeset_maxhz(int fd, const AppCfg *cfg, ModesetResult *out) {
         char cname[32];
         snprintf(cname, sizeof(cname), "%s-%u", conn_type_str(c->connector_type), c->connector_type_id);
 
-        if (c->connection == DRM_MODE_CONNECTED && c->count_modes > 0 &&
-            (!cfg->connector_name[0] || strcmp(cfg->connector_name, cname) == 0)) {
-            best = c->modes[0];
-            for (int m = 1; m < c->count_modes; ++m) {
-                if (better_mode(&c->modes[m], &best)) {
-                    best = c->modes[m];
-                }
+        if (connector_taken(c->connector_id, taken, n_taken)) {
+            drmModeFreeConnector(c);
+            if (connector_name[0] && strcmp(connector_name, cname) == 0) {
+                drmModeFreeResources(res);
+                return -6;
             }
+            continue;
+        }
+        if (c->connection == DRM_MODE_CONNECTED && c->count_modes > 0 &&
+            (!connector_name[0] || strcmp(connector_name, cname) == 0)) {
+            select_mode(c, cfg, &best);
 
             drmModeEncoder *enc = NULL;
             if (c->encoder_id) {
                 enc = drmModeGetEncoder(fd, c->encoder_id);
             }
             int crtc_id = -1;
-            if (enc && enc->crtc_id) {
+            if (enc && enc->crtc_id && !crtc_taken(enc->crtc_id, taken, n_taken)) {
                 crtc = drmModeGetCrtc(fd, enc->crtc_id);
                 if (crtc) {
                     crtc_id = crtc->crtc_id;
+                    crtc_from_encoder = 1;
                 }
             }
             if (crtc_id < 0) {
@@ -136,7 +400,7 @@ int atomic_modeset_maxhz(int fd, const AppCfg *cfg, ModesetResult *out) {
                         continue;
                     }
                     for (int ci = 0; ci < res->count_crtcs; ++ci) {
-                        if (e2->possible_crtcs & (1 << ci)) {
+                        if ((e2->possible_crtcs & (1 << ci)) && !crtc_taken(res->crtcs[ci], taken, n_taken)) {
                             crtc = drmModeGetCrtc(fd, res->crtcs[ci]);
                             if (crtc) {
                                 crtc_id = crtc->crtc_id;
@@ -170,11 +434,20 @@ int atomic_modeset_maxhz(int fd, const AppCfg *cfg, ModesetResult *out) {
     int w = best.hdisplay;
     int h = best.vdisplay;
     int hz = vrefresh(&best);
-    LOGI("Chosen: %s id=%u  %dx%d@%d  CRTC=%d  plane=%d", cname, conn->connector_id, w, h, hz, crtc->crtc_id, cfg->plane_id);
+    LOGI("Chosen: %s id=%u  %dx%d@%d  CRTC=%d  plane=%d  (mode policy %s)", cname, conn->connector_id, w, h, hz,
+         crtc->crtc_id, (int)plane_id, cfg_mode_policy_name(cfg->mode_policy));
+
+    /*
+     * If the connector is already driven by this CRTC in the chosen mode, a
+     * modeset would only make the sink resynchronise. Leave the CRTC alone and
+     * just reset the video plane.
+     */
+    int reuse = crtc_from_encoder && crtc->mode_valid && same_timing(&crtc->mode, &best) &&
+                crtc_is_active(fd, crtc->crtc_id) && !link_is_bad(fd, conn->connector_id);
 
     struct DumbFB fb = {0};
-    if (create_argb_fb(fd, w, h, 0xFF000000u, &fb) != 0) {
-        LOGE("create_argb_fb failed: %s", strerror(errno));
+    if (!reuse && create_black_fb(fd, w, h, &fb) != 0) {
+        LOGE("create_black_fb failed: %s", strerror(errno));
         drmModeFreeConnector(conn);
         drmModeFreeCrtc(crtc);
         drmModeFreeResources(res);
@@ -182,7 +455,7 @@ int atomic_modeset_maxhz(int fd, const AppCfg *cfg, ModesetResult *out) {
     }
 
     uint32_t mode_blob = 0;
-    if (drmModeCreatePropertyBlob(fd, &best, sizeof(best), &mode_blob) != 0) {
+    if (!reuse && drmModeCreatePropertyBlob(fd, &best, sizeof(best), &mode_blob) != 0) {
         LOGE("drmModeCreatePropertyBlob failed: %s", strerror(errno));
         destroy_dumb_fb(fd, &fb);
         drmModeFreeConnector(conn);
@@ -194,7 +467,9 @@ int atomic_modeset_maxhz(int fd, const AppCfg *cfg, ModesetResult *out) {
     drmModeAtomicReq *req = drmModeAtomicAlloc();
     if (!req) {
         LOGE("drmModeAtomicAlloc failed");
-        drmModeDestroyPropertyBlob(fd, mode_blob);
+        if (mode_blob) {
+            drmModeDestroyPropertyBlob(fd, mode_blob);
+        }
         destroy_dumb_fb(fd, &fb);
         drmModeFreeConnector(conn);
         drmModeFreeCrtc(crtc);
@@ -202,53 +477,106 @@ int atomic_modeset_maxhz(int fd, const AppCfg *cfg, ModesetResult *out) {
         return -5;
     }
 
-    uint32_t crtc_active = 0, crtc_mode_id = 0;
-    drm_get_prop_id(fd, crtc->crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE", &crtc_active);
-    drm_get_prop_id(fd, crtc->crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID", &crtc_mode_id);
-    drmModeAtomicAddProperty(req, crtc->crtc_id, crtc_active, 1);
-    drmModeAtomicAddProperty(req, crtc->crtc_id, crtc_mode_id, mode_blob);
+    /*
+     * Variable refresh: the sink must say it can, and the CRTC must expose the
+     * switch. Whatever the range descriptor says, the chosen mode's refresh is
+     * the fastest the CRTC will scan out.
+     */
+    uint64_t vrr_capable = 0;
+    uint32_t crtc_vrr_id = 0;
+    int vrr = 0, vrr_min_hz = 0, vrr_max_hz = hz;
+    if (cfg->vrr &&
+        read_prop_value(fd, conn->connector_id, DRM_MODE_OBJECT_CONNECTOR, "vrr_capable", &vrr_capable) == 0 &&
+        vrr_capable != 0 &&
+        drm_get_prop_id(fd, crtc->crtc_id, DRM_MODE_OBJECT_CRTC, "VRR_ENABLED", &crtc_vrr_id) == 0) {
+        vrr = 1;
+        int lo = 0, hi = 0;
+        if (edid_refresh_range(fd, conn->connector_id, &lo, &hi) == 0) {
+            vrr_min_hz = lo;
+            vrr_max_hz = hi < hz ? hi : hz;
+        }
+    } else {
+        // Written as 0 below: an earlier client may have left it on.
+        crtc_vrr_id = 0;
+        drm_get_prop_id(fd, crtc->crtc_id, DRM_MODE_OBJECT_CRTC, "VRR_ENABLED", &crtc_vrr_id);
+    }
+
+    if (!reuse) {
+        uint32_t crtc_active = 0, crtc_mode_id = 0;
+        drm_get_prop_id(fd, crtc->crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE", &crtc_active);
+        drm_get_prop_id(fd, crtc->crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID", &crtc_mode_id);
+        drmModeAtomicAddProperty(req, crtc->crtc_id, crtc_active, 1);
+        drmModeAtomicAddProperty(req, crtc->crtc_id, crtc_mode_id, mode_blob);
 
-    uint32_t conn_crtc_id = 0;
-    drm_get_prop_id(fd, conn->connector_id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", &conn_crtc_id);
-    drmModeAtomicAddProperty(req, conn->connector_id, conn_crtc_id, crtc->crtc_id);
+        uint32_t conn_crtc_id = 0;
+        drm_get_prop_id(fd, conn->connector_id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", &conn_crtc_id);
+        drmModeAtomicAddProperty(req, conn->connector_id, conn_crtc_id, crtc->crtc_id);
+        uint32_t conn_link_status = 0;
+        if (drm_get_prop_id(fd, conn->connector_id, DRM_MODE_OBJECT_CONNECTOR, "link-status", &conn_link_status) == 0) {
+            drmModeAtomicAddProperty(req, conn->connector_id, conn_link_status, DRM_MODE_LINK_STATUS_GOOD);
+        }
+    }
 
     uint32_t plane_fb_id = 0, plane_crtc_id = 0, plane_crtc_x = 0, plane_crtc_y = 0;
     uint32_t plane_crtc_w = 0, plane_crtc_h = 0, plane_src_x = 0, plane_src_y = 0;
     uint32_t plane_src_w = 0, plane_src_h = 0;
     uint32_t plane_zpos_id = 0;
     uint64_t zmin = 0, zmax = 0;
-    int have_zpos = (drm_get_prop_id_and_range_ci(fd, cfg->plane_id, DRM_MODE_OBJECT_PLANE, "ZPOS",
+    int have_zpos = (drm_get_prop_id_and_range_ci(fd, plane_id, DRM_MODE_OBJECT_PLANE, "ZPOS",
                                                   &plane_zpos_id, &zmin, &zmax, "zpos") == 0);
 
-    drm_get_prop_id(fd, cfg->plane_id, DRM_MODE_OBJECT_PLANE, "FB_ID", &plane_fb_id);
-    drm_get_prop_id(fd, cfg->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_ID", &plane_crtc_id);
-    drm_get_prop_id(fd, cfg->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_X", &plane_crtc_x);
-    drm_get_prop_id(fd, cfg->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_Y", &plane_crtc_y);
-    drm_get_prop_id(fd, cfg->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_W", &plane_crtc_w);
-    drm_get_prop_id(fd, cfg->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_H", &plane_crtc_h);
-    drm_get_prop_id(fd, cfg->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_X", &plane_src_x);
-    drm_get_prop_id(fd, cfg->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_Y", &plane_src_y);
-    drm_get_prop_id(fd, cfg->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_W", &plane_src_w);
-    drm_get_prop_id(fd, cfg->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_H", &plane_src_h);
-
-    drmModeAtomicAddProperty(req, cfg->plane_id, plane_fb_id, fb.fb_id);
-    drmModeAtomicAddProperty(req, cfg->plane_id, plane_crtc_id, crtc->crtc_id);
-    drmModeAtomicAddProperty(req, cfg->plane_id, plane_crtc_x, 0);
-    drmModeAtomicAddProperty(req, cfg->plane_id, plane_crtc_y, 0);
-    drmModeAtomicAddProperty(req, cfg->plane_id, plane_crtc_w, w);
-    drmModeAtomicAddProperty(req, cfg->plane_id, plane_crtc_h, h);
-    drmModeAtomicAddProperty(req, cfg->plane_id, plane_src_x, 0);
-    drmModeAtomicAddProperty(req, cfg->plane_id, plane_src_y, 0);
-    drmModeAtomicAddProperty(req, cfg->plane_id, plane_src_w, (uint64_t)w << 16);
-    drmModeAtomicAddProperty(req, cfg->plane_id, plane_src_h, (uint64_t)h << 16);
+    drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "FB_ID", &plane_fb_id);
+    drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_ID", &plane_crtc_id);
+    drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_X", &plane_crtc_x);
+    drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_Y", &plane_crtc_y);
+    drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_W", &plane_crtc_w);
+    drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_H", &plane_crtc_h);
+    drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_X", &plane_src_x);
+    drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_Y", &plane_src_y);
+    drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_W", &plane_src_w);
+    drm_get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_H", &plane_src_h);
+
+    if (reuse) {
+        // The plane is disabled either way once the black fb below is gone; the display places it.
+        drmModeAtomicAddProperty(req, plane_id, plane_fb_id, 0);
+        drmModeAtomicAddProperty(req, plane_id, plane_crtc_id, 0);
+    } else {
+        drmModeAtomicAddProperty(req, plane_id, plane_fb_id, fb.fb_id);
+        drmModeAtomicAddProperty(req, plane_id, plane_crtc_id, crtc->crtc_id);
+        drmModeAtomicAddProperty(req, plane_id, plane_crtc_x, 0);
+        drmModeAtomicAddProperty(req, plane_id, plane_crtc_y, 0);
+        drmModeAtomicAddProperty(req, plane_id, plane_crtc_w, w);
+        drmModeAtomicAddProperty(req, plane_id, plane_crtc_h, h);
+        drmModeAtomicAddProperty(req, plane_id, plane_src_x, 0);
+        drmModeAtomicAddProperty(req, plane_id, plane_src_y, 0);
+        drmModeAtomicAddProperty(req, plane_id, plane_src_w, (uint64_t)w << 16);
+        drmModeAtomicAddProperty(req, plane_id, plane_src_h, (uint64_t)h << 16);
+    }
 
     if (have_zpos) {
-        drmModeAtomicAddProperty(req, cfg->plane_id, plane_zpos_id, zmax);
+        drmModeAtomicAddProperty(req, plane_id, plane_zpos_id, zmax);
+    }
+
+    // VRR_ENABLED goes last so it can be dropped again if the driver refuses it.
+    int vrr_cursor = drmModeAtomicGetCursor(req);
+    if (crtc_vrr_id) {
+        drmModeAtomicAddProperty(req, crtc->crtc_id, crtc_vrr_id, vrr ? 1 : 0);
     }
 
-    int flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+    uint64_t commit_start_ns = log_startup_elapsed_ns();
+    int flags = reuse ? 0 : DRM_MODE_ATOMIC_ALLOW_MODESET;
     int ret = drmModeAtomicCommit(fd, req, flags, NULL);
-    if (ret != 0) {
+    if (ret != 0 && vrr) {
+        LOGW("Commit with VRR_ENABLED failed: %s; retrying with fixed refresh", strerror(errno));
+        drmModeAtomicSetCursor(req, vrr_cursor);
+        vrr = 0;
+        ret = drmModeAtomicCommit(fd, req, flags, NULL);
+    }
+    double commit_ms = (log_startup_elapsed_ns() - commit_start_ns) / 1e6;
+    if (ret != 0 && reuse) {
+        // The mode is already up; the display can still place its plane without this.
+        LOGW("Plane-only update failed: %s; continuing with the current state", strerror(errno));
+    } else if (ret != 0) {
         LOGE("drmModeAtomicCommit failed: %s", strerror(errno));
         drmModeAtomicFree(req);
         drmModeDestroyPropertyBlob(fd, mode_blob);
@@ -259,10 +587,22 @@ int atomic_modeset_maxhz(int fd, const AppCfg *cfg, ModesetResult *out) {
         return -9;
     }
 
-    LOGI("Atomic COMMIT: %dx%d@%d on %s via plane %d", w, h, hz, cname, cfg->plane_id);
+    if (reuse) {
+        LOGI("Mode %dx%d@%d already active on %s; skipped modeset, plane update took %.1f ms", w, h, hz, cname,
+             commit_ms);
+    } else {
+        LOGI("Atomic COMMIT: %dx%d@%d on %s via plane %d (%.1f ms)", w, h, hz, cname, (int)plane_id, commit_ms);
+    }
+    if (vrr) {
+        LOGI("VRR enabled on %s: %d-%d Hz", cname, vrr_min_hz, vrr_max_hz);
+    } else if (cfg->vrr) {
+        LOGI("VRR not available on %s; fixed %d Hz refresh", cname, hz);
+    }
 
     drmModeAtomicFree(req);
-    drmModeDestroyPropertyBlob(fd, mode_blob);
+    if (mode_blob) {
+        drmModeDestroyPropertyBlob(fd, mode_blob);
+    }
     destroy_dumb_fb(fd, &fb);
 
     if (out) {
@@ -271,6 +611,12 @@ int atomic_modeset_maxhz(int fd, const AppCfg *cfg, ModesetResult *out) {
         out->mode_w = w;
         out->mode_h = h;
         out->mode_hz = hz;
+        out->mode = best;
+        out->plane_id = plane_id;
+        out->mode_reused = reuse;
+        out->vrr_active = vrr;
+        out->vrr_min_hz = vrr ? vrr_min_hz : 0;
+        out->vrr_max_hz = vrr ? vrr_max_hz : 0;
     }
 
     drmModeFreeConnector(conn);
@@ -279,6 +625,41 @@ int atomic_modeset_maxhz(int fd, const AppCfg *cfg, ModesetResult *out) {
     return 0;
 }
 
+int atomic_modeset_maxhz(int fd, const AppCfg *cfg, ModesetResult *out) {
+    return modeset_head(fd, cfg, cfg->connector_name, (uint32_t)cfg->plane_id, NULL, 0, out);
+}
+
+int drm_modeset_mirrors(int fd, const AppCfg *cfg, ModesetResult *heads) {
+    if (cfg == NULL || heads == NULL) {
+        return 0;
+    }
+    int count = 1;
+    for (int i = 0; i < cfg->mirror_count && count < DRM_MAX_HEADS; ++i) {
+        const MirrorCfg *m = &cfg->mirrors[i];
+        int plane_used = 0;
+        for (int h = 0; h < count; ++h) {
+            plane_used |= heads[h].plane_id == (uint32_t)m->plane_id;
+        }
+        if (plane_used) {
+            LOGW("Mirror %s: plane %d already shows another head; skipped", m->connector_name, m->plane_id);
+            continue;
+        }
+        // Heads already set up keep their connector and CRTC; a clash is refused before anything is committed.
+        ModesetResult r = {0};
+        int ret = modeset_head(fd, cfg, m->connector_name, (uint32_t)m->plane_id, heads, count, &r);
+        if (ret == -6) {
+            LOGW("Mirror %s is already driven by another head; skipped", m->connector_name);
+            continue;
+        }
+        if (ret != 0) {
+            LOGW("Mirror %s: not connected or no free CRTC; skipped", m->connector_name);
+            continue;
+        }
+        heads[count++] = r;
+    }
+    return count;
+}
+
 int is_any_connected(int fd, const AppCfg *cfg) {
     drmModeRes *res = drmModeGetResources(fd);
     if (!res) {
@@ -286,7 +667,8 @@ int is_any_connected(int fd, const AppCfg *cfg) {
     }
     int connected = 0;
     for (int i = 0; i < res->count_connectors; ++i) {
-        drmModeConnector *c = drmModeGetConnector(fd, res->connectors[i]);
+        // The kernel has probed by the time it reports a hotplug; its cached state is enough.
+        drmModeConnector *c = drmModeGetConnectorCurrent(fd, res->connectors[i]);
         if (!c) {
             continue;
         }
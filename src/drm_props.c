@@ -1,79 +1,246 @@
 #include "drm_props.h"
 #include "logging.h"
 
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
-int drm_get_prop_id(int fd, uint32_t obj_id, uint32_t obj_type, const char *name, uint32_t *out) {
+struct PropEntry {
+    char name[DRM_PROP_NAME_LEN];
+    DrmPropInfo info;
+    int count_enums;
+    struct drm_mode_property_enum *enums;
+};
+
+struct PropTable {
+    uint32_t obj_id;
+    uint32_t obj_type;
+    uint32_t count;
+    struct PropEntry *entries;
+    /* Open addressing over entry index + 1; 0 marks an empty bucket. */
+    uint32_t bucket_mask;
+    uint32_t *buckets;
+    struct PropTable *next;
+};
+
+static pthread_mutex_t g_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct PropTable *g_tables = NULL;
+static DrmPropsStats g_stats;
+
+static uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+static void free_table(struct PropTable *t) {
+    for (uint32_t i = 0; i < t->count; ++i) {
+        free(t->entries[i].enums);
+    }
+    free(t->entries);
+    free(t->buckets);
+    free(t);
+}
+
+static struct PropTable *build_table(int fd, uint32_t obj_id, uint32_t obj_type) {
     drmModeObjectProperties *props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+    g_stats.ioctls++;
     if (!props) {
-        return -1;
+        return NULL;
     }
-    int found = 0;
+
+    struct PropTable *t = calloc(1, sizeof(*t));
+    uint32_t buckets = 16;
+    while (buckets < props->count_props * 2) {
+        buckets <<= 1;
+    }
+    if (t) {
+        t->entries = calloc(props->count_props ? props->count_props : 1, sizeof(*t->entries));
+        t->buckets = calloc(buckets, sizeof(*t->buckets));
+    }
+    if (!t || !t->entries || !t->buckets) {
+        if (t) {
+            free(t->entries);
+            free(t->buckets);
+            free(t);
+        }
+        drmModeFreeObjectProperties(props);
+        return NULL;
+    }
+    t->obj_id = obj_id;
+    t->obj_type = obj_type;
+    t->bucket_mask = buckets - 1;
+
     for (uint32_t i = 0; i < props->count_props; ++i) {
         drmModePropertyRes *p = drmModeGetProperty(fd, props->props[i]);
+        g_stats.ioctls++;
         if (!p) {
             continue;
         }
-        if (!strcmp(p->name, name)) {
-            *out = p->prop_id;
-            found = 1;
-            drmModeFreeProperty(p);
-            break;
+        struct PropEntry *e = &t->entries[t->count];
+        memcpy(e->name, p->name, sizeof(e->name));
+        e->name[sizeof(e->name) - 1] = '\0';
+        e->info.id = p->prop_id;
+        e->info.flags = p->flags;
+        e->info.immutable_value = props->prop_values[i];
+        if (((p->flags & DRM_MODE_PROP_RANGE) ||
+             (p->flags & DRM_MODE_PROP_EXTENDED_TYPE) == DRM_MODE_PROP_SIGNED_RANGE) &&
+            p->count_values >= 2) {
+            e->info.min = p->values[0];
+            e->info.max = p->values[1];
+        }
+        if ((p->flags & (DRM_MODE_PROP_ENUM | DRM_MODE_PROP_BITMASK)) && p->count_enums > 0) {
+            e->enums = malloc((size_t)p->count_enums * sizeof(*e->enums));
+            if (e->enums) {
+                memcpy(e->enums, p->enums, (size_t)p->count_enums * sizeof(*e->enums));
+                e->count_enums = p->count_enums;
+            }
         }
         drmModeFreeProperty(p);
+
+        uint32_t slot = hash_name(e->name) & t->bucket_mask;
+        while (t->buckets[slot] != 0) {
+            slot = (slot + 1) & t->bucket_mask;
+        }
+        t->buckets[slot] = t->count + 1;
+        t->count++;
     }
     drmModeFreeObjectProperties(props);
-    return found ? 0 : -1;
+    g_stats.tables_built++;
+    return t;
 }
 
-int drm_get_prop_id_and_range_ci(int fd, uint32_t obj_id, uint32_t obj_type,
-                                 const char *name1, uint32_t *out_id,
-                                 uint64_t *out_min, uint64_t *out_max,
-                                 const char *alt_name2) {
-    drmModeObjectProperties *props = drmModeObjectGetProperties(fd, obj_id, obj_type);
-    if (!props) {
+/* Lock held. */
+static struct PropTable *get_table(int fd, uint32_t obj_id, uint32_t obj_type) {
+    for (struct PropTable *t = g_tables; t; t = t->next) {
+        if (t->obj_id == obj_id && t->obj_type == obj_type) {
+            return t;
+        }
+    }
+    struct PropTable *t = build_table(fd, obj_id, obj_type);
+    if (t) {
+        t->next = g_tables;
+        g_tables = t;
+    }
+    return t;
+}
+
+/* Lock held. */
+static const struct PropEntry *find_entry(const struct PropTable *t, const char *name) {
+    uint32_t slot = hash_name(name) & t->bucket_mask;
+    while (t->buckets[slot] != 0) {
+        const struct PropEntry *e = &t->entries[t->buckets[slot] - 1];
+        if (!strcmp(e->name, name)) {
+            return e;
+        }
+        slot = (slot + 1) & t->bucket_mask;
+    }
+    return NULL;
+}
+
+int drm_prop_lookup(int fd, uint32_t obj_id, uint32_t obj_type, const char *name, DrmPropInfo *out) {
+    if (!name) {
+        return -1;
+    }
+    pthread_mutex_lock(&g_tables_lock);
+    g_stats.lookups++;
+    const struct PropTable *t = get_table(fd, obj_id, obj_type);
+    const struct PropEntry *e = t ? find_entry(t, name) : NULL;
+    if (e && out) {
+        *out = e->info;
+    }
+    pthread_mutex_unlock(&g_tables_lock);
+    return e ? 0 : -1;
+}
+
+int drm_prop_enum_value(int fd, uint32_t obj_id, uint32_t obj_type, const char *name, const char *enum_name,
+                        uint64_t *out) {
+    if (!name || !enum_name) {
         return -1;
     }
     int found = 0;
-    for (uint32_t i = 0; i < props->count_props; ++i) {
-        drmModePropertyRes *p = drmModeGetProperty(fd, props->props[i]);
-        if (!p) {
-            continue;
-        }
-        if (!strcmp(p->name, name1) || (alt_name2 && !strcmp(p->name, alt_name2))) {
-            *out_id = p->prop_id;
-            found = 1;
-            if ((p->flags & DRM_MODE_PROP_RANGE) && out_min && out_max) {
-                *out_min = p->values[0];
-                *out_max = p->values[1];
+    pthread_mutex_lock(&g_tables_lock);
+    g_stats.lookups++;
+    const struct PropTable *t = get_table(fd, obj_id, obj_type);
+    const struct PropEntry *e = t ? find_entry(t, name) : NULL;
+    for (int i = 0; e && i < e->count_enums; ++i) {
+        if (!strcmp(e->enums[i].name, enum_name)) {
+            if (out) {
+                *out = e->enums[i].value;
             }
-            drmModeFreeProperty(p);
+            found = 1;
             break;
         }
-        drmModeFreeProperty(p);
     }
-    drmModeFreeObjectProperties(props);
+    pthread_mutex_unlock(&g_tables_lock);
     return found ? 0 : -1;
 }
 
+void drm_props_invalidate(void) {
+    pthread_mutex_lock(&g_tables_lock);
+    struct PropTable *t = g_tables;
+    g_tables = NULL;
+    g_stats.invalidations++;
+    pthread_mutex_unlock(&g_tables_lock);
+    while (t) {
+        struct PropTable *next = t->next;
+        free_table(t);
+        t = next;
+    }
+}
+
+void drm_props_get_stats(DrmPropsStats *stats) {
+    if (!stats) {
+        return;
+    }
+    pthread_mutex_lock(&g_tables_lock);
+    *stats = g_stats;
+    pthread_mutex_unlock(&g_tables_lock);
+}
+
+int drm_get_prop_id(int fd, uint32_t obj_id, uint32_t obj_type, const char *name, uint32_t *out) {
+    DrmPropInfo info;
+    if (drm_prop_lookup(fd, obj_id, obj_type, name, &info) != 0) {
+        return -1;
+    }
+    *out = info.id;
+    return 0;
+}
+
+int drm_get_prop_id_and_range_ci(int fd, uint32_t obj_id, uint32_t obj_type,
+                                 const char *name1, uint32_t *out_id,
+                                 uint64_t *out_min, uint64_t *out_max,
+                                 const char *alt_name2) {
+    DrmPropInfo info;
+    if (drm_prop_lookup(fd, obj_id, obj_type, name1, &info) != 0 &&
+        (!alt_name2 || drm_prop_lookup(fd, obj_id, obj_type, alt_name2, &info) != 0)) {
+        return -1;
+    }
+    *out_id = info.id;
+    if ((info.flags & DRM_MODE_PROP_RANGE) && out_min && out_max) {
+        *out_min = info.min;
+        *out_max = info.max;
+    }
+    return 0;
+}
+
 void drm_debug_list_props(int fd, uint32_t obj_id, uint32_t obj_type, const char *tag) {
-    drmModeObjectProperties *props = drmModeObjectGetProperties(fd, obj_id, obj_type);
-    if (!props) {
+    pthread_mutex_lock(&g_tables_lock);
+    const struct PropTable *t = get_table(fd, obj_id, obj_type);
+    if (!t) {
+        pthread_mutex_unlock(&g_tables_lock);
         LOGV("%s: no props", tag);
         return;
     }
-    fprintf(stderr, "[DBG] %s props (%u):", tag, props->count_props);
-    for (uint32_t i = 0; i < props->count_props; ++i) {
-        drmModePropertyRes *p = drmModeGetProperty(fd, props->props[i]);
-        if (!p) {
-            continue;
-        }
-        fprintf(stderr, " %s", p->name);
-        drmModeFreeProperty(p);
+    fprintf(stderr, "[DBG] %s props (%u):", tag, t->count);
+    for (uint32_t i = 0; i < t->count; ++i) {
+        fprintf(stderr, " %s", t->entries[i].name);
     }
     fprintf(stderr, "\n");
-    drmModeFreeObjectProperties(props);
+    pthread_mutex_unlock(&g_tables_lock);
 }
@@ -0,0 +1,312 @@
+#include "frame_pacer.h"
+
+#include <string.h>
+
+/* Feed timestamps remembered for decode-time lookups (a few hundred ms of stream). */
+#define PACER_FEED_HISTORY 64
+/* Time the driver needs between our commit and the vblank that latches it. */
+#define PACER_LATCH_MARGIN_NS 1000000ll
+/* Only hold a frame back when its successor is predicted this far ahead of the deadline. */
+#define PACER_HOLD_SLACK_NS 500000ll
+/* Let the transit floor creep up so sender clock drift cannot pin it forever. */
+#define PACER_BASE_DRIFT_NS 20000ll
+#define PACER_MAX_PLAYOUT_NS 100000000ll
+#define PACER_SMOOTH_QUEUE_DEPTH 3
+
+struct FeedEntry {
+    gint64 pts_us;
+    guint64 feed_ns;
+};
+
+struct Estimate {
+    gint64 avg;
+    gint64 dev;
+    gboolean primed;
+};
+
+struct FramePacer {
+    PacingMode mode;
+    gint64 nominal_period_ns;
+    gint64 period_ns;
+    guint64 last_flip_ns;
+
+    struct FeedEntry feeds[PACER_FEED_HISTORY];
+    guint feed_head;
+    guint feed_count;
+    gint64 interval_ns;
+
+    struct Estimate decode;
+    struct Estimate commit;
+
+    gint64 transit_base_ns;
+    gboolean have_base;
+    gint64 jitter_ns;
+    gint64 playout_delay_ns;
+
+    guint64 frames_held;
+    guint64 frames_immediate;
+    guint64 frames_late;
+};
+
+/* Mean/deviation tracker in the style of TCP's RTT estimator. */
+static void estimate_update(struct Estimate *e, gint64 sample) {
+    if (!e->primed) {
+        e->avg = sample;
+        e->dev = sample / 2;
+        e->primed = TRUE;
+        return;
+    }
+    gint64 err = sample - e->avg;
+    e->avg += err / 8;
+    if (err < 0) {
+        err = -err;
+    }
+    e->dev += (err - e->dev) / 4;
+}
+
+static gint64 estimate_upper(const struct Estimate *e, int k) {
+    return e->primed ? e->avg + k * e->dev : 0;
+}
+
+FramePacer *frame_pacer_new(PacingMode mode, int refresh_hz) {
+    FramePacer *p = g_new0(FramePacer, 1);
+    p->mode = mode;
+    p->nominal_period_ns = refresh_hz > 0 ? 1000000000ll / refresh_hz : 0;
+    p->period_ns = p->nominal_period_ns;
+    return p;
+}
+
+void frame_pacer_set_refresh(FramePacer *p, int refresh_hz) {
+    if (p == NULL) {
+        return;
+    }
+    p->nominal_period_ns = refresh_hz > 0 ? 1000000000ll / refresh_hz : 0;
+    p->period_ns = p->nominal_period_ns;
+    // The vblank phase is relearned from the first flip in the new mode.
+    p->last_flip_ns = 0;
+}
+
+void frame_pacer_free(FramePacer *p) {
+    g_free(p);
+}
+
+PacingMode frame_pacer_mode(const FramePacer *p) {
+    return p ? p->mode : PACING_MODE_LATENCY;
+}
+
+guint frame_pacer_queue_depth(const FramePacer *p) {
+    return (p && p->mode == PACING_MODE_SMOOTH) ? PACER_SMOOTH_QUEUE_DEPTH : 1;
+}
+
+static const struct FeedEntry *feed_at(const FramePacer *p, guint age) {
+    guint idx = (p->feed_head + PACER_FEED_HISTORY - 1 - age) % PACER_FEED_HISTORY;
+    return &p->feeds[idx];
+}
+
+void frame_pacer_note_feed(FramePacer *p, gint64 pts_us, guint64 now_ns) {
+    if (p == NULL) {
+        return;
+    }
+    if (p->feed_count > 0) {
+        const struct FeedEntry *last = feed_at(p, 0);
+        if (last->pts_us == pts_us) {
+            // Several packets of one access unit: the first one starts the clock.
+            return;
+        }
+        gint64 delta_ns = (pts_us - last->pts_us) * 1000ll;
+        if (delta_ns > 0 && delta_ns < 200000000ll) {
+            p->interval_ns = p->interval_ns ? p->interval_ns + (delta_ns - p->interval_ns) / 16 : delta_ns;
+        }
+    }
+    p->feeds[p->feed_head].pts_us = pts_us;
+    p->feeds[p->feed_head].feed_ns = now_ns;
+    p->feed_head = (p->feed_head + 1) % PACER_FEED_HISTORY;
+    if (p->feed_count < PACER_FEED_HISTORY) {
+        p->feed_count++;
+    }
+}
+
+void frame_pacer_note_flip(FramePacer *p, guint64 flip_ns) {
+    if (p == NULL || flip_ns == 0) {
+        return;
+    }
+    if (p->last_flip_ns != 0 && flip_ns > p->last_flip_ns && p->period_ns > 0) {
+        gint64 interval = (gint64)(flip_ns - p->last_flip_ns);
+        gint64 n = (interval + p->period_ns / 2) / p->period_ns;
+        if (n >= 1 && n <= 4) {
+            gint64 sample = interval / n;
+            gint64 tolerance = p->nominal_period_ns / 20;
+            if (sample > p->nominal_period_ns - tolerance && sample < p->nominal_period_ns + tolerance) {
+                p->period_ns += (sample - p->period_ns) / 16;
+            }
+        }
+    }
+    p->last_flip_ns = flip_ns;
+}
+
+void frame_pacer_note_commit_cost(FramePacer *p, guint64 cost_ns) {
+    if (p == NULL) {
+        return;
+    }
+    estimate_update(&p->commit, (gint64)cost_ns);
+}
+
+static gint64 commit_lead(const FramePacer *p) {
+    return PACER_LATCH_MARGIN_NS + estimate_upper(&p->commit, 4);
+}
+
+/* First predicted vblank at or after t, or 0 if there is no flip to phase from yet. */
+static guint64 vblank_at_or_after(const FramePacer *p, guint64 t) {
+    if (p->last_flip_ns == 0 || p->period_ns <= 0) {
+        return 0;
+    }
+    if (t <= p->last_flip_ns) {
+        return p->last_flip_ns + (guint64)p->period_ns;
+    }
+    guint64 period = (guint64)p->period_ns;
+    guint64 k = (t - p->last_flip_ns + period - 1) / period;
+    return p->last_flip_ns + k * period;
+}
+
+static guint64 lookup_feed(const FramePacer *p, gint64 pts_us) {
+    for (guint age = 0; age < p->feed_count; ++age) {
+        const struct FeedEntry *e = feed_at(p, age);
+        if (e->pts_us == pts_us) {
+            return e->feed_ns;
+        }
+    }
+    return 0;
+}
+
+/* When the frame after pts_us is expected out of the decoder, or 0 if unknown. */
+static guint64 predict_next_ready(const FramePacer *p, gint64 pts_us) {
+    if (!p->decode.primed || p->feed_count == 0) {
+        return 0;
+    }
+    gint64 decode_ns = estimate_upper(&p->decode, 2);
+
+    // The successor may already be inside the decoder.
+    const struct FeedEntry *next = NULL;
+    for (guint age = 0; age < p->feed_count; ++age) {
+        const struct FeedEntry *e = feed_at(p, age);
+        if (e->pts_us <= pts_us) {
+            break;
+        }
+        next = e;
+    }
+    if (next != NULL) {
+        return next->feed_ns + (guint64)decode_ns;
+    }
+    if (p->interval_ns <= 0) {
+        return 0;
+    }
+    const struct FeedEntry *last = feed_at(p, 0);
+    return last->feed_ns + (guint64)p->interval_ns + (guint64)decode_ns;
+}
+
+static void update_jitter(FramePacer *p, gint64 pts_us, guint64 ready_ns) {
+    gint64 transit = (gint64)ready_ns - pts_us * 1000ll;
+    if (!p->have_base || transit < p->transit_base_ns) {
+        p->transit_base_ns = transit;
+        p->have_base = TRUE;
+    } else {
+        p->transit_base_ns = MIN(p->transit_base_ns + PACER_BASE_DRIFT_NS, transit);
+    }
+
+    gint64 excess = transit - p->transit_base_ns;
+    p->jitter_ns += (excess - p->jitter_ns) / 16;
+
+    // Jump straight to a new worst case, then bleed the extra delay off slowly.
+    if (excess > p->playout_delay_ns) {
+        p->playout_delay_ns = excess;
+    } else {
+        p->playout_delay_ns -= p->playout_delay_ns / 128;
+    }
+
+    gint64 max_delay = PACER_MAX_PLAYOUT_NS;
+    if (p->interval_ns > 0) {
+        // Holding more than the queue can store would only turn into drops.
+        max_delay = MIN(max_delay, p->interval_ns * (PACER_SMOOTH_QUEUE_DEPTH - 1));
+    }
+    p->playout_delay_ns = CLAMP(p->playout_delay_ns, 0, max_delay);
+}
+
+static guint64 schedule_latency(FramePacer *p, gint64 pts_us, guint64 now_ns, gint64 lead) {
+    guint64 vblank = vblank_at_or_after(p, now_ns + (guint64)lead);
+    if (vblank == 0) {
+        p->frames_immediate++;
+        return now_ns;
+    }
+
+    /*
+     * Committing now or at the deadline lands on the same vblank, so waiting is
+     * free. It pays off when the next frame is due before the deadline: that
+     * one replaces this one and the screen shows newer content.
+     */
+    guint64 deadline = vblank - (guint64)lead;
+    guint64 next_ready = predict_next_ready(p, pts_us);
+    if (next_ready != 0 && next_ready + PACER_HOLD_SLACK_NS < deadline) {
+        p->frames_held++;
+        return deadline;
+    }
+    p->frames_immediate++;
+    return now_ns;
+}
+
+static guint64 schedule_smooth(FramePacer *p, gint64 pts_us, guint64 now_ns, gint64 lead) {
+    if (!p->have_base) {
+        p->frames_immediate++;
+        return now_ns;
+    }
+
+    gint64 target = pts_us * 1000ll + p->transit_base_ns + p->playout_delay_ns + lead;
+    if (target <= 0 || (guint64)target < now_ns + (guint64)lead) {
+        p->frames_late++;
+        return now_ns;
+    }
+
+    guint64 vblank = vblank_at_or_after(p, (guint64)target);
+    if (vblank == 0) {
+        return (guint64)target - (guint64)lead;
+    }
+    p->frames_held++;
+    return vblank - (guint64)lead;
+}
+
+guint64 frame_pacer_frame_ready(FramePacer *p, gint64 pts_us, guint64 ready_ns, guint64 now_ns) {
+    if (p == NULL) {
+        return now_ns;
+    }
+
+    guint64 feed_ns = lookup_feed(p, pts_us);
+    if (feed_ns != 0 && ready_ns >= feed_ns) {
+        estimate_update(&p->decode, (gint64)(ready_ns - feed_ns));
+    }
+    update_jitter(p, pts_us, ready_ns);
+
+    gint64 lead = commit_lead(p);
+    if (p->mode == PACING_MODE_SMOOTH) {
+        return schedule_smooth(p, pts_us, now_ns, lead);
+    }
+    return schedule_latency(p, pts_us, now_ns, lead);
+}
+
+void frame_pacer_get_stats(const FramePacer *p, FramePacerStats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    memset(stats, 0, sizeof(*stats));
+    if (p == NULL) {
+        return;
+    }
+    stats->vblank_period_ns = (guint64)MAX(p->period_ns, 0);
+    stats->frame_interval_ns = (guint64)MAX(p->interval_ns, 0);
+    stats->decode_time_ns = (guint64)MAX(p->decode.avg, 0);
+    stats->decode_time_dev_ns = (guint64)MAX(p->decode.dev, 0);
+    stats->jitter_ns = (guint64)MAX(p->jitter_ns, 0);
+    stats->playout_delay_ns = (guint64)MAX(p->playout_delay_ns, 0);
+    stats->commit_lead_ns = (guint64)commit_lead(p);
+    stats->frames_held = p->frames_held;
+    stats->frames_immediate = p->frames_immediate;
+    stats->frames_late = p->frames_late;
+}
@@ -0,0 +1,467 @@
+#include "frame_pool.h"
+
+#include "logging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+/* Idle pools kept around for a format change back or a pipeline restart. */
+#define FRAME_POOL_CACHE_MAX_IDLE 2
+#define FRAME_POOL_CACHE_IDLE_BUDGET (128ull * 1024ull * 1024ull)
+#define FRAME_POOL_CACHE_MAX_LEARNED 8
+
+typedef enum {
+    POOL_BUILDING = 0,
+    POOL_IDLE,
+    POOL_IN_USE,
+    POOL_FAILED,
+} PoolState;
+
+struct FramePool {
+    FramePoolGeometry geo;
+    FramePoolBuffer buffers[FRAME_POOL_MAX_BUFFERS];
+    guint built;
+    guint64 bytes;
+    PoolState state;
+    gboolean prefetched;
+    guint waiters;
+    guint64 last_used;
+};
+
+struct LearnedGeometry {
+    guint64 stream_key;
+    FramePoolGeometry geo;
+};
+
+struct FramePoolCache {
+    int drm_fd;
+
+    GMutex lock;
+    GCond cond;
+    GThread *thread;
+    gboolean stop_requested;
+
+    GPtrArray *pools;
+    GQueue build_queue;
+    guint64 use_seq;
+
+    struct LearnedGeometry learned[FRAME_POOL_CACHE_MAX_LEARNED];
+    guint learned_count;
+    guint learned_next;
+
+    FramePoolCacheStats stats;
+};
+
+static inline guint64 monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (guint64)ts.tv_sec * 1000000000ull + (guint64)ts.tv_nsec;
+}
+
+static gboolean same_layout(const FramePoolGeometry *a, const FramePoolGeometry *b) {
+    return a->format == b->format && a->drm_fourcc == b->drm_fourcc && a->width == b->width &&
+           a->height == b->height && a->hor_stride == b->hor_stride && a->ver_stride == b->ver_stride &&
+           a->frame_size == b->frame_size;
+}
+
+static void destroy_buffer(int drm_fd, FramePoolBuffer *buf) {
+    if (buf->fb_id) {
+        drmModeRmFB(drm_fd, buf->fb_id);
+        buf->fb_id = 0;
+    }
+    if (buf->prime_fd >= 0) {
+        close(buf->prime_fd);
+        buf->prime_fd = -1;
+    }
+    if (buf->handle) {
+        struct drm_mode_destroy_dumb dmd = {.handle = buf->handle};
+        ioctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dmd);
+        buf->handle = 0;
+    }
+}
+
+static void destroy_pool(FramePoolCache *cache, FramePool *pool) {
+    for (guint i = 0; i < pool->built; ++i) {
+        destroy_buffer(cache->drm_fd, &pool->buffers[i]);
+    }
+    g_free(pool);
+}
+
+static gboolean create_buffer(int drm_fd, const FramePoolGeometry *geo, FramePoolBuffer *buf) {
+    memset(buf, 0, sizeof(*buf));
+    buf->prime_fd = -1;
+
+    struct drm_mode_create_dumb dmcd;
+    memset(&dmcd, 0, sizeof(dmcd));
+    dmcd.bpp = 8;
+    dmcd.width = geo->hor_stride;
+    dmcd.height = (uint32_t)((geo->frame_size + geo->hor_stride - 1) / geo->hor_stride);
+
+    int ret;
+    do {
+        ret = ioctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &dmcd);
+    } while (ret == -1 && (errno == EINTR || errno == EAGAIN));
+    if (ret != 0) {
+        LOGW("Frame pool: DRM_IOCTL_MODE_CREATE_DUMB failed: %s", g_strerror(errno));
+        return FALSE;
+    }
+    buf->handle = dmcd.handle;
+    buf->size = dmcd.size;
+
+    struct drm_prime_handle dph;
+    memset(&dph, 0, sizeof(dph));
+    dph.handle = dmcd.handle;
+    dph.fd = -1;
+    do {
+        ret = ioctl(drm_fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &dph);
+    } while (ret == -1 && (errno == EINTR || errno == EAGAIN));
+    if (ret != 0) {
+        LOGW("Frame pool: PRIME_HANDLE_TO_FD failed: %s", g_strerror(errno));
+        destroy_buffer(drm_fd, buf);
+        return FALSE;
+    }
+    buf->prime_fd = dph.fd;
+
+    uint32_t handles[4] = {dmcd.handle, dmcd.handle, 0, 0};
+    uint32_t pitches[4] = {dmcd.pitch, dmcd.pitch, 0, 0};
+    uint32_t offsets[4] = {0, dmcd.pitch * geo->ver_stride, 0, 0};
+    ret = drmModeAddFB2(drm_fd, geo->width, geo->height, geo->drm_fourcc, handles, pitches, offsets, &buf->fb_id,
+                        0);
+    if (ret != 0) {
+        LOGW("Frame pool: drmModeAddFB2 failed: %s", g_strerror(errno));
+        destroy_buffer(drm_fd, buf);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void build_pool(FramePoolCache *cache, FramePool *pool) {
+    guint count = MIN(pool->geo.count, FRAME_POOL_MAX_BUFFERS);
+    for (guint i = 0; i < count; ++i) {
+        if (!create_buffer(cache->drm_fd, &pool->geo, &pool->buffers[pool->built])) {
+            continue;
+        }
+        pool->bytes += pool->buffers[pool->built].size;
+        pool->built++;
+    }
+}
+
+static gpointer build_thread_func(gpointer data) {
+    FramePoolCache *cache = (FramePoolCache *)data;
+
+    g_mutex_lock(&cache->lock);
+    while (!cache->stop_requested) {
+        FramePool *pool = g_queue_pop_head(&cache->build_queue);
+        if (pool == NULL) {
+            g_cond_wait(&cache->cond, &cache->lock);
+            continue;
+        }
+        g_mutex_unlock(&cache->lock);
+
+        guint64 start_ns = monotonic_ns();
+        build_pool(cache, pool);
+        guint64 build_ns = monotonic_ns() - start_ns;
+        LOGI("Frame pool: built %u/%u buffers for %ux%u (stride %ux%u), %.1f MiB in %.1f ms%s", pool->built,
+             pool->geo.count, pool->geo.width, pool->geo.height, pool->geo.hor_stride, pool->geo.ver_stride,
+             pool->bytes / (1024.0 * 1024.0), build_ns / 1e6, pool->prefetched ? " (prefetch)" : "");
+
+        g_mutex_lock(&cache->lock);
+        pool->state = pool->built > 0 ? POOL_IDLE : POOL_FAILED;
+        pool->last_used = ++cache->use_seq;
+        cache->stats.pools_built++;
+        cache->stats.build_ns_last = build_ns;
+        cache->stats.build_ns_max = MAX(cache->stats.build_ns_max, build_ns);
+        cache->stats.bytes_resident += pool->bytes;
+        g_cond_broadcast(&cache->cond);
+    }
+    g_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+/*
+ * Moves least recently used idle pools (and failed builds) out of the cache
+ * until the idle set fits the limits with room for reserve_bytes. keep is
+ * never evicted. Lock held; the caller destroys the returned pools unlocked.
+ */
+static void evict_idle(FramePoolCache *cache, guint64 reserve_bytes, const FramePool *keep, GPtrArray *evicted) {
+    while (TRUE) {
+        guint idle = 0;
+        guint64 idle_bytes = reserve_bytes;
+        FramePool *victim = NULL;
+        for (guint i = 0; i < cache->pools->len; ++i) {
+            FramePool *pool = g_ptr_array_index(cache->pools, i);
+            if (pool->waiters > 0) {
+                continue;
+            }
+            if (pool->state == POOL_FAILED) {
+                victim = pool;
+                break;
+            }
+            if (pool->state != POOL_IDLE) {
+                continue;
+            }
+            idle++;
+            idle_bytes += pool->bytes;
+            if (pool != keep && (victim == NULL || pool->last_used < victim->last_used)) {
+                victim = pool;
+            }
+        }
+        if (victim == NULL) {
+            return;
+        }
+        if (victim->state != POOL_FAILED && idle <= FRAME_POOL_CACHE_MAX_IDLE &&
+            idle_bytes <= FRAME_POOL_CACHE_IDLE_BUDGET) {
+            return;
+        }
+        g_ptr_array_remove(cache->pools, victim);
+        if (victim->state == POOL_IDLE) {
+            cache->stats.evictions++;
+            cache->stats.bytes_resident -= victim->bytes;
+        }
+        g_ptr_array_add(evicted, victim);
+    }
+}
+
+static void destroy_evicted(FramePoolCache *cache, GPtrArray *evicted) {
+    for (guint i = 0; i < evicted->len; ++i) {
+        FramePool *pool = g_ptr_array_index(evicted, i);
+        LOGI("Frame pool: evicting %ux%u pool (%.1f MiB)", pool->geo.width, pool->geo.height,
+             pool->bytes / (1024.0 * 1024.0));
+        destroy_pool(cache, pool);
+    }
+    g_ptr_array_free(evicted, TRUE);
+}
+
+static guint64 estimate_bytes(const FramePoolGeometry *geo) {
+    return (guint64)geo->frame_size * MIN(geo->count, FRAME_POOL_MAX_BUFFERS);
+}
+
+/* Queues a build for geo; lock held. */
+static FramePool *queue_build(FramePoolCache *cache, const FramePoolGeometry *geo, gboolean prefetched) {
+    FramePool *pool = g_new0(FramePool, 1);
+    pool->geo = *geo;
+    pool->geo.count = MIN(geo->count, FRAME_POOL_MAX_BUFFERS);
+    pool->state = POOL_BUILDING;
+    pool->prefetched = prefetched;
+    g_ptr_array_add(cache->pools, pool);
+    g_queue_push_tail(&cache->build_queue, pool);
+    g_cond_broadcast(&cache->cond);
+    return pool;
+}
+
+/* Best usable pool for geo that is not in use; idle ones win over builds in progress. Lock held. */
+static FramePool *find_pool(FramePoolCache *cache, const FramePoolGeometry *geo) {
+    FramePool *best = NULL;
+    for (guint i = 0; i < cache->pools->len; ++i) {
+        FramePool *pool = g_ptr_array_index(cache->pools, i);
+        if (pool->state == POOL_IN_USE || pool->state == POOL_FAILED || !same_layout(&pool->geo, geo) ||
+            pool->geo.count < geo->count) {
+            continue;
+        }
+        if (best == NULL || (pool->state == POOL_IDLE && best->state != POOL_IDLE)) {
+            best = pool;
+        }
+    }
+    return best;
+}
+
+FramePoolCache *frame_pool_cache_new(int drm_fd) {
+    int dup_fd = fcntl(drm_fd, F_DUPFD_CLOEXEC, 0);
+    if (dup_fd < 0) {
+        LOGE("Frame pool: failed to dup DRM fd: %s", g_strerror(errno));
+        return NULL;
+    }
+
+    FramePoolCache *cache = g_new0(FramePoolCache, 1);
+    cache->drm_fd = dup_fd;
+    cache->pools = g_ptr_array_new();
+    g_queue_init(&cache->build_queue);
+    g_mutex_init(&cache->lock);
+    g_cond_init(&cache->cond);
+
+    cache->thread = g_thread_new("frame-pool", build_thread_func, cache);
+    if (cache->thread == NULL) {
+        LOGE("Frame pool: failed to start build thread");
+        frame_pool_cache_free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void frame_pool_cache_free(FramePoolCache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+
+    g_mutex_lock(&cache->lock);
+    cache->stop_requested = TRUE;
+    g_cond_broadcast(&cache->cond);
+    g_mutex_unlock(&cache->lock);
+    if (cache->thread != NULL) {
+        g_thread_join(cache->thread);
+        cache->thread = NULL;
+    }
+
+    LOGI("Frame pool: %" G_GUINT64_FORMAT " pools built (max %.1f ms), %" G_GUINT64_FORMAT " cache hits (%"
+         G_GUINT64_FORMAT " prefetched), %" G_GUINT64_FORMAT " evictions",
+         cache->stats.pools_built, cache->stats.build_ns_max / 1e6, cache->stats.cache_hits,
+         cache->stats.prefetch_hits, cache->stats.evictions);
+
+    g_queue_clear(&cache->build_queue);
+    for (guint i = 0; i < cache->pools->len; ++i) {
+        FramePool *pool = g_ptr_array_index(cache->pools, i);
+        if (pool->state == POOL_IN_USE) {
+            LOGW("Frame pool: freeing %ux%u pool that is still in use", pool->geo.width, pool->geo.height);
+        }
+        destroy_pool(cache, pool);
+    }
+    g_ptr_array_free(cache->pools, TRUE);
+
+    if (cache->drm_fd >= 0) {
+        close(cache->drm_fd);
+    }
+    g_mutex_clear(&cache->lock);
+    g_cond_clear(&cache->cond);
+    g_free(cache);
+}
+
+FramePool *frame_pool_cache_acquire(FramePoolCache *cache, const FramePoolGeometry *geo) {
+    if (cache == NULL || geo == NULL || geo->count == 0 || geo->hor_stride == 0) {
+        return NULL;
+    }
+
+    FramePoolGeometry want = *geo;
+    want.count = MIN(want.count, FRAME_POOL_MAX_BUFFERS);
+    GPtrArray *evicted = g_ptr_array_new();
+    FramePool *result = NULL;
+
+    g_mutex_lock(&cache->lock);
+    FramePool *pool = find_pool(cache, &want);
+    gboolean cached = (pool != NULL);
+    if (pool == NULL) {
+        // Make room before allocating: on small boards CMA is the scarce resource.
+        evict_idle(cache, estimate_bytes(&want), NULL, evicted);
+        pool = queue_build(cache, &want, FALSE);
+    }
+    pool->waiters++;
+    while (pool->state == POOL_BUILDING) {
+        g_cond_wait(&cache->cond, &cache->lock);
+    }
+    pool->waiters--;
+    if (pool->state == POOL_IDLE) {
+        if (cached) {
+            cache->stats.cache_hits++;
+        }
+        if (pool->prefetched) {
+            cache->stats.prefetch_hits++;
+        }
+        pool->state = POOL_IN_USE;
+        pool->prefetched = FALSE;
+        result = pool;
+    } else if (pool->waiters == 0 && g_ptr_array_remove(cache->pools, pool)) {
+        g_ptr_array_add(evicted, pool);
+    }
+    g_mutex_unlock(&cache->lock);
+
+    destroy_evicted(cache, evicted);
+    return result;
+}
+
+void frame_pool_cache_release(FramePoolCache *cache, FramePool *pool) {
+    if (cache == NULL || pool == NULL) {
+        return;
+    }
+    GPtrArray *evicted = g_ptr_array_new();
+    g_mutex_lock(&cache->lock);
+    pool->state = POOL_IDLE;
+    pool->last_used = ++cache->use_seq;
+    evict_idle(cache, 0, pool, evicted);
+    g_mutex_unlock(&cache->lock);
+    destroy_evicted(cache, evicted);
+}
+
+void frame_pool_cache_learn(FramePoolCache *cache, guint64 stream_key, const FramePoolGeometry *geo) {
+    if (cache == NULL || geo == NULL || stream_key == 0) {
+        return;
+    }
+    g_mutex_lock(&cache->lock);
+    guint slot = cache->learned_count;
+    for (guint i = 0; i < cache->learned_count; ++i) {
+        if (cache->learned[i].stream_key == stream_key) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == cache->learned_count) {
+        if (cache->learned_count < FRAME_POOL_CACHE_MAX_LEARNED) {
+            cache->learned_count++;
+        } else {
+            slot = cache->learned_next;
+            cache->learned_next = (cache->learned_next + 1) % FRAME_POOL_CACHE_MAX_LEARNED;
+        }
+    }
+    cache->learned[slot].stream_key = stream_key;
+    cache->learned[slot].geo = *geo;
+    g_mutex_unlock(&cache->lock);
+}
+
+gboolean frame_pool_cache_prefetch(FramePoolCache *cache, guint64 stream_key, guint count) {
+    if (cache == NULL || stream_key == 0 || count == 0) {
+        return FALSE;
+    }
+
+    GPtrArray *evicted = g_ptr_array_new();
+    gboolean queued = FALSE;
+    g_mutex_lock(&cache->lock);
+    for (guint i = 0; i < cache->learned_count; ++i) {
+        if (cache->learned[i].stream_key != stream_key) {
+            continue;
+        }
+        FramePoolGeometry geo = cache->learned[i].geo;
+        geo.count = MIN(count, FRAME_POOL_MAX_BUFFERS);
+        if (find_pool(cache, &geo) == NULL) {
+            evict_idle(cache, estimate_bytes(&geo), NULL, evicted);
+            queue_build(cache, &geo, TRUE);
+            queued = TRUE;
+        }
+        break;
+    }
+    g_mutex_unlock(&cache->lock);
+    destroy_evicted(cache, evicted);
+    return queued;
+}
+
+guint frame_pool_size(const FramePool *pool) {
+    return pool ? pool->built : 0;
+}
+
+const FramePoolBuffer *frame_pool_buffer(const FramePool *pool, guint index) {
+    if (pool == NULL || index >= pool->built) {
+        return NULL;
+    }
+    return &pool->buffers[index];
+}
+
+guint64 frame_pool_bytes(const FramePool *pool) {
+    return pool ? pool->bytes : 0;
+}
+
+void frame_pool_cache_get_stats(FramePoolCache *cache, FramePoolCacheStats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    memset(stats, 0, sizeof(*stats));
+    if (cache == NULL) {
+        return;
+    }
+    g_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    g_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,183 @@
+#include "hevc_parse.h"
+
+#include <string.h>
+
+/* Everything we read sits in the first few dozen bytes; VUI and beyond are never touched. */
+#define HEVC_SPS_RBSP_MAX 256
+
+struct BitReader {
+    const guint8 *data;
+    size_t size;
+    size_t pos; /* in bits */
+    gboolean overrun;
+};
+
+static guint32 read_bits(struct BitReader *br, guint n) {
+    guint32 value = 0;
+    for (guint i = 0; i < n; ++i) {
+        if (br->pos >= br->size * 8) {
+            br->overrun = TRUE;
+            return 0;
+        }
+        guint8 byte = br->data[br->pos >> 3];
+        value = (value << 1) | ((byte >> (7 - (br->pos & 7))) & 1u);
+        br->pos++;
+    }
+    return value;
+}
+
+static void skip_bits(struct BitReader *br, size_t n) {
+    br->pos += n;
+    if (br->pos > br->size * 8) {
+        br->overrun = TRUE;
+    }
+}
+
+static guint32 read_ue(struct BitReader *br) {
+    guint leading_zeros = 0;
+    while (read_bits(br, 1) == 0) {
+        if (br->overrun || ++leading_zeros > 31) {
+            br->overrun = TRUE;
+            return 0;
+        }
+    }
+    if (leading_zeros == 0) {
+        return 0;
+    }
+    return ((1u << leading_zeros) - 1u) + read_bits(br, leading_zeros);
+}
+
+/* Strips emulation prevention bytes (00 00 03 -> 00 00). */
+static size_t unescape_rbsp(const guint8 *src, size_t size, guint8 *dst, size_t dst_size) {
+    size_t out = 0;
+    guint zeros = 0;
+    for (size_t i = 0; i < size && out < dst_size; ++i) {
+        if (zeros >= 2 && src[i] == 0x03) {
+            zeros = 0;
+            continue;
+        }
+        dst[out++] = src[i];
+        zeros = (src[i] == 0) ? zeros + 1 : 0;
+    }
+    return out;
+}
+
+/* Returns the offset just past the next 00 00 01 start code at or after pos, or size. */
+static size_t next_start_code(const guint8 *data, size_t size, size_t pos) {
+    while (pos + 3 <= size) {
+        if (data[pos + 2] > 1) {
+            pos += 3;
+        } else if (data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 1) {
+            return pos + 3;
+        } else {
+            pos++;
+        }
+    }
+    return size;
+}
+
+gboolean hevc_find_sps(const guint8 *data, size_t size, const guint8 **nal_out, size_t *nal_size_out) {
+    if (data == NULL || size < 5) {
+        return FALSE;
+    }
+
+    size_t nal = next_start_code(data, size, 0);
+    while (nal + 2 <= size) {
+        guint type = (data[nal] >> 1) & 0x3f;
+        if (type < 32) {
+            // First slice of the picture: parameter sets only ever come before it.
+            return FALSE;
+        }
+        size_t next = next_start_code(data, size, nal);
+        if (type == HEVC_NAL_SPS) {
+            size_t end = (next < size) ? next - 3 : size;
+            // A four-byte start code leaves its leading zero on the previous NAL.
+            while (end > nal && data[end - 1] == 0) {
+                end--;
+            }
+            *nal_out = data + nal;
+            *nal_size_out = end - nal;
+            return TRUE;
+        }
+        nal = next;
+    }
+    return FALSE;
+}
+
+static void skip_profile_tier_level(struct BitReader *br, guint max_sub_layers_minus1, HevcSpsInfo *out) {
+    skip_bits(br, 2 + 1); // general_profile_space, general_tier_flag
+    out->general_profile_idc = read_bits(br, 5);
+    skip_bits(br, 32 + 4 + 43 + 1); // compatibility flags, source flags, reserved bits
+    out->general_level_idc = read_bits(br, 8);
+
+    guint8 profile_present[8] = {0};
+    guint8 level_present[8] = {0};
+    for (guint i = 0; i < max_sub_layers_minus1; ++i) {
+        profile_present[i] = (guint8)read_bits(br, 1);
+        level_present[i] = (guint8)read_bits(br, 1);
+    }
+    if (max_sub_layers_minus1 > 0) {
+        skip_bits(br, 2 * (8 - max_sub_layers_minus1));
+    }
+    for (guint i = 0; i < max_sub_layers_minus1; ++i) {
+        if (profile_present[i]) {
+            skip_bits(br, 88);
+        }
+        if (level_present[i]) {
+            skip_bits(br, 8);
+        }
+    }
+}
+
+int hevc_parse_sps(const guint8 *nal, size_t size, HevcSpsInfo *out) {
+    if (nal == NULL || size < 3 || out == NULL) {
+        return -1;
+    }
+    if (((nal[0] >> 1) & 0x3f) != HEVC_NAL_SPS) {
+        return -1;
+    }
+
+    guint8 rbsp[HEVC_SPS_RBSP_MAX];
+    size_t rbsp_size = unescape_rbsp(nal + 2, size - 2, rbsp, sizeof(rbsp));
+    struct BitReader br = {.data = rbsp, .size = rbsp_size, .pos = 0, .overrun = FALSE};
+
+    HevcSpsInfo info;
+    memset(&info, 0, sizeof(info));
+
+    skip_bits(&br, 4); // sps_video_parameter_set_id
+    guint max_sub_layers_minus1 = read_bits(&br, 3);
+    skip_bits(&br, 1); // sps_temporal_id_nesting_flag
+    if (max_sub_layers_minus1 > 6) {
+        return -1;
+    }
+    skip_profile_tier_level(&br, max_sub_layers_minus1, &info);
+
+    read_ue(&br); // sps_seq_parameter_set_id
+    info.chroma_format_idc = read_ue(&br);
+    if (info.chroma_format_idc == 3) {
+        skip_bits(&br, 1); // separate_colour_plane_flag
+    }
+    info.width = read_ue(&br);
+    info.height = read_ue(&br);
+    if (read_bits(&br, 1)) { // conformance_window_flag
+        for (int i = 0; i < 4; ++i) {
+            read_ue(&br);
+        }
+    }
+    info.bit_depth_luma = read_ue(&br) + 8;
+    info.bit_depth_chroma = read_ue(&br) + 8;
+    read_ue(&br); // log2_max_pic_order_cnt_lsb_minus4
+
+    guint ordering_info_present = read_bits(&br, 1);
+    for (guint i = ordering_info_present ? 0 : max_sub_layers_minus1; i <= max_sub_layers_minus1; ++i) {
+        info.max_dec_pic_buffering = read_ue(&br) + 1;
+        info.max_num_reorder = read_ue(&br);
+        read_ue(&br); // sps_max_latency_increase_plus1
+    }
+
+    if (br.overrun || info.width == 0 || info.height == 0 || info.max_dec_pic_buffering > 16) {
+        return -1;
+    }
+    *out = info;
+    return 0;
+}
@@ -4,6 +4,22 @@
 #include <time.h>
 
 static _Atomic int g_verbose = 0;
+static _Atomic uint64_t g_startup_ns = 0;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + (uint64_t)t.tv_nsec;
+}
+
+void log_startup_begin(void) {
+    atomic_store_explicit(&g_startup_ns, monotonic_ns(), memory_order_relaxed);
+}
+
+uint64_t log_startup_elapsed_ns(void) {
+    uint64_t start = atomic_load_explicit(&g_startup_ns, memory_order_relaxed);
+    return start ? monotonic_ns() - start : 0;
+}
 
 const char *log_timestamp(void) {
     static _Thread_local char buf[32];
@@ -3,9 +3,12 @@
 #define _GNU_SOURCE
 
 #include "config.h"
+#include "drm_hotplug.h"
 #include "drm_modeset.h"
+#include "drm_props.h"
 #include "logging.h"
 #include "pipeline.h"
+#include "record_helper.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -40,6 +43,40 @@ static void *pipeline_stop_worker(void *arg) {
     return NULL;
 }
 
+/*
+ * A connector came or went. Decoding carries on throughout: while no sink is
+ * connected the display only holds frames; once one is back, the modeset is
+ * redone (cheaply, if the CRTC kept its mode) and the display rebinds to it.
+ */
+static void handle_hotplug(int fd, const AppCfg *cfg, ModesetResult *heads, int *head_count, PipelineState *ps,
+                           int *connected) {
+    // Connector and CRTC properties may have changed with the sink.
+    drm_props_invalidate();
+    if (!is_any_connected(fd, cfg)) {
+        if (*connected) {
+            LOGI("Display disconnected; holding presentation, decoding continues");
+            pipeline_display_hold(ps);
+            *connected = 0;
+        }
+        return;
+    }
+
+    LOGI("Display %s; redoing modeset", *connected ? "changed" : "reconnected");
+    uint64_t start_ns = log_startup_elapsed_ns();
+    pipeline_display_hold(ps);
+    ModesetResult next = {0};
+    if (atomic_modeset_maxhz(fd, cfg, &next) != 0) {
+        LOGW("Modeset after hotplug failed; waiting for the next hotplug event");
+        *connected = 0;
+        return;
+    }
+    heads[0] = next;
+    *head_count = drm_modeset_mirrors(fd, cfg, heads);
+    *connected = 1;
+    pipeline_display_rebind(ps, heads, *head_count);
+    LOGI("Display rebound %.1f ms after the hotplug event", (log_startup_elapsed_ns() - start_ns) / 1e6);
+}
+
 static const char *g_instance_pid_path = "/tmp/pixelpilot_stripped_rk.pid";
 
 static void remove_instance_pid(void) {
@@ -176,6 +213,10 @@ static void *signal_thread_func(void *arg) {
 }
 
 int main(int argc, char **argv) {
+    log_startup_begin();
+    if (argc > 1 && strcmp(argv[1], RECORD_HELPER_ARG) == 0) {
+        return record_helper_main(argc, argv);
+    }
     AppCfg cfg;
     int parse_rc = parse_cli(argc, argv, &cfg);
     if (parse_rc != 0) {
@@ -212,8 +253,8 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    ModesetResult ms = {0};
-    if (atomic_modeset_maxhz(fd, &cfg, &ms) != 0) {
+    ModesetResult heads[DRM_MAX_HEADS] = {0};
+    if (atomic_modeset_maxhz(fd, &cfg, &heads[0]) != 0) {
         LOGE("Failed to configure display output");
         g_exit_flag = 1;
         pthread_kill(g_signal_thread, SIGTERM);
@@ -222,10 +263,12 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    int head_count = drm_modeset_mirrors(fd, &cfg, heads);
+
     PipelineState ps = {0};
     ps.state = PIPELINE_STOPPED;
 
-    if (pipeline_start(&cfg, &ms, fd, &ps) != 0) {
+    if (pipeline_start(&cfg, heads, head_count, fd, &ps) != 0) {
         LOGE("Pipeline start failed");
         g_exit_flag = 1;
         pthread_kill(g_signal_thread, SIGTERM);
@@ -240,8 +283,18 @@ int main(int argc, char **argv) {
         }
     }
 
+    DrmHotplug *hotplug = drm_hotplug_new(cfg.card_path);
+    if (hotplug == NULL) {
+        LOGW("Connector hotplug monitoring unavailable; reconnecting a display needs a restart");
+    }
+    int display_connected = 1;
+
     for (;;) {
         struct pollfd pfd = {.fd = STDIN_FILENO, .events = 0};
+        if (hotplug != NULL) {
+            pfd.fd = drm_hotplug_fd(hotplug);
+            pfd.events = POLLIN;
+        }
         poll(&pfd, 1, 200);
 
         if (g_exit_flag) {
@@ -249,6 +302,10 @@ int main(int argc, char **argv) {
             break;
         }
 
+        if (hotplug != NULL && (pfd.revents & POLLIN) && drm_hotplug_drain(hotplug) > 0) {
+            handle_hotplug(fd, &cfg, heads, &head_count, &ps, &display_connected);
+        }
+
         if (g_start_record_flag > 0) {
             g_start_record_flag = 0;
             if (!cfg.record.enable) {
@@ -281,11 +338,14 @@ int main(int argc, char **argv) {
             g_restart_flag = 0;
             LOGI("Restarting pipeline");
             pipeline_stop(&ps, 700);
-            if (pipeline_start(&cfg, &ms, fd, &ps) != 0) {
+            if (pipeline_start(&cfg, heads, head_count, fd, &ps) != 0) {
                 LOGE("Pipeline restart failed");
                 g_exit_flag = 1;
-            } else if (cfg.record.enable) {
-                if (pipeline_enable_recording(&ps, &cfg.record) != 0) {
+            } else {
+                if (!display_connected) {
+                    pipeline_display_hold(&ps);
+                }
+                if (cfg.record.enable && pipeline_enable_recording(&ps, &cfg.record) != 0) {
                     LOGW("Failed to re-enable recording after restart");
                 }
             }
@@ -316,6 +376,14 @@ int main(int argc, char **argv) {
         }
     }
     LOGI("Pipeline stopped");
+    pipeline_release_frame_pools(&ps);
+    drm_hotplug_free(hotplug);
+    if (!video_recorder_wait_finalized(10000)) {
+        LOGW("Recording still being finalised at exit; the last file may lack its index");
+    }
+    if (!record_helper_wait_exited(10000)) {
+        LOGW("Recorder helper still finalising at exit; it finishes the file on its own");
+    }
 
     g_exit_flag = 1;
     pthread_kill(g_signal_thread, SIGTERM);
@@ -0,0 +1,343 @@
+#include "osd.h"
+#include "drm_fb.h"
+#include "drm_props.h"
+#include "logging.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__has_include)
+#if __has_include(<libdrm/drm_fourcc.h>)
+#include <libdrm/drm_fourcc.h>
+#else
+#include <drm/drm_fourcc.h>
+#endif
+#else
+#include <drm/drm_fourcc.h>
+#endif
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#define OSD_LINES 4
+#define OSD_COLS 18
+#define OSD_SCALE 2
+/* 5x7 glyphs in a 6x8 cell, so neighbouring cells never share a pixel. */
+#define OSD_CELL_W (6 * OSD_SCALE)
+#define OSD_CELL_H (8 * OSD_SCALE)
+#define OSD_LINE_H (OSD_CELL_H + 2 * OSD_SCALE)
+#define OSD_PAD 8
+#define OSD_MARGIN 16
+#define OSD_PANEL_W (2 * OSD_PAD + OSD_COLS * OSD_CELL_W)
+#define OSD_PANEL_H (2 * OSD_PAD + OSD_LINES * OSD_LINE_H - 2 * OSD_SCALE)
+#define OSD_BG 0x80000000u
+#define OSD_FG 0xFFFFFFFFu
+
+/* Rows top to bottom, bit 4 is the leftmost column. Characters without an entry draw blank. */
+static const uint8_t osd_font[128][7] = {
+    ['0'] = {0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E}, ['1'] = {0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E},
+    ['2'] = {0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F}, ['3'] = {0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E},
+    ['4'] = {0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02}, ['5'] = {0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E},
+    ['6'] = {0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E}, ['7'] = {0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08},
+    ['8'] = {0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E}, ['9'] = {0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C},
+    ['A'] = {0x0E, 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11}, ['B'] = {0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E},
+    ['C'] = {0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E}, ['D'] = {0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C},
+    ['E'] = {0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F}, ['F'] = {0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10},
+    ['G'] = {0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F}, ['H'] = {0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11},
+    ['I'] = {0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E}, ['J'] = {0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C},
+    ['K'] = {0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11}, ['L'] = {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F},
+    ['M'] = {0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11}, ['N'] = {0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11},
+    ['O'] = {0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E}, ['P'] = {0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10},
+    ['Q'] = {0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D}, ['R'] = {0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11},
+    ['S'] = {0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E}, ['T'] = {0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04},
+    ['U'] = {0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E}, ['V'] = {0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04},
+    ['W'] = {0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A}, ['X'] = {0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11},
+    ['Y'] = {0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04}, ['Z'] = {0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F},
+    ['.'] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C}, [':'] = {0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00},
+    ['/'] = {0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00}, ['%'] = {0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03},
+    ['-'] = {0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00},
+};
+
+struct Osd {
+    int drm_fd;
+    DrmDisplay *display;
+    uint32_t plane_id;
+    struct DumbFB bufs[2];
+    /* What each buffer holds; a cell is drawn only when the new text differs from it. */
+    char shown[2][OSD_LINES][OSD_COLS];
+
+    guint64 updates;
+    guint64 posted;
+    guint64 unchanged;
+    guint64 busy;
+    guint64 cells_drawn;
+};
+
+static int crtc_index(int fd, uint32_t crtc_id) {
+    drmModeRes *res = drmModeGetResources(fd);
+    if (res == NULL) {
+        return -1;
+    }
+    int idx = -1;
+    for (int i = 0; i < res->count_crtcs; ++i) {
+        if (res->crtcs[i] == crtc_id) {
+            idx = i;
+            break;
+        }
+    }
+    drmModeFreeResources(res);
+    return idx;
+}
+
+static gboolean plane_supports_argb(const drmModePlane *p) {
+    for (uint32_t i = 0; i < p->count_formats; ++i) {
+        if (p->formats[i] == DRM_FORMAT_ARGB8888) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* First idle overlay plane on the CRTC that scans out ARGB; primary and cursor planes are left alone. */
+static uint32_t find_osd_plane(int fd, int crtc_idx, uint32_t video_plane_id) {
+    drmModePlaneRes *pres = drmModeGetPlaneResources(fd);
+    if (pres == NULL) {
+        return 0;
+    }
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < pres->count_planes && found == 0; ++i) {
+        uint32_t plane_id = pres->planes[i];
+        if (plane_id == video_plane_id) {
+            continue;
+        }
+        drmModePlane *p = drmModeGetPlane(fd, plane_id);
+        if (p == NULL) {
+            continue;
+        }
+        DrmPropInfo type;
+        gboolean overlay = drm_prop_lookup(fd, plane_id, DRM_MODE_OBJECT_PLANE, "type", &type) == 0 &&
+                           type.immutable_value == DRM_PLANE_TYPE_OVERLAY;
+        if (overlay && (p->possible_crtcs & (1u << crtc_idx)) != 0 && p->crtc_id == 0 && p->fb_id == 0 &&
+            plane_supports_argb(p)) {
+            found = plane_id;
+        }
+        drmModeFreePlane(p);
+    }
+    drmModeFreePlaneResources(pres);
+    return found;
+}
+
+static int plane_current_value(int fd, uint32_t plane_id, uint32_t prop_id, uint64_t *out) {
+    drmModeObjectProperties *props = drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+    if (props == NULL) {
+        return -1;
+    }
+    int ret = -1;
+    for (uint32_t i = 0; i < props->count_props; ++i) {
+        if (props->props[i] == prop_id) {
+            *out = props->prop_values[i];
+            ret = 0;
+            break;
+        }
+    }
+    drmModeFreeObjectProperties(props);
+    return ret;
+}
+
+/*
+ * The OSD has to end up above the video plane, which the modeset put at the
+ * top of its own range. If the OSD plane cannot go higher, the video plane
+ * steps down one instead.
+ */
+static int choose_zpos(int fd, uint32_t video_plane_id, DrmOverlayPlacement *pl) {
+    DrmPropInfo osd_z;
+    if (drm_prop_lookup(fd, pl->plane_id, DRM_MODE_OBJECT_PLANE, "zpos", &osd_z) != 0) {
+        // No zpos: the driver stacks by plane order, nothing to arrange.
+        return 0;
+    }
+    DrmPropInfo video_z;
+    uint64_t video_cur = 0;
+    if (drm_prop_lookup(fd, video_plane_id, DRM_MODE_OBJECT_PLANE, "zpos", &video_z) != 0 ||
+        plane_current_value(fd, video_plane_id, video_z.id, &video_cur) != 0) {
+        return 0;
+    }
+
+    gboolean osd_fixed = (osd_z.flags & DRM_MODE_PROP_IMMUTABLE) != 0;
+    if (osd_fixed) {
+        if (osd_z.immutable_value > video_cur) {
+            return 0;
+        }
+    } else if (osd_z.max > video_cur) {
+        pl->zpos_prop = osd_z.id;
+        pl->zpos = MAX(osd_z.min, video_cur + 1);
+        return 0;
+    }
+
+    uint64_t osd_top = osd_fixed ? osd_z.immutable_value : osd_z.max;
+    gboolean video_fixed = (video_z.flags & DRM_MODE_PROP_IMMUTABLE) != 0;
+    if (video_fixed || osd_top == 0 || osd_top - 1 < video_z.min) {
+        LOGW("OSD: plane %u cannot be stacked above video plane %u (zpos %" G_GUINT64_FORMAT ")", pl->plane_id,
+             video_plane_id, video_cur);
+        return -1;
+    }
+    if (!osd_fixed) {
+        pl->zpos_prop = osd_z.id;
+        pl->zpos = osd_top;
+    }
+    pl->video_zpos_prop = video_z.id;
+    pl->video_zpos = osd_top - 1;
+    return 0;
+}
+
+Osd *osd_new(int drm_fd, DrmDisplay *display, const ModesetResult *ms, const AppCfg *cfg) {
+    if (display == NULL || ms == NULL || cfg == NULL) {
+        return NULL;
+    }
+    uint32_t video_plane_id = ms->plane_id != 0 ? ms->plane_id : (uint32_t)cfg->plane_id;
+    DrmOverlayPlacement pl;
+    memset(&pl, 0, sizeof(pl));
+    if (cfg->osd_plane_id > 0) {
+        pl.plane_id = (uint32_t)cfg->osd_plane_id;
+    } else {
+        int idx = crtc_index(drm_fd, ms->crtc_id);
+        if (idx >= 0 && idx < 32) {
+            pl.plane_id = find_osd_plane(drm_fd, idx, video_plane_id);
+        }
+        if (pl.plane_id == 0) {
+            LOGW("OSD: no free ARGB overlay plane on CRTC %u", ms->crtc_id);
+            return NULL;
+        }
+    }
+
+    pl.w = MIN(OSD_PANEL_W, ms->mode_w);
+    pl.h = MIN(OSD_PANEL_H, ms->mode_h);
+    pl.x = MIN(OSD_MARGIN, ms->mode_w - pl.w);
+    pl.y = MIN(OSD_MARGIN, ms->mode_h - pl.h);
+    if (pl.w < OSD_PANEL_W || pl.h < OSD_PANEL_H) {
+        LOGW("OSD: %dx%d mode too small for the panel", ms->mode_w, ms->mode_h);
+        return NULL;
+    }
+    if (choose_zpos(drm_fd, video_plane_id, &pl) != 0) {
+        return NULL;
+    }
+
+    Osd *osd = g_new0(Osd, 1);
+    osd->drm_fd = drm_fd;
+    osd->display = display;
+    osd->plane_id = pl.plane_id;
+    for (int b = 0; b < 2; ++b) {
+        if (create_argb_fb(drm_fd, OSD_PANEL_W, OSD_PANEL_H, OSD_BG, &osd->bufs[b]) != 0) {
+            LOGW("OSD: failed to allocate %dx%d ARGB buffer", OSD_PANEL_W, OSD_PANEL_H);
+            osd_free(osd);
+            return NULL;
+        }
+        memset(osd->shown[b], ' ', sizeof(osd->shown[b]));
+    }
+    if (drm_display_set_overlay(display, &pl) != 0) {
+        osd_free(osd);
+        return NULL;
+    }
+    LOGI("OSD: plane %u, %dx%d at %d,%d%s", pl.plane_id, pl.w, pl.h, pl.x, pl.y,
+         pl.video_zpos_prop != 0 ? ", video plane lowered one zpos step" : "");
+    return osd;
+}
+
+void osd_free(Osd *osd) {
+    if (osd == NULL) {
+        return;
+    }
+    if (osd->updates > 0) {
+        LOGI("OSD: %" G_GUINT64_FORMAT " updates, %" G_GUINT64_FORMAT " posted, %" G_GUINT64_FORMAT
+             " unchanged, %" G_GUINT64_FORMAT " skipped while busy; %" G_GUINT64_FORMAT " cells (%" G_GUINT64_FORMAT
+             " px) drawn",
+             osd->updates, osd->posted, osd->unchanged, osd->busy, osd->cells_drawn,
+             osd->cells_drawn * OSD_CELL_W * OSD_CELL_H);
+    }
+    // Removing an fb that is still scanned out switches the plane off.
+    for (int b = 0; b < 2; ++b) {
+        if (osd->bufs[b].fb_id != 0) {
+            destroy_dumb_fb(osd->drm_fd, &osd->bufs[b]);
+        }
+    }
+    g_free(osd);
+}
+
+static void draw_cell(struct DumbFB *fb, int line, int col, char c) {
+    const uint8_t *glyph = osd_font[(unsigned char)c & 0x7f];
+    int x0 = OSD_PAD + col * OSD_CELL_W;
+    int y0 = OSD_PAD + line * OSD_LINE_H;
+    for (int y = 0; y < OSD_CELL_H; ++y) {
+        uint32_t *row = (uint32_t *)((uint8_t *)fb->map + (size_t)(y0 + y) * fb->pitch) + x0;
+        int gy = y / OSD_SCALE;
+        uint8_t bits = gy < 7 ? glyph[gy] : 0;
+        for (int x = 0; x < OSD_CELL_W; ++x) {
+            int gx = x / OSD_SCALE;
+            row[x] = (gx < 5 && (bits & (0x10u >> gx))) ? OSD_FG : OSD_BG;
+        }
+    }
+}
+
+static void format_line(char *out, const char *fmt, ...) {
+    char tmp[OSD_COLS + 1];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    n = CLAMP(n, 0, OSD_COLS);
+    memcpy(out, tmp, (size_t)n);
+    memset(out + n, ' ', (size_t)(OSD_COLS - n));
+}
+
+void osd_update(Osd *osd, const OsdValues *v) {
+    if (osd == NULL || v == NULL) {
+        return;
+    }
+    osd->updates++;
+
+    char text[OSD_LINES][OSD_COLS];
+    format_line(text[0], "RATE %6.2f MBIT/S", v->bitrate_mbps);
+    format_line(text[1], "LOSS %5.1f%% %6" G_GUINT64_FORMAT, v->loss_pct, v->lost_packets % 1000000u);
+    if (v->latency_ms >= 0.0) {
+        format_line(text[2], "LAT  %6.1f MS", v->latency_ms);
+    } else {
+        format_line(text[2], "LAT      -- MS");
+    }
+    format_line(text[3], "FPS  %6.1f", v->fps);
+
+    uint32_t on_screen = 0;
+    if (!drm_display_overlay_idle(osd->display, &on_screen)) {
+        osd->busy++;
+        return;
+    }
+    int front = -1;
+    for (int b = 0; b < 2; ++b) {
+        if (osd->bufs[b].fb_id == on_screen) {
+            front = b;
+        }
+    }
+    if (front >= 0 && memcmp(osd->shown[front], text, sizeof(text)) == 0) {
+        osd->unchanged++;
+        return;
+    }
+
+    // Only the span between the first and the last changed cell of a line is rewritten.
+    int back = front == 0 ? 1 : 0;
+    struct DumbFB *fb = &osd->bufs[back];
+    for (int line = 0; line < OSD_LINES; ++line) {
+        int first = 0;
+        int last = OSD_COLS - 1;
+        while (first <= last && osd->shown[back][line][first] == text[line][first]) {
+            first++;
+        }
+        while (last >= first && osd->shown[back][line][last] == text[line][last]) {
+            last--;
+        }
+        for (int col = first; col <= last; ++col) {
+            draw_cell(fb, line, col, text[line][col]);
+            osd->cells_drawn++;
+        }
+    }
+    memcpy(osd->shown[back], text, sizeof(text));
+    drm_display_post_overlay(osd->display, fb->fb_id);
+    osd->posted++;
+}
@@ -17,6 +17,8 @@
 #include <sys/resource.h>
 #include <string.h>
 
+#define OSD_INTERVAL_MS 500
+
 #define CHECK_ELEM(elem, name)                                                                      \
     do {                                                                                            \
         if ((elem) == NULL) {                                                                       \
@@ -126,11 +128,6 @@ static gpointer appsink_thread_func(gpointer data) {
     ps->appsink_thread_running = TRUE;
     g_mutex_unlock(&ps->lock);
 
-    size_t max_packet = video_decoder_max_packet_size(ps->decoder_initialized ? ps->decoder : NULL);
-    if (max_packet == 0) {
-        max_packet = 1024 * 1024;
-    }
-
     while (TRUE) {
         g_mutex_lock(&ps->lock);
         gboolean stop = ps->stop_requested;
@@ -153,21 +150,25 @@ static gpointer appsink_thread_func(gpointer data) {
             if (!GST_CLOCK_TIME_IS_VALID(pts)) {
                 pts = GST_BUFFER_DTS(buffer);
             }
-            GstMapInfo map;
-            if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
-                if (map.size > 0 && map.size <= max_packet) {
-                    g_mutex_lock(&ps->recorder_lock);
-                    VideoRecorder *recorder = ps->recorder;
-                    if (recorder != NULL) {
-                        video_recorder_handle_sample(recorder, sample, buffer, map.data, map.size);
-                    }
-                    g_mutex_unlock(&ps->recorder_lock);
-
-                    if (video_decoder_feed(ps->decoder, map.data, map.size, pts) != 0) {
-                        LOGV("Video decoder feed busy; retrying");
-                    }
+            if (gst_buffer_get_size(buffer) > 0) {
+                // The recorder and the pre-roll take their own reference; the helper ring one copy.
+                g_mutex_lock(&ps->recorder_lock);
+                VideoRecorder *recorder = ps->recorder;
+                if (recorder != NULL) {
+                    video_recorder_handle_sample(recorder, sample, buffer, NULL, 0);
+                } else if (ps->record_backlog != NULL) {
+                    // A new helper is taking the pre-roll; these follow it once it has.
+                    g_ptr_array_add(ps->record_backlog, gst_sample_ref(sample));
+                } else if (record_helper_is_running(ps->record_helper)) {
+                    record_helper_publish(ps->record_helper, sample, buffer);
+                } else if (ps->preroll != NULL) {
+                    record_preroll_push(ps->preroll, gst_sample_get_caps(sample), buffer);
+                }
+                g_mutex_unlock(&ps->recorder_lock);
+
+                if (video_decoder_feed_buffer(ps->decoder, buffer, pts) != 0) {
+                    LOGV("Video decoder feed busy; retrying");
                 }
-                gst_buffer_unmap(buffer, &map);
             }
         }
 
@@ -184,6 +185,60 @@ static gpointer appsink_thread_func(gpointer data) {
     return NULL;
 }
 
+/* Turns the receiver and display counters into per-interval rates for the OSD. */
+static gpointer osd_thread_func(gpointer data) {
+    PipelineState *ps = (PipelineState *)data;
+    DrmDisplay *display = video_decoder_display(ps->decoder);
+
+    UdpReceiverStats last_udp;
+    DrmDisplayStats last_disp;
+    udp_receiver_get_stats(ps->udp_receiver, &last_udp);
+    drm_display_get_stats(display, &last_disp);
+    gint64 last_us = g_get_monotonic_time();
+
+    g_mutex_lock(&ps->lock);
+    while (!ps->osd_stop) {
+        gint64 deadline = last_us + (gint64)OSD_INTERVAL_MS * G_TIME_SPAN_MILLISECOND;
+        while (!ps->osd_stop && g_cond_wait_until(&ps->osd_cond, &ps->lock, deadline)) {
+        }
+        if (ps->osd_stop) {
+            break;
+        }
+        g_mutex_unlock(&ps->lock);
+
+        UdpReceiverStats udp;
+        DrmDisplayStats disp;
+        udp_receiver_get_stats(ps->udp_receiver, &udp);
+        drm_display_get_stats(display, &disp);
+        gint64 now_us = g_get_monotonic_time();
+        double dt = (double)(now_us - last_us) / 1e6;
+
+        guint64 packets = udp.packets - last_udp.packets;
+        guint64 lost = udp.lost_packets - last_udp.lost_packets;
+        guint64 frames = 0;
+        guint64 latency_ns = 0;
+        for (int m = 0; m < DRM_PRESENT_MODE_COUNT; ++m) {
+            frames += disp.flip_latency_frames[m] - last_disp.flip_latency_frames[m];
+            latency_ns += disp.flip_latency_ns[m] - last_disp.flip_latency_ns[m];
+        }
+        OsdValues v = {
+            .bitrate_mbps = dt > 0 ? (double)(udp.bytes - last_udp.bytes) * 8.0 / dt / 1e6 : 0.0,
+            .loss_pct = packets + lost ? 100.0 * (double)lost / (double)(packets + lost) : 0.0,
+            .lost_packets = udp.lost_packets,
+            .latency_ms = frames ? (double)latency_ns / (double)frames / 1e6 : -1.0,
+            .fps = dt > 0 ? (double)(disp.frames_presented - last_disp.frames_presented) / dt : 0.0,
+        };
+        osd_update(ps->osd, &v);
+
+        last_udp = udp;
+        last_disp = disp;
+        last_us = now_us;
+        g_mutex_lock(&ps->lock);
+    }
+    g_mutex_unlock(&ps->lock);
+    return NULL;
+}
+
 static gpointer bus_thread_func(gpointer data) {
     PipelineState *ps = (PipelineState *)data;
     GstBus *bus = gst_element_get_bus(ps->pipeline);
@@ -251,7 +306,12 @@ static gpointer bus_thread_func(gpointer data) {
     return NULL;
 }
 
-int pipeline_start(const AppCfg *cfg, const ModesetResult *ms, int drm_fd, PipelineState *ps) {
+static RecordPreroll *new_preroll(const RecordCfg *cfg) {
+    gsize max_bytes = (gsize)MAX(cfg->preroll_mb, 1) * 1024u * 1024u;
+    return record_preroll_new((guint)cfg->preroll_s, max_bytes);
+}
+
+int pipeline_start(const AppCfg *cfg, const ModesetResult *ms, int head_count, int drm_fd, PipelineState *ps) {
     if (cfg == NULL || ms == NULL || ps == NULL) {
         return -1;
     }
@@ -267,6 +327,7 @@ int pipeline_start(const AppCfg *cfg, const ModesetResult *ms, int drm_fd, Pipel
         g_mutex_init(&ps->lock);
         g_mutex_init(&ps->recorder_lock);
         g_cond_init(&ps->cond);
+        g_cond_init(&ps->osd_cond);
         ps->initialized = TRUE;
     }
 
@@ -280,6 +341,18 @@ int pipeline_start(const AppCfg *cfg, const ModesetResult *ms, int drm_fd, Pipel
     ps->appsink_thread_running = FALSE;
     ps->stop_requested = FALSE;
     ps->encountered_error = FALSE;
+    ps->osd = NULL;
+    ps->osd_thread = NULL;
+    ps->osd_stop = FALSE;
+
+    if (cfg->record.preroll_s > 0) {
+        RecordPreroll *preroll = new_preroll(&cfg->record);
+        g_mutex_lock(&ps->recorder_lock);
+        ps->preroll = preroll;
+        g_mutex_unlock(&ps->recorder_lock);
+        LOGI("record: keeping the last %d s (up to %d MB) for instant replay", cfg->record.preroll_s,
+             MAX(cfg->record.preroll_mb, 1));
+    }
 
     GstElement *pipeline = gst_pipeline_new("pixelpilot_stripped_rk");
     CHECK_ELEM(pipeline, "pipeline");
@@ -398,18 +471,40 @@ int pipeline_start(const AppCfg *cfg, const ModesetResult *ms, int drm_fd, Pipel
         }
     }
 
-    if (video_decoder_init(ps->decoder, cfg, ms, drm_fd) != 0) {
+    if (ps->frame_pools == NULL) {
+        ps->frame_pools = frame_pool_cache_new(drm_fd);
+        if (ps->frame_pools == NULL) {
+            LOGW("Frame pool cache unavailable; the decoder will allocate its own");
+        }
+    }
+
+    if (video_decoder_init(ps->decoder, cfg, ms, head_count, drm_fd, ps->frame_pools) != 0) {
         LOGE("Failed to initialise video decoder");
         goto fail;
     }
     ps->decoder_initialized = TRUE;
 
+    // The overlay plane has to be attached before the display thread starts committing.
+    if (cfg->osd) {
+        ps->osd = osd_new(drm_fd, video_decoder_display(ps->decoder), ms, cfg);
+        if (ps->osd == NULL) {
+            LOGW("OSD unavailable; continuing without it");
+        }
+    }
+
     if (video_decoder_start(ps->decoder) != 0) {
         LOGE("Failed to start video decoder");
         goto fail;
     }
     ps->decoder_running = TRUE;
 
+    if (ps->osd != NULL) {
+        ps->osd_thread = g_thread_new("osd", osd_thread_func, ps);
+        if (ps->osd_thread == NULL) {
+            LOGW("Failed to create OSD thread; continuing without it");
+        }
+    }
+
     ps->appsink_thread = g_thread_new("appsink-thread", appsink_thread_func, ps);
     if (ps->appsink_thread == NULL) {
         LOGE("Failed to create appsink thread");
@@ -498,6 +593,15 @@ static void cleanup_pipeline(PipelineState *ps) {
         g_thread_join(ps->bus_thread);
         ps->bus_thread = NULL;
     }
+    // Reads the receiver and display counters, so it goes first.
+    if (ps->osd_thread != NULL) {
+        g_mutex_lock(&ps->lock);
+        ps->osd_stop = TRUE;
+        g_cond_broadcast(&ps->osd_cond);
+        g_mutex_unlock(&ps->lock);
+        g_thread_join(ps->osd_thread);
+        ps->osd_thread = NULL;
+    }
 
     if (ps->udp_receiver != NULL) {
         udp_receiver_destroy(ps->udp_receiver);
@@ -524,14 +628,28 @@ static void cleanup_pipeline(PipelineState *ps) {
         video_decoder_free(ps->decoder);
         ps->decoder = NULL;
     }
+    // Only once the display is gone: its last commit may still scan out an OSD buffer.
+    osd_free(ps->osd);
+    ps->osd = NULL;
 
     g_mutex_lock(&ps->recorder_lock);
     VideoRecorder *rec = ps->recorder;
     ps->recorder = NULL;
+    RecordHelper *helper = ps->record_helper;
+    ps->record_helper = NULL;
+    GPtrArray *backlog = ps->record_backlog;
+    ps->record_backlog = NULL;
+    RecordPreroll *preroll = ps->preroll;
+    ps->preroll = NULL;
     g_mutex_unlock(&ps->recorder_lock);
+    if (backlog != NULL) {
+        g_ptr_array_unref(backlog);
+    }
     if (rec != NULL) {
         video_recorder_free(rec);
     }
+    record_helper_stop(helper);
+    record_preroll_free(preroll);
 }
 
 void pipeline_poll_child(PipelineState *ps) {
@@ -560,6 +678,79 @@ void pipeline_poll_child(PipelineState *ps) {
     }
 }
 
+static int enable_recording_helper(PipelineState *ps, const RecordCfg *cfg) {
+    g_mutex_lock(&ps->recorder_lock);
+    gboolean recording =
+        ps->recorder != NULL || ps->record_backlog != NULL || record_helper_is_running(ps->record_helper);
+    // A helper that died is replaced; its ring has nothing left worth reading.
+    RecordHelper *dead = recording ? NULL : ps->record_helper;
+    if (!recording) {
+        ps->record_helper = NULL;
+    }
+    g_mutex_unlock(&ps->recorder_lock);
+    record_helper_stop(dead);
+    if (recording) {
+        return 0;
+    }
+
+    RecordPreroll *fresh = cfg->preroll_s > 0 ? new_preroll(cfg) : NULL;
+    RecordHelper *helper = record_helper_start(cfg);
+    if (helper == NULL) {
+        record_preroll_free(fresh);
+        return -1;
+    }
+
+    g_mutex_lock(&ps->recorder_lock);
+    if (ps->record_helper != NULL || ps->recorder != NULL || ps->record_backlog != NULL) {
+        g_mutex_unlock(&ps->recorder_lock);
+        record_helper_stop(helper);
+        record_preroll_free(fresh);
+        return 0;
+    }
+    // Recording counts as active from the spawn on, not only once the helper has caught up.
+    ps->record_helper_starting = helper;
+    // Copying the pre-roll into the ring takes a while: swap it out, and hold live AUs back meanwhile.
+    RecordPreroll *preroll = ps->preroll;
+    if (preroll != NULL) {
+        ps->preroll = fresh;
+        fresh = NULL;
+    }
+    ps->record_backlog = g_ptr_array_new_with_free_func((GDestroyNotify)gst_sample_unref);
+    g_mutex_unlock(&ps->recorder_lock);
+    record_preroll_free(fresh);
+
+    record_helper_prime(helper, preroll);
+    record_preroll_free(preroll);
+
+    // The lock is only taken to swap the backlog; the helper goes in once there is nothing left to hand over.
+    for (;;) {
+        g_mutex_lock(&ps->recorder_lock);
+        GPtrArray *backlog = ps->record_backlog;
+        if (backlog == NULL) {
+            // Recording was stopped meanwhile.
+            ps->record_helper_starting = NULL;
+            g_mutex_unlock(&ps->recorder_lock);
+            record_helper_stop(helper);
+            return 0;
+        }
+        if (backlog->len == 0) {
+            ps->record_backlog = NULL;
+            ps->record_helper = helper;
+            ps->record_helper_starting = NULL;
+            g_mutex_unlock(&ps->recorder_lock);
+            g_ptr_array_unref(backlog);
+            return 0;
+        }
+        ps->record_backlog = g_ptr_array_new_with_free_func((GDestroyNotify)gst_sample_unref);
+        g_mutex_unlock(&ps->recorder_lock);
+        for (guint i = 0; i < backlog->len; ++i) {
+            GstSample *sample = g_ptr_array_index(backlog, i);
+            record_helper_publish(helper, sample, gst_sample_get_buffer(sample));
+        }
+        g_ptr_array_unref(backlog);
+    }
+}
+
 int pipeline_enable_recording(PipelineState *ps, const RecordCfg *cfg) {
     if (ps == NULL || cfg == NULL) {
         return -1;
@@ -570,6 +761,9 @@ int pipeline_enable_recording(PipelineState *ps, const RecordCfg *cfg) {
 
     RecordCfg local_cfg = *cfg;
     local_cfg.enable = 1;
+    if (local_cfg.helper) {
+        return enable_recording_helper(ps, &local_cfg);
+    }
 
     VideoRecorder *rec = video_recorder_new(&local_cfg);
     if (rec == NULL) {
@@ -582,6 +776,8 @@ int pipeline_enable_recording(PipelineState *ps, const RecordCfg *cfg) {
         video_recorder_free(rec);
         return 0;
     }
+    // The file starts with what the ring holds, from its oldest keyframe on.
+    video_recorder_prime(rec, ps->preroll);
     ps->recorder = rec;
     g_mutex_unlock(&ps->recorder_lock);
     return 0;
@@ -595,11 +791,20 @@ void pipeline_disable_recording(PipelineState *ps) {
     g_mutex_lock(&ps->recorder_lock);
     VideoRecorder *rec = ps->recorder;
     ps->recorder = NULL;
+    RecordHelper *helper = ps->record_helper;
+    ps->record_helper = NULL;
+    // A helper still being primed notices and stops itself.
+    GPtrArray *backlog = ps->record_backlog;
+    ps->record_backlog = NULL;
     g_mutex_unlock(&ps->recorder_lock);
 
+    if (backlog != NULL) {
+        g_ptr_array_unref(backlog);
+    }
     if (rec != NULL) {
         video_recorder_free(rec);
     }
+    record_helper_stop(helper);
 }
 
 int pipeline_get_recording_stats(const PipelineState *ps, PipelineRecordingStats *stats) {
@@ -618,8 +823,53 @@ int pipeline_get_recording_stats(const PipelineState *ps, PipelineRecordingStats
         stats->bytes_written = vr_stats.bytes_written;
         stats->elapsed_ns = vr_stats.elapsed_ns;
         stats->media_duration_ns = vr_stats.media_duration_ns;
+        stats->queue_depth = vr_stats.queue_depth;
+        stats->dropped_aus = vr_stats.dropped_aus;
+        stats->write_latency_avg_ns = vr_stats.write_latency_avg_ns;
+        stats->write_latency_max_ns = vr_stats.write_latency_max_ns;
         g_strlcpy(stats->output_path, vr_stats.output_path, sizeof(stats->output_path));
+    } else if (ps->record_helper != NULL || ps->record_helper_starting != NULL) {
+        VideoRecorderStats vr_stats;
+        record_helper_get_stats(ps->record_helper != NULL ? ps->record_helper : ps->record_helper_starting,
+                                &vr_stats);
+        stats->active = vr_stats.active ? TRUE : FALSE;
+        stats->elapsed_ns = vr_stats.elapsed_ns;
+        stats->dropped_aus = vr_stats.dropped_aus;
     }
     g_mutex_unlock((GMutex *)&ps->recorder_lock);
     return 0;
 }
+
+int pipeline_get_decoder_stats(const PipelineState *ps, VideoDecoderStats *stats) {
+    if (ps == NULL || stats == NULL) {
+        return -1;
+    }
+    if (!ps->decoder_initialized || ps->decoder == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return -1;
+    }
+    video_decoder_get_stats(ps->decoder, stats);
+    return 0;
+}
+
+void pipeline_display_hold(PipelineState *ps) {
+    if (ps == NULL || !ps->decoder_initialized || ps->decoder == NULL) {
+        return;
+    }
+    video_decoder_display_hold(ps->decoder);
+}
+
+void pipeline_display_rebind(PipelineState *ps, const ModesetResult *ms, int head_count) {
+    if (ps == NULL || ms == NULL || !ps->decoder_initialized || ps->decoder == NULL) {
+        return;
+    }
+    video_decoder_display_rebind(ps->decoder, ms, head_count);
+}
+
+void pipeline_release_frame_pools(PipelineState *ps) {
+    if (ps == NULL || ps->state != PIPELINE_STOPPED) {
+        return;
+    }
+    frame_pool_cache_free(ps->frame_pools);
+    ps->frame_pools = NULL;
+}
@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+
+#include "record_helper.h"
+
+#include "logging.h"
+#include "record_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* The ring holds at least this much, and twice the pre-roll so it can be handed over whole. */
+#define RECORD_HELPER_RING_MIN_BYTES (32u * 1024u * 1024u)
+#define RECORD_HELPER_RING_SLOTS 8192u
+/* How often the helper looks whether the main process is still there while no AU comes in. */
+#define RECORD_HELPER_POLL_MS 200
+#define RECORD_HELPER_FINALIZE_MS 60000
+
+struct RecordHelper {
+    RecordRing *ring;
+    GPid pid;
+    /* One reference for the pipeline's handle, one for the reaper thread. */
+    gint refs;
+    gint exited;
+    guint64 start_time_ns;
+};
+
+/* Helpers whose process has not been reaped yet. */
+static GMutex helpers_lock;
+static GCond helpers_cond;
+static guint helpers_running;
+
+static void helper_unref(RecordHelper *helper) {
+    if (g_atomic_int_dec_and_test(&helper->refs)) {
+        record_ring_free(helper->ring);
+        g_free(helper);
+    }
+}
+
+static gpointer reaper_thread_func(gpointer data) {
+    RecordHelper *helper = (RecordHelper *)data;
+    int status = 0;
+    pid_t rc;
+    while ((rc = waitpid(helper->pid, &status, 0)) < 0 && errno == EINTR) {
+    }
+    if (rc < 0) {
+        LOGW("record: cannot wait for the recorder helper (pid %d): %s", helper->pid, g_strerror(errno));
+    } else if (WIFSIGNALED(status)) {
+        LOGE("record: recorder helper (pid %d) died from signal %d; the live video carries on", helper->pid,
+             WTERMSIG(status));
+    } else if (WEXITSTATUS(status) != 0) {
+        LOGW("record: recorder helper (pid %d) exited with status %d", helper->pid, WEXITSTATUS(status));
+    } else {
+        LOGI("record: recorder helper (pid %d) finished", helper->pid);
+    }
+    g_atomic_int_set(&helper->exited, TRUE);
+    helper_unref(helper);
+
+    g_mutex_lock(&helpers_lock);
+    helpers_running--;
+    g_cond_broadcast(&helpers_cond);
+    g_mutex_unlock(&helpers_lock);
+    return NULL;
+}
+
+/* Runs in the child between fork and exec, where g_spawn has marked every descriptor close-on-exec. */
+static void keep_ring_descriptors(gpointer data) {
+    const int *fds = (const int *)data;
+    for (int i = 0; i < 2; ++i) {
+        int flags = fcntl(fds[i], F_GETFD);
+        if (flags >= 0) {
+            fcntl(fds[i], F_SETFD, flags & ~FD_CLOEXEC);
+        }
+    }
+}
+
+RecordHelper *record_helper_start(const RecordCfg *cfg) {
+    if (cfg == NULL) {
+        return NULL;
+    }
+    gsize ring_bytes = RECORD_HELPER_RING_MIN_BYTES;
+    if (cfg->preroll_s > 0) {
+        ring_bytes = MAX(ring_bytes, (gsize)MAX(cfg->preroll_mb, 1) * 2u * 1024u * 1024u);
+    }
+    RecordRing *ring = record_ring_new(ring_bytes, RECORD_HELPER_RING_SLOTS, cfg);
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    GError *error = NULL;
+    gchar *exe = g_file_read_link("/proc/self/exe", &error);
+    if (exe == NULL) {
+        LOGE("record: cannot find the executable for the recorder helper: %s",
+             error != NULL ? error->message : "unknown error");
+        g_clear_error(&error);
+        record_ring_free(ring);
+        return NULL;
+    }
+    int fds[2] = {record_ring_get_fd(ring), record_ring_get_event_fd(ring)};
+    gchar *fd_arg = g_strdup_printf("%d", fds[0]);
+    gchar *event_arg = g_strdup_printf("%d", fds[1]);
+    gchar *argv[] = {exe, (gchar *)RECORD_HELPER_ARG, fd_arg, event_arg, NULL};
+    // The child inherits the signal mask: SIGINT/SIGTERM stay with the main process, which closes the ring.
+    GPid pid = 0;
+    gboolean spawned = g_spawn_async(NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, keep_ring_descriptors, fds, &pid,
+                                     &error);
+    g_free(fd_arg);
+    g_free(event_arg);
+    g_free(exe);
+    if (!spawned) {
+        LOGE("record: cannot start the recorder helper: %s", error != NULL ? error->message : "unknown error");
+        g_clear_error(&error);
+        record_ring_free(ring);
+        return NULL;
+    }
+
+    RecordHelper *helper = g_new0(RecordHelper, 1);
+    helper->ring = ring;
+    helper->pid = pid;
+    helper->refs = 2;
+    helper->start_time_ns = (guint64)g_get_monotonic_time() * 1000u;
+
+    g_mutex_lock(&helpers_lock);
+    helpers_running++;
+    g_mutex_unlock(&helpers_lock);
+    GThread *reaper = g_thread_try_new("record-reaper", reaper_thread_func, helper, NULL);
+    if (reaper == NULL) {
+        LOGE("record: failed to start the reaper thread; stopping the recorder helper");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        g_mutex_lock(&helpers_lock);
+        helpers_running--;
+        g_mutex_unlock(&helpers_lock);
+        record_ring_free(ring);
+        g_free(helper);
+        return NULL;
+    }
+    g_thread_unref(reaper);
+
+    LOGI("record: recording in helper process %d through a %.0f MB AU ring", pid, ring_bytes / (1024.0 * 1024.0));
+    return helper;
+}
+
+void record_helper_publish(RecordHelper *helper, GstSample *sample, GstBuffer *buffer) {
+    if (helper == NULL || buffer == NULL || g_atomic_int_get(&helper->exited)) {
+        return;
+    }
+    record_ring_publish(helper->ring, sample != NULL ? gst_sample_get_caps(sample) : NULL, buffer);
+}
+
+void record_helper_prime(RecordHelper *helper, RecordPreroll *preroll) {
+    if (helper == NULL || preroll == NULL) {
+        return;
+    }
+    guint64 span_ns = 0;
+    gsize bytes = 0;
+    guint count = record_preroll_get_depth(preroll, &bytes, &span_ns);
+    if (count == 0) {
+        return;
+    }
+    GstCaps *caps = record_preroll_get_caps(preroll);
+    GstBuffer *buffer;
+    while ((buffer = record_preroll_pop(preroll)) != NULL) {
+        record_ring_publish(helper->ring, caps, buffer);
+        gst_buffer_unref(buffer);
+    }
+    if (caps != NULL) {
+        gst_caps_unref(caps);
+    }
+    LOGI("record: starting with %u AUs (%.1f s, %.1f MB) of pre-roll", count, span_ns / 1e9,
+         bytes / (1024.0 * 1024.0));
+}
+
+void record_helper_stop(RecordHelper *helper) {
+    if (helper == NULL) {
+        return;
+    }
+    RecordRingStats stats;
+    record_ring_get_stats(helper->ring, &stats);
+    if (stats.rejected > 0) {
+        LOGW("record: the AU ring turned away %" G_GUINT64_FORMAT " AUs (too large, or in a GOP that lost one)",
+             stats.rejected);
+    }
+    record_ring_close(helper->ring);
+    record_ring_free(helper->ring);
+    helper->ring = NULL;
+    helper_unref(helper);
+}
+
+gboolean record_helper_is_running(const RecordHelper *helper) {
+    return helper != NULL && !g_atomic_int_get((gint *)&helper->exited);
+}
+
+void record_helper_get_stats(const RecordHelper *helper, VideoRecorderStats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    memset(stats, 0, sizeof(*stats));
+    if (helper == NULL) {
+        return;
+    }
+    // Bytes and file names stay in the helper; the ring tells what it lost.
+    RecordRingStats ring_stats;
+    record_ring_get_stats(helper->ring, &ring_stats);
+    stats->active = record_helper_is_running(helper);
+    stats->dropped_aus = ring_stats.skipped + ring_stats.rejected;
+    guint64 now_ns = (guint64)g_get_monotonic_time() * 1000u;
+    stats->elapsed_ns = now_ns > helper->start_time_ns ? now_ns - helper->start_time_ns : 0;
+}
+
+gboolean record_helper_wait_exited(guint timeout_ms) {
+    gint64 deadline = g_get_monotonic_time() + (gint64)timeout_ms * G_TIME_SPAN_MILLISECOND;
+    g_mutex_lock(&helpers_lock);
+    while (helpers_running > 0) {
+        if (!g_cond_wait_until(&helpers_cond, &helpers_lock, deadline)) {
+            break;
+        }
+    }
+    gboolean done = helpers_running == 0;
+    g_mutex_unlock(&helpers_lock);
+    return done;
+}
+
+int record_helper_main(int argc, char **argv) {
+    if (argc < 4) {
+        LOGE("%s needs the AU ring and its eventfd", RECORD_HELPER_ARG);
+        return 2;
+    }
+    int fd = atoi(argv[2]);
+    int event_fd = atoi(argv[3]);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(event_fd, F_SETFD, FD_CLOEXEC);
+
+    gst_init(NULL, NULL);
+    RecordRing *ring = record_ring_attach(fd, event_fd);
+    if (ring == NULL) {
+        return 1;
+    }
+    RecordCfg cfg = *record_ring_get_cfg(ring);
+    cfg.enable = 1;
+    pid_t parent = getppid();
+
+    VideoRecorder *rec = video_recorder_new(&cfg);
+    if (rec == NULL) {
+        record_ring_free(ring);
+        return 1;
+    }
+
+    GstCaps *caps = NULL;
+    guint64 aus = 0;
+    for (;;) {
+        GstBuffer *buffer = NULL;
+        GstCaps *new_caps = NULL;
+        int rc = record_ring_next(ring, &buffer, &new_caps, RECORD_HELPER_POLL_MS);
+        if (rc < 0) {
+            break;
+        }
+        if (rc == 0) {
+            if (getppid() != parent) {
+                LOGW("record: the main process is gone; finishing the recording");
+                break;
+            }
+            continue;
+        }
+        if (new_caps != NULL) {
+            if (caps != NULL) {
+                gst_caps_unref(caps);
+            }
+            caps = new_caps;
+        }
+        GstSample *sample = gst_sample_new(buffer, caps, NULL, NULL);
+        video_recorder_handle_sample(rec, sample, buffer, NULL, 0);
+        gst_sample_unref(sample);
+        gst_buffer_unref(buffer);
+        aus++;
+    }
+
+    RecordRingStats stats;
+    record_ring_get_stats(ring, &stats);
+    LOGI("record: helper took %" G_GUINT64_FORMAT " AUs from the ring; %" G_GUINT64_FORMAT " overrun(s), %"
+         G_GUINT64_FORMAT " AUs skipped", aus, stats.overruns, stats.skipped);
+    record_ring_free(ring);
+    if (caps != NULL) {
+        gst_caps_unref(caps);
+    }
+
+    video_recorder_free(rec);
+    if (!video_recorder_wait_finalized(RECORD_HELPER_FINALIZE_MS)) {
+        LOGE("record: helper gave up waiting for the recording to be finalised");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+
+#include "record_io.h"
+
+#include "logging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RECORD_IO_BLOCK (1u << 20)
+#define RECORD_IO_BLOCKS 4
+/* Covers the logical block size of SD cards and the page size; O_DIRECT needs both offset and length aligned. */
+#define RECORD_IO_ALIGN 4096u
+#define RECORD_IO_PREALLOC (64ll << 20)
+
+struct IoBlock {
+    guint8 *data;
+    int64_t offset;
+    size_t len;
+};
+
+struct RecordIo {
+    gchar *path;
+    int fd;
+    /* Unaligned positioned writes cannot go through the O_DIRECT descriptor. */
+    int patch_fd;
+    gboolean direct;
+    gboolean prealloc;
+    int64_t prealloc_end;
+
+    struct IoBlock blocks[RECORD_IO_BLOCKS];
+    /* The block being filled covers [cur->offset, cur->offset + RECORD_IO_BLOCK); cur_fill bytes are valid. */
+    struct IoBlock *cur;
+    size_t cur_fill;
+    int64_t end;
+
+    GAsyncQueue *free_q;
+    GAsyncQueue *full_q;
+    GThread *thread;
+    gint failed;
+
+    GMutex lock;
+    GCond idle;
+    guint in_flight;
+    RecordIoStats stats;
+};
+
+/* Pushed to full_q to stop the I/O thread. */
+static struct IoBlock io_stop_block;
+
+static guint64 monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (guint64)ts.tv_sec * 1000000000ull + (guint64)ts.tv_nsec;
+}
+
+static int pwrite_all(int fd, const guint8 *data, size_t len, int64_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, (off_t)offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int write_block(RecordIo *io, const struct IoBlock *b) {
+    if (pwrite_all(io->fd, b->data, b->len, b->offset) == 0) {
+        return 0;
+    }
+    if (errno != EINVAL || !io->direct) {
+        return -1;
+    }
+    // Some filesystems accept O_DIRECT at open and refuse it on write; carry on through the page cache.
+    int flags = fcntl(io->fd, F_GETFL);
+    if (flags < 0 || fcntl(io->fd, F_SETFL, flags & ~O_DIRECT) != 0) {
+        return -1;
+    }
+    LOGW("record: %s refuses direct writes; using buffered I/O", io->path);
+    g_mutex_lock(&io->lock);
+    io->direct = FALSE;
+    io->stats.direct = FALSE;
+    g_mutex_unlock(&io->lock);
+    return pwrite_all(io->fd, b->data, b->len, b->offset);
+}
+
+static gpointer io_thread_func(gpointer data) {
+    RecordIo *io = (RecordIo *)data;
+    while (TRUE) {
+        struct IoBlock *b = g_async_queue_pop(io->full_q);
+        if (b == &io_stop_block) {
+            break;
+        }
+        guint64 t0 = monotonic_ns();
+        gboolean ok = g_atomic_int_get(&io->failed) == 0 && write_block(io, b) == 0;
+        guint64 took = monotonic_ns() - t0;
+        if (!ok && !g_atomic_int_get(&io->failed)) {
+            LOGE("record: write of %zu bytes at %" G_GINT64_FORMAT " failed: %s", b->len, b->offset,
+                 g_strerror(errno));
+            g_atomic_int_set(&io->failed, 1);
+        }
+
+        g_mutex_lock(&io->lock);
+        if (ok) {
+            io->stats.blocks++;
+            io->stats.block_bytes += b->len;
+            io->stats.write_ns += took;
+            io->stats.write_max_ns = MAX(io->stats.write_max_ns, took);
+        }
+        io->in_flight--;
+        g_cond_broadcast(&io->idle);
+        g_mutex_unlock(&io->lock);
+        g_async_queue_push(io->free_q, b);
+    }
+    return NULL;
+}
+
+static void acquire_block(RecordIo *io, int64_t offset) {
+    struct IoBlock *b = g_async_queue_try_pop(io->free_q);
+    if (b == NULL) {
+        g_mutex_lock(&io->lock);
+        io->stats.stalls++;
+        g_mutex_unlock(&io->lock);
+        b = g_async_queue_pop(io->free_q);
+    }
+    b->offset = offset;
+    b->len = 0;
+    io->cur = b;
+    io->cur_fill = 0;
+}
+
+/* Hands the current block to the I/O thread; a partial block is zero-padded to the alignment. */
+static void submit_block(RecordIo *io, size_t len) {
+    struct IoBlock *b = io->cur;
+    size_t padded = io->direct ? (len + RECORD_IO_ALIGN - 1) & ~(size_t)(RECORD_IO_ALIGN - 1) : len;
+    if (padded > len) {
+        memset(b->data + len, 0, padded - len);
+    }
+    b->len = padded;
+    g_mutex_lock(&io->lock);
+    io->in_flight++;
+    g_mutex_unlock(&io->lock);
+    io->cur = NULL;
+    g_async_queue_push(io->full_q, b);
+}
+
+static void wait_idle(RecordIo *io) {
+    g_mutex_lock(&io->lock);
+    while (io->in_flight > 0) {
+        g_cond_wait(&io->idle, &io->lock);
+    }
+    g_mutex_unlock(&io->lock);
+}
+
+/* Positioned write outside the block stream, once nothing in flight can overwrite it. */
+static int patch_write(RecordIo *io, int64_t offset, const guint8 *data, size_t size) {
+    wait_idle(io);
+    if (g_atomic_int_get(&io->failed)) {
+        return -1;
+    }
+    int fd = io->fd;
+    if (io->direct) {
+        if (io->patch_fd < 0) {
+            io->patch_fd = open(io->path, O_WRONLY | O_CLOEXEC);
+            if (io->patch_fd < 0) {
+                LOGE("record: failed to reopen %s for patching: %s", io->path, g_strerror(errno));
+                g_atomic_int_set(&io->failed, 1);
+                return -1;
+            }
+        }
+        fd = io->patch_fd;
+    }
+    if (pwrite_all(fd, data, size, offset) != 0) {
+        LOGE("record: patch of %zu bytes at %" G_GINT64_FORMAT " failed: %s", size, offset, g_strerror(errno));
+        g_atomic_int_set(&io->failed, 1);
+        return -1;
+    }
+    g_mutex_lock(&io->lock);
+    io->stats.patches++;
+    g_mutex_unlock(&io->lock);
+    return 0;
+}
+
+static void preallocate(RecordIo *io) {
+    while (io->prealloc && io->end + (int64_t)RECORD_IO_BLOCK * RECORD_IO_BLOCKS > io->prealloc_end) {
+        if (fallocate(io->fd, FALLOC_FL_KEEP_SIZE, (off_t)io->prealloc_end, (off_t)RECORD_IO_PREALLOC) != 0) {
+            LOGI("record: no extent preallocation on %s (%s)", io->path, g_strerror(errno));
+            io->prealloc = FALSE;
+            g_mutex_lock(&io->lock);
+            io->stats.preallocating = FALSE;
+            g_mutex_unlock(&io->lock);
+            return;
+        }
+        io->prealloc_end += RECORD_IO_PREALLOC;
+    }
+}
+
+RecordIo *record_io_open(const char *path) {
+    if (path == NULL) {
+        return NULL;
+    }
+    RecordIo *io = g_new0(RecordIo, 1);
+    io->path = g_strdup(path);
+    io->patch_fd = -1;
+    io->direct = TRUE;
+    io->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+    if (io->fd < 0 && errno == EINVAL) {
+        io->direct = FALSE;
+        io->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (io->fd < 0) {
+        LOGE("record: failed to open %s: %s", path, g_strerror(errno));
+        g_free(io->path);
+        g_free(io);
+        return NULL;
+    }
+
+    g_mutex_init(&io->lock);
+    g_cond_init(&io->idle);
+    io->free_q = g_async_queue_new();
+    io->full_q = g_async_queue_new();
+    for (int i = 0; i < RECORD_IO_BLOCKS; ++i) {
+        void *mem = NULL;
+        if (posix_memalign(&mem, RECORD_IO_ALIGN, RECORD_IO_BLOCK) != 0) {
+            LOGE("record: failed to allocate I/O blocks");
+            g_atomic_int_set(&io->failed, 1);
+            record_io_close(io, NULL);
+            return NULL;
+        }
+        io->blocks[i].data = mem;
+        g_async_queue_push(io->free_q, &io->blocks[i]);
+    }
+    io->thread = g_thread_try_new("record-io", io_thread_func, io, NULL);
+    if (io->thread == NULL) {
+        LOGE("record: failed to start I/O thread");
+        g_atomic_int_set(&io->failed, 1);
+        record_io_close(io, NULL);
+        return NULL;
+    }
+
+    io->prealloc = TRUE;
+    io->stats.direct = io->direct;
+    io->stats.preallocating = TRUE;
+    acquire_block(io, 0);
+    return io;
+}
+
+int record_io_write(RecordIo *io, int64_t offset, const void *data, size_t size) {
+    if (io == NULL || data == NULL || offset < 0 || g_atomic_int_get(&io->failed)) {
+        return -1;
+    }
+    const guint8 *p = (const guint8 *)data;
+    io->end = MAX(io->end, offset + (int64_t)size);
+    preallocate(io);
+
+    while (size > 0) {
+        struct IoBlock *b = io->cur;
+        if (offset < b->offset) {
+            // Behind the blocks handed off already: minimp4 patching a box size.
+            size_t n = (size_t)MIN((int64_t)size, b->offset - offset);
+            if (patch_write(io, offset, p, n) != 0) {
+                return -1;
+            }
+            p += n;
+            offset += (int64_t)n;
+            size -= n;
+            continue;
+        }
+        size_t at = (size_t)(offset - b->offset);
+        if (at >= RECORD_IO_BLOCK) {
+            // Skipped ahead: what was never written reads as zeros.
+            memset(b->data + io->cur_fill, 0, RECORD_IO_BLOCK - io->cur_fill);
+            submit_block(io, RECORD_IO_BLOCK);
+            acquire_block(io, b->offset + RECORD_IO_BLOCK);
+            continue;
+        }
+        if (at > io->cur_fill) {
+            memset(b->data + io->cur_fill, 0, at - io->cur_fill);
+        }
+        size_t n = MIN(size, RECORD_IO_BLOCK - at);
+        memcpy(b->data + at, p, n);
+        io->cur_fill = MAX(io->cur_fill, at + n);
+        p += n;
+        offset += (int64_t)n;
+        size -= n;
+        if (io->cur_fill == RECORD_IO_BLOCK) {
+            submit_block(io, RECORD_IO_BLOCK);
+            acquire_block(io, b->offset + RECORD_IO_BLOCK);
+        }
+    }
+    return g_atomic_int_get(&io->failed) ? -1 : 0;
+}
+
+int record_io_flush(RecordIo *io) {
+    if (io == NULL || g_atomic_int_get(&io->failed)) {
+        return -1;
+    }
+    // The partial block stays ours; a copy of its valid bytes goes out now and the full block later.
+    if (io->cur != NULL && io->cur_fill > 0) {
+        return patch_write(io, io->cur->offset, io->cur->data, io->cur_fill);
+    }
+    return 0;
+}
+
+int record_io_close(RecordIo *io, RecordIoStats *stats) {
+    if (io == NULL) {
+        return -1;
+    }
+    if (io->thread != NULL) {
+        if (io->cur != NULL && io->cur_fill > 0) {
+            submit_block(io, io->cur_fill);
+        }
+        g_async_queue_push(io->full_q, &io_stop_block);
+        g_thread_join(io->thread);
+        io->thread = NULL;
+    }
+
+    int ret = g_atomic_int_get(&io->failed) ? -1 : 0;
+    // Drops the padding of the last block and any preallocation past the end.
+    if (ftruncate(io->fd, (off_t)io->end) != 0) {
+        LOGW("record: failed to trim %s to %" G_GINT64_FORMAT " bytes: %s", io->path, io->end, g_strerror(errno));
+    }
+    if (close(io->fd) != 0) {
+        LOGE("record: close of %s failed: %s", io->path, g_strerror(errno));
+        ret = -1;
+    }
+    if (io->patch_fd >= 0) {
+        close(io->patch_fd);
+    }
+    if (stats != NULL) {
+        *stats = io->stats;
+    }
+
+    for (int i = 0; i < RECORD_IO_BLOCKS; ++i) {
+        free(io->blocks[i].data);
+    }
+    g_async_queue_unref(io->free_q);
+    g_async_queue_unref(io->full_q);
+    g_cond_clear(&io->idle);
+    g_mutex_clear(&io->lock);
+    g_free(io->path);
+    g_free(io);
+    return ret;
+}
+
+void record_io_get_stats(RecordIo *io, RecordIoStats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    memset(stats, 0, sizeof(*stats));
+    if (io == NULL) {
+        return;
+    }
+    g_mutex_lock(&io->lock);
+    *stats = io->stats;
+    g_mutex_unlock(&io->lock);
+}
@@ -0,0 +1,78 @@
+#include "record_policy.h"
+
+/* A window is under pressure with the queue this full, or this full and draining slower than it fills. */
+#define RECORD_POLICY_QUEUE_HIGH 0.5
+#define RECORD_POLICY_QUEUE_BUSY 0.2
+/* A window is calm with the queue below this and the writer keeping pace. */
+#define RECORD_POLICY_QUEUE_LOW 0.05
+/* Calm windows in a row before stepping back down. */
+#define RECORD_POLICY_CALM_WINDOWS 5
+
+struct RecordPolicy {
+    guint64 min_free_bytes;
+    RecordLevel load_level;
+    guint calm_windows;
+};
+
+static RecordLevel space_level(const RecordPolicy *policy, gint64 free_bytes) {
+    if (policy->min_free_bytes == 0 || free_bytes < 0) {
+        return RECORD_LEVEL_FULL;
+    }
+    if ((guint64)free_bytes < policy->min_free_bytes) {
+        return RECORD_LEVEL_PAUSED;
+    }
+    if ((guint64)free_bytes < policy->min_free_bytes * 2) {
+        return RECORD_LEVEL_IRAP_ONLY;
+    }
+    return RECORD_LEVEL_FULL;
+}
+
+RecordPolicy *record_policy_new(guint64 min_free_bytes) {
+    RecordPolicy *policy = g_new0(RecordPolicy, 1);
+    policy->min_free_bytes = min_free_bytes;
+    policy->load_level = RECORD_LEVEL_FULL;
+    return policy;
+}
+
+void record_policy_free(RecordPolicy *policy) {
+    g_free(policy);
+}
+
+RecordLevel record_policy_update(RecordPolicy *policy, const RecordPressure *pressure) {
+    if (policy == NULL || pressure == NULL) {
+        return RECORD_LEVEL_FULL;
+    }
+
+    gboolean falling_behind = pressure->drained_bytes < pressure->queued_bytes;
+    if (pressure->queue_fill >= RECORD_POLICY_QUEUE_HIGH ||
+        (pressure->queue_fill >= RECORD_POLICY_QUEUE_BUSY && falling_behind)) {
+        policy->calm_windows = 0;
+        if (policy->load_level < RECORD_LEVEL_PAUSED) {
+            policy->load_level++;
+        }
+    } else if (pressure->queue_fill < RECORD_POLICY_QUEUE_LOW && !falling_behind) {
+        if (++policy->calm_windows >= RECORD_POLICY_CALM_WINDOWS && policy->load_level > RECORD_LEVEL_FULL) {
+            policy->load_level--;
+            policy->calm_windows = 0;
+        }
+    } else {
+        policy->calm_windows = 0;
+    }
+
+    return MAX(policy->load_level, space_level(policy, pressure->free_bytes));
+}
+
+const char *record_level_name(RecordLevel level) {
+    switch (level) {
+    case RECORD_LEVEL_FULL:
+        return "full";
+    case RECORD_LEVEL_REFERENCE_ONLY:
+        return "reference pictures only";
+    case RECORD_LEVEL_IRAP_ONLY:
+        return "IRAP pictures only";
+    case RECORD_LEVEL_PAUSED:
+        return "paused";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,171 @@
+#include "record_preroll.h"
+
+#define RECORD_PREROLL_MIN_CAPACITY 256u
+
+struct PrerollEntry {
+    GstBuffer *buffer;
+    gint64 time_us;
+    gsize size;
+    gboolean keyframe;
+};
+
+struct RecordPreroll {
+    gint64 span_us;
+    gsize max_bytes;
+    /* Circular: count entries from head, oldest first; the oldest is always a keyframe. */
+    struct PrerollEntry *entries;
+    guint capacity;
+    guint head;
+    guint count;
+    gsize bytes;
+    GstCaps *caps;
+};
+
+static struct PrerollEntry *entry_at(const RecordPreroll *preroll, guint i) {
+    return &preroll->entries[(preroll->head + i) % preroll->capacity];
+}
+
+static void drop_oldest(RecordPreroll *preroll) {
+    struct PrerollEntry *entry = entry_at(preroll, 0);
+    preroll->bytes -= entry->size;
+    gst_buffer_unref(entry->buffer);
+    entry->buffer = NULL;
+    preroll->head = (preroll->head + 1) % preroll->capacity;
+    preroll->count--;
+}
+
+/* Returns the index of the second GOP, or 0 if the ring holds one GOP at most. */
+static guint second_gop(const RecordPreroll *preroll) {
+    for (guint i = 1; i < preroll->count; ++i) {
+        if (entry_at(preroll, i)->keyframe) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+static void drop_gop(RecordPreroll *preroll) {
+    guint next = second_gop(preroll);
+    guint n = next != 0 ? next : preroll->count;
+    for (guint i = 0; i < n; ++i) {
+        drop_oldest(preroll);
+    }
+}
+
+static gboolean grow(RecordPreroll *preroll) {
+    guint capacity = preroll->capacity * 2;
+    struct PrerollEntry *entries = g_try_new0(struct PrerollEntry, capacity);
+    if (entries == NULL) {
+        return FALSE;
+    }
+    for (guint i = 0; i < preroll->count; ++i) {
+        entries[i] = *entry_at(preroll, i);
+    }
+    g_free(preroll->entries);
+    preroll->entries = entries;
+    preroll->capacity = capacity;
+    preroll->head = 0;
+    return TRUE;
+}
+
+RecordPreroll *record_preroll_new(guint seconds, gsize max_bytes) {
+    if (seconds == 0 || max_bytes == 0) {
+        return NULL;
+    }
+    RecordPreroll *preroll = g_new0(RecordPreroll, 1);
+    preroll->span_us = (gint64)seconds * G_TIME_SPAN_SECOND;
+    preroll->max_bytes = max_bytes;
+    preroll->capacity = RECORD_PREROLL_MIN_CAPACITY;
+    preroll->entries = g_new0(struct PrerollEntry, preroll->capacity);
+    return preroll;
+}
+
+void record_preroll_free(RecordPreroll *preroll) {
+    if (preroll == NULL) {
+        return;
+    }
+    while (preroll->count > 0) {
+        drop_oldest(preroll);
+    }
+    if (preroll->caps != NULL) {
+        gst_caps_unref(preroll->caps);
+    }
+    g_free(preroll->entries);
+    g_free(preroll);
+}
+
+void record_preroll_push(RecordPreroll *preroll, GstCaps *caps, GstBuffer *buffer) {
+    if (preroll == NULL || buffer == NULL) {
+        return;
+    }
+    gboolean keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    if (preroll->count == 0 && !keyframe) {
+        // Nothing before the next IRAP picture could be decoded.
+        return;
+    }
+    if (caps != NULL && caps != preroll->caps) {
+        gst_caps_replace(&preroll->caps, caps);
+    }
+
+    gint64 now = g_get_monotonic_time();
+    if (keyframe) {
+        // Drop the oldest GOP once the ones after it cover the span on their own.
+        guint next;
+        while ((next = second_gop(preroll)) != 0 && now - entry_at(preroll, next)->time_us >= preroll->span_us) {
+            drop_gop(preroll);
+        }
+    }
+
+    if (preroll->count == preroll->capacity && !grow(preroll)) {
+        drop_gop(preroll);
+        if (preroll->count == 0 && !keyframe) {
+            return;
+        }
+    }
+    struct PrerollEntry *entry = &preroll->entries[(preroll->head + preroll->count) % preroll->capacity];
+    entry->buffer = gst_buffer_ref(buffer);
+    entry->time_us = now;
+    entry->size = gst_buffer_get_size(buffer);
+    entry->keyframe = keyframe;
+    preroll->count++;
+    preroll->bytes += entry->size;
+
+    // Whole GOPs only: a GOP that alone exceeds the limit empties the ring until the next keyframe.
+    while (preroll->bytes > preroll->max_bytes) {
+        drop_gop(preroll);
+    }
+}
+
+GstBuffer *record_preroll_pop(RecordPreroll *preroll) {
+    if (preroll == NULL || preroll->count == 0) {
+        return NULL;
+    }
+    struct PrerollEntry *entry = entry_at(preroll, 0);
+    GstBuffer *buffer = entry->buffer;
+    entry->buffer = NULL;
+    preroll->bytes -= entry->size;
+    preroll->head = (preroll->head + 1) % preroll->capacity;
+    preroll->count--;
+    return buffer;
+}
+
+GstCaps *record_preroll_get_caps(const RecordPreroll *preroll) {
+    if (preroll == NULL || preroll->caps == NULL) {
+        return NULL;
+    }
+    return gst_caps_ref(preroll->caps);
+}
+
+guint record_preroll_get_depth(const RecordPreroll *preroll, gsize *bytes, guint64 *span_ns) {
+    if (bytes != NULL) {
+        *bytes = preroll != NULL ? preroll->bytes : 0;
+    }
+    if (span_ns != NULL) {
+        *span_ns = 0;
+        if (preroll != NULL && preroll->count > 0) {
+            gint64 span_us = entry_at(preroll, preroll->count - 1)->time_us - entry_at(preroll, 0)->time_us;
+            *span_ns = (guint64)span_us * 1000u;
+        }
+    }
+    return preroll != NULL ? preroll->count : 0;
+}
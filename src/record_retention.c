@@ -0,0 +1,113 @@
+#include "record_retention.h"
+
+#include "logging.h"
+#include "record_stream.h"
+
+#include <errno.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+struct RetainedFile {
+    gchar *path;
+    guint64 size;
+    gint64 mtime_ns;
+};
+
+static void retained_file_free(gpointer data) {
+    struct RetainedFile *file = (struct RetainedFile *)data;
+    g_free(file->path);
+    g_free(file);
+}
+
+/* keep may be spelled differently from dir/name (a relative path, "./"), so the file itself is compared. */
+static gboolean is_kept_file(const struct stat *st, const gchar *name, const struct stat *keep_st, const char *keep) {
+    if (keep == NULL) {
+        return FALSE;
+    }
+    if (keep_st != NULL) {
+        return st->st_dev == keep_st->st_dev && st->st_ino == keep_st->st_ino;
+    }
+    gchar *keep_name = g_path_get_basename(keep);
+    gboolean same = strcmp(keep_name, name) == 0;
+    g_free(keep_name);
+    return same;
+}
+
+static gint compare_oldest_first(gconstpointer a, gconstpointer b) {
+    const struct RetainedFile *fa = *(const struct RetainedFile *const *)a;
+    const struct RetainedFile *fb = *(const struct RetainedFile *const *)b;
+    if (fa->mtime_ns != fb->mtime_ns) {
+        return fa->mtime_ns < fb->mtime_ns ? -1 : 1;
+    }
+    // Same timestamp (coarse filesystem clocks): segment names sort in recording order.
+    return strcmp(fa->path, fb->path);
+}
+
+guint64 record_retention_enforce(const char *dir, const char *prefix, const char *suffix, guint64 budget,
+                                 guint64 reserve, const char *keep) {
+    if (dir == NULL || prefix == NULL || suffix == NULL || budget == 0) {
+        return 0;
+    }
+
+    GError *error = NULL;
+    GDir *d = g_dir_open(dir, 0, &error);
+    if (d == NULL) {
+        LOGW("record: cannot scan %s for retention: %s", dir, error != NULL ? error->message : "unknown error");
+        g_clear_error(&error);
+        return 0;
+    }
+
+    struct stat keep_st;
+    gboolean have_keep_st = keep != NULL && stat(keep, &keep_st) == 0;
+
+    GPtrArray *files = g_ptr_array_new_with_free_func(retained_file_free);
+    guint64 total = reserve;
+    const gchar *name;
+    while ((name = g_dir_read_name(d)) != NULL) {
+        if (!g_str_has_prefix(name, prefix) || !g_str_has_suffix(name, suffix)) {
+            continue;
+        }
+        gchar *path = g_build_filename(dir, name, NULL);
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            g_free(path);
+            continue;
+        }
+        total += (guint64)st.st_size;
+        if (is_kept_file(&st, name, have_keep_st ? &keep_st : NULL, keep)) {
+            g_free(path);
+            continue;
+        }
+        struct RetainedFile *file = g_new0(struct RetainedFile, 1);
+        file->path = path;
+        file->size = (guint64)st.st_size;
+        file->mtime_ns = (gint64)st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+        g_ptr_array_add(files, file);
+    }
+    g_dir_close(d);
+
+    g_ptr_array_sort(files, compare_oldest_first);
+    guint64 deleted = 0;
+    for (guint i = 0; i < files->len && total > budget; ++i) {
+        struct RetainedFile *file = g_ptr_array_index(files, i);
+        if (g_unlink(file->path) != 0) {
+            LOGW("record: failed to delete %s: %s", file->path, g_strerror(errno));
+            continue;
+        }
+        LOGI("record: deleted %s (%.1f MB) to stay within the %.0f MB budget", file->path,
+             file->size / (1024.0 * 1024.0), budget / (1024.0 * 1024.0));
+        // An Annex B recording's timestamp file goes with it.
+        gchar *timestamps = g_strconcat(file->path, RECORD_STREAM_TIMESTAMPS_SUFFIX, NULL);
+        g_unlink(timestamps);
+        g_free(timestamps);
+        total -= file->size;
+        deleted += file->size;
+    }
+    if (total > budget) {
+        LOGW("record: recordings in %s need %.1f MB with room for the current file, over the %.0f MB budget", dir,
+             total / (1024.0 * 1024.0), budget / (1024.0 * 1024.0));
+    }
+    g_ptr_array_free(files, TRUE);
+    return deleted;
+}
@@ -0,0 +1,480 @@
+#define _GNU_SOURCE
+
+#include "record_ring.h"
+
+#include "logging.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define RECORD_RING_MAGIC 0x52525050u // "PPRR"
+#define RECORD_RING_VERSION 1u
+#define RECORD_RING_CAPS_MAX 4096
+/* Caps generations kept, so AUs still in the ring keep theirs across a change. */
+#define RECORD_RING_CAPS_ENTRIES 4u
+#define RECORD_RING_AU_KEYFRAME 0x1u
+/* AUs before this one were turned away; it is where decoding can pick up again. */
+#define RECORD_RING_AU_DISCONT 0x2u
+
+struct RingSlot {
+    /* 2n+1 while AU n is written into the slot, 2n+2 once it is complete. */
+    _Atomic uint64_t seq;
+    /* Position of the AU in the data stream; it sits at offset % data_bytes. */
+    uint64_t offset;
+    uint64_t pts;
+    uint64_t duration;
+    uint32_t size;
+    uint32_t flags;
+    uint32_t caps_gen;
+    uint32_t reserved;
+};
+
+/* Seqlocked like the slots; gen says which caps change the text belongs to. */
+struct RingCaps {
+    _Atomic uint64_t seq;
+    uint32_t gen;
+    uint32_t len;
+    char text[RECORD_RING_CAPS_MAX];
+};
+
+struct RingShared {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t data_bytes;
+    uint64_t slots_offset;
+    uint64_t data_offset;
+    uint32_t slot_count;
+    int32_t producer_pid;
+    RecordCfg cfg;
+
+    _Atomic uint64_t published;
+    /* End of the data the producer has claimed, including the AU it is writing. */
+    _Atomic uint64_t claimed;
+    _Atomic int closed;
+
+    /* caps_gen counts caps changes; generation g sits in caps[g % RECORD_RING_CAPS_ENTRIES]. */
+    uint32_t caps_gen;
+    struct RingCaps caps[RECORD_RING_CAPS_ENTRIES];
+
+    /* Written by the consumer, read by the producer for its stats. */
+    _Atomic uint64_t overruns;
+    _Atomic uint64_t skipped;
+};
+
+struct RecordRing {
+    int fd;
+    int event_fd;
+    gboolean producer;
+    guint8 *map;
+    gsize map_size;
+    struct RingShared *shared;
+    struct RingSlot *slots;
+    guint8 *data;
+
+    /* Producer */
+    uint64_t next_seq;
+    uint64_t write_offset;
+    GstCaps *caps;
+    guint64 rejected;
+    /* An AU was turned away: the rest of its GOP goes too, and the next IRAP picture is marked. */
+    gboolean dropping;
+
+    /* Consumer */
+    uint64_t read_seq;
+    uint32_t caps_gen;
+    gboolean resync;
+};
+
+static gsize align_up(gsize value, gsize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static gboolean map_ring(RecordRing *ring, gsize size) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (map == MAP_FAILED) {
+        LOGE("record: cannot map the AU ring: %s", g_strerror(errno));
+        return FALSE;
+    }
+    ring->map = map;
+    ring->map_size = size;
+    ring->shared = (struct RingShared *)ring->map;
+    return TRUE;
+}
+
+RecordRing *record_ring_new(gsize data_bytes, guint slots, const RecordCfg *cfg) {
+    if (data_bytes == 0 || slots == 0 || cfg == NULL) {
+        return NULL;
+    }
+    gsize page = (gsize)sysconf(_SC_PAGESIZE);
+    gsize slots_offset = align_up(sizeof(struct RingShared), 64);
+    gsize data_offset = align_up(slots_offset + (gsize)slots * sizeof(struct RingSlot), page);
+    gsize size = data_offset + align_up(data_bytes, page);
+
+    RecordRing *ring = g_new0(RecordRing, 1);
+    ring->producer = TRUE;
+    ring->event_fd = -1;
+    ring->fd = memfd_create("pixelpilot-record-ring", MFD_CLOEXEC);
+    if (ring->fd < 0 || ftruncate(ring->fd, (off_t)size) != 0) {
+        LOGE("record: cannot create the AU ring (%.0f MB): %s", size / (1024.0 * 1024.0), g_strerror(errno));
+        record_ring_free(ring);
+        return NULL;
+    }
+    ring->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ring->event_fd < 0) {
+        LOGE("record: cannot create the AU ring eventfd: %s", g_strerror(errno));
+        record_ring_free(ring);
+        return NULL;
+    }
+    if (!map_ring(ring, size)) {
+        record_ring_free(ring);
+        return NULL;
+    }
+
+    // A fresh memfd reads as zeros: every slot starts out empty, with no AU published.
+    struct RingShared *shared = ring->shared;
+    shared->magic = RECORD_RING_MAGIC;
+    shared->version = RECORD_RING_VERSION;
+    shared->data_bytes = align_up(data_bytes, page);
+    shared->slots_offset = slots_offset;
+    shared->data_offset = data_offset;
+    shared->slot_count = slots;
+    shared->producer_pid = (int32_t)getpid();
+    shared->cfg = *cfg;
+    ring->slots = (struct RingSlot *)(ring->map + slots_offset);
+    ring->data = ring->map + data_offset;
+    return ring;
+}
+
+int record_ring_get_fd(const RecordRing *ring) {
+    return ring != NULL ? ring->fd : -1;
+}
+
+int record_ring_get_event_fd(const RecordRing *ring) {
+    return ring != NULL ? ring->event_fd : -1;
+}
+
+static void notify(RecordRing *ring) {
+    // Non-blocking: the counter cannot realistically saturate, and a lost wakeup only costs the consumer's timeout.
+    uint64_t one = 1;
+    ssize_t n = write(ring->event_fd, &one, sizeof(one));
+    (void)n;
+}
+
+static void publish_caps(RecordRing *ring, GstCaps *caps) {
+    gchar *text = gst_caps_to_string(caps);
+    gsize len = text != NULL ? strlen(text) : 0;
+    if (len >= RECORD_RING_CAPS_MAX) {
+        LOGW("record: stream caps too long for the AU ring (%" G_GSIZE_FORMAT " bytes); keeping the previous ones",
+             len);
+        g_free(text);
+        return;
+    }
+    struct RingShared *shared = ring->shared;
+    uint32_t gen = shared->caps_gen + 1;
+    struct RingCaps *entry = &shared->caps[gen % RECORD_RING_CAPS_ENTRIES];
+    uint64_t seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+    atomic_store_explicit(&entry->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(entry->text, text, len + 1);
+    entry->len = (uint32_t)len;
+    entry->gen = gen;
+    atomic_store_explicit(&entry->seq, seq + 2, memory_order_release);
+    shared->caps_gen = gen;
+    g_free(text);
+    gst_caps_replace(&ring->caps, caps);
+}
+
+static void reject(RecordRing *ring, gsize size) {
+    ring->rejected++;
+    if (!ring->dropping) {
+        // The appsink thread logs once per gap; the rest of the GOP would not decode without this AU.
+        LOGW("record: AU of %" G_GSIZE_FORMAT " bytes cannot go into the AU ring; dropping to the next IRAP picture",
+             size);
+        ring->dropping = TRUE;
+    }
+}
+
+gboolean record_ring_publish(RecordRing *ring, GstCaps *caps, GstBuffer *buffer) {
+    if (ring == NULL || !ring->producer || buffer == NULL) {
+        return FALSE;
+    }
+    struct RingShared *shared = ring->shared;
+    gsize size = gst_buffer_get_size(buffer);
+    gboolean keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    if (ring->dropping && !keyframe) {
+        ring->rejected++;
+        return FALSE;
+    }
+    // An AU over a quarter of the ring would leave the consumer no slack at all.
+    if (size == 0 || size > shared->data_bytes / 4) {
+        reject(ring, size);
+        return FALSE;
+    }
+    if (caps != NULL && caps != ring->caps && (ring->caps == NULL || !gst_caps_is_equal(caps, ring->caps))) {
+        publish_caps(ring, caps);
+    }
+
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        reject(ring, size);
+        return FALSE;
+    }
+
+    uint64_t n = ring->next_seq;
+    uint64_t offset = ring->write_offset;
+    struct RingSlot *slot = &ring->slots[n % shared->slot_count];
+    // Claim the bytes and mark the slot first, so a reader still copying either sees that it lost them.
+    atomic_store_explicit(&shared->claimed, offset + size, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, 2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    GstClockTime pts = GST_BUFFER_PTS_IS_VALID(buffer) ? GST_BUFFER_PTS(buffer) : GST_BUFFER_DTS(buffer);
+    slot->offset = offset;
+    slot->pts = pts;
+    slot->duration = GST_BUFFER_DURATION(buffer);
+    slot->size = (uint32_t)size;
+    slot->flags = (keyframe ? RECORD_RING_AU_KEYFRAME : 0) | (ring->dropping ? RECORD_RING_AU_DISCONT : 0);
+    slot->caps_gen = shared->caps_gen;
+
+    // The one copy made on the recorder's behalf.
+    gsize at = (gsize)(offset % shared->data_bytes);
+    gsize first = MIN(size, (gsize)shared->data_bytes - at);
+    memcpy(ring->data + at, map.data, first);
+    memcpy(ring->data, map.data + first, size - first);
+    gst_buffer_unmap(buffer, &map);
+
+    atomic_store_explicit(&slot->seq, 2 * n + 2, memory_order_release);
+    atomic_store_explicit(&shared->published, n + 1, memory_order_release);
+    ring->next_seq = n + 1;
+    ring->write_offset = offset + size;
+    ring->dropping = FALSE;
+    notify(ring);
+    return TRUE;
+}
+
+void record_ring_close(RecordRing *ring) {
+    if (ring == NULL || !ring->producer) {
+        return;
+    }
+    atomic_store_explicit(&ring->shared->closed, 1, memory_order_release);
+    notify(ring);
+}
+
+RecordRing *record_ring_attach(int fd, int event_fd) {
+    RecordRing *ring = g_new0(RecordRing, 1);
+    ring->fd = fd;
+    ring->event_fd = event_fd;
+    struct RingShared head;
+    if (pread(fd, &head, sizeof(head), 0) != (ssize_t)sizeof(head) || head.magic != RECORD_RING_MAGIC ||
+        head.version != RECORD_RING_VERSION) {
+        LOGE("record: fd %d is not an AU ring", fd);
+        record_ring_free(ring);
+        return NULL;
+    }
+    if (!map_ring(ring, head.data_offset + head.data_bytes)) {
+        record_ring_free(ring);
+        return NULL;
+    }
+    ring->slots = (struct RingSlot *)(ring->map + head.slots_offset);
+    ring->data = ring->map + head.data_offset;
+    // Start at the oldest AU still in a slot; the first one written must be an IRAP picture anyway.
+    uint64_t published = atomic_load_explicit(&ring->shared->published, memory_order_acquire);
+    ring->read_seq = published > head.slot_count ? published - head.slot_count : 0;
+    ring->resync = TRUE;
+    return ring;
+}
+
+const RecordCfg *record_ring_get_cfg(const RecordRing *ring) {
+    return ring != NULL ? &ring->shared->cfg : NULL;
+}
+
+/* The caps of generation gen; NULL if they cannot be read or were already replaced. */
+static GstCaps *read_caps(RecordRing *ring, uint32_t gen) {
+    struct RingCaps *entry = &ring->shared->caps[gen % RECORD_RING_CAPS_ENTRIES];
+    gchar text[RECORD_RING_CAPS_MAX];
+    ring->caps_gen = gen;
+    // The producer rewrites the entry in a moment; it may also have died halfway through.
+    for (guint tries = 0; tries < 1000; ++tries) {
+        uint64_t seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+        if (seq & 1) {
+            g_usleep(100);
+            continue;
+        }
+        uint32_t len = MIN(entry->len, RECORD_RING_CAPS_MAX - 1);
+        uint32_t entry_gen = entry->gen;
+        memcpy(text, entry->text, len);
+        text[len] = '\0';
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq) {
+            continue;
+        }
+        if (entry_gen != gen) {
+            LOGW("record: the stream caps changed %u times while the recorder was behind; keeping older ones",
+                 RECORD_RING_CAPS_ENTRIES);
+            return NULL;
+        }
+        return len > 0 ? gst_caps_from_string(text) : NULL;
+    }
+    LOGW("record: cannot read the stream caps from the AU ring");
+    return NULL;
+}
+
+static void wait_event(RecordRing *ring, int timeout_ms) {
+    struct pollfd pfd = {.fd = ring->event_fd, .events = POLLIN};
+    if (poll(&pfd, 1, timeout_ms) > 0) {
+        uint64_t count;
+        ssize_t n = read(ring->event_fd, &count, sizeof(count));
+        (void)n;
+    }
+}
+
+static void overrun(RecordRing *ring, uint64_t published) {
+    struct RingShared *shared = ring->shared;
+    atomic_fetch_add_explicit(&shared->overruns, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shared->skipped, published - ring->read_seq, memory_order_relaxed);
+    if (!ring->resync) {
+        LOGW("record: the recorder fell %" G_GUINT64_FORMAT " AUs behind and lost its place in the ring; "
+             "skipping to the next IRAP picture", (guint64)(published - ring->read_seq));
+    }
+    ring->read_seq = published;
+    ring->resync = TRUE;
+}
+
+int record_ring_next(RecordRing *ring, GstBuffer **buffer, GstCaps **caps, int timeout_ms) {
+    if (ring == NULL || ring->producer || buffer == NULL || caps == NULL) {
+        return -1;
+    }
+    *buffer = NULL;
+    *caps = NULL;
+    struct RingShared *shared = ring->shared;
+    gboolean waited = FALSE;
+
+    for (;;) {
+        int closed = atomic_load_explicit(&shared->closed, memory_order_acquire);
+        uint64_t published = atomic_load_explicit(&shared->published, memory_order_acquire);
+        if (ring->read_seq == published) {
+            if (closed) {
+                return -1;
+            }
+            if (waited) {
+                return 0;
+            }
+            wait_event(ring, timeout_ms);
+            waited = TRUE;
+            continue;
+        }
+        if (published - ring->read_seq > shared->slot_count) {
+            overrun(ring, published);
+            continue;
+        }
+
+        uint64_t n = ring->read_seq;
+        struct RingSlot *slot = &ring->slots[n % shared->slot_count];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != 2 * n + 2) {
+            overrun(ring, published);
+            continue;
+        }
+        uint64_t offset = slot->offset;
+        uint32_t size = slot->size;
+        uint32_t flags = slot->flags;
+        uint32_t caps_gen = slot->caps_gen;
+        GstClockTime pts = slot->pts;
+        GstClockTime duration = slot->duration;
+        gboolean keyframe = (flags & RECORD_RING_AU_KEYFRAME) != 0;
+        if ((flags & RECORD_RING_AU_DISCONT) != 0) {
+            ring->resync = TRUE;
+        }
+        if (ring->resync && !keyframe) {
+            // Nothing decodes until the next IRAP picture.
+            atomic_fetch_add_explicit(&shared->skipped, 1, memory_order_relaxed);
+            ring->read_seq++;
+            continue;
+        }
+        if (size == 0 || size > shared->data_bytes) {
+            overrun(ring, published);
+            continue;
+        }
+
+        GstBuffer *out = gst_buffer_new_allocate(NULL, size, NULL);
+        GstMapInfo map;
+        if (out == NULL || !gst_buffer_map(out, &map, GST_MAP_WRITE)) {
+            LOGE("record: cannot allocate %u bytes for an AU from the ring", size);
+            if (out != NULL) {
+                gst_buffer_unref(out);
+            }
+            return -1;
+        }
+        gsize at = (gsize)(offset % shared->data_bytes);
+        gsize first = MIN((gsize)size, (gsize)shared->data_bytes - at);
+        memcpy(map.data, ring->data + at, first);
+        memcpy(map.data + first, ring->data, size - first);
+        gst_buffer_unmap(out, &map);
+
+        // The copy only counts if the producer did not get to these bytes meanwhile.
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq ||
+            atomic_load_explicit(&shared->claimed, memory_order_relaxed) > offset + shared->data_bytes) {
+            gst_buffer_unref(out);
+            overrun(ring, atomic_load_explicit(&shared->published, memory_order_acquire));
+            continue;
+        }
+
+        GST_BUFFER_PTS(out) = pts;
+        GST_BUFFER_DURATION(out) = duration;
+        if (!keyframe) {
+            GST_BUFFER_FLAG_SET(out, GST_BUFFER_FLAG_DELTA_UNIT);
+        }
+        if (ring->resync) {
+            // AUs were lost before this one, on either side of the ring.
+            GST_BUFFER_FLAG_SET(out, GST_BUFFER_FLAG_DISCONT);
+        }
+        if (caps_gen != ring->caps_gen) {
+            *caps = read_caps(ring, caps_gen);
+        }
+        ring->resync = FALSE;
+        ring->read_seq++;
+        *buffer = out;
+        return 1;
+    }
+}
+
+void record_ring_get_stats(const RecordRing *ring, RecordRingStats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    memset(stats, 0, sizeof(*stats));
+    if (ring == NULL || ring->shared == NULL) {
+        return;
+    }
+    struct RingShared *shared = ring->shared;
+    stats->published = atomic_load_explicit(&shared->published, memory_order_relaxed);
+    stats->rejected = ring->rejected;
+    stats->overruns = atomic_load_explicit(&shared->overruns, memory_order_relaxed);
+    stats->skipped = atomic_load_explicit(&shared->skipped, memory_order_relaxed);
+}
+
+void record_ring_free(RecordRing *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    if (ring->caps != NULL) {
+        gst_caps_unref(ring->caps);
+    }
+    if (ring->map != NULL) {
+        munmap(ring->map, ring->map_size);
+    }
+    if (ring->event_fd >= 0) {
+        close(ring->event_fd);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    g_free(ring);
+}
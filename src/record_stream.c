@@ -0,0 +1,283 @@
+#include "record_stream.h"
+
+#include "logging.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TS_PACKET_BYTES 188
+#define TS_PID_PAT 0x0000
+#define TS_PID_PMT 0x1000
+#define TS_PID_VIDEO 0x0100
+#define TS_STREAM_TYPE_HEVC 0x24
+#define TS_PES_HEADER_BYTES 14
+/* Adaptation field of an AU's first packet: flags and PCR. */
+#define TS_PCR_FIELD_BYTES 7
+/* PTS ahead of the PCR, the decoder delay players allow for (ffmpeg's default muxdelay, 0.7 s). */
+#define TS_PTS_DELAY_90K 63000u
+#define TS_TIMESTAMP_MASK 0x1FFFFFFFFull
+/* Packets handed to writev at once; a large AU goes out in several calls. */
+#define TS_BATCH_PACKETS 256
+
+struct RecordStream {
+    RecordStreamFormat format;
+    RecordStreamWritevFn writev;
+    void *token;
+    int64_t offset;
+
+    /* MPEG-TS: PAT and PMT are built once; only their continuity counters change. */
+    guint8 pat[TS_PACKET_BYTES];
+    guint8 pmt[TS_PACKET_BYTES];
+    guint8 cc_pat;
+    guint8 cc_pmt;
+    guint8 cc_video;
+    /* One header slot per packet of the batch; payloads stay in the AU. */
+    guint8 *headers;
+    struct iovec *iov;
+    int iovcnt;
+    int packets;
+
+    /* Annex B */
+    FILE *timestamps;
+    gchar *timestamps_path;
+};
+
+static guint32 crc32_mpeg(const guint8 *data, size_t size) {
+    guint32 crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+        crc ^= (guint32)data[i] << 24;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 0x80000000u) ? (crc << 1) ^ 0x04C11DB7u : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static void build_psi_packet(guint8 *packet, guint16 pid, const guint8 *section, size_t size) {
+    memset(packet, 0xFF, TS_PACKET_BYTES);
+    packet[0] = 0x47;
+    packet[1] = 0x40 | ((pid >> 8) & 0x1F);
+    packet[2] = pid & 0xFF;
+    packet[3] = 0x10;
+    packet[4] = 0x00; // pointer_field
+    memcpy(packet + 5, section, size);
+    guint32 crc = crc32_mpeg(section, size);
+    packet[5 + size] = (guint8)(crc >> 24);
+    packet[6 + size] = (guint8)(crc >> 16);
+    packet[7 + size] = (guint8)(crc >> 8);
+    packet[8 + size] = (guint8)crc;
+}
+
+static void build_psi(RecordStream *stream) {
+    // section_length counts from after itself through the CRC.
+    const guint8 pat[] = {
+        0x00, 0xB0, 13, 0x00, 0x01, 0xC1, 0x00, 0x00,
+        0x00, 0x01, 0xE0 | (TS_PID_PMT >> 8), TS_PID_PMT & 0xFF,
+    };
+    const guint8 pmt[] = {
+        0x02, 0xB0, 18, 0x00, 0x01, 0xC1, 0x00, 0x00,
+        0xE0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xFF, 0xF0, 0x00,
+        TS_STREAM_TYPE_HEVC, 0xE0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xFF, 0xF0, 0x00,
+    };
+    build_psi_packet(stream->pat, TS_PID_PAT, pat, sizeof(pat));
+    build_psi_packet(stream->pmt, TS_PID_PMT, pmt, sizeof(pmt));
+}
+
+static int flush_batch(RecordStream *stream) {
+    if (stream->iovcnt == 0) {
+        return 0;
+    }
+    size_t size = 0;
+    for (int i = 0; i < stream->iovcnt; ++i) {
+        size += stream->iov[i].iov_len;
+    }
+    int rc = stream->writev(stream->offset, stream->iov, stream->iovcnt, stream->token);
+    stream->offset += (int64_t)size;
+    stream->iovcnt = 0;
+    stream->packets = 0;
+    return rc;
+}
+
+static guint8 *next_header(RecordStream *stream) {
+    return stream->headers + (size_t)stream->packets * TS_PACKET_BYTES;
+}
+
+/* The header is in the slot next_header returned; the payload completes the packet. */
+static int add_packet(RecordStream *stream, size_t header_size, const guint8 *payload, size_t payload_size) {
+    stream->iov[stream->iovcnt].iov_base = next_header(stream);
+    stream->iov[stream->iovcnt].iov_len = header_size;
+    stream->iovcnt++;
+    if (payload_size > 0) {
+        stream->iov[stream->iovcnt].iov_base = (void *)payload;
+        stream->iov[stream->iovcnt].iov_len = payload_size;
+        stream->iovcnt++;
+    }
+    stream->packets++;
+    return stream->packets == TS_BATCH_PACKETS ? flush_batch(stream) : 0;
+}
+
+static int add_psi(RecordStream *stream, const guint8 *packet, guint8 *cc) {
+    guint8 *header = next_header(stream);
+    memcpy(header, packet, TS_PACKET_BYTES);
+    header[3] = (header[3] & 0xF0) | (*cc & 0x0F);
+    *cc = (*cc + 1) & 0x0F;
+    return add_packet(stream, TS_PACKET_BYTES, NULL, 0);
+}
+
+static size_t put_pcr(guint8 *p, guint64 pcr_90k) {
+    guint64 base = pcr_90k & TS_TIMESTAMP_MASK;
+    p[0] = (guint8)(base >> 25);
+    p[1] = (guint8)(base >> 17);
+    p[2] = (guint8)(base >> 9);
+    p[3] = (guint8)(base >> 1);
+    p[4] = (guint8)(((base & 1) << 7) | 0x7E); // 6 reserved bits, extension 0
+    p[5] = 0x00;
+    return 6;
+}
+
+static size_t put_pes_header(guint8 *p, guint64 pts_90k) {
+    guint64 pts = pts_90k & TS_TIMESTAMP_MASK;
+    // Video stream 0xE0, unbounded length, data aligned, PTS only (no B-frames, so DTS equals PTS).
+    const guint8 head[] = {0x00, 0x00, 0x01, 0xE0, 0x00, 0x00, 0x84, 0x80, 0x05};
+    memcpy(p, head, sizeof(head));
+    p[9] = (guint8)(0x21 | ((pts >> 29) & 0x0E));
+    p[10] = (guint8)(pts >> 22);
+    p[11] = (guint8)(((pts >> 14) & 0xFE) | 0x01);
+    p[12] = (guint8)(pts >> 7);
+    p[13] = (guint8)(((pts << 1) & 0xFE) | 0x01);
+    return TS_PES_HEADER_BYTES;
+}
+
+static int ts_write_au(RecordStream *stream, const guint8 *data, size_t size, guint64 pts_90k, gboolean keyframe) {
+    // Tables ahead of each keyframe, so a reader joining or cutting there finds the program.
+    if (keyframe && (add_psi(stream, stream->pat, &stream->cc_pat) != 0 ||
+                     add_psi(stream, stream->pmt, &stream->cc_pmt) != 0)) {
+        return -1;
+    }
+
+    size_t done = 0;
+    gboolean first = TRUE;
+    do {
+        size_t remaining = size - done;
+        gboolean adaptation = first;
+        size_t adaptation_size = first ? TS_PCR_FIELD_BYTES : 0;
+        size_t pes = first ? TS_PES_HEADER_BYTES : 0;
+        size_t room = TS_PACKET_BYTES - 4 - (adaptation ? 1 + adaptation_size : 0) - pes;
+        if (remaining < room) {
+            // The last packet is padded with adaptation field stuffing.
+            size_t stuffing = room - remaining;
+            if (adaptation) {
+                adaptation_size += stuffing;
+            } else {
+                adaptation = TRUE;
+                adaptation_size = stuffing - 1;
+            }
+            room = remaining;
+        }
+
+        guint8 *h = next_header(stream);
+        size_t n = 0;
+        h[n++] = 0x47;
+        h[n++] = (first ? 0x40 : 0x00) | ((TS_PID_VIDEO >> 8) & 0x1F);
+        h[n++] = TS_PID_VIDEO & 0xFF;
+        h[n++] = (adaptation ? 0x30 : 0x10) | stream->cc_video;
+        stream->cc_video = (stream->cc_video + 1) & 0x0F;
+        if (adaptation) {
+            h[n++] = (guint8)adaptation_size;
+            size_t end = n + adaptation_size;
+            if (adaptation_size > 0) {
+                h[n++] = first ? (guint8)(0x10 | (keyframe ? 0x40 : 0x00)) : 0x00; // PCR, random access
+                if (first) {
+                    n += put_pcr(h + n, pts_90k);
+                }
+                memset(h + n, 0xFF, end - n);
+                n = end;
+            }
+        }
+        if (first) {
+            n += put_pes_header(h + n, pts_90k + TS_PTS_DELAY_90K);
+        }
+        if (add_packet(stream, n, data + done, room) != 0) {
+            return -1;
+        }
+        done += room;
+        first = FALSE;
+    } while (done < size);
+
+    return flush_batch(stream);
+}
+
+static int annexb_write_au(RecordStream *stream, const guint8 *data, size_t size, guint64 pts_90k) {
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = size};
+    if (stream->writev(stream->offset, &iov, 1, stream->token) != 0) {
+        return -1;
+    }
+    stream->offset += (int64_t)size;
+    if (stream->timestamps != NULL) {
+        fprintf(stream->timestamps, "%.3f\n", pts_90k / 90.0);
+    }
+    return 0;
+}
+
+RecordStream *record_stream_new(RecordStreamFormat format, const char *path, RecordStreamWritevFn writev, void *token) {
+    if (path == NULL || writev == NULL) {
+        return NULL;
+    }
+    RecordStream *stream = g_new0(RecordStream, 1);
+    stream->format = format;
+    stream->writev = writev;
+    stream->token = token;
+
+    if (format == RECORD_STREAM_TS) {
+        build_psi(stream);
+        stream->headers = g_new(guint8, (size_t)TS_BATCH_PACKETS * TS_PACKET_BYTES);
+        stream->iov = g_new(struct iovec, TS_BATCH_PACKETS * 2);
+        return stream;
+    }
+
+    // The video is worth more than its timestamps: without the file the recording still goes on.
+    stream->timestamps_path = g_strconcat(path, RECORD_STREAM_TIMESTAMPS_SUFFIX, NULL);
+    stream->timestamps = fopen(stream->timestamps_path, "w");
+    if (stream->timestamps == NULL) {
+        LOGW("record: cannot create %s: %s", stream->timestamps_path, g_strerror(errno));
+    } else {
+        fputs("# timestamp format v2\n", stream->timestamps);
+    }
+    return stream;
+}
+
+int record_stream_write_au(RecordStream *stream, const guint8 *data, size_t size, guint64 pts_90k, gboolean keyframe) {
+    if (stream == NULL || data == NULL || size == 0) {
+        return -1;
+    }
+    if (stream->format == RECORD_STREAM_TS) {
+        return ts_write_au(stream, data, size, pts_90k, keyframe);
+    }
+    return annexb_write_au(stream, data, size, pts_90k);
+}
+
+void record_stream_flush(RecordStream *stream) {
+    if (stream != NULL && stream->timestamps != NULL) {
+        fflush(stream->timestamps);
+    }
+}
+
+int record_stream_close(RecordStream *stream) {
+    if (stream == NULL) {
+        return 0;
+    }
+    int rc = flush_batch(stream);
+    if (stream->timestamps != NULL) {
+        gboolean failed = ferror(stream->timestamps) != 0;
+        if (fclose(stream->timestamps) != 0 || failed) {
+            LOGW("record: %s may be incomplete: %s", stream->timestamps_path, g_strerror(errno));
+            rc = -1;
+        }
+    }
+    g_free(stream->timestamps_path);
+    g_free(stream->headers);
+    g_free(stream->iov);
+    g_free(stream);
+    return rc;
+}
@@ -38,6 +38,7 @@ struct UdpReceiver {
     gboolean stop_requested;
     GstBufferPool *pool;
     gboolean pool_active;
+    UdpReceiverStats stats;   // published by the receiver thread under lock
 };
 
 static void set_thread_priority_rr(int rr_prio, int nice_inc) {
@@ -96,6 +97,20 @@ static gboolean payload_type_matches(const guint8 *data, gssize len, int expecte
     return payload_type == (guint8)expected_pt;
 }
 
+// RTP sequence gaps; reordered or repeated packets (a step back) are not counted.
+static void note_rtp_sequence(UdpReceiverStats *stats, gboolean *have_seq, guint16 *expected,
+                              const guint8 *data, gssize len) {
+    if (len < 4) return;
+    guint16 seq = (guint16)((data[2] << 8) | data[3]);
+    if (*have_seq) {
+        guint16 gap = (guint16)(seq - *expected);
+        if (gap >= 0x8000u) return;
+        stats->lost_packets += gap;
+    }
+    *have_seq = TRUE;
+    *expected = (guint16)(seq + 1u);
+}
+
 static gpointer receiver_thread(gpointer data) {
     UdpReceiver *ur = (UdpReceiver *)data;
 
@@ -108,9 +123,14 @@ static gpointer receiver_thread(gpointer data) {
         return NULL;
     }
 
+    UdpReceiverStats stats = ur->stats;
+    gboolean have_seq = FALSE;
+    guint16 expected_seq = 0;
+
     while (TRUE) {
         g_mutex_lock(&ur->lock);
         gboolean stop = ur->stop_requested;
+        ur->stats = stats;
         g_mutex_unlock(&ur->lock);
         if (stop) break;
 
@@ -126,11 +146,15 @@ static gpointer receiver_thread(gpointer data) {
         }
         if (n == 0) continue;
         if (!payload_type_matches(buffer, n, ur->vid_pt)) continue;
+        stats.packets++;
+        stats.bytes += (guint64)n;
+        note_rtp_sequence(&stats, &have_seq, &expected_seq, buffer, n);
 
         // Manual upstream leak: if appsrc is backed up, drop this packet.
         guint64 level = gst_app_src_get_current_level_bytes(ur->video_appsrc);
         if (level > APPSRC_LEVEL_MAX) {
             // Optional verbose: LOGV("Dropping packet, appsrc level=%" G_GUINT64_FORMAT, level);
+            stats.dropped++;
             continue;
         }
 
@@ -182,6 +206,15 @@ static gpointer receiver_thread(gpointer data) {
     return NULL;
 }
 
+void udp_receiver_get_stats(UdpReceiver *ur, UdpReceiverStats *stats) {
+    if (stats == NULL) return;
+    memset(stats, 0, sizeof(*stats));
+    if (ur == NULL) return;
+    g_mutex_lock(&ur->lock);
+    *stats = ur->stats;
+    g_mutex_unlock(&ur->lock);
+}
+
 UdpReceiver *udp_receiver_create(int udp_port, int vid_pt, GstAppSrc *video_appsrc) {
     if (video_appsrc == NULL) return NULL;
 
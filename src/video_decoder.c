@@ -1,7 +1,10 @@
 #include "video_decoder.h"
 
+#include "drm_display.h"
 #include "drm_fb.h"
 #include "drm_props.h"
+#include "frame_pool.h"
+#include "hevc_parse.h"
 #include "logging.h"
 
 #include <errno.h>
@@ -39,44 +42,73 @@
 #define DRM_PLANE_TYPE_OVERLAY 0
 #endif
 
-#define DECODER_READ_BUF_SIZE (1024 * 1024)
+#define DECODER_AU_SLAB_INITIAL (256 * 1024)
 #define DECODER_MAX_FRAMES 24
+/* Extra buffers beyond DPB + display holds: the picture being decoded plus slack for immediate output. */
+#define DECODER_POOL_MARGIN 2
+/*
+ * Both MPP ports block until work is available. The timeouts only bound how
+ * long a stop request can go unnoticed; they are not a polling interval.
+ */
+#define DECODER_INPUT_TIMEOUT_MS 50
+#define DECODER_OUTPUT_TIMEOUT_MS 50
 
 struct FrameSlot {
     int prime_fd;
     uint32_t fb_id;
-    uint32_t handle;
+    gboolean owns_fd;
+};
+
+/* A cached frame pool attached to one MPP external buffer group. */
+struct PoolBinding {
+    FramePool *pool;
+    MppBufferGroup group;
+    struct FrameSlot slots[FRAME_POOL_MAX_BUFFERS];
+    guint slot_count;
+    /* Frames handed to the display and not yet released (atomic). */
+    gint outstanding;
+};
+
+struct DisplayToken {
+    MppFrame frame;
+    struct PoolBinding *binding;
+    /* One reference per display showing the frame; the last release returns it to MPP. */
+    gint refs;
+};
+
+/* Source of the AU currently referenced by vd->packet. */
+struct FeedSource {
+    GstBuffer *buffer;
+    GstMapInfo map;
+    gboolean mapped;
 };
 
 struct VideoDecoder {
     gboolean initialized;
     gboolean running;
     gboolean frame_thread_running;
-    gboolean display_thread_running;
     gboolean eos_received;
     gboolean lock_initialized;
     gboolean cond_initialized;
+    gboolean stats_lock_initialized;
 
     int drm_fd;
     uint32_t plane_id;
     uint32_t crtc_id;
     int mode_w;
     int mode_h;
-    uint32_t src_w;
-    uint32_t src_h;
-
-    uint32_t prop_fb_id;
-    uint32_t prop_crtc_id;
-    uint32_t prop_crtc_x;
-    uint32_t prop_crtc_y;
-    uint32_t prop_crtc_w;
-    uint32_t prop_crtc_h;
-    uint32_t prop_src_x;
-    uint32_t prop_src_y;
-    uint32_t prop_src_w;
-    uint32_t prop_src_h;
+    ModePolicy mode_policy;
+
+    DrmDisplay *display;
+    /* Mirror heads that could not join the lead's commits, each paced on its own. */
+    DrmDisplay *mirror_displays[DRM_MAX_HEADS - 1];
+    uint32_t mirror_connectors[DRM_MAX_HEADS - 1];
+    guint mirror_display_count;
 
     struct DumbFB background_fb;
+    /* Allocation size; larger than the mode when the mode policy may switch to a bigger one. */
+    int background_w;
+    int background_h;
     uint32_t background_plane_id;
     uint32_t background_prop_fb_id;
     uint32_t background_prop_crtc_id;
@@ -94,21 +126,43 @@ struct VideoDecoder {
 
     MppCtx ctx;
     MppApi *mpi;
-    MppBufferGroup frm_grp;
-    struct FrameSlot frame_map[DECODER_MAX_FRAMES];
+    /*
+     * binding is what MPP decodes into. After a format change the previous
+     * bindings stay on the retiring list, still scanning out, until the display
+     * has released their last frame, i.e. until a frame from a newer pool has
+     * flipped. Back-to-back changes may leave several there (frame thread).
+     */
+    FramePoolCache *pools;
+    gboolean owns_pools;
+    struct PoolBinding *binding;
+    GPtrArray *retiring;
+
+    /* From the latest SPS seen on the feed path (stats_lock). */
+    HevcSpsInfo sps;
+    gint stream_dpb;
+    guint64 bound_stream_key;
+    guint64 prefetch_stream_key;
 
-    guint8 *packet_buf;
-    size_t packet_buf_size;
+    /*
+     * Access units are handed to MPP straight from the mapped GstBuffer. The
+     * slab is only used to linearise buffers that span several GstMemory
+     * blocks and grows on demand, so there is no upper bound on AU size.
+     */
+    guint8 *au_slab;
+    size_t au_slab_size;
     MppPacket packet;
+    struct FeedSource feed_src;
 
     GMutex lock;
     GCond cond;
-    uint32_t pending_fb;
-    uint64_t pending_pts;
 
     GThread *frame_thread;
-    GThread *display_thread;
 
+    gboolean input_blocking;
+    gboolean output_blocking;
+
+    GMutex stats_lock;
+    VideoDecoderStats stats;
 };
 
 VideoDecoder *video_decoder_new(void) {
@@ -123,18 +177,18 @@ void video_decoder_free(VideoDecoder *vd) {
     g_free(vd);
 }
 
-static inline guint64 get_time_ms(void) {
+static inline guint64 get_time_ns(void) {
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (guint64)ts.tv_sec * 1000ull + ts.tv_nsec / 1000000ull;
+    return (guint64)ts.tv_sec * 1000000000ull + (guint64)ts.tv_nsec;
 }
 
+/* MPP passes the timestamp through untouched; microseconds keep the pacer's jitter estimate below a millisecond. */
 static inline RK_S64 gst_pts_to_mpp_timestamp(GstClockTime pts) {
     if (!GST_CLOCK_TIME_IS_VALID(pts)) {
-        return (RK_S64)get_time_ms();
+        return (RK_S64)(get_time_ns() / 1000ull);
     }
-    guint64 ms = gst_util_uint64_scale(pts, 1, GST_MSECOND);
-    return (RK_S64)ms;
+    return (RK_S64)(pts / GST_USECOND);
 }
 
 static inline void copy_packet_data(guint8 *dst, const guint8 *src, size_t size) {
@@ -188,38 +242,97 @@ static void log_decoder_neon_status_once(void) {
     }
 }
 
-static void reset_frame_map(VideoDecoder *vd) {
-    for (int i = 0; i < DECODER_MAX_FRAMES; ++i) {
-        vd->frame_map[i].prime_fd = -1;
-        vd->frame_map[i].fb_id = 0;
-        vd->frame_map[i].handle = 0;
+static void unbind_pool(VideoDecoder *vd, struct PoolBinding *binding) {
+    if (binding == NULL) {
+        return;
+    }
+    for (guint i = 0; i < binding->slot_count; ++i) {
+        if (binding->slots[i].owns_fd && binding->slots[i].prime_fd >= 0) {
+            close(binding->slots[i].prime_fd);
+        }
     }
+    if (binding->group != NULL) {
+        mpp_buffer_group_clear(binding->group);
+        mpp_buffer_group_put(binding->group);
+    }
+    // The buffers themselves stay cached for the next format change or restart.
+    frame_pool_cache_release(vd->pools, binding->pool);
+    g_free(binding);
 }
 
-static void release_frame_group(VideoDecoder *vd) {
-    if (vd->frm_grp == NULL) {
-        return;
+static struct PoolBinding *bind_pool(FramePool *pool) {
+    struct PoolBinding *binding = g_new0(struct PoolBinding, 1);
+    binding->pool = pool;
+
+    if (mpp_buffer_group_get_external(&binding->group, MPP_BUFFER_TYPE_DRM) != MPP_OK) {
+        LOGE("MPP: failed to get external buffer group");
+        g_free(binding);
+        return NULL;
     }
-    for (int i = 0; i < DECODER_MAX_FRAMES; ++i) {
-        if (vd->frame_map[i].fb_id) {
-            drmModeRmFB(vd->drm_fd, vd->frame_map[i].fb_id);
-            vd->frame_map[i].fb_id = 0;
-        }
-        if (vd->frame_map[i].prime_fd >= 0) {
-            close(vd->frame_map[i].prime_fd);
-            vd->frame_map[i].prime_fd = -1;
+
+    for (guint i = 0; i < frame_pool_size(pool); ++i) {
+        const FramePoolBuffer *buf = frame_pool_buffer(pool, i);
+        MppBufferInfo info;
+        memset(&info, 0, sizeof(info));
+        info.type = MPP_BUFFER_TYPE_DRM;
+        info.size = buf->size;
+        info.fd = buf->prime_fd;
+        MPP_RET ret = mpp_buffer_commit(binding->group, &info);
+        if (ret != MPP_OK) {
+            LOGW("MPP: buffer_commit failed (%d)", ret);
+            continue;
         }
-        if (vd->frame_map[i].handle) {
-            struct drm_mode_destroy_dumb dmd = {.handle = vd->frame_map[i].handle};
-            ioctl(vd->drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dmd);
-            vd->frame_map[i].handle = 0;
+        struct FrameSlot *slot = &binding->slots[binding->slot_count++];
+        slot->prime_fd = info.fd;
+        slot->fb_id = buf->fb_id;
+        slot->owns_fd = (info.fd != buf->prime_fd);
+    }
+    return binding;
+}
+
+/* Hands previous pools back once the display no longer shows any of their frames. */
+static void maybe_retire_pool(VideoDecoder *vd) {
+    for (guint i = vd->retiring->len; i-- > 0;) {
+        struct PoolBinding *binding = g_ptr_array_index(vd->retiring, i);
+        if (g_atomic_int_get(&binding->outstanding) == 0) {
+            LOGV("Video decoder: previous frame pool released by the display");
+            g_ptr_array_remove_index(vd->retiring, i);
+            unbind_pool(vd, binding);
         }
     }
-    mpp_buffer_group_clear(vd->frm_grp);
-    mpp_buffer_group_put(vd->frm_grp);
-    vd->frm_grp = NULL;
-    vd->src_w = 0;
-    vd->src_h = 0;
+}
+
+static void release_display_frame(void *token) {
+    struct DisplayToken *t = (struct DisplayToken *)token;
+    if (!g_atomic_int_dec_and_test(&t->refs)) {
+        return;
+    }
+    mpp_frame_deinit(&t->frame);
+    g_atomic_int_add(&t->binding->outstanding, -1);
+    g_free(t);
+}
+
+static inline guint64 stream_key_from_sps(const HevcSpsInfo *sps) {
+    if (sps->width == 0 || sps->height == 0) {
+        return 0;
+    }
+    return ((guint64)sps->width << 32) | ((guint64)(sps->height & 0xffffffu) << 8) | (sps->bit_depth_luma & 0xffu);
+}
+
+/* Displays pace independently, so each may hold a different set of frames. */
+static guint display_held_frames(VideoDecoder *vd) {
+    guint held = drm_display_max_held_frames(vd->display);
+    for (guint i = 0; i < vd->mirror_display_count; ++i) {
+        held += drm_display_max_held_frames(vd->mirror_displays[i]);
+    }
+    return held;
+}
+
+static int pool_count_for_dpb(VideoDecoder *vd, gint dpb) {
+    if (dpb <= 0) {
+        return DECODER_MAX_FRAMES;
+    }
+    return MIN(dpb + (int)display_held_frames(vd) + DECODER_POOL_MARGIN, DECODER_MAX_FRAMES);
 }
 
 static void set_control_verbose(MppApi *mpi, MppCtx ctx, MpiCmd control, RK_U32 enable) {
@@ -229,6 +342,21 @@ static void set_control_verbose(MppApi *mpi, MppCtx ctx, MpiCmd control, RK_U32
     }
 }
 
+static gboolean set_port_timeout(VideoDecoder *vd, MpiCmd timeout_cmd, MpiCmd block_cmd, RK_S64 timeout_ms,
+                                 const char *port) {
+    RK_S64 timeout = timeout_ms;
+    if (vd->mpi->control(vd->ctx, timeout_cmd, &timeout) == MPP_OK) {
+        return TRUE;
+    }
+    // Older MPP builds only understand the MppPollType flavour of the same knob.
+    MppPollType block = (MppPollType)timeout_ms;
+    if (vd->mpi->control(vd->ctx, block_cmd, &block) == MPP_OK) {
+        return TRUE;
+    }
+    LOGW("Video decoder: failed to set %s timeout; falling back to polling", port);
+    return FALSE;
+}
+
 static void set_mpp_decoding_parameters(VideoDecoder *vd) {
     MppDecCfg cfg = NULL;
     if (mpp_dec_cfg_init(&cfg) != MPP_OK) {
@@ -302,28 +430,10 @@ static gboolean setup_black_background(VideoDecoder *vd) {
             continue;
         }
 
-        drmModeObjectProperties *props = drmModeObjectGetProperties(vd->drm_fd, plane->plane_id, DRM_MODE_OBJECT_PLANE);
-        if (!props) {
-            drmModeFreePlane(plane);
-            continue;
-        }
-
-        gboolean is_primary = FALSE;
-        for (uint32_t p = 0; p < props->count_props; ++p) {
-            drmModePropertyRes *prop = drmModeGetProperty(vd->drm_fd, props->props[p]);
-            if (!prop) {
-                continue;
-            }
-            if (strcmp(prop->name, "type") == 0) {
-                if (props->prop_values[p] == DRM_PLANE_TYPE_PRIMARY) {
-                    is_primary = TRUE;
-                }
-                drmModeFreeProperty(prop);
-                break;
-            }
-            drmModeFreeProperty(prop);
-        }
-        drmModeFreeObjectProperties(props);
+        // "type" is immutable, so the cached value from the property table is current.
+        DrmPropInfo type;
+        gboolean is_primary = drm_prop_lookup(vd->drm_fd, plane->plane_id, DRM_MODE_OBJECT_PLANE, "type", &type) == 0 &&
+                              type.immutable_value == DRM_PLANE_TYPE_PRIMARY;
 
         if (is_primary) {
             primary_plane = plane->plane_id;
@@ -344,7 +454,7 @@ static gboolean setup_black_background(VideoDecoder *vd) {
         return FALSE;
     }
 
-    if (create_argb_fb(vd->drm_fd, vd->mode_w, vd->mode_h, 0xFF000000u, &vd->background_fb) != 0) {
+    if (create_black_fb(vd->drm_fd, vd->background_w, vd->background_h, &vd->background_fb) != 0) {
         LOGW("Video decoder: failed to allocate background FB: %s", g_strerror(errno));
         memset(&vd->background_fb, 0, sizeof(vd->background_fb));
         return FALSE;
@@ -410,6 +520,7 @@ static gboolean setup_black_background(VideoDecoder *vd) {
 
     vd->background_plane_id = primary_plane;
     vd->background_initialized = TRUE;
+    drm_display_set_background(vd->display, primary_plane, vd->background_w, vd->background_h);
     return TRUE;
 }
 
@@ -441,83 +552,15 @@ static void teardown_background(VideoDecoder *vd) {
     vd->background_has_zpos = FALSE;
 }
 
-static int commit_plane(VideoDecoder *vd, uint32_t fb_id, uint32_t src_w, uint32_t src_h) {
-    drmModeAtomicReq *req = drmModeAtomicAlloc();
-    if (!req) {
-        return -1;
-    }
-
-    if (src_w == 0) {
-        src_w = vd->src_w ? vd->src_w : (uint32_t)vd->mode_w;
-    } else {
-        vd->src_w = src_w;
-    }
-    if (src_h == 0) {
-        src_h = vd->src_h ? vd->src_h : (uint32_t)vd->mode_h;
-    } else {
-        vd->src_h = src_h;
-    }
-
-    uint32_t dst_w = vd->mode_w;
-    uint32_t dst_h = vd->mode_h;
-    uint32_t dst_x = 0;
-    uint32_t dst_y = 0;
-
-    if (src_w != 0 && src_h != 0) {
-        double mode_aspect = (double)vd->mode_w / (double)vd->mode_h;
-        double src_aspect = (double)src_w / (double)src_h;
-
-        if (mode_aspect > 0.0 && src_aspect > 0.0) {
-            if (src_aspect > mode_aspect) {
-                dst_w = vd->mode_w;
-                dst_h = (uint32_t)((double)vd->mode_w / src_aspect + 0.5);
-                if (dst_h > vd->mode_h) {
-                    dst_h = vd->mode_h;
-                }
-            } else {
-                dst_h = vd->mode_h;
-                dst_w = (uint32_t)((double)vd->mode_h * src_aspect + 0.5);
-                if (dst_w > vd->mode_w) {
-                    dst_w = vd->mode_w;
-                }
-            }
-        }
+/* Under the stream policy the CRTC may move to any of the connector's modes; cover the largest. */
+static void choose_background_size(VideoDecoder *vd, uint32_t connector_id) {
+    vd->background_w = vd->mode_w;
+    vd->background_h = vd->mode_h;
+    if (vd->mode_policy == MODE_POLICY_STREAM &&
+        drm_modeset_max_mode_size(vd->drm_fd, connector_id, &vd->background_w, &vd->background_h) != 0) {
+        vd->background_w = vd->mode_w;
+        vd->background_h = vd->mode_h;
     }
-
-    if (dst_w == 0) {
-        dst_w = 1;
-    }
-    if (dst_h == 0) {
-        dst_h = 1;
-    }
-
-    if (dst_w < vd->mode_w) {
-        dst_x = (vd->mode_w - dst_w) / 2;
-    }
-    if (dst_h < vd->mode_h) {
-        dst_y = (vd->mode_h - dst_h) / 2;
-    }
-
-    drmModeAtomicAddProperty(req, vd->plane_id, vd->prop_fb_id, fb_id);
-    drmModeAtomicAddProperty(req, vd->plane_id, vd->prop_crtc_id, vd->crtc_id);
-    drmModeAtomicAddProperty(req, vd->plane_id, vd->prop_crtc_x, dst_x);
-    drmModeAtomicAddProperty(req, vd->plane_id, vd->prop_crtc_y, dst_y);
-    drmModeAtomicAddProperty(req, vd->plane_id, vd->prop_crtc_w, dst_w);
-    drmModeAtomicAddProperty(req, vd->plane_id, vd->prop_crtc_h, dst_h);
-    drmModeAtomicAddProperty(req, vd->plane_id, vd->prop_src_x, 0);
-    drmModeAtomicAddProperty(req, vd->plane_id, vd->prop_src_y, 0);
-    drmModeAtomicAddProperty(req, vd->plane_id, vd->prop_src_w, (uint64_t)src_w << 16);
-    drmModeAtomicAddProperty(req, vd->plane_id, vd->prop_src_h, (uint64_t)src_h << 16);
-
-    int ret = drmModeAtomicCommit(vd->drm_fd, req, DRM_MODE_ATOMIC_NONBLOCK, NULL);
-    if (ret != 0 && errno == EBUSY) {
-        ret = drmModeAtomicCommit(vd->drm_fd, req, 0, NULL);
-    }
-    if (ret != 0) {
-        LOGW("Atomic commit failed: %s", g_strerror(errno));
-    }
-    drmModeAtomicFree(req);
-    return ret;
 }
 
 static int setup_external_buffers(VideoDecoder *vd, MppFrame frame) {
@@ -531,85 +574,80 @@ static int setup_external_buffers(VideoDecoder *vd, MppFrame frame) {
         LOGE("MPP: unexpected format %d", fmt);
         return -1;
     }
-
-    release_frame_group(vd);
-
-    if (mpp_buffer_group_get_external(&vd->frm_grp, MPP_BUFFER_TYPE_DRM) != MPP_OK) {
-        LOGE("MPP: failed to get external buffer group");
+    if (hor_stride == 0 || ver_stride == 0) {
+        LOGE("MPP: invalid strides %ux%u", hor_stride, ver_stride);
         return -1;
     }
 
-    reset_frame_map(vd);
+    /*
+     * MPP reports strides in bytes for both formats, so one plane of luma plus
+     * half of that for interleaved chroma is the whole frame. Trust MPP's own
+     * figure when it asks for more (e.g. trailing metadata).
+     */
+    size_t frame_size = MAX((size_t)mpp_frame_get_buf_size(frame), (size_t)hor_stride * ver_stride * 3 / 2);
+
+    g_mutex_lock(&vd->stats_lock);
+    HevcSpsInfo sps = vd->sps;
+    g_mutex_unlock(&vd->stats_lock);
+    gint dpb = g_atomic_int_get(&vd->stream_dpb);
+    guint display_held = display_held_frames(vd);
+
+    FramePoolGeometry geo;
+    memset(&geo, 0, sizeof(geo));
+    geo.format = (uint32_t)fmt;
+    geo.drm_fourcc = DRM_FORMAT_NV12;
+    geo.width = width;
+    geo.height = height;
+    geo.hor_stride = hor_stride;
+    geo.ver_stride = ver_stride;
+    geo.frame_size = frame_size;
+    geo.count = (guint)pool_count_for_dpb(vd, dpb);
+
+    guint64 wait_start_ns = get_time_ns();
+    FramePool *pool = frame_pool_cache_acquire(vd->pools, &geo);
+    guint64 wait_ns = get_time_ns() - wait_start_ns;
+    if (pool == NULL) {
+        LOGE("Video decoder: no frame buffers for %ux%u", width, height);
+        return -1;
+    }
+    struct PoolBinding *binding = bind_pool(pool);
+    if (binding == NULL) {
+        frame_pool_cache_release(vd->pools, pool);
+        return -1;
+    }
 
-    for (int i = 0; i < DECODER_MAX_FRAMES; ++i) {
-        struct drm_mode_create_dumb dmcd;
-        memset(&dmcd, 0, sizeof(dmcd));
-        dmcd.bpp = (fmt == MPP_FMT_YUV420SP) ? 8 : 10;
-        dmcd.width = hor_stride;
-        dmcd.height = ver_stride * 2;
+    guint64 stream_key = stream_key_from_sps(&sps);
+    frame_pool_cache_learn(vd->pools, stream_key, &geo);
+    g_mutex_lock(&vd->stats_lock);
+    vd->bound_stream_key = stream_key;
+    vd->stats.pool_buffers = binding->slot_count;
+    vd->stats.pool_bytes = frame_pool_bytes(pool);
+    g_mutex_unlock(&vd->stats_lock);
 
-        int ret;
-        do {
-            ret = ioctl(vd->drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &dmcd);
-        } while (ret == -1 && (errno == EINTR || errno == EAGAIN));
-        if (ret != 0) {
-            LOGW("DRM_IOCTL_MODE_CREATE_DUMB failed: %s", g_strerror(errno));
-            continue;
-        }
-        vd->frame_map[i].handle = dmcd.handle;
-
-        struct drm_prime_handle dph;
-        memset(&dph, 0, sizeof(dph));
-        dph.handle = dmcd.handle;
-        dph.fd = -1;
-        do {
-            ret = ioctl(vd->drm_fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &dph);
-        } while (ret == -1 && (errno == EINTR || errno == EAGAIN));
-        if (ret != 0) {
-            LOGW("PRIME_HANDLE_TO_FD failed: %s", g_strerror(errno));
-            continue;
-        }
+    guint64 fixed_bytes = (guint64)DECODER_MAX_FRAMES * hor_stride * ver_stride * 2;
+    LOGI("Video decoder: frame pool for %ux%u (stride %ux%u): %u x %.2f MiB = %.1f MiB "
+         "(DPB %d + %u display + %d margin; fixed %d-frame layout would take %.1f MiB), ready after %.1f ms",
+         width, height, hor_stride, ver_stride, binding->slot_count, frame_size / (1024.0 * 1024.0),
+         frame_pool_bytes(pool) / (1024.0 * 1024.0), dpb, display_held, DECODER_POOL_MARGIN, DECODER_MAX_FRAMES,
+         fixed_bytes / (1024.0 * 1024.0), wait_ns / 1e6);
+    if (dpb <= 0) {
+        LOGW("Video decoder: no SPS seen before the format change; using the full %u-frame pool", geo.count);
+    }
 
-        MppBufferInfo info;
-        memset(&info, 0, sizeof(info));
-        info.type = MPP_BUFFER_TYPE_DRM;
-        info.size = dmcd.size;
-        info.fd = dph.fd;
-        ret = mpp_buffer_commit(vd->frm_grp, &info);
-        if (ret != MPP_OK) {
-            LOGW("MPP: buffer_commit failed (%d)", ret);
-            close(dph.fd);
-            continue;
-        }
-        vd->frame_map[i].prime_fd = info.fd;
-        if (dph.fd != info.fd) {
-            close(dph.fd);
-        }
-
-        uint32_t handles[4] = {0};
-        uint32_t pitches[4] = {0};
-        uint32_t offsets[4] = {0};
-        handles[0] = vd->frame_map[i].handle;
-        handles[1] = vd->frame_map[i].handle;
-        pitches[0] = dmcd.pitch;
-        pitches[1] = dmcd.pitch;
-        offsets[0] = 0;
-        offsets[1] = dmcd.pitch * ver_stride;
-
-        ret = drmModeAddFB2(vd->drm_fd, width, height, DRM_FORMAT_NV12, handles, pitches, offsets,
-                            &vd->frame_map[i].fb_id, 0);
-        if (ret != 0) {
-            LOGW("drmModeAddFB2 failed: %s", g_strerror(errno));
-            continue;
-        }
+    // Whatever is on screen keeps its buffers until a frame from the new pool replaces it,
+    // even when the format changes again before that happens.
+    if (vd->binding != NULL) {
+        g_ptr_array_add(vd->retiring, vd->binding);
     }
+    vd->binding = binding;
+    maybe_retire_pool(vd);
 
-    vd->mpi->control(vd->ctx, MPP_DEC_SET_EXT_BUF_GROUP, vd->frm_grp);
+    vd->mpi->control(vd->ctx, MPP_DEC_SET_EXT_BUF_GROUP, binding->group);
     vd->mpi->control(vd->ctx, MPP_DEC_SET_INFO_CHANGE_READY, NULL);
-
-    vd->src_w = width;
-    vd->src_h = height;
-    commit_plane(vd, vd->frame_map[0].fb_id, width, height);
+    drm_display_note_stream(vd->display, (int)width, (int)height);
+    for (guint i = 0; i < vd->mirror_display_count; ++i) {
+        drm_display_note_stream(vd->mirror_displays[i], (int)width, (int)height);
+    }
     return 0;
 }
 
@@ -620,40 +658,50 @@ static gpointer frame_thread_func(gpointer data) {
         if (!vd->running) {
             break;
         }
+        maybe_retire_pool(vd);
+
         MppFrame frame = NULL;
         MPP_RET ret = vd->mpi->decode_get_frame(vd->ctx, &frame);
         if (ret != MPP_OK || frame == NULL) {
-            g_usleep(1000);
+            // With a blocking output port a timeout is just the stop check; errors still back off.
+            if (!vd->output_blocking || (ret != MPP_OK && ret != MPP_ERR_TIMEOUT)) {
+                g_usleep(1000);
+            }
             continue;
         }
 
+        gboolean eos = mpp_frame_get_eos(frame) ? TRUE : FALSE;
         if (mpp_frame_get_info_change(frame)) {
             setup_external_buffers(vd, frame);
         } else {
             RK_U32 errinfo = mpp_frame_get_errinfo(frame);
             RK_U32 discard = mpp_frame_get_discard(frame);
+            MppBuffer buffer = mpp_frame_get_buffer(frame);
             if (G_UNLIKELY(errinfo || discard)) {
                 LOGW("MPP: dropping frame errinfo=%u discard=%u", errinfo, discard);
-                vd->eos_received = mpp_frame_get_eos(frame) ? TRUE : FALSE;
-                mpp_frame_deinit(&frame);
-                if (vd->eos_received) {
-                    break;
-                }
-                continue;
-            }
-
-            MppBuffer buffer = mpp_frame_get_buffer(frame);
-            if (buffer != NULL) {
+            } else if (buffer != NULL && vd->binding != NULL) {
                 MppBufferInfo info;
                 memset(&info, 0, sizeof(info));
                 if (mpp_buffer_info_get(buffer, &info) == MPP_OK) {
-                    for (int i = 0; i < DECODER_MAX_FRAMES; ++i) {
-                        if (vd->frame_map[i].prime_fd == info.fd) {
-                            g_mutex_lock(&vd->lock);
-                            vd->pending_fb = vd->frame_map[i].fb_id;
-                            vd->pending_pts = mpp_frame_get_pts(frame);
-                            g_cond_signal(&vd->cond);
-                            g_mutex_unlock(&vd->lock);
+                    struct PoolBinding *binding = vd->binding;
+                    for (guint i = 0; i < binding->slot_count; ++i) {
+                        if (binding->slots[i].prime_fd == info.fd) {
+                            // The display keeps the frame (and its buffer) until the next flip retires it.
+                            // Every head scans out the same fb; nothing is copied.
+                            struct DisplayToken *token = g_new(struct DisplayToken, 1);
+                            token->frame = frame;
+                            token->binding = binding;
+                            token->refs = 1 + (gint)vd->mirror_display_count;
+                            g_atomic_int_inc(&binding->outstanding);
+                            uint32_t fb_id = binding->slots[i].fb_id;
+                            RK_U32 w = mpp_frame_get_width(frame);
+                            RK_U32 h = mpp_frame_get_height(frame);
+                            RK_S64 pts = mpp_frame_get_pts(frame);
+                            frame = NULL;
+                            drm_display_submit(vd->display, fb_id, w, h, pts, token);
+                            for (guint m = 0; m < vd->mirror_display_count; ++m) {
+                                drm_display_submit(vd->mirror_displays[m], fb_id, w, h, pts, token);
+                            }
                             break;
                         }
                     }
@@ -661,8 +709,10 @@ static gpointer frame_thread_func(gpointer data) {
             }
         }
 
-        vd->eos_received = mpp_frame_get_eos(frame) ? TRUE : FALSE;
-        mpp_frame_deinit(&frame);
+        vd->eos_received = eos;
+        if (frame != NULL) {
+            mpp_frame_deinit(&frame);
+        }
         if (vd->eos_received) {
             break;
         }
@@ -676,83 +726,102 @@ static gpointer frame_thread_func(gpointer data) {
     return NULL;
 }
 
-static gpointer display_thread_func(gpointer data) {
-    VideoDecoder *vd = (VideoDecoder *)data;
-    vd->display_thread_running = TRUE;
-    while (TRUE) {
-        g_mutex_lock(&vd->lock);
-        while (vd->running && vd->pending_fb == 0) {
-            g_cond_wait(&vd->cond, &vd->lock);
-        }
-        uint32_t fb = vd->pending_fb;
-        vd->pending_fb = 0;
-        gboolean still_running = vd->running;
-        g_mutex_unlock(&vd->lock);
-
-        if (!still_running && fb == 0) {
-            break;
-        }
-        if (fb != 0) {
-            commit_plane(vd, fb, 0, 0);
-        }
-        if (!still_running) {
-            break;
-        }
+static void release_feed_source(struct FeedSource *src) {
+    if (src->mapped) {
+        gst_buffer_unmap(src->buffer, &src->map);
+        src->mapped = FALSE;
+    }
+    if (src->buffer != NULL) {
+        gst_buffer_unref(src->buffer);
+        src->buffer = NULL;
     }
-    vd->display_thread_running = FALSE;
-    return NULL;
 }
 
-size_t video_decoder_max_packet_size(const VideoDecoder *vd) {
-    if (vd == NULL || vd->packet_buf_size == 0) {
-        return DECODER_READ_BUF_SIZE;
+static gboolean ensure_au_slab(VideoDecoder *vd, size_t size) {
+    if (size <= vd->au_slab_size && vd->au_slab != NULL) {
+        return TRUE;
+    }
+    size_t new_size = vd->au_slab_size ? vd->au_slab_size : DECODER_AU_SLAB_INITIAL;
+    while (new_size < size) {
+        new_size *= 2;
     }
-    return vd->packet_buf_size;
+    guint8 *slab = g_try_malloc(new_size);
+    if (slab == NULL) {
+        LOGE("Video decoder: failed to grow AU slab to %zu bytes", new_size);
+        return FALSE;
+    }
+    g_free(vd->au_slab);
+    vd->au_slab = slab;
+    vd->au_slab_size = new_size;
+    LOGV("Video decoder: AU slab grown to %zu bytes", new_size);
+    return TRUE;
 }
 
-int video_decoder_init(VideoDecoder *vd, const AppCfg *cfg, const ModesetResult *ms, int drm_fd) {
-    if (vd == NULL || cfg == NULL || ms == NULL) {
+int video_decoder_init(VideoDecoder *vd, const AppCfg *cfg, const ModesetResult *ms, int head_count, int drm_fd,
+                       FramePoolCache *pools) {
+    if (vd == NULL || cfg == NULL || ms == NULL || head_count < 1) {
         return -1;
     }
 
     log_decoder_neon_status_once();
 
     memset(vd, 0, sizeof(*vd));
+    g_mutex_init(&vd->stats_lock);
+    vd->stats_lock_initialized = TRUE;
     vd->drm_fd = -1;
     vd->plane_id = (uint32_t)cfg->plane_id;
     vd->crtc_id = ms->crtc_id;
     vd->mode_w = ms->mode_w;
     vd->mode_h = ms->mode_h;
-    vd->packet_buf_size = DECODER_READ_BUF_SIZE;
-    vd->packet_buf = g_malloc0(vd->packet_buf_size);
-    if (vd->packet_buf == NULL) {
-        LOGE("Video decoder: failed to allocate packet buffer");
+    if (!ensure_au_slab(vd, DECODER_AU_SLAB_INITIAL)) {
         return -1;
     }
 
     int dup_fd = fcntl(drm_fd, F_DUPFD_CLOEXEC, 0);
     if (dup_fd < 0) {
         LOGE("Video decoder: failed to dup DRM fd: %s", g_strerror(errno));
-        g_free(vd->packet_buf);
-        vd->packet_buf = NULL;
+        g_free(vd->au_slab);
+        vd->au_slab = NULL;
+        vd->au_slab_size = 0;
         return -1;
     }
     vd->drm_fd = dup_fd;
+    vd->retiring = g_ptr_array_new();
+
+    vd->pools = pools;
+    if (vd->pools == NULL) {
+        vd->pools = frame_pool_cache_new(vd->drm_fd);
+        vd->owns_pools = TRUE;
+        if (vd->pools == NULL) {
+            video_decoder_deinit(vd);
+            return -1;
+        }
+    }
 
-    if (drm_get_prop_id(vd->drm_fd, vd->plane_id, DRM_MODE_OBJECT_PLANE, "FB_ID", &vd->prop_fb_id) != 0 ||
-        drm_get_prop_id(vd->drm_fd, vd->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_ID", &vd->prop_crtc_id) != 0 ||
-        drm_get_prop_id(vd->drm_fd, vd->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_X", &vd->prop_crtc_x) != 0 ||
-        drm_get_prop_id(vd->drm_fd, vd->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_Y", &vd->prop_crtc_y) != 0 ||
-        drm_get_prop_id(vd->drm_fd, vd->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_W", &vd->prop_crtc_w) != 0 ||
-        drm_get_prop_id(vd->drm_fd, vd->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_H", &vd->prop_crtc_h) != 0 ||
-        drm_get_prop_id(vd->drm_fd, vd->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_X", &vd->prop_src_x) != 0 ||
-        drm_get_prop_id(vd->drm_fd, vd->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_Y", &vd->prop_src_y) != 0 ||
-        drm_get_prop_id(vd->drm_fd, vd->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_W", &vd->prop_src_w) != 0 ||
-        drm_get_prop_id(vd->drm_fd, vd->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_H", &vd->prop_src_h) != 0) {
-        LOGE("Video decoder: failed to query plane properties");
+    vd->display = drm_display_new(vd->drm_fd, cfg, ms, release_display_frame);
+    if (vd->display == NULL) {
+        LOGE("Video decoder: failed to set up display for plane %u", vd->plane_id);
         video_decoder_deinit(vd);
         return -1;
     }
+    for (int i = 1; i < head_count && i < DRM_MAX_HEADS; ++i) {
+        if (drm_display_add_mirror(vd->display, &ms[i]) == 0) {
+            continue;
+        }
+        DrmDisplay *md = drm_display_new(vd->drm_fd, cfg, &ms[i], release_display_frame);
+        if (md == NULL) {
+            LOGW("Video decoder: failed to set up mirror display for plane %u", ms[i].plane_id);
+            continue;
+        }
+        LOGI("Video decoder: connector %u mirrors with its own pacing (%d Hz)", ms[i].connector_id, ms[i].mode_hz);
+        vd->mirror_connectors[vd->mirror_display_count] = ms[i].connector_id;
+        vd->mirror_displays[vd->mirror_display_count++] = md;
+    }
+
+    // The CRTC may still be in a mode an earlier pipeline's policy chose.
+    drm_display_get_mode(vd->display, &vd->mode_w, &vd->mode_h, NULL);
+    vd->mode_policy = cfg->mode_policy;
+    choose_background_size(vd, ms->connector_id);
 
     if (!setup_black_background(vd)) {
         LOGW("Video decoder: continuing without background plane");
@@ -764,7 +833,7 @@ int video_decoder_init(VideoDecoder *vd, const AppCfg *cfg, const ModesetResult
         return -1;
     }
 
-    if (mpp_packet_init(&vd->packet, vd->packet_buf, vd->packet_buf_size) != MPP_OK) {
+    if (mpp_packet_init(&vd->packet, vd->au_slab, vd->au_slab_size) != MPP_OK) {
         LOGE("Video decoder: mpp_packet_init failed");
         video_decoder_deinit(vd);
         return -1;
@@ -782,26 +851,15 @@ int video_decoder_init(VideoDecoder *vd, const AppCfg *cfg, const ModesetResult
 
     set_mpp_decoding_parameters(vd);
 
-#if defined(MPP_SET_OUTPUT_TIMEOUT)
-    int64_t timeout = 5000; // allow decode_get_frame() to wake at ~5 ms intervals
-    if (vd->mpi->control(vd->ctx, MPP_SET_OUTPUT_TIMEOUT, &timeout) != MPP_OK) {
-        LOGW("Video decoder: failed to set output timeout");
-    }
-#else
-    int block = 5; // poll with a small timeout so shutdown does not block indefinitely
-    if (vd->mpi->control(vd->ctx, MPP_SET_OUTPUT_BLOCK, &block) != MPP_OK) {
-        LOGW("Video decoder: failed to set output block timeout");
-    }
-#endif
+    vd->input_blocking = set_port_timeout(vd, MPP_SET_INPUT_TIMEOUT, MPP_SET_INPUT_BLOCK,
+                                          DECODER_INPUT_TIMEOUT_MS, "input");
+    vd->output_blocking = set_port_timeout(vd, MPP_SET_OUTPUT_TIMEOUT, MPP_SET_OUTPUT_BLOCK,
+                                           DECODER_OUTPUT_TIMEOUT_MS, "output");
 
     g_mutex_init(&vd->lock);
     g_cond_init(&vd->cond);
     vd->lock_initialized = TRUE;
     vd->cond_initialized = TRUE;
-    vd->pending_fb = 0;
-    vd->pending_pts = 0;
-    vd->frm_grp = NULL;
-    reset_frame_map(vd);
 
     vd->initialized = TRUE;
     return 0;
@@ -818,6 +876,16 @@ void video_decoder_deinit(VideoDecoder *vd) {
         mpp_packet_deinit(&vd->packet);
         vd->packet = NULL;
     }
+    release_feed_source(&vd->feed_src);
+
+    // Return every frame still held for scanout before MPP goes away.
+    for (guint i = 0; i < vd->mirror_display_count; ++i) {
+        drm_display_free(vd->mirror_displays[i]);
+        vd->mirror_displays[i] = NULL;
+    }
+    vd->mirror_display_count = 0;
+    drm_display_free(vd->display);
+    vd->display = NULL;
 
     if (vd->mpi && vd->ctx) {
         vd->mpi->reset(vd->ctx);
@@ -826,13 +894,27 @@ void video_decoder_deinit(VideoDecoder *vd) {
     vd->ctx = NULL;
     vd->mpi = NULL;
 
-    release_frame_group(vd);
+    if (vd->retiring != NULL) {
+        for (guint i = 0; i < vd->retiring->len; ++i) {
+            unbind_pool(vd, g_ptr_array_index(vd->retiring, i));
+        }
+        g_ptr_array_free(vd->retiring, TRUE);
+        vd->retiring = NULL;
+    }
+    unbind_pool(vd, vd->binding);
+    vd->binding = NULL;
+    if (vd->owns_pools) {
+        frame_pool_cache_free(vd->pools);
+        vd->owns_pools = FALSE;
+    }
+    vd->pools = NULL;
 
     teardown_background(vd);
 
-    if (vd->packet_buf) {
-        g_free(vd->packet_buf);
-        vd->packet_buf = NULL;
+    if (vd->au_slab) {
+        g_free(vd->au_slab);
+        vd->au_slab = NULL;
+        vd->au_slab_size = 0;
     }
 
     if (vd->drm_fd >= 0) {
@@ -848,6 +930,16 @@ void video_decoder_deinit(VideoDecoder *vd) {
         g_cond_clear(&vd->cond);
         vd->cond_initialized = FALSE;
     }
+    if (vd->initialized) {
+        LOGI("Video decoder: %" G_GUINT64_FORMAT " packets fed, %" G_GUINT64_FORMAT
+             " put retries, %.1f ms waiting on MPP input (max %.1f ms)",
+             vd->stats.packets_fed, vd->stats.put_retries, vd->stats.put_wait_ns / 1e6,
+             vd->stats.put_wait_max_ns / 1e6);
+    }
+    if (vd->stats_lock_initialized) {
+        g_mutex_clear(&vd->stats_lock);
+        vd->stats_lock_initialized = FALSE;
+    }
     vd->initialized = FALSE;
 }
 
@@ -859,19 +951,25 @@ int video_decoder_start(VideoDecoder *vd) {
         return 0;
     }
 
+    if (drm_display_start(vd->display) != 0) {
+        return -1;
+    }
+    for (guint i = 0; i < vd->mirror_display_count; ++i) {
+        if (drm_display_start(vd->mirror_displays[i]) != 0) {
+            LOGW("Video decoder: mirror display for connector %u did not start", vd->mirror_connectors[i]);
+        }
+    }
+
     vd->running = TRUE;
     vd->eos_received = FALSE;
 
     vd->frame_thread = g_thread_new("mpp-frame", frame_thread_func, vd);
     if (vd->frame_thread == NULL) {
         vd->running = FALSE;
-        return -1;
-    }
-    vd->display_thread = g_thread_new("mpp-display", display_thread_func, vd);
-    if (vd->display_thread == NULL) {
-        vd->running = FALSE;
-        g_thread_join(vd->frame_thread);
-        vd->frame_thread = NULL;
+        drm_display_stop(vd->display);
+        for (guint i = 0; i < vd->mirror_display_count; ++i) {
+            drm_display_stop(vd->mirror_displays[i]);
+        }
         return -1;
     }
     return 0;
@@ -913,38 +1011,158 @@ void video_decoder_stop(VideoDecoder *vd) {
         g_thread_join(vd->frame_thread);
         vd->frame_thread = NULL;
     }
-    if (vd->display_thread) {
-        g_thread_join(vd->display_thread);
-        vd->display_thread = NULL;
+    drm_display_stop(vd->display);
+    for (guint i = 0; i < vd->mirror_display_count; ++i) {
+        drm_display_stop(vd->mirror_displays[i]);
     }
 }
 
-int video_decoder_feed(VideoDecoder *vd, const guint8 *data, size_t size, GstClockTime pts) {
-    if (vd == NULL || !vd->running) {
-        return -1;
+static void note_stream_sps(VideoDecoder *vd, const guint8 *data, size_t size) {
+    const guint8 *nal = NULL;
+    size_t nal_size = 0;
+    if (!hevc_find_sps(data, size, &nal, &nal_size)) {
+        return;
     }
-    if (size == 0 || size > vd->packet_buf_size) {
-        return -1;
+    HevcSpsInfo info;
+    if (hevc_parse_sps(nal, nal_size, &info) != 0) {
+        LOGV("Video decoder: ignoring unparsable SPS (%zu bytes)", nal_size);
+        return;
+    }
+    g_mutex_lock(&vd->stats_lock);
+    gboolean changed = memcmp(&info, &vd->sps, sizeof(info)) != 0;
+    vd->sps = info;
+    guint64 key = stream_key_from_sps(&info);
+    gboolean prefetch = key != vd->bound_stream_key && key != vd->prefetch_stream_key;
+    if (prefetch) {
+        vd->prefetch_stream_key = key;
     }
+    g_mutex_unlock(&vd->stats_lock);
+    g_atomic_int_set(&vd->stream_dpb, (gint)info.max_dec_pic_buffering);
 
-    copy_packet_data(vd->packet_buf, data, size);
-    mpp_packet_set_length(vd->packet, 0);
-    mpp_packet_set_size(vd->packet, vd->packet_buf_size);
-    mpp_packet_set_data(vd->packet, vd->packet_buf);
-    mpp_packet_set_pos(vd->packet, vd->packet_buf);
+    if (changed) {
+        LOGI("Video decoder: SPS %ux%u, %u-bit, level %u.%u, DPB %u (reorder %u)", info.width, info.height,
+             info.bit_depth_luma, info.general_level_idc / 30, (info.general_level_idc % 30) / 3,
+             info.max_dec_pic_buffering, info.max_num_reorder);
+    }
+    // A layout we have decoded before: get its pool built while MPP is still parsing up to the format change.
+    if (prefetch &&
+        frame_pool_cache_prefetch(vd->pools, key, (guint)pool_count_for_dpb(vd, (gint)info.max_dec_pic_buffering))) {
+        LOGV("Video decoder: prefetching frame pool for %ux%u", info.width, info.height);
+    }
+}
+
+/* A blocking input port has already waited out these; anything else would come straight back. */
+static gboolean put_waited(const VideoDecoder *vd, MPP_RET ret) {
+    return vd->input_blocking && (ret == MPP_ERR_TIMEOUT || ret == MPP_ERR_BUFFER_FULL);
+}
+
+static int put_packet(VideoDecoder *vd, const guint8 *data, size_t size, GstClockTime pts) {
+    note_stream_sps(vd, data, size);
+
+    /*
+     * The packet only borrows the caller's memory: with split_parse enabled
+     * MPP copies the bitstream into its own parser buffer before
+     * decode_put_packet() returns, so no staging copy is needed here.
+     */
+    mpp_packet_set_data(vd->packet, (void *)data);
+    mpp_packet_set_size(vd->packet, size);
+    mpp_packet_set_pos(vd->packet, (void *)data);
     mpp_packet_set_length(vd->packet, size);
     RK_S64 packet_pts = gst_pts_to_mpp_timestamp(pts);
     mpp_packet_set_pts(vd->packet, packet_pts);
     mpp_packet_set_dts(vd->packet, packet_pts);
 
+    guint64 start_ns = get_time_ns();
+    guint64 retries = 0;
+    int result = -1;
     while (vd->running) {
         MPP_RET ret = vd->mpi->decode_put_packet(vd->ctx, vd->packet);
         if (ret == MPP_OK) {
-            return 0;
+            result = 0;
+            break;
+        }
+        if (ret != MPP_ERR_TIMEOUT && ret != MPP_ERR_BUFFER_FULL && retries == 0) {
+            LOGW("Video decoder: decode_put_packet failed (%d); retrying", ret);
+        }
+        ++retries;
+        if (!put_waited(vd, ret)) {
+            g_usleep(2000);
+        }
+    }
+
+    guint64 wait_ns = retries > 0 ? get_time_ns() - start_ns : 0;
+    if (result == 0) {
+        // The pacer times decode latency from when the bitstream reached us.
+        drm_display_note_feed(vd->display, packet_pts, start_ns);
+        for (guint i = 0; i < vd->mirror_display_count; ++i) {
+            drm_display_note_feed(vd->mirror_displays[i], packet_pts, start_ns);
         }
-        g_usleep(2000);
     }
-    return -1;
+    g_mutex_lock(&vd->stats_lock);
+    if (result == 0) {
+        vd->stats.packets_fed++;
+    }
+    vd->stats.put_retries += retries;
+    vd->stats.put_wait_ns += wait_ns;
+    if (wait_ns > vd->stats.put_wait_max_ns) {
+        vd->stats.put_wait_max_ns = wait_ns;
+    }
+    g_mutex_unlock(&vd->stats_lock);
+    return result;
+}
+
+int video_decoder_feed_buffer(VideoDecoder *vd, GstBuffer *buffer, GstClockTime pts) {
+    if (vd == NULL || !vd->running || buffer == NULL) {
+        return -1;
+    }
+
+    gsize size = gst_buffer_get_size(buffer);
+    if (size == 0) {
+        return -1;
+    }
+
+    struct FeedSource *src = &vd->feed_src;
+    src->buffer = gst_buffer_ref(buffer);
+
+    const guint8 *data = NULL;
+    guint n_mem = gst_buffer_n_memory(buffer);
+    if (n_mem == 1) {
+        if (!gst_buffer_map(src->buffer, &src->map, GST_MAP_READ)) {
+            LOGW("Video decoder: failed to map access unit (%" G_GSIZE_FORMAT " bytes)", size);
+            release_feed_source(src);
+            return -1;
+        }
+        src->mapped = TRUE;
+        data = src->map.data;
+        size = src->map.size;
+    } else {
+        // Scattered AU: gather into the slab rather than letting GStreamer
+        // allocate a fresh merged block for every map.
+        if (!ensure_au_slab(vd, size)) {
+            release_feed_source(src);
+            return -1;
+        }
+        size_t offset = 0;
+        for (guint i = 0; i < n_mem && offset < size; ++i) {
+            GstMemory *mem = gst_buffer_peek_memory(buffer, i);
+            GstMapInfo mmap;
+            if (!gst_memory_map(mem, &mmap, GST_MAP_READ)) {
+                LOGW("Video decoder: failed to map AU memory %u/%u", i + 1, n_mem);
+                release_feed_source(src);
+                return -1;
+            }
+            size_t chunk = MIN(mmap.size, size - offset);
+            copy_packet_data(vd->au_slab + offset, mmap.data, chunk);
+            offset += chunk;
+            gst_memory_unmap(mem, &mmap);
+        }
+        data = vd->au_slab;
+        size = offset;
+    }
+
+    int ret = put_packet(vd, data, size, pts);
+    release_feed_source(src);
+    return ret;
 }
 
 void video_decoder_send_eos(VideoDecoder *vd) {
@@ -953,9 +1171,9 @@ void video_decoder_send_eos(VideoDecoder *vd) {
     }
 
     mpp_packet_set_length(vd->packet, 0);
-    mpp_packet_set_size(vd->packet, vd->packet_buf_size);
-    mpp_packet_set_data(vd->packet, vd->packet_buf);
-    mpp_packet_set_pos(vd->packet, vd->packet_buf);
+    mpp_packet_set_size(vd->packet, vd->au_slab_size);
+    mpp_packet_set_data(vd->packet, vd->au_slab);
+    mpp_packet_set_pos(vd->packet, vd->au_slab);
     mpp_packet_set_eos(vd->packet);
 
     int attempts = 0;
@@ -971,6 +1189,63 @@ void video_decoder_send_eos(VideoDecoder *vd) {
             LOGW("Video decoder: giving up on EOS after %d attempts", attempts);
             break;
         }
-        g_usleep(2000);
+        if (!put_waited(vd, ret)) {
+            g_usleep(2000);
+        }
+    }
+}
+
+void video_decoder_display_hold(VideoDecoder *vd) {
+    if (vd == NULL || !vd->initialized) {
+        return;
+    }
+    drm_display_hold(vd->display);
+    for (guint i = 0; i < vd->mirror_display_count; ++i) {
+        drm_display_hold(vd->mirror_displays[i]);
+    }
+}
+
+void video_decoder_display_rebind(VideoDecoder *vd, const ModesetResult *ms, int head_count) {
+    if (vd == NULL || !vd->initialized || ms == NULL || head_count < 1) {
+        return;
+    }
+    // The display is held, so the planes are ours until the rebind releases it.
+    vd->crtc_id = ms->crtc_id;
+    vd->mode_w = ms->mode_w;
+    vd->mode_h = ms->mode_h;
+    teardown_background(vd);
+    choose_background_size(vd, ms->connector_id);
+    if (!setup_black_background(vd)) {
+        LOGW("Video decoder: continuing without background plane");
+    }
+    drm_display_rebind(vd->display, ms, ms + 1, head_count - 1);
+    // A mirror whose connector did not come back stays held on its last frame.
+    for (guint i = 0; i < vd->mirror_display_count; ++i) {
+        for (int h = 1; h < head_count; ++h) {
+            if (ms[h].connector_id == vd->mirror_connectors[i]) {
+                drm_display_rebind(vd->mirror_displays[i], &ms[h], NULL, 0);
+                break;
+            }
+        }
+    }
+}
+
+DrmDisplay *video_decoder_display(VideoDecoder *vd) {
+    if (vd == NULL || !vd->initialized) {
+        return NULL;
+    }
+    return vd->display;
+}
+
+void video_decoder_get_stats(VideoDecoder *vd, VideoDecoderStats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    memset(stats, 0, sizeof(*stats));
+    if (vd == NULL || !vd->initialized) {
+        return;
     }
+    g_mutex_lock(&vd->stats_lock);
+    *stats = vd->stats;
+    g_mutex_unlock(&vd->stats_lock);
 }
@@ -1,8 +1,15 @@
+#define _GNU_SOURCE
+
 #include "video_recorder.h"
 
 #include "logging.h"
+#include "record_io.h"
+#include "record_policy.h"
+#include "record_retention.h"
+#include "record_stream.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gst/app/gstappsink.h>
@@ -10,9 +17,13 @@
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
 
 #define MINIMP4_IMPLEMENTATION
 #define MP4E_MAX_TRACKS 1
+#define MP4D_TFDT_SUPPORT 1
 #if defined(__GNUC__) && !defined(__clang_analyzer__)
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-function"
@@ -23,20 +34,51 @@
 #pragma GCC diagnostic pop
 #endif
 
+/*
+ * Bounds on what the writer may lag behind. Past either one the recorder
+ * drops AUs until the next keyframe, so what is written stays decodable.
+ */
+#define RECORD_QUEUE_MAX_AUS 512
+#define RECORD_QUEUE_MAX_BYTES (48u * 1024u * 1024u)
+#define RECORD_WRITER_NICE 10
+/* Storage pressure is judged over windows this long; free space is checked as often. */
+#define RECORD_POLICY_WINDOW_US G_TIME_SPAN_SECOND
+
+/* An AU handed from the appsink thread to the writer thread. */
+struct RecordItem {
+    GstBuffer *buffer;
+    GstClockTime pts;
+    GstClockTime duration;
+    gsize size;
+    gboolean keyframe;
+    /* AUs were left out right before this one. */
+    gboolean discontinuity;
+    /* Set on the first item only; the writer takes the stream geometry from it. */
+    GstCaps *caps;
+};
+
 struct PendingSample {
     GstBuffer *buffer;
     GstClockTime pts;
     GstClockTime duration;
+    gboolean keyframe;
     gboolean valid;
 };
 
 struct VideoRecorder {
     gboolean enabled;
-    gboolean failed;
-    FILE *fp;
+    /* Set by the writer thread, read by the appsink thread (atomic). */
+    gint failed;
+    RecordIo *io;
     MP4E_mux_t *mux;
     mp4_h26x_writer_t writer;
     gboolean writer_initialized;
+    /* ts and annexb modes write through a RecordStream instead of the muxer. */
+    gboolean streaming;
+    RecordStreamFormat stream_format;
+    RecordStream *stream;
+    /* A stream file starts at the first keyframe; nothing before it decodes. */
+    gboolean stream_synced;
     guint width;
     guint height;
     guint64 default_duration_90k;
@@ -45,14 +87,93 @@ struct VideoRecorder {
     RecordMode mode;
     int sequential_mode_flag;
     int enable_fragmentation;
+    guint fragment_ms;
     struct PendingSample pending;
     gboolean awaiting_sync_warning;
     guint64 bytes_written;
     guint64 total_duration_90k;
     guint64 start_time_ns;
+    guint64 aus_written;
+    /* Annex B bytes handed to the muxer and muxer write calls, for the container overhead. */
+    guint64 au_bytes;
+    guint64 mux_writes;
+    /* Block writer stats of the files already closed, summed. */
+    RecordIoStats io_totals;
     GMutex stats_lock;
+    /* Unlinked sidecar the muxer spills its sample index to; -1 until the first spill. */
+    int index_fd;
+    guint64 index_spilled;
+
+    /*
+     * Segmented recording: at the first keyframe past either limit the writer
+     * moves on to stem-NNNN.ext. With a budget, the oldest recordings in the
+     * directory (prefix*ext) are deleted to make room for the next segment.
+     */
+    guint64 segment_max_90k;
+    guint64 segment_max_bytes;
+    guint64 budget_bytes;
+    gchar *segment_dir;
+    gchar *segment_stem;
+    gchar *segment_ext;
+    gchar *segment_prefix;
+    guint segment_index;
+    guint64 segment_start_90k;
+    guint64 segment_start_bytes;
+    guint64 last_segment_bytes;
+    gboolean budget_warned;
+
+    /*
+     * Queue from the appsink thread to the writer thread, which does all the
+     * muxing and file I/O and, once closing is set, finalises the file and
+     * frees the recorder.
+     */
+    GMutex queue_lock;
+    GCond queue_cond;
+    GQueue queue;
+    gsize queue_bytes;
+    guint queue_max_depth;
+    /* The pre-roll handed over at start is queued on top of the usual bounds. */
+    guint preroll_aus;
+    gsize preroll_bytes;
+    gboolean caps_sent;
+    gboolean dropping_gop;
+    gboolean flush_requested;
+    /* Pausing: push the file's blocks out, but keep the pending AU so its duration spans the pause. */
+    gboolean io_flush_requested;
+    gboolean closing;
+    guint64 dropped_aus;
+    guint64 dropped_gops;
+    gboolean gap;
+
+    /*
+     * Storage pressure (record_policy.h): the appsink thread feeds the policy
+     * once per window and leaves out what the level says. A step down waits
+     * for a keyframe, so the pictures it lets back in have their references.
+     * The writer thread measures free space, as statvfs may block on the card.
+     */
+    RecordPolicy *policy;
+    RecordLevel level;
+    /* Read by the appsink thread outside queue_lock (atomic). */
+    gint applied_level;
+    gint64 window_start_us;
+    guint64 window_queued_bytes;
+    guint64 window_drained_bytes;
+    gint64 free_bytes;
+    guint64 level_changes;
+    guint64 level_entered[RECORD_LEVEL_COUNT];
+    guint64 degraded_aus;
+    /* Appsink thread only: sps_max_sub_layers_minus1 of the stream. */
+    guint max_temporal_id;
+    /* Writer thread only. */
+    gchar *space_dir;
+    gint64 next_space_check_us;
 };
 
+/* Recorders whose writer thread is still finalising after video_recorder_free. */
+static GMutex finalize_lock;
+static GCond finalize_cond;
+static guint finalizing;
+
 static gchar *recorder_timestamp_string(void) {
     GDateTime *now = g_date_time_new_now_local();
     if (now == NULL) {
@@ -80,7 +201,7 @@ static gboolean path_looks_like_directory(const gchar *path) {
     return g_file_test(path, G_FILE_TEST_IS_DIR);
 }
 
-static gchar *build_timestamped_output_path(const gchar *requested_path) {
+static gchar *build_timestamped_output_path(const gchar *requested_path, const gchar *ext) {
     const gchar *base_path = (requested_path != NULL && requested_path[0] != '\0') ? requested_path : "/media";
     gchar *timestamp = recorder_timestamp_string();
     if (timestamp == NULL) {
@@ -89,7 +210,7 @@ static gchar *build_timestamped_output_path(const gchar *requested_path) {
 
     gchar *full_path = NULL;
     if (path_looks_like_directory(base_path)) {
-        gchar *filename = g_strdup_printf("pixelpilot_stripped_rk-%s.mp4", timestamp);
+        gchar *filename = g_strdup_printf("pixelpilot_stripped_rk-%s%s", timestamp, ext);
         full_path = g_build_filename(base_path, filename, NULL);
         g_free(filename);
     } else {
@@ -103,7 +224,7 @@ static gchar *build_timestamped_output_path(const gchar *requested_path) {
             with_timestamp = g_strdup_printf("%s-%s%s", name, timestamp, dot);
             g_free(name);
         } else {
-            with_timestamp = g_strdup_printf("%s-%s.mp4", basename, timestamp);
+            with_timestamp = g_strdup_printf("%s-%s%s", basename, timestamp, ext);
         }
 
         if (dir != NULL && dir[0] != '\0' && strcmp(dir, ".") != 0) {
@@ -122,24 +243,122 @@ static gchar *build_timestamped_output_path(const gchar *requested_path) {
 
 static int recorder_write_callback(int64_t offset, const void *buffer, size_t size, void *token) {
     VideoRecorder *rec = (VideoRecorder *)token;
-    if (rec == NULL || rec->fp == NULL || buffer == NULL) {
+    if (rec == NULL || rec->io == NULL || buffer == NULL) {
+        return -1;
+    }
+    if (record_io_write(rec->io, offset, buffer, size) != 0) {
         return -1;
     }
-    if (fseeko(rec->fp, offset, SEEK_SET) != 0) {
-        LOGE("minimp4: fseeko failed at offset %" G_GINT64_FORMAT ": %s", offset, g_strerror(errno));
+    g_mutex_lock(&rec->stats_lock);
+    rec->bytes_written += size;
+    rec->mux_writes++;
+    g_mutex_unlock(&rec->stats_lock);
+    return 0;
+}
+
+/* The muxer hands over an AU as NAL length fields and NALs still in the mapped buffer. */
+static int recorder_writev_callback(int64_t offset, const MP4E_iovec_t *iov, int iovcnt, void *token) {
+    VideoRecorder *rec = (VideoRecorder *)token;
+    if (rec == NULL || rec->io == NULL || iov == NULL) {
         return -1;
     }
-    size_t written = fwrite(buffer, 1, size, rec->fp);
-    if (written != size) {
-        LOGE("minimp4: fwrite short write (%zu/%zu): %s", written, size, g_strerror(errno));
+    guint64 size = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        if (record_io_write(rec->io, offset, iov[i].data, (size_t)iov[i].bytes) != 0) {
+            return -1;
+        }
+        offset += iov[i].bytes;
+        size += (guint64)iov[i].bytes;
+    }
+    g_mutex_lock(&rec->stats_lock);
+    rec->bytes_written += size;
+    rec->mux_writes++;
+    g_mutex_unlock(&rec->stats_lock);
+    return 0;
+}
+
+static int recorder_stream_writev(int64_t offset, const struct iovec *iov, int iovcnt, void *token) {
+    VideoRecorder *rec = (VideoRecorder *)token;
+    if (rec == NULL || rec->io == NULL || iov == NULL) {
         return -1;
     }
+    guint64 size = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        if (record_io_write(rec->io, offset, iov[i].iov_base, iov[i].iov_len) != 0) {
+            return -1;
+        }
+        offset += (int64_t)iov[i].iov_len;
+        size += (guint64)iov[i].iov_len;
+    }
     g_mutex_lock(&rec->stats_lock);
-    rec->bytes_written += written;
+    rec->bytes_written += size;
+    rec->mux_writes++;
     g_mutex_unlock(&rec->stats_lock);
     return 0;
 }
 
+static int open_index_sidecar(VideoRecorder *rec) {
+    gchar *dir = g_path_get_dirname(rec->output_path);
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        // No O_TMPFILE on this filesystem (vfat): a named file, unlinked right away.
+        gchar *tmpl = g_build_filename(dir, ".pixelpilot-index-XXXXXX", NULL);
+        fd = g_mkstemp_full(tmpl, O_RDWR | O_CLOEXEC, 0600);
+        if (fd >= 0) {
+            g_unlink(tmpl);
+        }
+        g_free(tmpl);
+    }
+    if (fd < 0) {
+        LOGE("record: cannot create the index sidecar in %s: %s", dir, g_strerror(errno));
+    }
+    g_free(dir);
+    return fd;
+}
+
+/* Past a few thousand samples the muxer's index goes to the sidecar; MP4E_close reads it back. */
+static int recorder_index_write(int64_t offset, const void *buffer, size_t size, void *token) {
+    VideoRecorder *rec = (VideoRecorder *)token;
+    if (rec->index_fd < 0 && (rec->index_fd = open_index_sidecar(rec)) < 0) {
+        return -1;
+    }
+    const guint8 *p = buffer;
+    while (size > 0) {
+        ssize_t n = pwrite(rec->index_fd, p, size, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            LOGE("record: index sidecar write failed: %s", g_strerror(errno));
+            return -1;
+        }
+        p += n;
+        offset += n;
+        size -= (size_t)n;
+        rec->index_spilled += (guint64)n;
+    }
+    return 0;
+}
+
+static int recorder_index_read(int64_t offset, void *buffer, size_t size, void *token) {
+    VideoRecorder *rec = (VideoRecorder *)token;
+    guint8 *p = buffer;
+    while (size > 0) {
+        ssize_t n = pread(rec->index_fd, p, size, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            LOGE("record: index sidecar read failed: %s", n < 0 ? g_strerror(errno) : "short file");
+            return -1;
+        }
+        p += n;
+        offset += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
 static guint64 gst_time_to_90k(GstClockTime value) {
     if (!GST_CLOCK_TIME_IS_VALID(value)) {
         return 0;
@@ -157,8 +376,8 @@ static void pending_reset(struct PendingSample *pending) {
     memset(pending, 0, sizeof(*pending));
 }
 
-static gboolean ensure_writer_initialized(VideoRecorder *rec, GstSample *sample) {
-    if (rec->writer_initialized || rec->mux == NULL) {
+static gboolean ensure_writer_initialized(VideoRecorder *rec, GstCaps *caps) {
+    if (rec->writer_initialized || (rec->mux == NULL && rec->stream == NULL)) {
         return rec->writer_initialized;
     }
 
@@ -167,24 +386,21 @@ static gboolean ensure_writer_initialized(VideoRecorder *rec, GstSample *sample)
     guint default_fps_n = 0;
     guint default_fps_d = 1;
 
-    if (sample != NULL) {
-        GstCaps *caps = gst_sample_get_caps(sample);
-        if (caps != NULL) {
-            GstStructure *s = gst_caps_get_structure(caps, 0);
-            if (s != NULL) {
-                gint tmp = 0;
-                if (gst_structure_get_int(s, "width", &tmp) && tmp > 0) {
-                    width = (guint)tmp;
-                }
-                if (gst_structure_get_int(s, "height", &tmp) && tmp > 0) {
-                    height = (guint)tmp;
-                }
-                gint fps_n = 0;
-                gint fps_d = 1;
-                if (gst_structure_get_fraction(s, "framerate", &fps_n, &fps_d) && fps_n > 0 && fps_d > 0) {
-                    default_fps_n = (guint)fps_n;
-                    default_fps_d = (guint)fps_d;
-                }
+    if (caps != NULL) {
+        GstStructure *s = gst_caps_get_structure(caps, 0);
+        if (s != NULL) {
+            gint tmp = 0;
+            if (gst_structure_get_int(s, "width", &tmp) && tmp > 0) {
+                width = (guint)tmp;
+            }
+            if (gst_structure_get_int(s, "height", &tmp) && tmp > 0) {
+                height = (guint)tmp;
+            }
+            gint fps_n = 0;
+            gint fps_d = 1;
+            if (gst_structure_get_fraction(s, "framerate", &fps_n, &fps_d) && fps_n > 0 && fps_d > 0) {
+                default_fps_n = (guint)fps_n;
+                default_fps_d = (guint)fps_d;
             }
         }
     }
@@ -199,9 +415,9 @@ static gboolean ensure_writer_initialized(VideoRecorder *rec, GstSample *sample)
         rec->default_duration_90k = 3000;
     }
 
-    if (mp4_h26x_write_init(&rec->writer, rec->mux, width, height, 1) != MP4E_STATUS_OK) {
+    if (!rec->streaming && mp4_h26x_write_init(&rec->writer, rec->mux, width, height, 1) != MP4E_STATUS_OK) {
         LOGE("minimp4: failed to initialise H.265 writer");
-        rec->failed = TRUE;
+        g_atomic_int_set(&rec->failed, TRUE);
         return FALSE;
     }
 
@@ -236,12 +452,25 @@ static guint32 compute_duration_90k(VideoRecorder *rec, GstClockTime prev_pts, G
     return (guint32)duration;
 }
 
+/* Returns MP4E status codes, so emit_pending treats both kinds of file alike. */
+static int stream_write(VideoRecorder *rec, const guint8 *data, gsize size) {
+    if (!rec->stream_synced && !rec->pending.keyframe) {
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    }
+    rec->stream_synced = TRUE;
+    guint64 pts_90k = rec->total_duration_90k - rec->segment_start_90k;
+    if (record_stream_write_au(rec->stream, data, size, pts_90k, rec->pending.keyframe) != 0) {
+        return MP4E_STATUS_FILE_WRITE_ERROR;
+    }
+    return MP4E_STATUS_OK;
+}
+
 static void emit_pending(VideoRecorder *rec, guint32 duration_90k) {
     if (!rec->pending.valid) {
         return;
     }
 
-    if (rec->failed || !rec->writer_initialized || rec->mux == NULL) {
+    if (g_atomic_int_get(&rec->failed) || !rec->writer_initialized || (rec->mux == NULL && rec->stream == NULL)) {
         pending_reset(&rec->pending);
         return;
     }
@@ -271,32 +500,389 @@ static void emit_pending(VideoRecorder *rec, guint32 duration_90k) {
     }
 
     gsize copy_size = MIN(map.size, pending_size);
-    int err = mp4_h26x_write_nal(&rec->writer, map.data, (int)copy_size, duration_90k);
+    int err = rec->stream != NULL ? stream_write(rec, map.data, copy_size)
+                                  : mp4_h26x_write_nal(&rec->writer, map.data, (int)copy_size, duration_90k);
     gst_buffer_unmap(rec->pending.buffer, &map);
     if (err == MP4E_STATUS_BAD_ARGUMENTS) {
         if (!rec->awaiting_sync_warning) {
-            LOGI("record: waiting for VPS/SPS/PPS+IDR before writing MP4; dropping frame");
+            LOGI("record: waiting for VPS/SPS/PPS+IDR before writing; dropping frame");
             rec->awaiting_sync_warning = TRUE;
         }
     } else if (err != MP4E_STATUS_OK) {
-        LOGE("minimp4: failed to write access unit (err=%d)", err);
-        rec->failed = TRUE;
+        LOGE("record: failed to write access unit (err=%d)", err);
+        g_atomic_int_set(&rec->failed, TRUE);
     } else {
         rec->awaiting_sync_warning = FALSE;
         g_mutex_lock(&rec->stats_lock);
         rec->total_duration_90k += duration_90k;
+        rec->aus_written++;
+        rec->au_bytes += copy_size;
         g_mutex_unlock(&rec->stats_lock);
     }
 
     pending_reset(&rec->pending);
 }
 
+static MP4E_mux_t *open_muxer(VideoRecorder *rec) {
+    MP4E_mux_t *mux = MP4E_open(rec->sequential_mode_flag, rec->enable_fragmentation, rec, recorder_write_callback);
+    if (mux == NULL) {
+        return NULL;
+    }
+    MP4E_set_writev_callback(mux, recorder_writev_callback);
+    if (!rec->enable_fragmentation) {
+        MP4E_set_index_spill(mux, recorder_index_write, recorder_index_read);
+    }
+    if (rec->enable_fragmentation) {
+        // One fragment per GOP, split when the GOP runs longer than fragment_ms (track timescale is 90 kHz).
+        MP4E_set_fragment_duration(mux, rec->fragment_ms * 90u);
+    }
+    return mux;
+}
+
+static RecordStream *open_stream(VideoRecorder *rec, const gchar *path) {
+    return record_stream_new(rec->stream_format, path, recorder_stream_writev, rec);
+}
+
+static void set_io(VideoRecorder *rec, RecordIo *io) {
+    // video_recorder_get_stats reads the block writer stats through rec->io.
+    g_mutex_lock(&rec->stats_lock);
+    rec->io = io;
+    g_mutex_unlock(&rec->stats_lock);
+}
+
+static void set_file(VideoRecorder *rec, MP4E_mux_t *mux, RecordStream *stream) {
+    // video_recorder_get_stats tells from these whether a file is open.
+    g_mutex_lock(&rec->stats_lock);
+    rec->mux = mux;
+    rec->stream = stream;
+    g_mutex_unlock(&rec->stats_lock);
+}
+
+/* Writes the index of the current file and closes it; returns FALSE if it may be incomplete. */
+static gboolean close_file(VideoRecorder *rec) {
+    gboolean ok = TRUE;
+    MP4E_mux_t *mux = rec->mux;
+    RecordStream *stream = rec->stream;
+    set_file(rec, NULL, NULL);
+    if (mux != NULL) {
+        int err = MP4E_close(mux);
+        if (err != MP4E_STATUS_OK) {
+            LOGE("minimp4: MP4E_close failed (err=%d)", err);
+            ok = FALSE;
+        }
+    }
+    if (stream != NULL) {
+        if (record_stream_close(stream) != 0) {
+            ok = FALSE;
+        }
+    }
+    if (rec->index_fd >= 0 && ftruncate(rec->index_fd, 0) != 0) {
+        LOGW("record: cannot truncate the index sidecar: %s", g_strerror(errno));
+    }
+
+    if (rec->io != NULL) {
+        RecordIo *io = rec->io;
+        set_io(rec, NULL);
+        RecordIoStats io_stats;
+        memset(&io_stats, 0, sizeof(io_stats));
+        if (record_io_close(io, &io_stats) != 0) {
+            ok = FALSE;
+        }
+        rec->io_totals.direct = io_stats.direct;
+        rec->io_totals.preallocating = io_stats.preallocating;
+        rec->io_totals.blocks += io_stats.blocks;
+        rec->io_totals.block_bytes += io_stats.block_bytes;
+        rec->io_totals.patches += io_stats.patches;
+        rec->io_totals.stalls += io_stats.stalls;
+        rec->io_totals.write_ns += io_stats.write_ns;
+        rec->io_totals.write_max_ns = MAX(rec->io_totals.write_max_ns, io_stats.write_max_ns);
+    }
+    if (!ok) {
+        LOGE("record: %s may be incomplete", rec->output_path);
+    }
+    return ok;
+}
+
+static gchar *segment_path(const VideoRecorder *rec, guint index) {
+    return g_strdup_printf("%s-%04u%s", rec->segment_stem, index, rec->segment_ext);
+}
+
+static void enforce_budget(VideoRecorder *rec) {
+    if (rec->budget_bytes == 0) {
+        return;
+    }
+    // Room for the file just started: the size limit if there is one, else as much as the last segment took.
+    guint64 reserve = rec->segment_max_bytes != 0 ? rec->segment_max_bytes : rec->last_segment_bytes;
+    if (reserve >= rec->budget_bytes) {
+        // Reserving it would delete every older recording and still not fit; count only what is on disk.
+        if (!rec->budget_warned) {
+            LOGW("record: a %.1f MB segment does not fit the %.0f MB budget; only older recordings beyond it are "
+                 "deleted",
+                 reserve / (1024.0 * 1024.0), rec->budget_bytes / (1024.0 * 1024.0));
+            rec->budget_warned = TRUE;
+        }
+        reserve = 0;
+    }
+    record_retention_enforce(rec->segment_dir, rec->segment_prefix, rec->segment_ext, rec->budget_bytes, reserve,
+                             rec->output_path);
+}
+
+/*
+ * Called between two AUs, the next one a keyframe: the muxer for the next
+ * segment takes over the H.265 writer before the current file is closed, so
+ * no AU is lost or written twice. On failure recording goes on in the
+ * current file. A stream file needs no hand-over; it starts at the keyframe.
+ */
+static void rotate_segment(VideoRecorder *rec) {
+    guint index = rec->segment_index + 1;
+    gchar *path = segment_path(rec, index);
+    RecordIo *io = record_io_open(path);
+    if (io == NULL) {
+        LOGW("record: cannot start segment %s; continuing %s", path, rec->output_path);
+        g_free(path);
+        return;
+    }
+
+    MP4E_mux_t *mux = NULL;
+    RecordStream *stream = NULL;
+    int err = MP4E_STATUS_OK;
+    RecordIo *old_io = rec->io;
+    if (rec->streaming) {
+        stream = open_stream(rec, path);
+    } else {
+        // MP4E_open writes the file header through rec->io right away.
+        set_io(rec, io);
+        mux = open_muxer(rec);
+        set_io(rec, old_io);
+        err = mux != NULL ? mp4_h26x_write_switch(&rec->writer, mux, (int)rec->width, (int)rec->height)
+                          : MP4E_STATUS_NO_MEMORY;
+    }
+    if (err != MP4E_STATUS_OK) {
+        LOGW("record: cannot start segment %s (err=%d); continuing %s", path, err, rec->output_path);
+        if (mux != NULL) {
+            set_io(rec, io);
+            MP4E_close(mux);
+            set_io(rec, old_io);
+        }
+        record_io_close(io, NULL);
+        g_unlink(path);
+        g_free(path);
+        return;
+    }
+
+    guint64 duration_90k = rec->total_duration_90k - rec->segment_start_90k;
+    rec->last_segment_bytes = rec->au_bytes - rec->segment_start_bytes;
+    close_file(rec);
+    LOGI("record: %s closed after %.1f s, %.1f MB", rec->output_path, duration_90k / 90000.0,
+         rec->last_segment_bytes / (1024.0 * 1024.0));
+
+    g_mutex_lock(&rec->stats_lock);
+    rec->io = io;
+    g_free(rec->output_path);
+    rec->output_path = path;
+    rec->mux = mux;
+    rec->stream = stream;
+    g_mutex_unlock(&rec->stats_lock);
+    rec->segment_index = index;
+    rec->segment_start_90k = rec->total_duration_90k;
+    rec->segment_start_bytes = rec->au_bytes;
+    LOGI("record: writing video to %s", rec->output_path);
+
+    enforce_budget(rec);
+}
+
+static gboolean segment_full(const VideoRecorder *rec) {
+    if (rec->segment_max_90k != 0 && rec->total_duration_90k - rec->segment_start_90k >= rec->segment_max_90k) {
+        return TRUE;
+    }
+    return rec->segment_max_bytes != 0 && rec->au_bytes - rec->segment_start_bytes >= rec->segment_max_bytes;
+}
+
+static void record_item_free(struct RecordItem *item) {
+    if (item->buffer != NULL) {
+        gst_buffer_unref(item->buffer);
+    }
+    if (item->caps != NULL) {
+        gst_caps_unref(item->caps);
+    }
+    g_free(item);
+}
+
+static void write_item(VideoRecorder *rec, struct RecordItem *item) {
+    if (g_atomic_int_get(&rec->failed) || !ensure_writer_initialized(rec, item->caps)) {
+        return;
+    }
+
+    if (rec->pending.valid) {
+        // Across AUs left out, the one before the gap lasts until the next one starts.
+        GstClockTime duration = item->discontinuity ? GST_CLOCK_TIME_NONE : rec->pending.duration;
+        guint32 dur90k = compute_duration_90k(rec, rec->pending.pts, duration, item->pts);
+        emit_pending(rec, dur90k);
+    }
+
+    // Segments start at an IRAP picture, so each file plays on its own.
+    if (item->keyframe && !g_atomic_int_get(&rec->failed) && rec->aus_written > 0 && segment_full(rec)) {
+        rotate_segment(rec);
+    }
+
+    rec->pending.buffer = item->buffer;
+    rec->pending.pts = item->pts;
+    rec->pending.duration = item->duration;
+    rec->pending.keyframe = item->keyframe;
+    rec->pending.valid = TRUE;
+    item->buffer = NULL;
+}
+
+static void flush_pending(VideoRecorder *rec) {
+    if (rec->pending.valid) {
+        guint32 dur90k = compute_duration_90k(rec, rec->pending.pts, rec->pending.duration, GST_CLOCK_TIME_NONE);
+        emit_pending(rec, dur90k);
+    }
+}
+
+static void recorder_destroy(VideoRecorder *rec) {
+    if (rec->io != NULL) {
+        record_io_close(rec->io, NULL);
+        rec->io = NULL;
+    }
+    if (rec->index_fd >= 0) {
+        close(rec->index_fd);
+    }
+    pending_reset(&rec->pending);
+    struct RecordItem *item;
+    while ((item = g_queue_pop_head(&rec->queue)) != NULL) {
+        record_item_free(item);
+    }
+    g_free(rec->output_path);
+    g_free(rec->segment_dir);
+    g_free(rec->segment_stem);
+    g_free(rec->segment_ext);
+    g_free(rec->segment_prefix);
+    g_free(rec->space_dir);
+    record_policy_free(rec->policy);
+    g_cond_clear(&rec->queue_cond);
+    g_mutex_clear(&rec->queue_lock);
+    g_mutex_clear(&rec->stats_lock);
+    g_free(rec);
+}
+
+static void finalize_recording(VideoRecorder *rec) {
+    flush_pending(rec);
+
+    if (rec->writer_initialized && !rec->streaming) {
+        mp4_h26x_write_close(&rec->writer);
+    }
+
+    close_file(rec);
+
+    const RecordIoStats *io_stats = &rec->io_totals;
+    if (rec->segment_stem != NULL) {
+        LOGI("record: %u segment(s), the last %s", rec->segment_index + 1, rec->output_path);
+    }
+    LOGI("record: %s closed; %" G_GUINT64_FORMAT " AUs written, %" G_GUINT64_FORMAT " dropped in %" G_GUINT64_FORMAT
+         " GOP(s), queue peak %u AUs", rec->output_path, rec->aus_written, rec->dropped_aus, rec->dropped_gops,
+         rec->queue_max_depth);
+    LOGI("record: %" G_GUINT64_FORMAT " block writes (%s%s), %.2f ms avg, %.2f ms max; %" G_GUINT64_FORMAT
+         " patches, %" G_GUINT64_FORMAT " stalls on a full ring",
+         io_stats->blocks, io_stats->direct ? "O_DIRECT" : "buffered", io_stats->preallocating ? ", preallocated" : "",
+         io_stats->blocks ? io_stats->write_ns / 1e6 / io_stats->blocks : 0.0, io_stats->write_max_ns / 1e6,
+         io_stats->patches, io_stats->stalls);
+    guint64 overhead = rec->bytes_written > rec->au_bytes ? rec->bytes_written - rec->au_bytes : 0;
+    LOGI("record: %" G_GUINT64_FORMAT " muxer writes, %" G_GUINT64_FORMAT " bytes of container overhead (%.2f%%)",
+         rec->mux_writes, overhead, rec->bytes_written ? 100.0 * overhead / rec->bytes_written : 0.0);
+    if (rec->index_spilled > 0) {
+        LOGI("record: %.1f MB of sample index spilled to the sidecar", rec->index_spilled / (1024.0 * 1024.0));
+    }
+    if (rec->level_changes > 0) {
+        LOGI("record: storage pressure changed the level %" G_GUINT64_FORMAT " time(s), left out %" G_GUINT64_FORMAT
+             " AUs; reference only %" G_GUINT64_FORMAT "x, IRAP only %" G_GUINT64_FORMAT "x, paused %" G_GUINT64_FORMAT
+             "x", rec->level_changes, rec->degraded_aus, rec->level_entered[RECORD_LEVEL_REFERENCE_ONLY],
+             rec->level_entered[RECORD_LEVEL_IRAP_ONLY], rec->level_entered[RECORD_LEVEL_PAUSED]);
+    }
+}
+
+/* Called without queue_lock: statvfs can take as long as the card does. */
+static void update_free_space(VideoRecorder *rec) {
+    struct statvfs st;
+    gint64 free_bytes = -1;
+    if (statvfs(rec->space_dir, &st) == 0) {
+        free_bytes = (gint64)((guint64)st.f_bavail * st.f_frsize);
+    }
+    rec->next_space_check_us = g_get_monotonic_time() + RECORD_POLICY_WINDOW_US;
+    g_mutex_lock(&rec->queue_lock);
+    rec->free_bytes = free_bytes;
+    g_mutex_unlock(&rec->queue_lock);
+}
+
+/* Everything that touches the muxer or the file runs here, below the video threads' priority. */
+static gpointer writer_thread_func(gpointer data) {
+    VideoRecorder *rec = (VideoRecorder *)data;
+    setpriority(PRIO_PROCESS, 0, RECORD_WRITER_NICE);
+    enforce_budget(rec);
+
+    g_mutex_lock(&rec->queue_lock);
+    while (TRUE) {
+        if (rec->space_dir != NULL && g_get_monotonic_time() >= rec->next_space_check_us) {
+            g_mutex_unlock(&rec->queue_lock);
+            update_free_space(rec);
+            g_mutex_lock(&rec->queue_lock);
+        }
+        gboolean timed_out = FALSE;
+        while (g_queue_is_empty(&rec->queue) && !rec->flush_requested && !rec->io_flush_requested && !rec->closing &&
+               !timed_out) {
+            if (rec->space_dir != NULL) {
+                // Keep measuring while paused, so recording resumes once there is room again.
+                timed_out = !g_cond_wait_until(&rec->queue_cond, &rec->queue_lock, rec->next_space_check_us);
+            } else {
+                g_cond_wait(&rec->queue_cond, &rec->queue_lock);
+            }
+        }
+        struct RecordItem *item = g_queue_pop_head(&rec->queue);
+        if (item != NULL) {
+            rec->queue_bytes -= item->size;
+            rec->window_drained_bytes += item->size;
+            g_mutex_unlock(&rec->queue_lock);
+            write_item(rec, item);
+            record_item_free(item);
+            g_mutex_lock(&rec->queue_lock);
+            continue;
+        }
+        if (rec->closing) {
+            break;
+        }
+        if (!rec->flush_requested && !rec->io_flush_requested) {
+            continue;
+        }
+        gboolean flush_au = rec->flush_requested;
+        rec->flush_requested = FALSE;
+        rec->io_flush_requested = FALSE;
+        g_mutex_unlock(&rec->queue_lock);
+        if (flush_au) {
+            flush_pending(rec);
+        }
+        record_stream_flush(rec->stream);
+        record_io_flush(rec->io);
+        g_mutex_lock(&rec->queue_lock);
+    }
+    g_mutex_unlock(&rec->queue_lock);
+
+    finalize_recording(rec);
+    recorder_destroy(rec);
+
+    g_mutex_lock(&finalize_lock);
+    finalizing--;
+    g_cond_broadcast(&finalize_cond);
+    g_mutex_unlock(&finalize_lock);
+    return NULL;
+}
+
 VideoRecorder *video_recorder_new(const RecordCfg *cfg) {
     if (cfg == NULL || !cfg->enable) {
         return NULL;
     }
 
-    gchar *output_path = build_timestamped_output_path(cfg->output_path);
+    const gchar *ext = cfg->mode == RECORD_MODE_TS ? ".ts" : cfg->mode == RECORD_MODE_ANNEXB ? ".h265" : ".mp4";
+    gchar *output_path = build_timestamped_output_path(cfg->output_path, ext);
     if (output_path == NULL) {
         LOGE("record: failed to prepare output path");
         return NULL;
@@ -320,14 +906,27 @@ VideoRecorder *video_recorder_new(const RecordCfg *cfg) {
     }
 
     g_mutex_init(&rec->stats_lock);
+    g_mutex_init(&rec->queue_lock);
+    g_cond_init(&rec->queue_cond);
+    g_queue_init(&rec->queue);
     rec->enabled = TRUE;
     rec->failed = FALSE;
     rec->default_duration_90k = 3000;
     rec->last_duration_90k = 0;
     rec->output_path = output_path;
+    rec->index_fd = -1;
     rec->bytes_written = 0;
     rec->total_duration_90k = 0;
     rec->start_time_ns = (guint64)g_get_monotonic_time() * 1000u;
+    guint64 min_free_bytes = cfg->min_free_mb > 0 ? (guint64)cfg->min_free_mb * 1024u * 1024u : 0;
+    rec->policy = record_policy_new(min_free_bytes);
+    rec->level = RECORD_LEVEL_FULL;
+    rec->applied_level = RECORD_LEVEL_FULL;
+    rec->window_start_us = g_get_monotonic_time();
+    rec->free_bytes = -1;
+    if (min_free_bytes != 0) {
+        rec->space_dir = g_path_get_dirname(output_path);
+    }
 
     rec->mode = cfg->mode;
     rec->sequential_mode_flag = 1;
@@ -341,6 +940,15 @@ VideoRecorder *video_recorder_new(const RecordCfg *cfg) {
     case RECORD_MODE_FRAGMENTED:
         rec->sequential_mode_flag = 1;
         rec->enable_fragmentation = 1;
+        rec->fragment_ms = cfg->fragment_ms > 0 ? (guint)cfg->fragment_ms : 0;
+        break;
+    case RECORD_MODE_TS:
+        rec->streaming = TRUE;
+        rec->stream_format = RECORD_STREAM_TS;
+        break;
+    case RECORD_MODE_ANNEXB:
+        rec->streaming = TRUE;
+        rec->stream_format = RECORD_STREAM_ANNEXB;
         break;
     case RECORD_MODE_SEQUENTIAL:
     default:
@@ -349,42 +957,157 @@ VideoRecorder *video_recorder_new(const RecordCfg *cfg) {
         break;
     }
 
-    rec->fp = fopen(rec->output_path, "wb");
-    if (rec->fp == NULL) {
-        LOGE("record: failed to open %s: %s", rec->output_path, g_strerror(errno));
+    rec->segment_max_90k = cfg->segment_s > 0 ? (guint64)cfg->segment_s * 90000u : 0;
+    rec->segment_max_bytes = cfg->segment_mb > 0 ? (guint64)cfg->segment_mb * 1024u * 1024u : 0;
+    rec->budget_bytes = cfg->budget_mb > 0 ? (guint64)cfg->budget_mb * 1024u * 1024u : 0;
+    if (rec->segment_max_90k != 0 || rec->segment_max_bytes != 0 || rec->budget_bytes != 0) {
+        // output_path is dir/name-YYYYmmdd-HHMMSS.ext; retention covers every recording named name-*.ext.
+        gchar *basename = g_path_get_basename(rec->output_path);
+        const gchar *dot = strrchr(basename, '.');
+        gsize stem_len = dot != NULL && dot != basename ? (gsize)(dot - basename) : strlen(basename);
+        gsize stamp_len = strlen("YYYYmmdd-HHMMSS");
+        rec->segment_dir = g_path_get_dirname(rec->output_path);
+        rec->segment_ext = g_strdup(basename + stem_len);
+        rec->segment_prefix = g_strndup(basename, stem_len > stamp_len ? stem_len - stamp_len : stem_len);
+        g_free(basename);
+    }
+    if (rec->segment_max_90k != 0 || rec->segment_max_bytes != 0) {
+        rec->segment_stem = g_strndup(rec->output_path, strlen(rec->output_path) - strlen(rec->segment_ext));
         g_free(rec->output_path);
-        g_free(rec);
+        rec->output_path = segment_path(rec, 0);
+    }
+
+    rec->io = record_io_open(rec->output_path);
+    if (rec->io == NULL) {
+        recorder_destroy(rec);
         return NULL;
     }
 
     LOGI("record: writing video to %s", rec->output_path);
-    LOGI("record: MP4 mode=%s (sequential=%d, fragmented=%d)",
-         cfg_record_mode_name(rec->mode), rec->sequential_mode_flag, rec->enable_fragmentation);
-
-    rec->mux = MP4E_open(rec->sequential_mode_flag, rec->enable_fragmentation, rec, recorder_write_callback);
-    if (rec->mux == NULL) {
+    if (rec->streaming) {
+        LOGI("record: %s stream, written as received with no index", cfg_record_mode_name(rec->mode));
+        rec->stream = open_stream(rec, rec->output_path);
+    } else {
+        LOGI("record: MP4 mode=%s (sequential=%d, fragmented=%d)",
+             cfg_record_mode_name(rec->mode), rec->sequential_mode_flag, rec->enable_fragmentation);
+        rec->mux = open_muxer(rec);
+    }
+    if (rec->mux == NULL && rec->stream == NULL) {
         LOGE("minimp4: failed to allocate muxer");
-        fclose(rec->fp);
-        rec->fp = NULL;
-        g_free(rec->output_path);
-        g_mutex_clear(&rec->stats_lock);
-        g_free(rec);
+        recorder_destroy(rec);
         return NULL;
     }
+    if (rec->segment_stem != NULL) {
+        LOGI("record: new segment at the first keyframe past %d s / %d MB (0 = no limit)", MAX(cfg->segment_s, 0),
+             MAX(cfg->segment_mb, 0));
+    }
+    if (rec->budget_bytes != 0) {
+        LOGI("record: keeping %s*%s in %s within %d MB", rec->segment_prefix, rec->segment_ext, rec->segment_dir,
+             cfg->budget_mb);
+    }
+    if (rec->space_dir != NULL) {
+        LOGI("record: IRAP pictures only below %d MB free in %s, paused below %d MB", cfg->min_free_mb * 2,
+             rec->space_dir, cfg->min_free_mb);
+    }
+    if (rec->enable_fragmentation) {
+        if (rec->fragment_ms > 0) {
+            LOGI("record: one fragment per GOP, split past %u ms", rec->fragment_ms);
+        } else {
+            LOGI("record: one fragment per GOP");
+        }
+    }
 
+    GThread *writer = g_thread_try_new("record-writer", writer_thread_func, rec, NULL);
+    if (writer == NULL) {
+        LOGE("record: failed to start writer thread");
+        if (rec->mux != NULL) {
+            MP4E_close(rec->mux);
+            rec->mux = NULL;
+        }
+        record_stream_close(rec->stream);
+        rec->stream = NULL;
+        recorder_destroy(rec);
+        return NULL;
+    }
+    // The writer thread outlives the caller's handle: it frees the recorder once finalised.
+    g_thread_unref(writer);
     return rec;
 }
 
-void video_recorder_handle_sample(VideoRecorder *rec, GstSample *sample, GstBuffer *buffer, const guint8 *data, size_t size) {
-    if (rec == NULL || !rec->enabled || rec->failed) {
-        return;
+/*
+ * Walks the NAL headers of an Annex B AU up to its first slice. Takes
+ * sps_max_sub_layers_minus1 from an SPS on the way, then tells whether the
+ * picture is a sub-layer non-reference picture of the highest sub-layer,
+ * which no other picture refers to.
+ */
+static gboolean is_droppable_picture(VideoRecorder *rec, const guint8 *data, gsize size) {
+    gsize i = 0;
+    while (i + 3 < size) {
+        if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) {
+            i++;
+            continue;
+        }
+        i += 3;
+        if (i + 1 >= size) {
+            break;
+        }
+        guint type = (data[i] >> 1) & 0x3F;
+        guint temporal_id = (data[i + 1] & 0x07) - 1u;
+        if (type == 33 && i + 2 < size) {
+            rec->max_temporal_id = (data[i + 2] >> 1) & 0x07;
+        } else if (type < 32) {
+            return type <= 14 && (type & 1) == 0 && temporal_id == rec->max_temporal_id;
+        }
     }
+    return FALSE;
+}
 
-    if (buffer == NULL && (data == NULL || size == 0)) {
+static gboolean classify_picture(VideoRecorder *rec, GstBuffer *buffer) {
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        return FALSE;
+    }
+    gboolean droppable = is_droppable_picture(rec, map.data, map.size);
+    gst_buffer_unmap(buffer, &map);
+    return droppable;
+}
+
+/* Called with queue_lock held; starts the next window. */
+static void measure_pressure(VideoRecorder *rec, RecordPressure *pressure) {
+    double fill_aus = (double)g_queue_get_length(&rec->queue) / (RECORD_QUEUE_MAX_AUS + rec->preroll_aus);
+    double fill_bytes = (double)rec->queue_bytes / (RECORD_QUEUE_MAX_BYTES + rec->preroll_bytes);
+    pressure->queue_fill = MAX(fill_aus, fill_bytes);
+    pressure->queued_bytes = rec->window_queued_bytes;
+    pressure->drained_bytes = rec->window_drained_bytes;
+    pressure->free_bytes = rec->free_bytes;
+    rec->window_queued_bytes = 0;
+    rec->window_drained_bytes = 0;
+}
+
+static void log_level_change(RecordLevel from, RecordLevel to, const RecordPressure *pressure, double window_s) {
+    gchar free_text[32];
+    if (pressure->free_bytes >= 0) {
+        g_snprintf(free_text, sizeof(free_text), "%.0f MB free", pressure->free_bytes / (1024.0 * 1024.0));
+    } else {
+        g_strlcpy(free_text, "free space unknown", sizeof(free_text));
+    }
+    if (to > from) {
+        LOGW("record: storage pressure (queue %.0f%%, %.1f MB/s in, %.1f MB/s out, %s): %s -> %s",
+             pressure->queue_fill * 100.0, pressure->queued_bytes / window_s / (1024.0 * 1024.0),
+             pressure->drained_bytes / window_s / (1024.0 * 1024.0), free_text, record_level_name(from),
+             record_level_name(to));
+    } else {
+        LOGI("record: storage pressure eased (queue %.0f%%, %s): %s -> %s at the next keyframe",
+             pressure->queue_fill * 100.0, free_text, record_level_name(from), record_level_name(to));
+    }
+}
+
+void video_recorder_handle_sample(VideoRecorder *rec, GstSample *sample, GstBuffer *buffer, const guint8 *data, size_t size) {
+    if (rec == NULL || !rec->enabled || g_atomic_int_get(&rec->failed)) {
         return;
     }
 
-    if (!ensure_writer_initialized(rec, sample)) {
+    if (buffer == NULL && (data == NULL || size == 0)) {
         return;
     }
 
@@ -402,14 +1125,9 @@ void video_recorder_handle_sample(VideoRecorder *rec, GstSample *sample, GstBuff
         duration = GST_BUFFER_DURATION(timestamp_buffer);
     }
 
-    if (rec->pending.valid) {
-        guint32 dur90k = compute_duration_90k(rec, rec->pending.pts, rec->pending.duration, pts);
-        emit_pending(rec, dur90k);
-    }
-
-    GstBuffer *pending_buffer = NULL;
+    GstBuffer *item_buffer = NULL;
     if (buffer != NULL) {
-        pending_buffer = gst_buffer_ref(buffer);
+        item_buffer = gst_buffer_ref(buffer);
     } else if (data != NULL && size > 0) {
         GstBuffer *tmp = gst_buffer_new_allocate(NULL, (gsize)size, NULL);
         if (tmp == NULL) {
@@ -425,67 +1143,187 @@ void video_recorder_handle_sample(VideoRecorder *rec, GstSample *sample, GstBuff
         memcpy(map.data, data, size);
         gst_buffer_unmap(tmp, &map);
         gst_buffer_set_size(tmp, (gsize)size);
-        pending_buffer = tmp;
+        item_buffer = tmp;
     }
 
-    if (pending_buffer == NULL) {
+    if (item_buffer == NULL) {
         return;
     }
 
-    rec->pending.buffer = pending_buffer;
-    rec->pending.pts = pts;
-    rec->pending.duration = duration;
-    rec->pending.valid = TRUE;
-}
+    gboolean keyframe = !GST_BUFFER_FLAG_IS_SET(item_buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    gsize item_size = gst_buffer_get_size(item_buffer);
+    // Keyframes carry the SPS the classification needs; other AUs are only looked at while it is in use.
+    gboolean droppable = FALSE;
+    if (keyframe || g_atomic_int_get(&rec->applied_level) == RECORD_LEVEL_REFERENCE_ONLY) {
+        droppable = classify_picture(rec, item_buffer) && !keyframe;
+    }
 
-void video_recorder_flush(VideoRecorder *rec) {
-    if (rec == NULL || !rec->enabled || rec->failed) {
-        pending_reset(&rec->pending);
+    gint64 now_us = g_get_monotonic_time();
+    RecordPressure pressure;
+    RecordLevel from = RECORD_LEVEL_FULL;
+    RecordLevel to = RECORD_LEVEL_FULL;
+    double window_s = 0.0;
+
+    g_mutex_lock(&rec->queue_lock);
+    if (GST_BUFFER_FLAG_IS_SET(item_buffer, GST_BUFFER_FLAG_DISCONT)) {
+        // AUs were lost upstream (the helper's ring turns them away or overruns); durations span the gap.
+        rec->gap = TRUE;
+    }
+    if (now_us - rec->window_start_us >= RECORD_POLICY_WINDOW_US) {
+        window_s = (now_us - rec->window_start_us) / 1e6;
+        rec->window_start_us = now_us;
+        measure_pressure(rec, &pressure);
+        from = rec->level;
+        to = record_policy_update(rec->policy, &pressure);
+        if (to != from) {
+            rec->level = to;
+            rec->level_changes++;
+            if (to == RECORD_LEVEL_PAUSED) {
+                // Get what is written onto the card while nothing new comes in.
+                rec->io_flush_requested = TRUE;
+                g_cond_signal(&rec->queue_cond);
+            }
+        }
+    }
+    RecordLevel applied = (RecordLevel)rec->applied_level;
+    if (rec->level > applied || (rec->level < applied && keyframe)) {
+        applied = rec->level;
+        g_atomic_int_set(&rec->applied_level, (gint)applied);
+        rec->level_entered[applied]++;
+    }
+    gboolean left_out = applied == RECORD_LEVEL_PAUSED || (applied == RECORD_LEVEL_IRAP_ONLY && !keyframe) ||
+                        (applied == RECORD_LEVEL_REFERENCE_ONLY && droppable);
+    if (left_out) {
+        rec->degraded_aus++;
+        rec->gap = TRUE;
+        g_mutex_unlock(&rec->queue_lock);
+        gst_buffer_unref(item_buffer);
+        if (to != from) {
+            log_level_change(from, to, &pressure, window_s);
+        }
         return;
     }
 
-    if (rec->pending.valid) {
-        guint32 dur90k = compute_duration_90k(rec, rec->pending.pts, rec->pending.duration, GST_CLOCK_TIME_NONE);
-        emit_pending(rec, dur90k);
+    gboolean full = g_queue_get_length(&rec->queue) >= RECORD_QUEUE_MAX_AUS + rec->preroll_aus ||
+                    rec->queue_bytes + item_size > RECORD_QUEUE_MAX_BYTES + rec->preroll_bytes;
+    if (rec->dropping_gop && keyframe && !full) {
+        rec->dropping_gop = FALSE;
+    } else if (!rec->dropping_gop && full) {
+        // The rest of this GOP would not decode without the AU dropped here.
+        rec->dropping_gop = TRUE;
+        rec->dropped_gops++;
+    }
+    if (rec->dropping_gop) {
+        rec->dropped_aus++;
+        rec->gap = TRUE;
+        g_mutex_unlock(&rec->queue_lock);
+        gst_buffer_unref(item_buffer);
+        if (to != from) {
+            log_level_change(from, to, &pressure, window_s);
+        }
+        return;
     }
 
-    if (rec->fp != NULL) {
-        fflush(rec->fp);
+    struct RecordItem *item = g_new0(struct RecordItem, 1);
+    item->buffer = item_buffer;
+    item->pts = pts;
+    item->duration = duration;
+    item->size = item_size;
+    item->keyframe = keyframe;
+    item->discontinuity = rec->gap;
+    rec->gap = FALSE;
+    if (!rec->caps_sent) {
+        GstCaps *caps = sample != NULL ? gst_sample_get_caps(sample) : NULL;
+        item->caps = caps != NULL ? gst_caps_ref(caps) : NULL;
+        rec->caps_sent = TRUE;
+    }
+    g_queue_push_tail(&rec->queue, item);
+    rec->queue_bytes += item_size;
+    rec->window_queued_bytes += item_size;
+    rec->queue_max_depth = MAX(rec->queue_max_depth, g_queue_get_length(&rec->queue));
+    g_cond_signal(&rec->queue_cond);
+    g_mutex_unlock(&rec->queue_lock);
+    if (to != from) {
+        log_level_change(from, to, &pressure, window_s);
     }
 }
 
-void video_recorder_free(VideoRecorder *rec) {
-    if (rec == NULL) {
+void video_recorder_prime(VideoRecorder *rec, RecordPreroll *preroll) {
+    if (rec == NULL || preroll == NULL) {
         return;
     }
-
-    video_recorder_flush(rec);
-
-    if (rec->writer_initialized) {
-        mp4_h26x_write_close(&rec->writer);
+    guint64 span_ns = 0;
+    if (record_preroll_get_depth(preroll, NULL, &span_ns) == 0) {
+        return;
     }
 
-    if (rec->mux != NULL) {
-        int err = MP4E_close(rec->mux);
-        if (err != MP4E_STATUS_OK) {
-            LOGE("minimp4: MP4E_close failed (err=%d)", err);
+    g_mutex_lock(&rec->queue_lock);
+    if (rec->caps_sent) {
+        // Live AUs are queued already; the pre-roll would land behind them.
+        g_mutex_unlock(&rec->queue_lock);
+        return;
+    }
+    GstBuffer *buffer;
+    while ((buffer = record_preroll_pop(preroll)) != NULL) {
+        struct RecordItem *item = g_new0(struct RecordItem, 1);
+        item->buffer = buffer;
+        item->pts = GST_BUFFER_PTS_IS_VALID(buffer) ? GST_BUFFER_PTS(buffer) : GST_BUFFER_DTS(buffer);
+        item->duration = GST_BUFFER_DURATION(buffer);
+        item->size = gst_buffer_get_size(buffer);
+        item->keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+        if (!rec->caps_sent) {
+            item->caps = record_preroll_get_caps(preroll);
+            rec->caps_sent = TRUE;
         }
-        rec->mux = NULL;
+        g_queue_push_tail(&rec->queue, item);
+        rec->queue_bytes += item->size;
+        rec->preroll_aus++;
+        rec->preroll_bytes += item->size;
     }
+    rec->queue_max_depth = MAX(rec->queue_max_depth, g_queue_get_length(&rec->queue));
+    g_cond_signal(&rec->queue_cond);
+    g_mutex_unlock(&rec->queue_lock);
+    LOGI("record: starting with %u AUs (%.1f s, %.1f MB) of pre-roll", rec->preroll_aus, span_ns / 1e9,
+         rec->preroll_bytes / (1024.0 * 1024.0));
+}
 
-    if (rec->fp != NULL) {
-        fclose(rec->fp);
-        rec->fp = NULL;
+void video_recorder_flush(VideoRecorder *rec) {
+    if (rec == NULL) {
+        return;
     }
+    g_mutex_lock(&rec->queue_lock);
+    rec->flush_requested = TRUE;
+    g_cond_signal(&rec->queue_cond);
+    g_mutex_unlock(&rec->queue_lock);
+}
 
-    if (rec->output_path != NULL) {
-        g_free(rec->output_path);
-        rec->output_path = NULL;
+void video_recorder_free(VideoRecorder *rec) {
+    if (rec == NULL) {
+        return;
     }
-    pending_reset(&rec->pending);
 
-    g_mutex_clear(&rec->stats_lock);
-    g_free(rec);
+    // The writer drains the queue, writes the index and frees the recorder; nothing here waits on the disk.
+    g_mutex_lock(&finalize_lock);
+    finalizing++;
+    g_mutex_unlock(&finalize_lock);
+
+    g_mutex_lock(&rec->queue_lock);
+    rec->closing = TRUE;
+    g_cond_signal(&rec->queue_cond);
+    g_mutex_unlock(&rec->queue_lock);
+}
+
+gboolean video_recorder_wait_finalized(guint timeout_ms) {
+    gint64 deadline = g_get_monotonic_time() + (gint64)timeout_ms * G_TIME_SPAN_MILLISECOND;
+    g_mutex_lock(&finalize_lock);
+    while (finalizing > 0) {
+        if (!g_cond_wait_until(&finalize_cond, &finalize_lock, deadline)) {
+            break;
+        }
+    }
+    gboolean done = finalizing == 0;
+    g_mutex_unlock(&finalize_lock);
+    return done;
 }
 
 void video_recorder_get_stats(const VideoRecorder *rec, VideoRecorderStats *stats) {
@@ -497,8 +1335,11 @@ void video_recorder_get_stats(const VideoRecorder *rec, VideoRecorderStats *stat
         return;
     }
 
+    RecordIoStats io_stats;
     g_mutex_lock((GMutex *)&rec->stats_lock);
-    stats->active = rec->enabled && !rec->failed && rec->fp != NULL && rec->mux != NULL;
+    record_io_get_stats(rec->io, &io_stats);
+    stats->active = rec->enabled && !g_atomic_int_get((gint *)&rec->failed) && rec->io != NULL &&
+                    (rec->mux != NULL || rec->stream != NULL);
     stats->bytes_written = rec->bytes_written;
     stats->media_duration_ns = gst_util_uint64_scale(rec->total_duration_90k, GST_SECOND, 90000);
     if (rec->start_time_ns != 0) {
@@ -513,4 +1354,19 @@ void video_recorder_get_stats(const VideoRecorder *rec, VideoRecorderStats *stat
         stats->output_path[0] = '\0';
     }
     g_mutex_unlock((GMutex *)&rec->stats_lock);
+
+    stats->writes = io_stats.blocks;
+    stats->write_latency_avg_ns = io_stats.blocks ? io_stats.write_ns / io_stats.blocks : 0;
+    stats->write_latency_max_ns = io_stats.write_max_ns;
+
+    g_mutex_lock((GMutex *)&rec->queue_lock);
+    stats->queue_depth = g_queue_get_length((GQueue *)&rec->queue);
+    stats->queue_bytes = rec->queue_bytes;
+    stats->queue_max_depth = rec->queue_max_depth;
+    stats->dropped_aus = rec->dropped_aus;
+    stats->dropped_gops = rec->dropped_gops;
+    stats->level = (RecordLevel)rec->applied_level;
+    stats->level_changes = rec->level_changes;
+    stats->degraded_aus = rec->degraded_aus;
+    g_mutex_unlock((GMutex *)&rec->queue_lock);
 }
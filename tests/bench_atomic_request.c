@@ -0,0 +1,102 @@
+/*
+ * Cost of building the atomic request for one video frame, the way the
+ * display thread did before and after it started reusing its request:
+ *
+ *   alloc   - a fresh drmModeAtomicReq per frame with the full plane state
+ *   rewind  - one request rewound with drmModeAtomicSetCursor, full plane state
+ *   fb_only - one request rewound, FB_ID only (plane already placed)
+ *
+ * Only the userspace side is measured; no DRM device is opened. Usage:
+ * bench_atomic_request [frames]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <xf86drmMode.h>
+
+#define DEFAULT_FRAMES 1000000u
+#define PLANE_ID 61u
+#define CRTC_ID 68u
+#define MODE_W 1920u
+#define MODE_H 1080u
+
+/* Property ids as a driver would hand them out; only their being distinct matters. */
+enum { PROP_FB_ID = 17, PROP_CRTC_ID, PROP_CRTC_X, PROP_CRTC_Y, PROP_CRTC_W, PROP_CRTC_H,
+       PROP_SRC_X, PROP_SRC_Y, PROP_SRC_W, PROP_SRC_H };
+
+static volatile int sink;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void add_placement(drmModeAtomicReq *req, uint32_t src_w, uint32_t src_h) {
+    drmModeAtomicAddProperty(req, PLANE_ID, PROP_CRTC_ID, CRTC_ID);
+    drmModeAtomicAddProperty(req, PLANE_ID, PROP_CRTC_X, 0);
+    drmModeAtomicAddProperty(req, PLANE_ID, PROP_CRTC_Y, 0);
+    drmModeAtomicAddProperty(req, PLANE_ID, PROP_CRTC_W, MODE_W);
+    drmModeAtomicAddProperty(req, PLANE_ID, PROP_CRTC_H, MODE_H);
+    drmModeAtomicAddProperty(req, PLANE_ID, PROP_SRC_X, 0);
+    drmModeAtomicAddProperty(req, PLANE_ID, PROP_SRC_Y, 0);
+    drmModeAtomicAddProperty(req, PLANE_ID, PROP_SRC_W, (uint64_t)src_w << 16);
+    drmModeAtomicAddProperty(req, PLANE_ID, PROP_SRC_H, (uint64_t)src_h << 16);
+}
+
+static uint64_t bench_alloc(unsigned frames) {
+    uint64_t start = monotonic_ns();
+    for (unsigned i = 0; i < frames; ++i) {
+        drmModeAtomicReq *req = drmModeAtomicAlloc();
+        if (req == NULL) {
+            fprintf(stderr, "drmModeAtomicAlloc failed\n");
+            exit(1);
+        }
+        drmModeAtomicAddProperty(req, PLANE_ID, PROP_FB_ID, 100 + i % 8);
+        add_placement(req, MODE_W, MODE_H);
+        sink += drmModeAtomicGetCursor(req);
+        drmModeAtomicFree(req);
+    }
+    return monotonic_ns() - start;
+}
+
+static uint64_t bench_rewind(drmModeAtomicReq *req, unsigned frames, int placement) {
+    uint64_t start = monotonic_ns();
+    for (unsigned i = 0; i < frames; ++i) {
+        drmModeAtomicSetCursor(req, 0);
+        drmModeAtomicAddProperty(req, PLANE_ID, PROP_FB_ID, 100 + i % 8);
+        if (placement) {
+            add_placement(req, MODE_W, MODE_H);
+        }
+        sink += drmModeAtomicGetCursor(req);
+    }
+    return monotonic_ns() - start;
+}
+
+int main(int argc, char **argv) {
+    unsigned frames = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 10) : DEFAULT_FRAMES;
+    if (frames == 0) {
+        frames = DEFAULT_FRAMES;
+    }
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    if (req == NULL) {
+        fprintf(stderr, "drmModeAtomicAlloc failed\n");
+        return 1;
+    }
+    // Warm the allocator and grow the reused request to its working size first.
+    bench_alloc(frames / 10 + 1);
+    bench_rewind(req, frames / 10 + 1, 1);
+
+    uint64_t alloc_ns = bench_alloc(frames);
+    uint64_t rewind_ns = bench_rewind(req, frames, 1);
+    uint64_t fb_only_ns = bench_rewind(req, frames, 0);
+    drmModeAtomicFree(req);
+
+    printf("%u frames\n", frames);
+    printf("  alloc:   %7.1f ns/frame\n", (double)alloc_ns / frames);
+    printf("  rewind:  %7.1f ns/frame (%.2fx)\n", (double)rewind_ns / frames, (double)alloc_ns / rewind_ns);
+    printf("  fb_only: %7.1f ns/frame (%.2fx)\n", (double)fb_only_ns / frames, (double)alloc_ns / fb_only_ns);
+    return 0;
+}
@@ -0,0 +1,245 @@
+#ifndef TESTS_MP4_ROUNDTRIP_H
+#define TESTS_MP4_ROUNDTRIP_H
+
+/*
+ * Muxes into memory through minimp4 the way the recorder drives it and reads
+ * the result back, for the MP4 tests. Include once per test program: it
+ * carries the minimp4 implementation.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A small index chunk makes a few hundred samples spill most of the index.
+#define MP4E_INDEX_CHUNK_SAMPLES 16
+#define MP4E_INDEX_MEM_CHUNKS 2
+#define MINIMP4_IMPLEMENTATION
+#include "minimp4.h"
+
+#include "synthetic_hevc.h"
+
+#define MP4_TEST_WIDTH 1280
+#define MP4_TEST_HEIGHT 720
+
+static int failures;
+
+#define CHECK(cond, ...)                                                                                               \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);                                                            \
+            fprintf(stderr, __VA_ARGS__);                                                                              \
+            fputc('\n', stderr);                                                                                       \
+            failures++;                                                                                                \
+            return;                                                                                                    \
+        }                                                                                                              \
+    } while (0)
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    /* Write callbacks seen, to tell that gathered writes were used. */
+    long writes;
+    long writev_calls;
+} MemFile;
+
+static inline void mem_file_put(MemFile *f, int64_t offset, const void *data, size_t size) {
+    size_t end = (size_t)offset + size;
+    if (end > f->capacity) {
+        f->capacity = end * 2;
+        f->data = realloc(f->data, f->capacity);
+    }
+    memcpy(f->data + offset, data, size);
+    if (end > f->size) {
+        f->size = end;
+    }
+}
+
+static inline void mem_file_free(MemFile *f) {
+    free(f->data);
+    memset(f, 0, sizeof(*f));
+}
+
+/* The muxer token: the file, and the sidecar the index spills to. */
+typedef struct {
+    MemFile file;
+    MemFile index;
+} Output;
+
+static inline int write_cb(int64_t offset, const void *buffer, size_t size, void *token) {
+    Output *out = (Output *)token;
+    mem_file_put(&out->file, offset, buffer, size);
+    out->file.writes++;
+    return 0;
+}
+
+static inline int writev_cb(int64_t offset, const MP4E_iovec_t *iov, int iovcnt, void *token) {
+    Output *out = (Output *)token;
+    for (int i = 0; i < iovcnt; ++i) {
+        mem_file_put(&out->file, offset, iov[i].data, (size_t)iov[i].bytes);
+        offset += iov[i].bytes;
+    }
+    out->file.writev_calls++;
+    return 0;
+}
+
+static inline int index_write_cb(int64_t offset, const void *buffer, size_t size, void *token) {
+    mem_file_put(&((Output *)token)->index, offset, buffer, size);
+    return 0;
+}
+
+static inline int index_read_cb(int64_t offset, void *buffer, size_t size, void *token) {
+    Output *out = (Output *)token;
+    if ((size_t)offset + size > out->index.size) {
+        return 1;
+    }
+    memcpy(buffer, out->index.data + offset, size);
+    return 0;
+}
+
+static inline int read_cb(int64_t offset, void *buffer, size_t size, void *token) {
+    const MemFile *f = (const MemFile *)token;
+    if ((size_t)offset + size > f->size) {
+        return 1;
+    }
+    memcpy(buffer, f->data + offset, size);
+    return 0;
+}
+
+/* Gathered writes always; a fragment duration when fragmented, the index sidecar when spill is set. */
+static inline MP4E_mux_t *open_mux(Output *out, int sequential, int fragmented, unsigned fragment_duration,
+                                   int spill) {
+    MP4E_mux_t *mux = MP4E_open(sequential, fragmented, out, write_cb);
+    if (mux == NULL) {
+        return NULL;
+    }
+    MP4E_set_writev_callback(mux, writev_cb);
+    if (fragmented) {
+        MP4E_set_fragment_duration(mux, fragment_duration);
+    }
+    if (spill) {
+        MP4E_set_index_spill(mux, index_write_cb, index_read_cb);
+    }
+    return mux;
+}
+
+static inline int write_aus(mp4_h26x_writer_t *writer, int first, int count) {
+    static unsigned char au[SYNTH_AU_MAX];
+    for (int i = first; i < first + count; ++i) {
+        int size = synth_au(au, i);
+        if (mp4_h26x_write_nal(writer, au, size, SYNTH_DURATION_90K) != MP4E_STATUS_OK) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Reads the moov-indexed file back and compares AUs first .. first+count-1. */
+static inline void check_indexed(const char *name, const MemFile *file, int first, int count) {
+    static unsigned char expected[SYNTH_AU_MAX];
+    MP4D_demux_t demux;
+    memset(&demux, 0, sizeof(demux));
+    CHECK(MP4D_open(&demux, read_cb, (void *)file, (int64_t)file->size) == 1, "%s: MP4D_open failed", name);
+    const MP4D_track_t *track = &demux.track[0];
+    if (demux.track_count != 1 || track->handler_type != MP4D_HANDLER_TYPE_VIDE) {
+        MP4D_close(&demux);
+        CHECK(0, "%s: expected a single video track", name);
+    }
+    if (track->sample_count != (unsigned)count) {
+        MP4D_close(&demux);
+        CHECK(0, "%s: %u samples, expected %d", name, track->sample_count, count);
+    }
+    for (int i = 0; i < count; ++i) {
+        unsigned bytes = 0, timestamp = 0, duration = 0;
+        MP4D_file_offset_t offset = MP4D_frame_offset(&demux, 0, (unsigned)i, &bytes, &timestamp, &duration);
+        int size = synth_sample(expected, first + i, i == 0);
+        int same = bytes == (unsigned)size && offset + bytes <= file->size &&
+                   memcmp(file->data + offset, expected, (size_t)size) == 0;
+        if (!same || duration != SYNTH_DURATION_90K || timestamp != (unsigned)i * SYNTH_DURATION_90K) {
+            MP4D_close(&demux);
+            CHECK(0, "%s: sample %d differs (%u bytes, expected %d; duration %u, timestamp %u)", name, i, bytes,
+                  size, duration, timestamp);
+        }
+    }
+    MP4D_close(&demux);
+}
+
+static inline uint32_t be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline const unsigned char *find_box(const unsigned char *p, const unsigned char *end, const char *type) {
+    while (p + 8 <= end) {
+        uint32_t size = be32(p);
+        if (size < 8 || p + size > end) {
+            return NULL;
+        }
+        if (memcmp(p + 4, type, 4) == 0) {
+            return p;
+        }
+        p += size;
+    }
+    return NULL;
+}
+
+/*
+ * Walks ftyp, moov and then moof+mdat pairs. Each trun must describe its
+ * mdat exactly; fragments are counted, and those starting at an IRAP
+ * picture must say so in first_sample_flags.
+ */
+static inline void check_fragmented(const char *name, const MemFile *file, int total, int expected_fragments,
+                                    int samples_per_fragment) {
+    static unsigned char expected[SYNTH_AU_MAX];
+    const unsigned char *p = file->data;
+    const unsigned char *end = file->data + file->size;
+    CHECK(file->size >= 16 && memcmp(p + 4, "ftyp", 4) == 0, "%s: no ftyp", name);
+    p += be32(p);
+    CHECK(p + 8 <= end && memcmp(p + 4, "moov", 4) == 0, "%s: no moov after ftyp", name);
+    p += be32(p);
+
+    int fragments = 0;
+    int sample = 0;
+    while (p < end) {
+        CHECK(p + 8 <= end && memcmp(p + 4, "moof", 4) == 0, "%s: expected moof at %ld", name, (long)(p - file->data));
+        const unsigned char *moof = p;
+        const unsigned char *moof_end = moof + be32(moof);
+        const unsigned char *mdat = moof_end;
+        CHECK(mdat + 8 <= end && memcmp(mdat + 4, "mdat", 4) == 0, "%s: moof without mdat", name);
+        const unsigned char *traf = find_box(moof + 8, moof_end, "traf");
+        CHECK(traf != NULL, "%s: moof without traf", name);
+        const unsigned char *trun = find_box(traf + 8, traf + be32(traf), "trun");
+        CHECK(trun != NULL, "%s: traf without trun", name);
+
+        uint32_t flags = be32(trun + 8) & 0xffffff;
+        uint32_t count = be32(trun + 12);
+        const unsigned char *data = moof + be32(trun + 16);
+        const unsigned char *entry = trun + 20;
+        int irap = synth_is_irap(sample);
+        CHECK(((flags & 0x004) != 0) == irap, "%s: fragment %d first_sample_flags %s", name, fragments,
+              irap ? "missing" : "on a non-IRAP sample");
+        if (flags & 0x004) {
+            entry += 4;
+        }
+        CHECK(data == mdat + 8, "%s: fragment %d data_offset does not point into its mdat", name, fragments);
+        CHECK(samples_per_fragment == 0 || count == (uint32_t)samples_per_fragment, "%s: fragment %d has %u samples",
+              name, fragments, count);
+        for (uint32_t i = 0; i < count; ++i, entry += 8, ++sample) {
+            uint32_t duration = be32(entry);
+            uint32_t size = be32(entry + 4);
+            int expected_size = synth_sample(expected, sample, sample == 0);
+            CHECK(duration == SYNTH_DURATION_90K, "%s: sample %d lasts %u", name, sample, duration);
+            CHECK(size == (uint32_t)expected_size && data + size <= end &&
+                      memcmp(data, expected, (size_t)expected_size) == 0,
+                  "%s: sample %d differs (%u bytes, expected %d)", name, sample, size, expected_size);
+            data += size;
+        }
+        CHECK(data == mdat + be32(mdat), "%s: fragment %d mdat holds more than its samples", name, fragments);
+        fragments++;
+        p = data;
+    }
+    CHECK(sample == total, "%s: %d samples, expected %d", name, sample, total);
+    CHECK(fragments == expected_fragments, "%s: %d fragments, expected %d", name, fragments, expected_fragments);
+}
+
+#endif // TESTS_MP4_ROUNDTRIP_H
@@ -0,0 +1,103 @@
+#ifndef TESTS_SYNTHETIC_HEVC_H
+#define TESTS_SYNTHETIC_HEVC_H
+
+#include <string.h>
+
+/*
+ * Synthetic H.265 access units for the recording tests: an AUD, the
+ * parameter sets ahead of each IRAP picture, a prefix SEI and four slice
+ * segments. Payload bytes are odd, so no start code shows up inside a NAL,
+ * and they depend on the AU index, so a misplaced AU does not compare equal.
+ */
+#define SYNTH_GOP 30
+#define SYNTH_SLICES 4
+#define SYNTH_AU_MAX 80000
+#define SYNTH_DURATION_90K 1500
+
+static const unsigned char synth_vps[] = {0, 0, 0, 1, 0x40, 1, 0x0c, 1, 0xff, 0xff, 1, 0x60, 0, 0, 3, 0,
+                                          0, 3, 0, 0, 3, 0, 0, 3, 0, 0x5d, 0xac, 9};
+static const unsigned char synth_sps[] = {0, 0, 0, 1, 0x42, 1, 1, 1, 0x60, 0, 0, 3, 0, 0, 3, 0, 0, 3, 0, 0, 3, 0, 0x5d,
+                                          0xa0, 2, 0x80, 0x80, 0x2d, 0x16, 0x59, 0x59, 0xa4, 0x93, 0x2b, 0x80, 0x40,
+                                          0, 0, 3, 0, 0x40, 0, 0, 7, 0x82};
+static const unsigned char synth_pps[] = {0, 0, 0, 1, 0x44, 1, 0xc1, 0x72, 0xb4, 0x62, 0x40};
+
+static inline int synth_is_irap(int index) {
+    return index % SYNTH_GOP == 0;
+}
+
+/* Writes a start code and a NAL of the given type with size bytes after the start code. */
+static inline int synth_put_nal(unsigned char *out, int type, int size, int first_slice, int index) {
+    out[0] = 0;
+    out[1] = 0;
+    out[2] = 0;
+    out[3] = 1;
+    out[4] = (unsigned char)(type << 1);
+    out[5] = 1;
+    for (int i = 6; i < size + 4; ++i) {
+        out[i] = (unsigned char)(i * 7 + type + index * 13) | 1;
+    }
+    if (type < 32) {
+        // first_slice_segment_in_pic_flag
+        out[6] = first_slice ? 0x80 : 0x01;
+    }
+    return size + 4;
+}
+
+static inline int synth_slice_size(int index) {
+    return synth_is_irap(index) ? 12000 : 2000 + (index * 37) % 1000;
+}
+
+/* Annex B access unit number index; returns its size. */
+static inline int synth_au(unsigned char *out, int index) {
+    int n = 0;
+    n += synth_put_nal(out + n, 35, 3, 0, index);
+    if (synth_is_irap(index)) {
+        memcpy(out + n, synth_vps, sizeof(synth_vps));
+        n += (int)sizeof(synth_vps);
+        memcpy(out + n, synth_sps, sizeof(synth_sps));
+        n += (int)sizeof(synth_sps);
+        memcpy(out + n, synth_pps, sizeof(synth_pps));
+        n += (int)sizeof(synth_pps);
+    }
+    n += synth_put_nal(out + n, 39, 20, 0, index);
+    for (int s = 0; s < SYNTH_SLICES; ++s) {
+        n += synth_put_nal(out + n, synth_is_irap(index) ? 19 : 1, synth_slice_size(index), s == 0, index);
+    }
+    return n;
+}
+
+/*
+ * The MP4 sample for AU index: its SEI and slices, each behind a 4-byte
+ * length; parameter sets go to hvcC. A writer drops the SEI ahead of the
+ * first IRAP picture it sees, so leading leaves it out.
+ */
+static inline int synth_sample(unsigned char *out, int index, int leading) {
+    unsigned char au[SYNTH_AU_MAX];
+    int size = synth_au(au, index);
+    int n = 0;
+    int i = 0;
+    while (i + 4 <= size) {
+        int start = i + 4;
+        int end = start;
+        while (end + 4 <= size && !(au[end] == 0 && au[end + 1] == 0 && au[end + 2] == 0 && au[end + 3] == 1)) {
+            ++end;
+        }
+        if (end + 4 > size) {
+            end = size;
+        }
+        int type = (au[start] >> 1) & 0x3f;
+        if (type < 32 || (type == 39 && !leading)) {
+            int len = end - start;
+            out[n] = (unsigned char)(len >> 24);
+            out[n + 1] = (unsigned char)(len >> 16);
+            out[n + 2] = (unsigned char)(len >> 8);
+            out[n + 3] = (unsigned char)len;
+            memcpy(out + n + 4, au + start, (size_t)len);
+            n += 4 + len;
+        }
+        i = end;
+    }
+    return n;
+}
+
+#endif // TESTS_SYNTHETIC_HEVC_H
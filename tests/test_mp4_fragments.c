@@ -0,0 +1,35 @@
+/*
+ * Fragmented MP4 as the recorder writes it: one moof+mdat per GOP by
+ * default, or split on a fixed duration. Every trun must describe its mdat
+ * exactly, fragments starting at an IRAP picture must flag it, and every
+ * sample must come back byte for byte with its duration.
+ */
+#include "mp4_roundtrip.h"
+
+#define AU_COUNT (SYNTH_GOP * 10)
+
+static void test_fragmented(const char *name, unsigned fragment_samples) {
+    Output out;
+    memset(&out, 0, sizeof(out));
+    MP4E_mux_t *mux = open_mux(&out, 0, 1, fragment_samples * SYNTH_DURATION_90K, 0);
+    mp4_h26x_writer_t writer;
+    CHECK(mux != NULL && mp4_h26x_write_init(&writer, mux, MP4_TEST_WIDTH, MP4_TEST_HEIGHT, 1) == MP4E_STATUS_OK,
+          "%s: init", name);
+    CHECK(write_aus(&writer, 0, AU_COUNT) == 0, "%s: writing failed", name);
+    mp4_h26x_write_close(&writer);
+    CHECK(MP4E_close(mux) == MP4E_STATUS_OK, "%s: MP4E_close failed", name);
+    int per_fragment = fragment_samples != 0 ? (int)fragment_samples : SYNTH_GOP;
+    check_fragmented(name, &out.file, AU_COUNT, AU_COUNT / per_fragment, per_fragment);
+    mem_file_free(&out.file);
+}
+
+int main(void) {
+    test_fragmented("one per GOP", 0);
+    test_fragmented("split every 10 samples", 10);
+    if (failures != 0) {
+        fprintf(stderr, "test_mp4_fragments: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("test_mp4_fragments: ok\n");
+    return 0;
+}
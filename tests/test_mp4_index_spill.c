@@ -0,0 +1,36 @@
+/*
+ * The standard-mode sample index lives in a few chunks of memory and spills
+ * the rest to a sidecar, read back at close. With a small chunk size most of
+ * the index goes through the sidecar; the file must still read back with
+ * every sample byte for byte, with its duration, in order.
+ */
+#include "mp4_roundtrip.h"
+
+#define AU_COUNT (SYNTH_GOP * 10)
+
+static void test_spill(const char *name, int sequential) {
+    Output out;
+    memset(&out, 0, sizeof(out));
+    MP4E_mux_t *mux = open_mux(&out, sequential, 0, 0, 1);
+    mp4_h26x_writer_t writer;
+    CHECK(mux != NULL && mp4_h26x_write_init(&writer, mux, MP4_TEST_WIDTH, MP4_TEST_HEIGHT, 1) == MP4E_STATUS_OK,
+          "%s: init", name);
+    CHECK(write_aus(&writer, 0, AU_COUNT) == 0, "%s: writing failed", name);
+    mp4_h26x_write_close(&writer);
+    CHECK(MP4E_close(mux) == MP4E_STATUS_OK, "%s: MP4E_close failed", name);
+    CHECK(out.index.size > 0, "%s: the index never spilled", name);
+    check_indexed(name, &out.file, 0, AU_COUNT);
+    mem_file_free(&out.file);
+    mem_file_free(&out.index);
+}
+
+int main(void) {
+    test_spill("standard", 0);
+    test_spill("sequential", 1);
+    if (failures != 0) {
+        fprintf(stderr, "test_mp4_index_spill: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("test_mp4_index_spill: ok\n");
+    return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * Segment hand-over as rotate_segment does it: the writer switches to a new
+ * muxer at a keyframe and only then is the old file closed. Both files must
+ * read back complete, each starting on its own keyframe, with no sample lost
+ * or duplicated across the cut.
+ */
+#include "mp4_roundtrip.h"
+
+#define AU_COUNT (SYNTH_GOP * 10)
+
+static void test_segment_switch(const char *name, int split) {
+    Output first, second;
+    memset(&first, 0, sizeof(first));
+    memset(&second, 0, sizeof(second));
+    MP4E_mux_t *mux = open_mux(&first, 1, 0, 0, 1);
+    mp4_h26x_writer_t writer;
+    CHECK(mux != NULL && mp4_h26x_write_init(&writer, mux, MP4_TEST_WIDTH, MP4_TEST_HEIGHT, 1) == MP4E_STATUS_OK,
+          "%s: init", name);
+    CHECK(write_aus(&writer, 0, split) == 0, "%s: writing the first segment failed", name);
+    MP4E_mux_t *next = open_mux(&second, 1, 0, 0, 1);
+    CHECK(next != NULL && mp4_h26x_write_switch(&writer, next, MP4_TEST_WIDTH, MP4_TEST_HEIGHT) == MP4E_STATUS_OK,
+          "%s: switch", name);
+    CHECK(MP4E_close(mux) == MP4E_STATUS_OK, "%s: closing the first segment failed", name);
+    CHECK(write_aus(&writer, split, AU_COUNT - split) == 0, "%s: writing the second segment failed", name);
+    mp4_h26x_write_close(&writer);
+    CHECK(MP4E_close(next) == MP4E_STATUS_OK, "%s: closing the second segment failed", name);
+    check_indexed(name, &first.file, 0, split);
+    check_indexed(name, &second.file, split, AU_COUNT - split);
+    mem_file_free(&first.file);
+    mem_file_free(&first.index);
+    mem_file_free(&second.file);
+    mem_file_free(&second.index);
+}
+
+int main(void) {
+    test_segment_switch("segment switch", SYNTH_GOP * 4);
+    test_segment_switch("segment switch, one GOP", SYNTH_GOP);
+    if (failures != 0) {
+        fprintf(stderr, "test_mp4_segments: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("test_mp4_segments: ok\n");
+    return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Feeds the recording policy window after window of made-up pressure: the
+ * level must climb one step per window while the writer falls behind, come
+ * back down only after a run of calm windows, and never sit below the floor
+ * free space sets, whatever the load.
+ */
+#include "record_policy.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define MB (1024ll * 1024ll)
+#define MIN_FREE (100 * MB)
+/* Calm windows in a row record_policy.c waits for before stepping down. */
+#define CALM_WINDOWS 5
+
+static int failures;
+
+#define CHECK(cond, ...)                                                                                               \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);                                                            \
+            fprintf(stderr, __VA_ARGS__);                                                                              \
+            fputc('\n', stderr);                                                                                       \
+            failures++;                                                                                                \
+            return;                                                                                                    \
+        }                                                                                                              \
+    } while (0)
+
+/* Queue fill and throughput over one window; free space unknown unless set afterwards. */
+static RecordPressure window(double queue_fill, guint64 queued_bytes, guint64 drained_bytes) {
+    RecordPressure pressure;
+    memset(&pressure, 0, sizeof(pressure));
+    pressure.queue_fill = queue_fill;
+    pressure.queued_bytes = queued_bytes;
+    pressure.drained_bytes = drained_bytes;
+    pressure.free_bytes = -1;
+    return pressure;
+}
+
+static const RecordPressure overloaded = {0.9, 4 * MB, 1 * MB, -1};
+static const RecordPressure calm = {0.0, 1 * MB, 1 * MB, -1};
+
+static void test_steps_up(void) {
+    RecordPolicy *policy = record_policy_new(0);
+    RecordLevel levels[RECORD_LEVEL_COUNT + 1];
+    for (int i = 0; i <= RECORD_LEVEL_COUNT; ++i) {
+        levels[i] = record_policy_update(policy, &overloaded);
+    }
+    record_policy_free(policy);
+    CHECK(levels[0] == RECORD_LEVEL_REFERENCE_ONLY && levels[1] == RECORD_LEVEL_IRAP_ONLY &&
+              levels[2] == RECORD_LEVEL_PAUSED,
+          "an overloaded writer did not step up one level per window");
+    CHECK(levels[RECORD_LEVEL_COUNT] == RECORD_LEVEL_PAUSED, "the level went past paused");
+}
+
+static void test_busy_queue(void) {
+    RecordPolicy *policy = record_policy_new(0);
+    // Moderately full but draining as fast as it fills: hold.
+    RecordPressure keeping_pace = window(0.3, 2 * MB, 2 * MB);
+    RecordLevel held = record_policy_update(policy, &keeping_pace);
+    // Moderately full and draining slower: step up.
+    RecordPressure falling_behind = window(0.3, 2 * MB, 1 * MB);
+    RecordLevel stepped = record_policy_update(policy, &falling_behind);
+    // Nearly empty but still draining slower is not calm either: hold.
+    RecordPressure behind_low = window(0.0, 2 * MB, 1 * MB);
+    for (int i = 0; i < CALM_WINDOWS * 2; ++i) {
+        record_policy_update(policy, &behind_low);
+    }
+    RecordLevel still = record_policy_update(policy, &behind_low);
+    record_policy_free(policy);
+    CHECK(held == RECORD_LEVEL_FULL, "a busy queue the writer keeps up with raised the level");
+    CHECK(stepped == RECORD_LEVEL_REFERENCE_ONLY, "a busy queue the writer falls behind on kept the level");
+    CHECK(still == RECORD_LEVEL_REFERENCE_ONLY, "the level came down while the writer was falling behind");
+}
+
+static void test_steps_down(void) {
+    RecordPolicy *policy = record_policy_new(0);
+    record_policy_update(policy, &overloaded);
+    record_policy_update(policy, &overloaded);
+    RecordLevel early = RECORD_LEVEL_COUNT;
+    for (int i = 0; i < CALM_WINDOWS - 1; ++i) {
+        early = record_policy_update(policy, &calm);
+    }
+    // One unsettled window starts the count over.
+    RecordPressure unsettled = window(0.1, 1 * MB, 1 * MB);
+    record_policy_update(policy, &unsettled);
+    RecordLevel reset = RECORD_LEVEL_COUNT;
+    for (int i = 0; i < CALM_WINDOWS - 1; ++i) {
+        reset = record_policy_update(policy, &calm);
+    }
+    RecordLevel first = record_policy_update(policy, &calm);
+    RecordLevel between = RECORD_LEVEL_COUNT;
+    for (int i = 0; i < CALM_WINDOWS - 1; ++i) {
+        between = record_policy_update(policy, &calm);
+    }
+    RecordLevel second = record_policy_update(policy, &calm);
+    RecordLevel settled = record_policy_update(policy, &calm);
+    record_policy_free(policy);
+    CHECK(early == RECORD_LEVEL_IRAP_ONLY && reset == RECORD_LEVEL_IRAP_ONLY,
+          "the level came down before %d calm windows in a row", CALM_WINDOWS);
+    CHECK(first == RECORD_LEVEL_REFERENCE_ONLY && between == RECORD_LEVEL_REFERENCE_ONLY,
+          "the level did not come down one step after %d calm windows", CALM_WINDOWS);
+    CHECK(second == RECORD_LEVEL_FULL && settled == RECORD_LEVEL_FULL, "the level did not settle back at full");
+}
+
+static void test_free_space(void) {
+    RecordPolicy *policy = record_policy_new(MIN_FREE);
+    RecordPressure pressure = calm;
+    pressure.free_bytes = 3 * MIN_FREE;
+    RecordLevel plenty = record_policy_update(policy, &pressure);
+    pressure.free_bytes = MIN_FREE * 3 / 2;
+    RecordLevel low = record_policy_update(policy, &pressure);
+    pressure.free_bytes = MIN_FREE / 2;
+    RecordLevel full_card = record_policy_update(policy, &pressure);
+    pressure.free_bytes = -1;
+    RecordLevel unknown = record_policy_update(policy, &pressure);
+    // Free space is a floor over the load level, not a step of it.
+    RecordPressure loaded = overloaded;
+    loaded.free_bytes = MIN_FREE * 3 / 2;
+    RecordLevel loaded_low = record_policy_update(policy, &loaded);
+    pressure = calm;
+    pressure.free_bytes = 3 * MIN_FREE;
+    RecordLevel loaded_plenty = record_policy_update(policy, &pressure);
+    record_policy_free(policy);
+
+    RecordPolicy *ignoring = record_policy_new(0);
+    pressure.free_bytes = 0;
+    RecordLevel ignored = record_policy_update(ignoring, &pressure);
+    record_policy_free(ignoring);
+
+    CHECK(plenty == RECORD_LEVEL_FULL, "plenty of free space lowered the level");
+    CHECK(low == RECORD_LEVEL_IRAP_ONLY, "below twice the minimum free space: %s", record_level_name(low));
+    CHECK(full_card == RECORD_LEVEL_PAUSED, "below the minimum free space: %s", record_level_name(full_card));
+    CHECK(unknown == RECORD_LEVEL_FULL, "unknown free space kept the floor: %s", record_level_name(unknown));
+    CHECK(loaded_low == RECORD_LEVEL_IRAP_ONLY && loaded_plenty == RECORD_LEVEL_REFERENCE_ONLY,
+          "the free space floor moved the load level");
+    CHECK(ignored == RECORD_LEVEL_FULL, "a zero minimum did not ignore free space");
+}
+
+static void test_names(void) {
+    for (int i = 0; i < RECORD_LEVEL_COUNT; ++i) {
+        CHECK(strcmp(record_level_name((RecordLevel)i), "unknown") != 0, "level %d has no name", i);
+        for (int j = 0; j < i; ++j) {
+            CHECK(strcmp(record_level_name((RecordLevel)i), record_level_name((RecordLevel)j)) != 0,
+                  "levels %d and %d share a name", j, i);
+        }
+    }
+    CHECK(strcmp(record_level_name(RECORD_LEVEL_COUNT), "unknown") == 0, "an invalid level has a name");
+    CHECK(record_policy_update(NULL, &overloaded) == RECORD_LEVEL_FULL, "no policy did not record everything");
+}
+
+int main(void) {
+    test_steps_up();
+    test_busy_queue();
+    test_steps_down();
+    test_free_space();
+    test_names();
+    if (failures != 0) {
+        fprintf(stderr, "test_record_policy: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("test_record_policy: ok\n");
+    return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * Fills the pre-roll ring the way the appsink thread does and drains it the
+ * way a starting recording does: what comes out must start at an IRAP
+ * picture, be in order, hold references to the very buffers pushed, and lose
+ * only whole GOPs from the front, to age or to the byte limit.
+ */
+#include "record_preroll.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define GOP 30
+#define AU_BYTES 1000u
+#define DURATION_NS 1000000u
+/* Past the ring's initial capacity, so it has to grow while wrapped. */
+#define GROWTH_AUS 600u
+
+static int failures;
+
+#define CHECK(cond, ...)                                                                                               \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);                                                            \
+            fprintf(stderr, __VA_ARGS__);                                                                              \
+            fputc('\n', stderr);                                                                                       \
+            failures++;                                                                                                \
+            return;                                                                                                    \
+        }                                                                                                              \
+    } while (0)
+
+/* AU index is told apart by its PTS; every gop-th one is an IRAP picture. */
+static GstBuffer *make_au(guint index, guint gop) {
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, AU_BYTES, NULL);
+    GST_BUFFER_PTS(buffer) = (GstClockTime)index * DURATION_NS;
+    if (index % gop != 0) {
+        GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    }
+    return buffer;
+}
+
+static void push_aus(RecordPreroll *preroll, GstCaps *caps, guint first, guint count, guint gop) {
+    for (guint i = first; i < first + count; ++i) {
+        GstBuffer *buffer = make_au(i, gop);
+        record_preroll_push(preroll, caps, buffer);
+        gst_buffer_unref(buffer);
+    }
+}
+
+/* Pops everything; TRUE if it came out as AUs first..first+count-1, in order. */
+static gboolean drain_matches(RecordPreroll *preroll, guint first, guint count) {
+    gboolean ok = TRUE;
+    guint n = 0;
+    GstBuffer *buffer;
+    while ((buffer = record_preroll_pop(preroll)) != NULL) {
+        ok = ok && GST_BUFFER_PTS(buffer) == (GstClockTime)(first + n) * DURATION_NS;
+        ok = ok && (n != 0 || !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT));
+        gst_buffer_unref(buffer);
+        n++;
+    }
+    return ok && n == count;
+}
+
+static void test_starts_at_keyframe(void) {
+    RecordPreroll *preroll = record_preroll_new(60, 64u * 1024u * 1024u);
+    CHECK(preroll != NULL, "record_preroll_new failed");
+    // Joined mid-GOP: the first 10 AUs cannot be decoded and are not kept.
+    push_aus(preroll, NULL, GOP - 10, 10 + 2 * GOP, GOP);
+    gsize bytes = 0;
+    guint depth = record_preroll_get_depth(preroll, &bytes, NULL);
+    gboolean drained = drain_matches(preroll, GOP, 2 * GOP);
+    gboolean empty = record_preroll_get_depth(preroll, &bytes, NULL) == 0 && bytes == 0;
+    record_preroll_free(preroll);
+    CHECK(depth == 2 * GOP, "%u AUs held, expected %u", depth, 2 * GOP);
+    CHECK(drained, "the ring did not drain from the first IRAP picture, in order");
+    CHECK(empty, "the ring still counts AUs after draining");
+}
+
+static void test_byte_limit(void) {
+    // Room for two GOPs and a half: the oldest GOP goes as a whole once the third is halfway in.
+    RecordPreroll *preroll = record_preroll_new(60, AU_BYTES * GOP * 5 / 2);
+    CHECK(preroll != NULL, "record_preroll_new failed");
+    push_aus(preroll, NULL, 0, 2 * GOP + GOP / 2 + 1, GOP);
+    gsize bytes = 0;
+    guint depth = record_preroll_get_depth(preroll, &bytes, NULL);
+    gboolean drained = drain_matches(preroll, GOP, GOP + GOP / 2 + 1);
+    record_preroll_free(preroll);
+    CHECK(depth == GOP + GOP / 2 + 1, "%u AUs held, expected %u", depth, GOP + GOP / 2 + 1);
+    CHECK(bytes == depth * AU_BYTES, "%lu bytes held for %u AUs", (unsigned long)bytes, depth);
+    CHECK(drained, "the byte limit did not drop the oldest GOP whole");
+}
+
+static void test_oversized_gop(void) {
+    // One GOP larger than the whole ring: it goes, and so does the rest of it until the next IRAP picture.
+    RecordPreroll *preroll = record_preroll_new(60, AU_BYTES * GOP / 2);
+    CHECK(preroll != NULL, "record_preroll_new failed");
+    push_aus(preroll, NULL, 0, GOP, GOP);
+    guint cut = record_preroll_get_depth(preroll, NULL, NULL);
+    push_aus(preroll, NULL, GOP, 10, GOP);
+    gboolean drained = drain_matches(preroll, GOP, 10);
+    record_preroll_free(preroll);
+    CHECK(cut == 0, "%u AUs of an oversized GOP were kept", cut);
+    CHECK(drained, "the ring did not restart at the next IRAP picture");
+}
+
+static void test_growth(void) {
+    RecordPreroll *preroll = record_preroll_new(60, 64u * 1024u * 1024u);
+    CHECK(preroll != NULL, "record_preroll_new failed");
+    // Move the head off the first slot first (a whole GOP), so growing has to unroll a wrapped ring.
+    push_aus(preroll, NULL, 0, 2 * GOP, GOP);
+    for (guint i = 0; i < GOP; ++i) {
+        gst_buffer_unref(record_preroll_pop(preroll));
+    }
+    push_aus(preroll, NULL, 2 * GOP, GROWTH_AUS, GOP);
+    guint depth = record_preroll_get_depth(preroll, NULL, NULL);
+    gboolean drained = drain_matches(preroll, GOP, GOP + GROWTH_AUS);
+    record_preroll_free(preroll);
+    CHECK(depth == GOP + GROWTH_AUS, "%u AUs held, expected %u", depth, GOP + GROWTH_AUS);
+    CHECK(drained, "AUs were lost or reordered while the ring grew");
+}
+
+static void test_time_span(void) {
+    RecordPreroll *preroll = record_preroll_new(1, 64u * 1024u * 1024u);
+    CHECK(preroll != NULL, "record_preroll_new failed");
+    // GOP 0 has to stay until GOP 1 alone covers the second.
+    push_aus(preroll, NULL, 0, GOP, GOP);
+    g_usleep(G_USEC_PER_SEC / 2);
+    push_aus(preroll, NULL, GOP, GOP, GOP);
+    g_usleep(G_USEC_PER_SEC / 2 + G_USEC_PER_SEC / 10);
+    push_aus(preroll, NULL, 2 * GOP, 1, GOP);
+    guint young = record_preroll_get_depth(preroll, NULL, NULL);
+    g_usleep(G_USEC_PER_SEC / 2);
+    push_aus(preroll, NULL, 2 * GOP + 1, GOP, GOP);
+    guint64 span_ns = 0;
+    guint depth = record_preroll_get_depth(preroll, NULL, &span_ns);
+    gboolean drained = drain_matches(preroll, GOP, 2 * GOP + 1);
+    record_preroll_free(preroll);
+    CHECK(young == 2 * GOP + 1, "a GOP went before the ones after it covered the span (%u AUs held)", young);
+    CHECK(depth == 2 * GOP + 1, "%u AUs held after GOP 0 aged out, expected %u", depth, 2 * GOP + 1);
+    CHECK(span_ns >= 1000000000ull, "the ring spans %lu ns, less than a second", (unsigned long)span_ns);
+    CHECK(drained, "the wrong GOP aged out");
+}
+
+static void test_references(void) {
+    RecordPreroll *preroll = record_preroll_new(60, AU_BYTES * GOP);
+    CHECK(preroll != NULL, "record_preroll_new failed");
+    GstCaps *first_caps = gst_caps_from_string("video/x-h265, stream-format=byte-stream, width=1280, height=720");
+    GstCaps *second_caps = gst_caps_from_string("video/x-h265, stream-format=byte-stream, width=1920, height=1080");
+    GstCaps *none = record_preroll_get_caps(preroll);
+
+    GstBuffer *kept = make_au(0, GOP);
+    record_preroll_push(preroll, first_caps, kept);
+    gboolean ref_taken = GST_MINI_OBJECT_REFCOUNT_VALUE(kept) == 2;
+    GstBuffer *popped = record_preroll_pop(preroll);
+    gboolean same = popped == kept && GST_MINI_OBJECT_REFCOUNT_VALUE(kept) == 2;
+    gst_buffer_unref(popped);
+
+    // Caps follow the latest AU that carried them; an AU without caps keeps the last ones.
+    push_aus(preroll, first_caps, 0, 1, GOP);
+    push_aus(preroll, second_caps, 1, 1, GOP);
+    push_aus(preroll, NULL, 2, 1, GOP);
+    GstCaps *caps = record_preroll_get_caps(preroll);
+    gboolean latest = caps != NULL && gst_caps_is_equal(caps, second_caps);
+    if (caps != NULL) {
+        gst_caps_unref(caps);
+    }
+
+    // Pushed again and then overrun: the ring lets go of its reference.
+    record_preroll_push(preroll, NULL, kept);
+    push_aus(preroll, NULL, GOP, GOP, GOP);
+    gboolean released = GST_MINI_OBJECT_REFCOUNT_VALUE(kept) == 1;
+    record_preroll_free(preroll);
+    gst_buffer_unref(kept);
+    gst_caps_unref(first_caps);
+    gst_caps_unref(second_caps);
+    CHECK(none == NULL, "caps were reported before any were seen");
+    CHECK(ref_taken, "push did not take a reference");
+    CHECK(same, "pop did not hand over the ring's reference to the buffer pushed");
+    CHECK(latest, "the caps are not those of the latest AU");
+    CHECK(released, "a dropped GOP kept its buffer alive");
+}
+
+int main(int argc, char **argv) {
+    gst_init(&argc, &argv);
+    test_starts_at_keyframe();
+    test_byte_limit();
+    test_oversized_gop();
+    test_growth();
+    test_time_span();
+    test_references();
+    if (failures != 0) {
+        fprintf(stderr, "test_record_preroll: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("test_record_preroll: ok\n");
+    return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * Runs the disk budget over a scratch directory: recordings go oldest
+ * first until the rest fits, files of other recordings are left alone, an
+ * Annex B file takes its timestamp file with it, and the file being written
+ * survives however its path is spelled.
+ */
+#include "record_retention.h"
+
+#include "record_stream.h"
+
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FILE_BYTES 1000
+#define MAX_FILES 8
+
+static int failures;
+
+#define CHECK(cond, ...)                                                                                               \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);                                                            \
+            fprintf(stderr, __VA_ARGS__);                                                                              \
+            fputc('\n', stderr);                                                                                       \
+            failures++;                                                                                                \
+            return;                                                                                                    \
+        }                                                                                                              \
+    } while (0)
+
+typedef struct {
+    gchar *dir;
+    const char *names[MAX_FILES];
+    int count;
+} Scratch;
+
+/* Files are created oldest first, a minute apart, so the modification time alone orders them. */
+static gboolean scratch_add(Scratch *s, const char *name, gsize size) {
+    static char data[FILE_BYTES * 4];
+    gchar *path = g_build_filename(s->dir, name, NULL);
+    gboolean ok = size <= sizeof(data) && g_file_set_contents(path, data, (gssize)size, NULL);
+    struct timespec times[2] = {{1600000000 + s->count * 60, 0}, {1600000000 + s->count * 60, 0}};
+    ok = ok && utimensat(AT_FDCWD, path, times, 0) == 0;
+    g_free(path);
+    s->names[s->count++] = name;
+    return ok;
+}
+
+static gboolean scratch_has(const Scratch *s, const char *name) {
+    gchar *path = g_build_filename(s->dir, name, NULL);
+    gboolean exists = g_file_test(path, G_FILE_TEST_EXISTS);
+    g_free(path);
+    return exists;
+}
+
+static void scratch_free(Scratch *s) {
+    for (int i = 0; i < s->count; ++i) {
+        gchar *path = g_build_filename(s->dir, s->names[i], NULL);
+        g_remove(path);
+        g_free(path);
+    }
+    g_rmdir(s->dir);
+    g_free(s->dir);
+    memset(s, 0, sizeof(*s));
+}
+
+static gboolean scratch_init(Scratch *s) {
+    memset(s, 0, sizeof(*s));
+    s->dir = g_dir_make_tmp("test_record_retention_XXXXXX", NULL);
+    return s->dir != NULL;
+}
+
+static void test_oldest_first(void) {
+    Scratch s;
+    CHECK(scratch_init(&s), "oldest first: cannot create a temporary directory");
+    gboolean ok = scratch_add(&s, "rec_0001.mp4", FILE_BYTES) && scratch_add(&s, "rec_0002.mp4", FILE_BYTES) &&
+                  scratch_add(&s, "rec_0003.mp4", FILE_BYTES) && scratch_add(&s, "rec_0004.mp4", FILE_BYTES) &&
+                  scratch_add(&s, "other_0001.mp4", FILE_BYTES * 4) && scratch_add(&s, "rec_0000.ts", FILE_BYTES * 4);
+    guint64 deleted = ok ? record_retention_enforce(s.dir, "rec_", ".mp4", FILE_BYTES * 5 / 2, 0, NULL) : 0;
+    gboolean gone = !scratch_has(&s, "rec_0001.mp4") && !scratch_has(&s, "rec_0002.mp4");
+    gboolean kept = scratch_has(&s, "rec_0003.mp4") && scratch_has(&s, "rec_0004.mp4");
+    gboolean others = scratch_has(&s, "other_0001.mp4") && scratch_has(&s, "rec_0000.ts");
+    scratch_free(&s);
+    CHECK(ok, "oldest first: cannot set up the recordings");
+    CHECK(deleted == FILE_BYTES * 2, "oldest first: %lu bytes deleted, expected %d", (unsigned long)deleted,
+          FILE_BYTES * 2);
+    CHECK(gone && kept, "oldest first: the wrong recordings were deleted");
+    CHECK(others, "oldest first: files of other recordings were touched");
+}
+
+static void test_reserve(void) {
+    Scratch s;
+    CHECK(scratch_init(&s), "reserve: cannot create a temporary directory");
+    gboolean ok = scratch_add(&s, "rec_0001.mp4", FILE_BYTES) && scratch_add(&s, "rec_0002.mp4", FILE_BYTES) &&
+                  scratch_add(&s, "rec_0003.mp4", FILE_BYTES);
+    guint64 within = ok ? record_retention_enforce(s.dir, "rec_", ".mp4", FILE_BYTES * 3, 0, NULL) : 1;
+    guint64 deleted = ok ? record_retention_enforce(s.dir, "rec_", ".mp4", FILE_BYTES * 3, FILE_BYTES / 2, NULL) : 0;
+    gboolean oldest_gone = !scratch_has(&s, "rec_0001.mp4") && scratch_has(&s, "rec_0002.mp4");
+    scratch_free(&s);
+    CHECK(ok, "reserve: cannot set up the recordings");
+    CHECK(within == 0, "reserve: %lu bytes deleted while within the budget", (unsigned long)within);
+    CHECK(deleted == FILE_BYTES && oldest_gone, "reserve: room for the next segment was not made");
+}
+
+static void test_timestamps_follow(void) {
+    Scratch s;
+    CHECK(scratch_init(&s), "timestamps: cannot create a temporary directory");
+    gboolean ok = scratch_add(&s, "rec_0001.h265", FILE_BYTES) &&
+                  scratch_add(&s, "rec_0001.h265" RECORD_STREAM_TIMESTAMPS_SUFFIX, 100) &&
+                  scratch_add(&s, "rec_0002.h265", FILE_BYTES);
+    guint64 deleted = ok ? record_retention_enforce(s.dir, "rec_", ".h265", FILE_BYTES, 0, NULL) : 0;
+    gboolean gone = !scratch_has(&s, "rec_0001.h265") &&
+                    !scratch_has(&s, "rec_0001.h265" RECORD_STREAM_TIMESTAMPS_SUFFIX);
+    gboolean kept = scratch_has(&s, "rec_0002.h265");
+    scratch_free(&s);
+    CHECK(ok, "timestamps: cannot set up the recordings");
+    CHECK(deleted == FILE_BYTES && gone && kept, "timestamps: the timestamp file outlived its recording");
+}
+
+static gchar *keep_full_path(const char *dir) {
+    return g_build_filename(dir, "rec_0001.mp4", NULL);
+}
+
+static gchar *keep_dot_relative(const char *dir) {
+    (void)dir;
+    return g_strdup("./rec_0001.mp4");
+}
+
+static gchar *keep_dot_segment(const char *dir) {
+    return g_strconcat(dir, "/./rec_0001.mp4", NULL);
+}
+
+static gchar *keep_parent_segment(const char *dir) {
+    gchar *base = g_path_get_basename(dir);
+    gchar *keep = g_strconcat(dir, "/../", base, "/rec_0001.mp4", NULL);
+    g_free(base);
+    return keep;
+}
+
+static gchar *keep_unreachable(const char *dir) {
+    (void)dir;
+    return g_strdup("/nonexistent/rec_0001.mp4");
+}
+
+/*
+ * The live file is the oldest and the budget only fits one file: everything
+ * else goes, never the live one. in_dir runs the budget from inside the
+ * recording directory, as a bare relative output path would.
+ */
+static void check_keep(const char *name, gchar *(*spell)(const char *dir), gboolean in_dir) {
+    Scratch s;
+    CHECK(scratch_init(&s), "%s: cannot create a temporary directory", name);
+    gboolean ok = scratch_add(&s, "rec_0001.mp4", FILE_BYTES) && scratch_add(&s, "rec_0002.mp4", FILE_BYTES) &&
+                  scratch_add(&s, "rec_0003.mp4", FILE_BYTES);
+    gchar *keep = spell(s.dir);
+    gchar *cwd = g_get_current_dir();
+    ok = ok && (!in_dir || chdir(s.dir) == 0);
+    guint64 deleted = ok ? record_retention_enforce(s.dir, "rec_", ".mp4", FILE_BYTES, 0, keep) : 0;
+    ok = (!in_dir || chdir(cwd) == 0) && ok;
+    gboolean live = scratch_has(&s, "rec_0001.mp4");
+    gboolean gone = !scratch_has(&s, "rec_0002.mp4") && !scratch_has(&s, "rec_0003.mp4");
+    g_free(cwd);
+    g_free(keep);
+    scratch_free(&s);
+    CHECK(ok, "%s: cannot set up the recordings", name);
+    CHECK(live, "%s: the file being written was deleted", name);
+    CHECK(deleted == FILE_BYTES * 2 && gone, "%s: %lu bytes deleted, expected %d", name, (unsigned long)deleted,
+          FILE_BYTES * 2);
+}
+
+static void test_keep(void) {
+    check_keep("keep, full path", keep_full_path, FALSE);
+    // Spelled differently from dir/name: matched by device and inode.
+    check_keep("keep, ./ relative", keep_dot_relative, TRUE);
+    check_keep("keep, dot segment", keep_dot_segment, FALSE);
+    check_keep("keep, parent segment", keep_parent_segment, FALSE);
+    // Cannot be stat'ed: matched by name.
+    check_keep("keep, unreachable", keep_unreachable, FALSE);
+}
+
+int main(void) {
+    test_oldest_first();
+    test_reserve();
+    test_timestamps_follow();
+    test_keep();
+    if (failures != 0) {
+        fprintf(stderr, "test_record_retention: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("test_record_retention: ok\n");
+    return 0;
+}
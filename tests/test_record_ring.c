@@ -0,0 +1,281 @@
+/*
+ * Drives the AU ring from both ends: first in one process, step by step,
+ * then with the consumer in a forked child that now and then stalls until
+ * the producer has lapped it. Whatever comes out must be whole, in order,
+ * start at IRAP pictures after a loss, carry DISCONT exactly there, and
+ * never include an AU from a GOP the producer had to cut short.
+ */
+#include "record_ring.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define GOP 30
+#define RING_BYTES (8u * 1024u * 1024u)
+#define RING_SLOTS 256u
+/* Over a quarter of the ring: turned away. */
+#define HUGE_AU (3u * 1024u * 1024u)
+#define DURATION_NS 1000000u
+#define STRESS_AUS 20000u
+/* The forked consumer stalls every this many AUs in the first half, until the producer laps it. */
+#define STRESS_STALL_EVERY 2000
+
+static int failures;
+
+#define CHECK(cond, ...)                                                                                               \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);                                                            \
+            fprintf(stderr, __VA_ARGS__);                                                                              \
+            fputc('\n', stderr);                                                                                       \
+            failures++;                                                                                                \
+            return;                                                                                                    \
+        }                                                                                                              \
+    } while (0)
+
+/* Size of AU index in the stress run; now and then one too large for the ring. */
+static gsize stress_size(guint index) {
+    if (index % 997 == 5 || index % 1499 == 0) {
+        return HUGE_AU;
+    }
+    return 500 + (index * 2654435761u) % 150000u;
+}
+
+/* TRUE if an AU of index's GOP, up to and including it, was too large. */
+static gboolean stress_gop_lost(guint index) {
+    for (guint i = index - index % GOP; i <= index; ++i) {
+        if (stress_size(i) == HUGE_AU) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static GstBuffer *make_au(guint index, gsize size) {
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, size, NULL);
+    GstMapInfo map;
+    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+    for (gsize i = 0; i < size; ++i) {
+        map.data[i] = (guint8)(index * 7 + i);
+    }
+    memcpy(map.data, &index, MIN(size, sizeof(index)));
+    gst_buffer_unmap(buffer, &map);
+    GST_BUFFER_PTS(buffer) = (GstClockTime)index * DURATION_NS;
+    GST_BUFFER_DURATION(buffer) = DURATION_NS;
+    if (index % GOP != 0) {
+        GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    }
+    return buffer;
+}
+
+static gboolean publish_au(RecordRing *ring, GstCaps *caps, guint index, gsize size) {
+    GstBuffer *buffer = make_au(index, size);
+    gboolean published = record_ring_publish(ring, caps, buffer);
+    gst_buffer_unref(buffer);
+    return published;
+}
+
+/* The index the AU was made with, or -1 if its bytes or timestamps are not those make_au gave it. */
+static gint64 au_index(GstBuffer *buffer) {
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        return -1;
+    }
+    guint index = 0;
+    memcpy(&index, map.data, MIN(map.size, sizeof(index)));
+    gboolean intact = map.size >= sizeof(index);
+    for (gsize i = sizeof(index); intact && i < map.size; ++i) {
+        intact = map.data[i] == (guint8)(index * 7 + i);
+    }
+    gst_buffer_unmap(buffer, &map);
+    if (!intact || GST_BUFFER_PTS(buffer) != (GstClockTime)index * DURATION_NS ||
+        GST_BUFFER_DURATION(buffer) != DURATION_NS ||
+        GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT) != (index % GOP != 0)) {
+        return -1;
+    }
+    return index;
+}
+
+static RecordRing *attach_consumer(RecordRing *ring) {
+    return record_ring_attach(dup(record_ring_get_fd(ring)), dup(record_ring_get_event_fd(ring)));
+}
+
+/*
+ * One process, nothing lost to overruns: every AU published comes out once,
+ * a turned-away AU takes the rest of its GOP, the next IRAP picture carries
+ * DISCONT, and caps show up only when they change.
+ */
+static void test_sequence(void) {
+    RecordCfg cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    g_strlcpy(cfg.output_path, "/media/rec.mp4", sizeof(cfg.output_path));
+    cfg.preroll_mb = 7;
+    RecordRing *ring = record_ring_new(RING_BYTES, RING_SLOTS, &cfg);
+    CHECK(ring != NULL, "record_ring_new failed");
+    RecordRing *consumer = attach_consumer(ring);
+    CHECK(consumer != NULL, "record_ring_attach failed");
+    const RecordCfg *seen = record_ring_get_cfg(consumer);
+    CHECK(strcmp(seen->output_path, cfg.output_path) == 0 && seen->preroll_mb == 7, "the config did not come across");
+
+    GstBuffer *buffer = NULL;
+    GstCaps *caps = NULL;
+    CHECK(record_ring_next(consumer, &buffer, &caps, 10) == 0, "an empty ring did not time out");
+
+    GstCaps *first_caps = gst_caps_from_string("video/x-h265, stream-format=byte-stream, width=1280, height=720");
+    GstCaps *second_caps = gst_caps_from_string("video/x-h265, stream-format=byte-stream, width=1920, height=1080");
+    // GOP 0 whole; GOP 1 loses AU 35 and what follows; GOP 2 arrives with new caps; GOP 3 loses its IRAP picture.
+    gboolean published_ok = TRUE;
+    for (guint i = 0; i < 4 * GOP; ++i) {
+        gsize size = i == 35 || i == 3 * GOP ? HUGE_AU : 1000 + i;
+        gboolean expected = i < 35 || (i >= 2 * GOP && i < 3 * GOP);
+        GstCaps *au_caps = i < 2 * GOP ? first_caps : second_caps;
+        published_ok &= publish_au(ring, au_caps, i, size) == expected;
+    }
+    published_ok &= publish_au(ring, second_caps, 4 * GOP, 1000);
+    record_ring_close(ring);
+    RecordRingStats stats;
+    record_ring_get_stats(ring, &stats);
+    CHECK(published_ok, "record_ring_publish took or turned away the wrong AUs");
+    CHECK(stats.published == 35 + GOP + 1 && stats.rejected == 2 * GOP - 5,
+          "producer stats: %" G_GUINT64_FORMAT " published, %" G_GUINT64_FORMAT " rejected", stats.published,
+          stats.rejected);
+
+    gint64 expected = 0;
+    int caps_changes = 0;
+    int rc;
+    while ((rc = record_ring_next(consumer, &buffer, &caps, 10)) == 1) {
+        gint64 index = au_index(buffer);
+        gboolean discont = GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DISCONT);
+        gst_buffer_unref(buffer);
+        if (caps != NULL) {
+            GstCaps *want = index < 2 * GOP ? first_caps : second_caps;
+            gboolean equal = gst_caps_is_equal(caps, want);
+            gst_caps_unref(caps);
+            CHECK(equal, "AU %" G_GINT64_FORMAT " came with the wrong caps", index);
+            caps_changes++;
+        }
+        CHECK(index == expected, "AU %" G_GINT64_FORMAT " came out, expected %" G_GINT64_FORMAT, index, expected);
+        // The first AU after attaching is flagged too: the consumer cannot know what came before.
+        CHECK(discont == (index == 0 || index == 2 * GOP || index == 4 * GOP),
+              "AU %" G_GINT64_FORMAT " DISCONT is %s", index, discont ? "set" : "missing");
+        expected = index == 34 ? 2 * GOP : index == 3 * GOP - 1 ? 4 * GOP : index + 1;
+    }
+    CHECK(rc == -1 && expected == 4 * GOP + 1, "the ring ended with %d after AU %" G_GINT64_FORMAT, rc, expected - 1);
+    CHECK(caps_changes == 2, "%d caps changes came out, expected 2", caps_changes);
+    CHECK(record_ring_next(consumer, &buffer, &caps, 10) == -1, "a drained, closed ring did not stay finished");
+
+    gst_caps_unref(first_caps);
+    gst_caps_unref(second_caps);
+    record_ring_free(consumer);
+    record_ring_free(ring);
+}
+
+/* The forked consumer; exits with the number of problems it found, capped. */
+static int stress_consumer(RecordRing *consumer) {
+    int bad = 0;
+    gint64 previous = -1;
+    gint64 next_stall = STRESS_STALL_EVERY;
+    guint64 stalls = 0;
+    RecordRingStats stats;
+    for (;;) {
+        GstBuffer *buffer = NULL;
+        GstCaps *caps = NULL;
+        int rc = record_ring_next(consumer, &buffer, &caps, 100);
+        if (rc < 0) {
+            break;
+        }
+        if (rc == 0) {
+            continue;
+        }
+        if (caps != NULL) {
+            gst_caps_unref(caps);
+        }
+        gint64 index = au_index(buffer);
+        gboolean discont = GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DISCONT);
+        gboolean keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+        gst_buffer_unref(buffer);
+        const char *problem = NULL;
+        if (index < 0) {
+            problem = "damaged";
+        } else if (index <= previous) {
+            problem = "out of order";
+        } else if (stress_gop_lost((guint)index)) {
+            problem = "from a GOP that lost an AU";
+        } else if (index != previous + 1 && !keyframe) {
+            problem = "resumes after a gap but is no IRAP picture";
+        } else if (discont != (index != previous + 1)) {
+            problem = discont ? "has DISCONT without a gap" : "follows a gap without DISCONT";
+        }
+        if (problem != NULL) {
+            fprintf(stderr, "consumer: AU %" G_GINT64_FORMAT " %s\n", index, problem);
+            bad++;
+        }
+        if (index >= 0) {
+            previous = index;
+        }
+        if (index >= next_stall && next_stall < STRESS_AUS / 2) {
+            record_ring_get_stats(consumer, &stats);
+            guint64 target = stats.published + 2 * RING_SLOTS;
+            while (stats.published < target) {
+                g_usleep(1000);
+                record_ring_get_stats(consumer, &stats);
+            }
+            next_stall += STRESS_STALL_EVERY;
+            stalls++;
+        }
+    }
+    record_ring_get_stats(consumer, &stats);
+    if (stats.overruns < stalls) {
+        fprintf(stderr, "consumer: %" G_GUINT64_FORMAT " overrun(s) for %" G_GUINT64_FORMAT " stall(s)\n",
+                stats.overruns, stalls);
+        bad++;
+    }
+    if (previous != STRESS_AUS - 1) {
+        fprintf(stderr, "consumer: the last AU was %" G_GINT64_FORMAT "\n", previous);
+        bad++;
+    }
+    return MIN(bad, 100);
+}
+
+static void test_stress(void) {
+    RecordCfg cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    RecordRing *ring = record_ring_new(RING_BYTES, RING_SLOTS, &cfg);
+    CHECK(ring != NULL, "record_ring_new failed");
+    fflush(NULL);
+    pid_t pid = fork();
+    CHECK(pid >= 0, "fork failed");
+    if (pid == 0) {
+        RecordRing *consumer = attach_consumer(ring);
+        _exit(consumer != NULL ? stress_consumer(consumer) : 100);
+    }
+
+    GstCaps *caps = gst_caps_from_string("video/x-h265, stream-format=byte-stream");
+    for (guint i = 0; i < STRESS_AUS; ++i) {
+        publish_au(ring, caps, i, stress_size(i));
+        if (i % 4 == 0) {
+            g_usleep(50);
+        }
+    }
+    record_ring_close(ring);
+    gst_caps_unref(caps);
+    int status = 0;
+    pid_t waited = waitpid(pid, &status, 0);
+    record_ring_free(ring);
+    CHECK(waited == pid && WIFEXITED(status), "the consumer did not exit cleanly");
+    CHECK(WEXITSTATUS(status) == 0, "the consumer found %d problem(s)", WEXITSTATUS(status));
+}
+
+int main(int argc, char **argv) {
+    gst_init(&argc, &argv);
+    test_sequence();
+    test_stress();
+    if (failures != 0) {
+        fprintf(stderr, "test_record_ring: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("test_record_ring: ok\n");
+    return 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * Writes synthetic H.265 through record_stream in both formats and checks
+ * the bytes: MPEG-TS packet structure, tables, timing and the elementary
+ * stream carried in it; Annex B output and its timestamp file.
+ */
+#include "record_stream.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "synthetic_hevc.h"
+
+#define AU_COUNT (SYNTH_GOP * 3)
+#define TS_PACKET_BYTES 188
+#define TS_PID_PAT 0x0000
+#define TS_PID_PMT 0x1000
+#define TS_PID_VIDEO 0x0100
+#define TS_PTS_DELAY_90K 63000u
+/* Payload room in an AU's first packet (after PCR and PES header) and in the packets after it. */
+#define TS_FIRST_ROOM 162
+#define TS_ROOM 184
+
+static int failures;
+
+#define CHECK(cond, ...)                                                                                               \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);                                                            \
+            fprintf(stderr, __VA_ARGS__);                                                                              \
+            fputc('\n', stderr);                                                                                       \
+            failures++;                                                                                                \
+            return;                                                                                                    \
+        }                                                                                                              \
+    } while (0)
+
+typedef struct {
+    GByteArray *data;
+    int calls;
+    /* Calls after which writev starts failing; negative never fails. */
+    int fail_after;
+} Sink;
+
+static int sink_writev(int64_t offset, const struct iovec *iov, int iovcnt, void *token) {
+    Sink *sink = (Sink *)token;
+    if (sink->fail_after >= 0 && sink->calls >= sink->fail_after) {
+        return -1;
+    }
+    sink->calls++;
+    if ((guint)offset != sink->data->len) {
+        return -1;
+    }
+    for (int i = 0; i < iovcnt; ++i) {
+        g_byte_array_append(sink->data, (const guint8 *)iov[i].iov_base, (guint)iov[i].iov_len);
+    }
+    return 0;
+}
+
+/*
+ * The AUs under test: synthetic pictures, every other one early in a GOP
+ * replaced by a short AU sized so its last packet is exactly full, one byte
+ * short (stuffing with an empty adaptation field) or two bytes short.
+ */
+static const int edge_sizes[] = {1,
+                                 TS_FIRST_ROOM - 1,
+                                 TS_FIRST_ROOM,
+                                 TS_FIRST_ROOM + 1,
+                                 TS_FIRST_ROOM + TS_ROOM - 2,
+                                 TS_FIRST_ROOM + TS_ROOM - 1,
+                                 TS_FIRST_ROOM + TS_ROOM,
+                                 TS_FIRST_ROOM + 3 * TS_ROOM};
+#define EDGE_COUNT ((int)(sizeof(edge_sizes) / sizeof(edge_sizes[0])))
+
+static int test_au(guint8 *out, int index, gboolean *keyframe) {
+    int slot = index % SYNTH_GOP;
+    if (slot > 0 && slot <= 2 * EDGE_COUNT && slot % 2 == 0) {
+        int size = edge_sizes[slot / 2 - 1];
+        for (int i = 0; i < size; ++i) {
+            out[i] = (guint8)(index + i * 5);
+        }
+        *keyframe = FALSE;
+        return size;
+    }
+    *keyframe = synth_is_irap(index);
+    return synth_au(out, index);
+}
+
+static GByteArray *write_stream(RecordStreamFormat format, const char *path, GByteArray *expected) {
+    static guint8 au[SYNTH_AU_MAX];
+    Sink sink = {g_byte_array_new(), 0, -1};
+    RecordStream *stream = record_stream_new(format, path, sink_writev, &sink);
+    if (stream == NULL) {
+        g_byte_array_unref(sink.data);
+        return NULL;
+    }
+    for (int i = 0; i < AU_COUNT; ++i) {
+        gboolean keyframe;
+        int size = test_au(au, i, &keyframe);
+        g_byte_array_append(expected, au, (guint)size);
+        if (record_stream_write_au(stream, au, (size_t)size, (guint64)i * SYNTH_DURATION_90K, keyframe) != 0) {
+            record_stream_close(stream);
+            g_byte_array_unref(sink.data);
+            return NULL;
+        }
+    }
+    if (record_stream_close(stream) != 0) {
+        g_byte_array_unref(sink.data);
+        return NULL;
+    }
+    return sink.data;
+}
+
+static guint32 crc32_mpeg(const guint8 *data, size_t size) {
+    guint32 crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+        crc ^= (guint32)data[i] << 24;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 0x80000000u) ? (crc << 1) ^ 0x04C11DB7u : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static guint64 read_timestamp(const guint8 *p) {
+    return ((guint64)(p[0] >> 1) & 7) << 30 | (guint64)p[1] << 22 | (guint64)(p[2] >> 1) << 15 |
+           (guint64)p[3] << 7 | p[4] >> 1;
+}
+
+static guint64 read_pcr_base(const guint8 *p) {
+    return (guint64)p[0] << 25 | (guint64)p[1] << 17 | (guint64)p[2] << 9 | (guint64)p[3] << 1 | p[4] >> 7;
+}
+
+static void test_ts(void) {
+    GByteArray *expected = g_byte_array_new();
+    GByteArray *ts = write_stream(RECORD_STREAM_TS, "unused.ts", expected);
+    CHECK(ts != NULL, "TS: writing failed");
+    CHECK(ts->len % TS_PACKET_BYTES == 0, "TS: %u bytes is not a whole number of packets", ts->len);
+
+    GByteArray *payload = g_byte_array_new();
+    int cc[3] = {-1, -1, -1};
+    int aus = 0;
+    int keyframes = 0;
+    /* PSI packets seen since the last AU started. */
+    int tables = 0;
+    for (guint offset = 0; offset < ts->len; offset += TS_PACKET_BYTES) {
+        const guint8 *p = ts->data + offset;
+        CHECK(p[0] == 0x47, "TS: lost sync at %u", offset);
+        gboolean start = (p[1] & 0x40) != 0;
+        guint pid = (guint)(p[1] & 0x1F) << 8 | p[2];
+        guint control = (p[3] >> 4) & 3;
+        int slot = pid == TS_PID_PAT ? 0 : pid == TS_PID_PMT ? 1 : 2;
+        CHECK(pid == TS_PID_PAT || pid == TS_PID_PMT || pid == TS_PID_VIDEO, "TS: stray PID 0x%x at %u", pid,
+              offset);
+        CHECK(cc[slot] < 0 || (p[3] & 0x0F) == ((cc[slot] + 1) & 0x0F), "TS: continuity break on PID 0x%x at %u",
+              pid, offset);
+        cc[slot] = p[3] & 0x0F;
+        CHECK(control & 1, "TS: packet at %u carries no payload", offset);
+
+        size_t at = 4;
+        gboolean random_access = FALSE;
+        const guint8 *pcr = NULL;
+        if (control & 2) {
+            size_t length = p[4];
+            at = 5 + length;
+            CHECK(at <= TS_PACKET_BYTES, "TS: adaptation field overruns the packet at %u", offset);
+            if (length > 0) {
+                random_access = (p[5] & 0x40) != 0;
+                size_t fill = 6;
+                if (p[5] & 0x10) {
+                    pcr = p + 6;
+                    fill = 12;
+                }
+                for (size_t i = fill; i < at; ++i) {
+                    CHECK(p[i] == 0xFF, "TS: stuffing byte 0x%02x at %u", p[i], offset);
+                }
+            }
+        }
+
+        if (pid != TS_PID_VIDEO) {
+            const guint8 *section = p + at + 1;
+            size_t length = (size_t)(section[1] & 0x0F) << 8 | section[2];
+            CHECK(start && p[at] == 0, "TS: table at %u does not start a section", offset);
+            CHECK(crc32_mpeg(section, 3 + length) == 0, "TS: bad table CRC at %u", offset);
+            CHECK(pid != TS_PID_PMT || section[12] == 0x24, "TS: PMT does not announce H.265");
+            tables++;
+            continue;
+        }
+
+        if (start) {
+            const guint8 *pes = p + at;
+            CHECK(pes[0] == 0 && pes[1] == 0 && pes[2] == 1 && pes[3] == 0xE0 && pes[8] == 5,
+                  "TS: bad PES header at %u", offset);
+            CHECK(pcr != NULL, "TS: AU %d has no PCR", aus);
+            guint64 pts = read_timestamp(pes + 9);
+            guint64 expected_pts = (guint64)aus * SYNTH_DURATION_90K;
+            CHECK(read_pcr_base(pcr) == expected_pts, "TS: AU %d PCR is off", aus);
+            CHECK(pts == expected_pts + TS_PTS_DELAY_90K, "TS: AU %d PTS is off", aus);
+            gboolean keyframe;
+            static guint8 au[SYNTH_AU_MAX];
+            test_au(au, aus, &keyframe);
+            CHECK(random_access == keyframe, "TS: AU %d random access flag is wrong", aus);
+            CHECK(tables == (keyframe ? 2 : 0), "TS: AU %d follows %d table packets", aus, tables);
+            keyframes += keyframe;
+            tables = 0;
+            aus++;
+            at += 14;
+        } else {
+            CHECK(pcr == NULL && !random_access, "TS: continuation packet at %u carries AU flags", offset);
+        }
+        g_byte_array_append(payload, p + at, TS_PACKET_BYTES - (guint)at);
+    }
+
+    CHECK(aus == AU_COUNT, "TS: %d AUs, expected %d", aus, AU_COUNT);
+    CHECK(keyframes == AU_COUNT / SYNTH_GOP, "TS: %d keyframes, expected %d", keyframes, AU_COUNT / SYNTH_GOP);
+    CHECK(payload->len == expected->len && memcmp(payload->data, expected->data, expected->len) == 0,
+          "TS: the carried stream differs from the input");
+    g_byte_array_unref(payload);
+    g_byte_array_unref(expected);
+    g_byte_array_unref(ts);
+}
+
+static void test_ts_write_failure(void) {
+    static guint8 au[SYNTH_AU_MAX];
+    Sink sink = {g_byte_array_new(), 0, 1};
+    RecordStream *stream = record_stream_new(RECORD_STREAM_TS, "unused.ts", sink_writev, &sink);
+    CHECK(stream != NULL, "TS: record_stream_new failed");
+    int size = synth_au(au, 0);
+    int rc = record_stream_write_au(stream, au, (size_t)size, 0, TRUE);
+    rc |= record_stream_write_au(stream, au, (size_t)size, SYNTH_DURATION_90K, TRUE);
+    record_stream_close(stream);
+    g_byte_array_unref(sink.data);
+    CHECK(rc != 0, "TS: a failed write was not reported");
+}
+
+static void test_annexb(void) {
+    gchar *dir = g_dir_make_tmp("test_record_stream_XXXXXX", NULL);
+    CHECK(dir != NULL, "Annex B: cannot create a temporary directory");
+    gchar *path = g_build_filename(dir, "rec.h265", NULL);
+    gchar *timestamps_path = g_strconcat(path, RECORD_STREAM_TIMESTAMPS_SUFFIX, NULL);
+
+    GByteArray *expected = g_byte_array_new();
+    GByteArray *es = write_stream(RECORD_STREAM_ANNEXB, path, expected);
+    gchar *timestamps = NULL;
+    gboolean read = g_file_get_contents(timestamps_path, &timestamps, NULL, NULL);
+    GString *expected_timestamps = g_string_new("# timestamp format v2\n");
+    for (int i = 0; i < AU_COUNT; ++i) {
+        g_string_append_printf(expected_timestamps, "%.3f\n", i * SYNTH_DURATION_90K / 90.0);
+    }
+    gboolean same_es = es != NULL && es->len == expected->len && memcmp(es->data, expected->data, es->len) == 0;
+    gboolean same_timestamps = read && strcmp(timestamps, expected_timestamps->str) == 0;
+
+    g_remove(timestamps_path);
+    g_rmdir(dir);
+    g_string_free(expected_timestamps, TRUE);
+    g_free(timestamps);
+    if (es != NULL) {
+        g_byte_array_unref(es);
+    }
+    g_byte_array_unref(expected);
+    g_free(timestamps_path);
+    g_free(path);
+    g_free(dir);
+    CHECK(same_es, "Annex B: the stream differs from the input");
+    CHECK(same_timestamps, "Annex B: the timestamp file differs");
+}
+
+int main(void) {
+    test_ts();
+    test_ts_write_failure();
+    test_annexb();
+    if (failures != 0) {
+        fprintf(stderr, "test_record_stream: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("test_record_stream: ok\n");
+    return 0;
+}
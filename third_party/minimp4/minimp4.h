@@ -34,6 +34,16 @@ extern "C" {
 
 #define MINIMP4_TRANSCODE_SPS_ID  1
 
+// Sample index of the muxer in standard and sequential modes: descriptors are
+// kept in chunks of this many samples; with MP4E_set_index_spill(), only the
+// first MP4E_INDEX_MEM_CHUNKS chunks and the last one stay in memory
+#ifndef MP4E_INDEX_CHUNK_SAMPLES
+#define MP4E_INDEX_CHUNK_SAMPLES  4096
+#endif
+#ifndef MP4E_INDEX_MEM_CHUNKS
+#define MP4E_INDEX_MEM_CHUNKS     16
+#endif
+
 // Support indexing of MP4 files over 4 GB.
 // If disabled, files with 64-bit offset fields is still supported,
 // but error signaled if such field contains too big offset
@@ -54,7 +64,9 @@ extern "C" {
 #define MP4D_TIMESTAMPS_SUPPORTED 1
 
 // Enable TrackFragmentBaseMediaDecodeTimeBox support
+#ifndef MP4D_TFDT_SUPPORT
 #define MP4D_TFDT_SUPPORT         0
+#endif
 
 /************************************************************************/
 /*          Some values of MP4(E/D)_track_t->object_type_indication     */
@@ -116,6 +128,9 @@ typedef boxsize_t MP4D_file_offset_t;
 #define HEVC_NAL_VPS 32
 #define HEVC_NAL_SPS 33
 #define HEVC_NAL_PPS 34
+#define HEVC_NAL_AUD 35
+#define HEVC_NAL_FD  38
+#define HEVC_NAL_SEI_PREFIX 39
 #define HEVC_NAL_BLA_W_LP 16
 #define HEVC_NAL_CRA_NUT  21
 
@@ -125,6 +140,13 @@ typedef boxsize_t MP4D_file_offset_t;
 
 typedef struct MP4E_mux_tag MP4E_mux_t;
 
+// Piece of a sample or of the file output, see MP4E_put_sample_v()
+typedef struct
+{
+    const void *data;
+    int bytes;
+} MP4E_iovec_t;
+
 typedef enum
 {
     e_audio,
@@ -339,10 +361,26 @@ typedef struct mp4_h26x_writer_tag
 #endif
     MP4E_mux_t *mux;
     int mux_track_id, is_hevc, need_vps, need_sps, need_pps, need_idr;
+    // HEVC prefix NALs (SEI etc.), length-prefixed, held until the first slice of their access unit
+    unsigned char *prefix;
+    int prefix_bytes;
+    // HEVC access unit gathered for MP4E_put_sample_v: NAL length fields and the NALs in the caller's buffer
+    MP4E_iovec_t *iov;
+    unsigned char *nal_sizes;
+    int iov_capacity;
 } mp4_h26x_writer_t;
 
 int mp4_h26x_write_init(mp4_h26x_writer_t *h, MP4E_mux_t *mux, int width, int height, int is_hevc);
 void mp4_h26x_write_close(mp4_h26x_writer_t *h);
+/**
+*   Continue writing into another multiplexer, e.g. the next file of a segmented
+*   recording, before the current one is closed. Parameter sets seen so far are
+*   carried over, so the new file can start at the next random access picture
+*   even if the stream does not repeat them there.
+*
+*   return error code MP4E_STATUS_*
+*/
+int mp4_h26x_write_switch(mp4_h26x_writer_t *h, MP4E_mux_t *mux, int width, int height);
 int mp4_h26x_write_nal(mp4_h26x_writer_t *h, const unsigned char *nal, int length, unsigned timeStamp90kHz_next);
 
 /************************************************************************/
@@ -433,6 +471,27 @@ int MP4E_add_track(MP4E_mux_t *mux, const MP4E_track_t *track_data);
 */
 int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind);
 
+/**
+*   Add new sample to specified track, given as iovcnt pieces that are written
+*   in order (e.g. NAL length fields and the NALs in place). Unlike
+*   MP4E_put_sample(), the sample is not copied in sequential mode: its 'mdat'
+*   is written at once, and a later MP4E_SAMPLE_CONTINUATION rewrites that
+*   box size in place. 'fragmentation' mode still gathers a copy until the
+*   fragment is written.
+*
+*   return error code MP4E_STATUS_*
+*/
+int MP4E_put_sample_v(MP4E_mux_t *mux, int track_num, const MP4E_iovec_t *iov, int iovcnt, int duration, int kind);
+
+/**
+*   Set optional scatter-gather output: pieces written back to back at offset in
+*   one call. Without it each piece goes to write_callback on its own.
+*
+*   return error code MP4E_STATUS_*
+*/
+int MP4E_set_writev_callback(MP4E_mux_t *mux,
+    int (*writev_callback)(int64_t offset, const MP4E_iovec_t *iov, int iovcnt, void *token));
+
 /**
 *   Finalize MP4 file, de-allocated memory, and closes MP4 multiplexer.
 *   The close operation takes a time and disk space, since it writes MP4 file
@@ -481,6 +540,30 @@ int MP4E_set_pps(MP4E_mux_t *mux, int track_id, const void *pps, int bytes);
 */
 int MP4E_set_text_comment(MP4E_mux_t *mux, const char *comment);
 
+/**
+*   Set the longest run of samples gathered into one movie fragment in
+*   'fragmentation' mode, in track timescale units. Samples are held in memory
+*   and written as one 'moof' + 'mdat' pair; a fragment always starts at a
+*   random access sample, and with duration 0 (default) ends only at the next
+*   one, so each fragment holds one GOP.
+*
+*   return error code MP4E_STATUS_*
+*/
+int MP4E_set_fragment_duration(MP4E_mux_t *mux, unsigned duration);
+
+/**
+*   Let the sample index of a long recording spill to a sidecar file instead
+*   of growing in memory. Past MP4E_INDEX_MEM_CHUNKS chunks each full chunk is
+*   handed to index_write, at increasing offsets from 0; MP4E_close() reads
+*   them back with index_read while it writes the 'stbl' tables. Both get
+*   the token given to MP4E_open() and return 0 on success.
+*
+*   return error code MP4E_STATUS_*
+*/
+int MP4E_set_index_spill(MP4E_mux_t *mux,
+    int (*index_write)(int64_t offset, const void *buffer, size_t size, void *token),
+    int (*index_read)(int64_t offset, void *buffer, size_t size, void *token));
+
 #ifdef __cplusplus
 }
 #endif
@@ -672,16 +755,34 @@ typedef struct {
     int capacity;
 } minimp4_vector_t;
 
+typedef struct
+{
+    sample_t *data;         // MP4E_INDEX_CHUNK_SAMPLES descriptors, NULL once spilled
+    int64_t spill_offset;
+} index_chunk_t;
+
 typedef struct
 {
     MP4E_track_t info;
-    minimp4_vector_t smpl;  // sample descriptor
+    minimp4_vector_t smpl;  // sample descriptors: index_chunk_t entries
+    int smpl_count;
+    unsigned smpl_duration; // sum of sample durations
+    int stts_count;         // runs of samples with equal duration
+    int sync_count;         // random access samples
     minimp4_vector_t pending_sample;
 
     minimp4_vector_t vsps;  // or dsi for audio
     minimp4_vector_t vpps;  // not used for audio
     minimp4_vector_t vvps;  // used for HEVC
 
+    // 'fragmentation' mode: samples of the fragment not yet written
+    minimp4_vector_t frag_smpl;
+    minimp4_vector_t frag_data;
+    uint64_t frag_time;     // decode time of the first sample in frag_smpl
+    uint64_t frag_duration; // sum of frag_smpl durations
+
+    int64_t mdat_pos;       // sequential mode: 'mdat' of the last sample from MP4E_put_sample_v
+
 } track_t;
 
 typedef struct MP4E_mux_tag
@@ -690,12 +791,18 @@ typedef struct MP4E_mux_tag
 
     int64_t write_pos;
     int (*write_callback)(int64_t offset, const void *buffer, size_t size, void *token);
+    int (*writev_callback)(int64_t offset, const MP4E_iovec_t *iov, int iovcnt, void *token);
     void *token;
     char *text_comment;
 
     int sequential_mode_flag;
     int enable_fragmentation; // flag, indicating streaming-friendly 'fragmentation' mode
     int fragments_count;      // # of fragments in 'fragmentation' mode
+    unsigned fragment_duration; // longest fragment, 0 = up to the next random access sample
+
+    int (*index_write)(int64_t offset, const void *buffer, size_t size, void *token);
+    int (*index_read)(int64_t offset, void *buffer, size_t size, void *token);
+    int64_t index_spill_pos;
 
 } MP4E_mux_t;
 
@@ -726,6 +833,9 @@ static const unsigned char box_ftyp[] = {
 // Finish atom: update atom size field
 #define END_ATOM --stack; WR4((unsigned char*)*stack, p - *stack);
 
+// Finish atom, which also holds 'extra' bytes written separately
+#define END_ATOM_PLUS(extra) --stack; WR4((unsigned char*)*stack, p - *stack + (extra));
+
 // Initiate atom: save position of size field on stack
 #define ATOM(x)  *stack++ = p; p += 4; WRITE_4(x);
 
@@ -817,7 +927,12 @@ MP4E_mux_t *MP4E_open(int sequential_mode_flag, int enable_fragmentation, void *
     mux->sequential_mode_flag = sequential_mode_flag || enable_fragmentation;
     mux->enable_fragmentation = enable_fragmentation;
     mux->fragments_count = 0;
+    mux->fragment_duration = 0;
+    mux->index_write = NULL;
+    mux->index_read = NULL;
+    mux->index_spill_pos = 0;
     mux->write_callback = write_callback;
+    mux->writev_callback = NULL;
     mux->token = token;
     mux->text_comment = NULL;
     mux->write_pos = sizeof(box_ftyp);
@@ -932,19 +1047,84 @@ int MP4E_set_pps(MP4E_mux_t *mux, int track_id, const void *pps, int bytes)
 
 static unsigned get_duration(const track_t *tr)
 {
-    unsigned i, sum_duration = 0;
-    const sample_t *s = (const sample_t *)tr->smpl.data;
-    for (i = 0; i < tr->smpl.bytes/sizeof(sample_t); i++)
+    return tr->smpl_duration;
+}
+
+/**
+*   Descriptor of the last sample in the index; always in memory
+*/
+static sample_t *index_last(const track_t *tr)
+{
+    const index_chunk_t *chunk = (const index_chunk_t *)(tr->smpl.data + tr->smpl.bytes) - 1;
+    return chunk->data + (tr->smpl_count - 1) % MP4E_INDEX_CHUNK_SAMPLES;
+}
+
+/**
+*   Add a descriptor to the index; starting a new chunk may spill the full one
+*/
+static sample_t *index_alloc_tail(MP4E_mux_t *mux, track_t *tr)
+{
+    if (!(tr->smpl_count % MP4E_INDEX_CHUNK_SAMPLES))
+    {
+        const int chunk_bytes = MP4E_INDEX_CHUNK_SAMPLES*sizeof(sample_t);
+        int nchunks = tr->smpl.bytes / sizeof(index_chunk_t);
+        index_chunk_t *chunk;
+        sample_t *data;
+        if (mux->index_write && nchunks >= MP4E_INDEX_MEM_CHUNKS)
+        {   // write the full chunk to the sidecar and reuse its memory for the next one
+            chunk = (index_chunk_t *)(tr->smpl.data + tr->smpl.bytes) - 1;
+            if (mux->index_write(mux->index_spill_pos, chunk->data, chunk_bytes, mux->token))
+                return NULL;
+            data = chunk->data;
+            chunk->data = NULL;
+            chunk->spill_offset = mux->index_spill_pos;
+            mux->index_spill_pos += chunk_bytes;
+        } else if (!(data = (sample_t *)malloc(chunk_bytes)))
+            return NULL;
+        chunk = (index_chunk_t *)minimp4_vector_alloc_tail(&tr->smpl, sizeof(index_chunk_t));
+        if (!chunk)
+        {
+            free(data);
+            return NULL;
+        }
+        chunk->data = data;
+        chunk->spill_offset = -1;
+    }
+    tr->smpl_count++;
+    return index_last(tr);
+}
+
+/**
+*   Samples of the given index chunk, read back into scratch if spilled
+*/
+static const sample_t *index_chunk(MP4E_mux_t *mux, const track_t *tr, int nchunk, sample_t *scratch, int *count)
+{
+    const index_chunk_t *chunk = (const index_chunk_t *)tr->smpl.data + nchunk;
+    *count = MINIMP4_MIN(tr->smpl_count - nchunk*MP4E_INDEX_CHUNK_SAMPLES, MP4E_INDEX_CHUNK_SAMPLES);
+    if (chunk->data)
+        return chunk->data;
+    if (!mux->index_read || mux->index_read(chunk->spill_offset, scratch, *count*sizeof(sample_t), mux->token))
+        return NULL;
+    return scratch;
+}
+
+static void index_reset(track_t *tr)
+{
+    int i, nchunks = tr->smpl.bytes / sizeof(index_chunk_t);
+    const index_chunk_t *chunk = (const index_chunk_t *)tr->smpl.data;
+    for (i = 0; i < nchunks; i++)
     {
-        sum_duration += s[i].duration;
+        if (chunk[i].data)
+            free(chunk[i].data);
     }
-    return sum_duration;
+    minimp4_vector_reset(&tr->smpl);
+    tr->smpl_count = 0;
 }
 
 static int write_pending_data(MP4E_mux_t *mux, track_t *tr)
 {
     // if have pending sample && have at least one sample in the index
-    if (tr->pending_sample.bytes > 0 && tr->smpl.bytes >= sizeof(sample_t))
+    if (tr->pending_sample.bytes > 0 && tr->smpl_count > 0)
     {
         // Complete pending sample
         sample_t *smpl_desc;
@@ -960,7 +1140,7 @@ static int write_pending_data(MP4E_mux_t *mux, track_t *tr)
         mux->write_pos += p - base;
 
         // Update sample descriptor with size and offset
-        smpl_desc = ((sample_t*)minimp4_vector_alloc_tail(&tr->smpl, 0)) - 1;
+        smpl_desc = index_last(tr);
         smpl_desc->size = tr->pending_sample.bytes;
         smpl_desc->offset = (boxsize_t)mux->write_pos;
 
@@ -976,49 +1156,75 @@ static int write_pending_data(MP4E_mux_t *mux, track_t *tr)
 
 static int add_sample_descriptor(MP4E_mux_t *mux, track_t *tr, int data_bytes, int duration, int kind)
 {
-    sample_t smp;
-    smp.size = data_bytes;
-    smp.offset = (boxsize_t)mux->write_pos;
-    smp.duration = (duration ? duration : tr->info.default_duration);
-    smp.flag_random_access = (kind == MP4E_SAMPLE_RANDOM_ACCESS);
-    return NULL != minimp4_vector_put(&tr->smpl, &smp, sizeof(sample_t));
+    sample_t *smp;
+    duration = (duration ? duration : tr->info.default_duration);
+    if (!tr->smpl_count || index_last(tr)->duration != (unsigned)duration)
+        tr->stts_count++;
+    smp = index_alloc_tail(mux, tr);
+    if (!smp)
+        return 0;
+    smp->size = data_bytes;
+    smp->offset = (boxsize_t)mux->write_pos;
+    smp->duration = duration;
+    smp->flag_random_access = (kind == MP4E_SAMPLE_RANDOM_ACCESS);
+    tr->smpl_duration += duration;
+    tr->sync_count += smp->flag_random_access;
+    return 1;
 }
 
 static int mp4e_flush_index(MP4E_mux_t *mux);
 
 /**
-*   Write Movie Fragment: 'moof' box
+*   Write the given pieces at the current position, with one writev callback when it is set
 */
-static int mp4e_write_fragment_header(MP4E_mux_t *mux, int track_num, int data_bytes, int duration, int kind
-#if MP4D_TFDT_SUPPORT
-, uint64_t timestamp
-#endif
-)
+static int mp4e_writev(MP4E_mux_t *mux, const MP4E_iovec_t *iov, int iovcnt)
+{
+    int i;
+    if (mux->writev_callback)
+    {
+        ERR(mux->writev_callback(mux->write_pos, iov, iovcnt, mux->token));
+        for (i = 0; i < iovcnt; i++)
+            mux->write_pos += iov[i].bytes;
+        return MP4E_STATUS_OK;
+    }
+    for (i = 0; i < iovcnt; i++)
+    {
+        ERR(mux->write_callback(mux->write_pos, iov[i].data, iov[i].bytes, mux->token));
+        mux->write_pos += iov[i].bytes;
+    }
+    return MP4E_STATUS_OK;
+}
+
+/**
+*   Write Movie Fragment: 'moof' box and 'mdat' header for the gathered samples, then their data
+*/
+static int mp4e_flush_fragment(MP4E_mux_t *mux, int track_num)
 {
-    unsigned char base[888], *p = base;
+    track_t *tr = ((track_t*)mux->tracks.data) + track_num;
+    const sample_t *smpl = (const sample_t *)tr->frag_smpl.data;
+    int i, err, nsamples = tr->frag_smpl.bytes / sizeof(sample_t);
+    unsigned char *base, *p;
     unsigned char *stack_base[20]; // atoms nesting stack
     unsigned char **stack = stack_base;
     unsigned char *pdata_offset;
     unsigned flags;
-    enum
-    {
-        default_sample_duration_present = 0x000008,
-        default_sample_flags_present = 0x000020,
-    } e;
+    MP4E_iovec_t iov[2];
 
-    track_t *tr = ((track_t*)mux->tracks.data) + track_num;
+    if (!nsamples)
+        return MP4E_STATUS_OK;
+    if (!mux->fragments_count++)
+        ERR(mp4e_flush_index(mux)); // write file headers before 1st fragment
+
+    base = p = (unsigned char *)malloc(128 + nsamples*8);
+    if (!base)
+        return MP4E_STATUS_NO_MEMORY;
 
     ATOM(BOX_moof)
         ATOM_FULL(BOX_mfhd, 0)
             WRITE_4(mux->fragments_count);  // start from 1
         END_ATOM
         ATOM(BOX_traf)
-            flags = 0;
-            if (tr->info.track_media_kind == e_video)
-                flags |= 0x20;          // default-sample-flags-present
-            else
-                flags |= 0x08;          // default-sample-duration-present
-            flags =  (tr->info.track_media_kind == e_video) ? 0x20020 : 0x20008;
+            flags = (tr->info.track_media_kind == e_video) ? 0x20020 : 0x20008;
 
             ATOM_FULL(BOX_tfhd, flags)
                 WRITE_4(track_num + 1); // track_ID
@@ -1027,130 +1233,186 @@ static int mp4e_write_fragment_header(MP4E_mux_t *mux, int track_num, int data_b
                     WRITE_4(0x1010000); // default_sample_flags
                 } else
                 {
-                    WRITE_4(duration);
+                    WRITE_4(smpl[0].duration);
                 }
             END_ATOM
             #if MP4D_TFDT_SUPPORT
             ATOM_FULL(BOX_tfdt, 0x01000000) // version 1
-                WRITE_4(timestamp >> 32); // upper timestamp
-                WRITE_4(timestamp & 0xffffffff); // lower timestamp
+                WRITE_4(tr->frag_time >> 32); // upper timestamp
+                WRITE_4(tr->frag_time & 0xffffffff); // lower timestamp
             END_ATOM
             #endif
-            if (tr->info.track_media_kind == e_audio)
-            {
-                flags  = 0;
-                flags |= 0x001;         // data-offset-present
-                flags |= 0x200;         // sample-size-present
-                ATOM_FULL(BOX_trun, flags)
-                    WRITE_4(1);         // sample_count
-                    pdata_offset = p; p += 4;  // save ptr to data_offset
-                    WRITE_4(data_bytes);// sample_size
-                END_ATOM
-            } else if (kind == MP4E_SAMPLE_RANDOM_ACCESS)
-            {
-                flags  = 0;
-                flags |= 0x001;         // data-offset-present
+            flags  = 0;
+            flags |= 0x001;             // data-offset-present
+            flags |= 0x100;             // sample-duration-present
+            flags |= 0x200;             // sample-size-present
+            if (tr->info.track_media_kind == e_video && smpl[0].flag_random_access)
                 flags |= 0x004;         // first-sample-flags-present
-                flags |= 0x100;         // sample-duration-present
-                flags |= 0x200;         // sample-size-present
-                ATOM_FULL(BOX_trun, flags)
-                    WRITE_4(1);         // sample_count
-                    pdata_offset = p; p += 4;   // save ptr to data_offset
+            ATOM_FULL(BOX_trun, flags)
+                WRITE_4(nsamples);      // sample_count
+                pdata_offset = p; p += 4;   // save ptr to data_offset
+                if (flags & 0x004)
+                {
                     WRITE_4(0x2000000); // first_sample_flags
-                    WRITE_4(duration);  // sample_duration
-                    WRITE_4(data_bytes);// sample_size
-                END_ATOM
-            } else
-            {
-                flags  = 0;
-                flags |= 0x001;         // data-offset-present
-                flags |= 0x100;         // sample-duration-present
-                flags |= 0x200;         // sample-size-present
-                ATOM_FULL(BOX_trun, flags)
-                    WRITE_4(1);         // sample_count
-                    pdata_offset = p; p += 4;   // save ptr to data_offset
-                    WRITE_4(duration);  // sample_duration
-                    WRITE_4(data_bytes);// sample_size
-                END_ATOM
-            }
+                }
+                for (i = 0; i < nsamples; i++)
+                {
+                    WRITE_4(smpl[i].duration);  // sample_duration
+                    WRITE_4(smpl[i].size);      // sample_size
+                }
+            END_ATOM
         END_ATOM
     END_ATOM
     WR4(pdata_offset, (p - base) + 8);
 
-    ERR(mux->write_callback(mux->write_pos, base, p - base, mux->token));
-    mux->write_pos += p - base;
-    return MP4E_STATUS_OK;
-}
-
-static int mp4e_write_mdat_box(MP4E_mux_t *mux, uint32_t size)
-{
-    unsigned char base[8], *p = base;
-    WRITE_4(size);
+    // MDAT header goes out in the same write as the MOOF
+    WRITE_4(tr->frag_data.bytes + 8);
     WRITE_4(BOX_mdat);
-    ERR(mux->write_callback(mux->write_pos, base, p - base, mux->token));
-    mux->write_pos += p - base;
+
+    iov[0].data = base;
+    iov[0].bytes = (int)(p - base);
+    iov[1].data = tr->frag_data.data;
+    iov[1].bytes = tr->frag_data.bytes;
+    err = mp4e_writev(mux, iov, 2);
+    free(base);
+    if (err)
+        return err;
+
+    tr->frag_time += tr->frag_duration;
+    tr->frag_duration = 0;
+    tr->frag_smpl.bytes = 0;
+    tr->frag_data.bytes = 0;
     return MP4E_STATUS_OK;
 }
 
 /**
-*   Add new sample to specified track
+*   Add new sample to specified track, gathered from several pieces
 */
-int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind)
+int MP4E_put_sample_v(MP4E_mux_t *mux, int track_num, const MP4E_iovec_t *iov, int iovcnt, int duration, int kind)
 {
     track_t *tr;
-    if (!mux || !data)
+    sample_t *smpl_desc;
+    int i, data_bytes = 0;
+    if (!mux || !iov || iovcnt <= 0)
         return MP4E_STATUS_BAD_ARGUMENTS;
     tr = ((track_t*)mux->tracks.data) + track_num;
+    for (i = 0; i < iovcnt; i++)
+        data_bytes += iov[i].bytes;
 
     if (mux->enable_fragmentation)
     {
-        #if MP4D_TFDT_SUPPORT
-        // NOTE: assume a constant `duration` to calculate current timestamp
-        uint64_t timestamp = (uint64_t)mux->fragments_count * duration;
-        #endif
-        if (!mux->fragments_count++)
-            ERR(mp4e_flush_index(mux)); // write file headers before 1st sample
-        // write MOOF + MDAT + sample data
-        #if MP4D_TFDT_SUPPORT
-        ERR(mp4e_write_fragment_header(mux, track_num, data_bytes, duration, kind, timestamp));
-        #else
-        ERR(mp4e_write_fragment_header(mux, track_num, data_bytes, duration, kind));
-        #endif
-        // write MDAT box for each sample
-        ERR(mp4e_write_mdat_box(mux, data_bytes + 8));
-        ERR(mux->write_callback(mux->write_pos, data, data_bytes, mux->token));
-        mux->write_pos += data_bytes;
+        // Gather samples; the fragment is written once the next sample must not join it
+        if (kind != MP4E_SAMPLE_CONTINUATION)
+        {
+            if (kind == MP4E_SAMPLE_RANDOM_ACCESS ||
+                (mux->fragment_duration && tr->frag_duration >= mux->fragment_duration))
+                ERR(mp4e_flush_fragment(mux, track_num));
+            smpl_desc = (sample_t*)minimp4_vector_alloc_tail(&tr->frag_smpl, sizeof(sample_t));
+            if (!smpl_desc)
+                return MP4E_STATUS_NO_MEMORY;
+            smpl_desc->size = 0;
+            smpl_desc->offset = 0;
+            smpl_desc->duration = (duration ? duration : tr->info.default_duration);
+            smpl_desc->flag_random_access = (kind == MP4E_SAMPLE_RANDOM_ACCESS);
+            tr->frag_duration += smpl_desc->duration;
+        } else if (tr->frag_smpl.bytes < (int)sizeof(sample_t))
+            return MP4E_STATUS_NO_MEMORY; // write continuation, but there are no samples in the fragment
+        smpl_desc = (sample_t*)(tr->frag_smpl.data + tr->frag_smpl.bytes) - 1;
+        smpl_desc->size += data_bytes;
+        for (i = 0; i < iovcnt; i++)
+        {
+            if (!minimp4_vector_put(&tr->frag_data, iov[i].data, iov[i].bytes))
+                return MP4E_STATUS_NO_MEMORY;
+        }
         return MP4E_STATUS_OK;
     }
 
     if (kind != MP4E_SAMPLE_CONTINUATION)
     {
         if (mux->sequential_mode_flag)
+        {   // size is known: write the sample's own 'mdat' now instead of buffering the sample
+            unsigned char base[8], *p = base;
             ERR(write_pending_data(mux, tr));
+            tr->mdat_pos = mux->write_pos;
+            WRITE_4(data_bytes + 8);
+            WRITE_4(BOX_mdat);
+            ERR(mux->write_callback(mux->write_pos, base, p - base, mux->token));
+            mux->write_pos += p - base;
+        }
         if (!add_sample_descriptor(mux, tr, data_bytes, duration, kind))
             return MP4E_STATUS_NO_MEMORY;
     } else
     {
-        if (!mux->sequential_mode_flag)
-        {
-            sample_t *smpl_desc;
-            if (tr->smpl.bytes < sizeof(sample_t))
-                return MP4E_STATUS_NO_MEMORY; // write continuation, but there are no samples in the index
-            // Accumulate size of the continuation in the sample descriptor
-            smpl_desc = (sample_t*)(tr->smpl.data + tr->smpl.bytes) - 1;
-            smpl_desc->size += data_bytes;
+        if (!tr->smpl_count)
+            return MP4E_STATUS_NO_MEMORY; // write continuation, but there are no samples in the index
+        if (mux->sequential_mode_flag && tr->pending_sample.bytes)
+        {   // continues a sample from MP4E_put_sample, still buffered
+            for (i = 0; i < iovcnt; i++)
+            {
+                if (!minimp4_vector_put(&tr->pending_sample, iov[i].data, iov[i].bytes))
+                    return MP4E_STATUS_NO_MEMORY;
+            }
+            return MP4E_STATUS_OK;
+        }
+        // Accumulate size of the continuation in the sample descriptor
+        smpl_desc = index_last(tr);
+        smpl_desc->size += data_bytes;
+        if (mux->sequential_mode_flag)
+        {   // the data lands right behind the sample; grow its 'mdat' in place
+            unsigned char base[4], *p = base;
+            WRITE_4(smpl_desc->size + 8);
+            ERR(mux->write_callback(tr->mdat_pos, base, p - base, mux->token));
         }
     }
+    return mp4e_writev(mux, iov, iovcnt);
+}
 
-    if (mux->sequential_mode_flag)
+/**
+*   Add new sample to specified track
+*/
+int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind)
+{
+    track_t *tr;
+    MP4E_iovec_t iov;
+    if (!mux || !data)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    tr = ((track_t*)mux->tracks.data) + track_num;
+    iov.data = data;
+    iov.bytes = data_bytes;
+
+    // Sequential mode buffers a new sample until its size is final; continuations may follow
+    if (!mux->sequential_mode_flag || mux->enable_fragmentation ||
+        (kind == MP4E_SAMPLE_CONTINUATION && !tr->pending_sample.bytes))
+        return MP4E_put_sample_v(mux, track_num, &iov, 1, duration, kind);
+
+    if (kind != MP4E_SAMPLE_CONTINUATION)
     {
-        if (!minimp4_vector_put(&tr->pending_sample, data, data_bytes))
+        ERR(write_pending_data(mux, tr));
+        if (!add_sample_descriptor(mux, tr, data_bytes, duration, kind))
             return MP4E_STATUS_NO_MEMORY;
-    } else
-    {
-        ERR(mux->write_callback(mux->write_pos, data, data_bytes, mux->token));
-        mux->write_pos += data_bytes;
     }
+    if (!minimp4_vector_put(&tr->pending_sample, data, data_bytes))
+        return MP4E_STATUS_NO_MEMORY;
+    return MP4E_STATUS_OK;
+}
+
+int MP4E_set_index_spill(MP4E_mux_t *mux,
+    int (*index_write)(int64_t offset, const void *buffer, size_t size, void *token),
+    int (*index_read)(int64_t offset, void *buffer, size_t size, void *token))
+{
+    if (!mux || !index_write != !index_read)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    mux->index_write = index_write;
+    mux->index_read = index_read;
+    return MP4E_STATUS_OK;
+}
+
+int MP4E_set_writev_callback(MP4E_mux_t *mux,
+    int (*writev_callback)(int64_t offset, const MP4E_iovec_t *iov, int iovcnt, void *token))
+{
+    if (!mux)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    mux->writev_callback = writev_callback;
     return MP4E_STATUS_OK;
 }
 
@@ -1183,8 +1445,103 @@ int MP4E_set_text_comment(MP4E_mux_t *mux, const char *comment)
     return MP4E_STATUS_OK;
 }
 
+int MP4E_set_fragment_duration(MP4E_mux_t *mux, unsigned duration)
+{
+    if (!mux)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    mux->fragment_duration = duration;
+    return MP4E_STATUS_OK;
+}
+
+enum
+{
+    TABLE_STTS,
+    TABLE_STSZ,
+    TABLE_STCO,
+    TABLE_CO64,
+    TABLE_STSS
+};
+
+typedef struct
+{
+    int pos;                // offset in the 'moov' buffer the table entries go to
+    int track;
+    int table;              // TABLE_*
+} index_table_t;
+
+/**
+*   Stream the entries of one 'stbl' table, a chunk of the sample index at a time
+*/
+static int mp4e_write_table(MP4E_mux_t *mux, const track_t *tr, int table)
+{
+    int nchunk, nchunks = tr->smpl.bytes / sizeof(index_chunk_t);
+    int i, n, err = MP4E_STATUS_OK;
+    unsigned cnt = 0, duration = 0, index = 0;
+    const sample_t *s;
+    sample_t *scratch = (sample_t *)malloc(MP4E_INDEX_CHUNK_SAMPLES*sizeof(sample_t));
+    unsigned char *base = (unsigned char *)malloc(MP4E_INDEX_CHUNK_SAMPLES*8 + 8), *p;
+    if (!scratch || !base)
+        err = MP4E_STATUS_NO_MEMORY;
+    for (nchunk = 0; nchunk < nchunks && !err; nchunk++)
+    {
+        s = index_chunk(mux, tr, nchunk, scratch, &n);
+        if (!s)
+        {
+            err = MP4E_STATUS_FILE_WRITE_ERROR;
+            break;
+        }
+        p = base;
+        for (i = 0; i < n; i++, index++)
+        {
+            switch (table)
+            {
+            case TABLE_STTS:
+                if (cnt && s[i].duration != duration)
+                {
+                    WRITE_4(cnt);
+                    WRITE_4(duration);
+                    cnt = 0;
+                }
+                duration = s[i].duration;
+                cnt++;
+                break;
+            case TABLE_STSZ:
+                WRITE_4(s[i].size);
+                break;
+            case TABLE_STCO:
+                WRITE_4(s[i].offset);
+                break;
+            case TABLE_CO64:
+                WRITE_4((s[i].offset >> 32) & 0xffffffff);
+                WRITE_4(s[i].offset & 0xffffffff);
+                break;
+            case TABLE_STSS:
+                if (s[i].flag_random_access)
+                {
+                    WRITE_4(index + 1);
+                }
+                break;
+            }
+        }
+        if (table == TABLE_STTS && nchunk == nchunks - 1)
+        {
+            WRITE_4(cnt);
+            WRITE_4(duration);
+        }
+        err = mux->write_callback(mux->write_pos, base, p - base, mux->token);
+        mux->write_pos += p - base;
+    }
+    if (scratch)
+        free(scratch);
+    if (base)
+        free(base);
+    return err;
+}
+
 /**
 *   Write file index 'moov' box with all its boxes and indexes
+*   The 'stbl' tables are streamed from the sample index, so the 'moov' buffer
+*   holds the boxes around them only
 */
 static int mp4e_flush_index(MP4E_mux_t *mux)
 {
@@ -1192,7 +1549,9 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
     unsigned char **stack = stack_base;
     unsigned char *base, *p;
     unsigned int ntr, index_bytes, ntracks = mux->tracks.bytes / sizeof(track_t);
-    int i, err;
+    int i, err, ntables = 0, written = 0;
+    index_table_t *tables;
+    uint64_t tables_bytes = 0;
 
     // How much memory needed for indexes
     // Experimental data:
@@ -1209,8 +1568,7 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
     {
         track_t *tr = ((track_t*)mux->tracks.data) + ntr;
         index_bytes += TRACK_HEADER_BYTES;          // fixed amount (implementation-dependent)
-        // may need extra 4 bytes for duration field + 4 bytes for worst-case random access box
-        index_bytes += tr->smpl.bytes * (sizeof(sample_t) + 4 + 4) / sizeof(sample_t);
+        index_bytes += tr->vvps.bytes;
         index_bytes += tr->vsps.bytes;
         index_bytes += tr->vpps.bytes;
 
@@ -1218,8 +1576,15 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
     }
 
     base = (unsigned char*)malloc(index_bytes);
-    if (!base)
+    tables = (index_table_t*)malloc((ntracks ? ntracks : 1)*4*sizeof(index_table_t));
+    if (!base || !tables)
+    {
+        if (base)
+            free(base);
+        if (tables)
+            free(tables);
         return MP4E_STATUS_NO_MEMORY;
+    }
     p = base;
 
     if (!mux->sequential_mode_flag)
@@ -1289,8 +1654,8 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
     {
         track_t *tr = ((track_t*)mux->tracks.data) + ntr;
         unsigned duration = get_duration(tr);
-        int samples_count = tr->smpl.bytes / sizeof(sample_t);
-        const sample_t *sample = (const sample_t *)tr->smpl.data;
+        int samples_count = tr->smpl_count;
+        uint64_t track_tables_bytes = 0;
         unsigned handler_type;
         const char *handler_ascii = NULL;
 
@@ -1584,25 +1949,18 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
                         /*      indexes                                                         */
                         /************************************************************************/
 
+                        // Entries of the tables below are streamed in after the buffer part before them
+#define INDEX_TABLE(kind, bytes) tables[ntables].pos = (int)(p - base); tables[ntables].track = ntr; \
+    tables[ntables++].table = kind; track_tables_bytes += (bytes);
+
                         // Time to Sample Box
                         ATOM_FULL(BOX_stts, 0);
+                        WRITE_4(samples_count ? tr->stts_count : 0);
+                        if (samples_count)
                         {
-                            unsigned char *pentry_count = p;
-                            int cnt = 1, entry_count = 0;
-                            WRITE_4(0);
-                            for (i = 0; i < samples_count; i++, cnt++)
-                            {
-                                if (i == (samples_count - 1) || sample[i].duration != sample[i + 1].duration)
-                                {
-                                    WRITE_4(cnt);
-                                    WRITE_4(sample[i].duration);
-                                    cnt = 0;
-                                    entry_count++;
-                                }
-                            }
-                            WR4(pentry_count, entry_count);
+                            INDEX_TABLE(TABLE_STTS, (uint64_t)tr->stts_count*8);
                         }
-                        END_ATOM;
+                        END_ATOM_PLUS(samples_count ? tr->stts_count*8 : 0);
 
                         // Sample To Chunk Box
                         ATOM_FULL(BOX_stsc, 0);
@@ -1623,62 +1981,42 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
                         WRITE_4(0); // sample_size  If this field is set to 0, then the samples have different sizes, and those sizes
                                     //  are stored in the sample size table.
                         WRITE_4(samples_count);  // sample_count;
-                        for (i = 0; i < samples_count; i++)
-                        {
-                            WRITE_4(sample[i].size);
-                        }
-                        END_ATOM;
+                        INDEX_TABLE(TABLE_STSZ, (uint64_t)samples_count*4);
+                        END_ATOM_PLUS(samples_count*4);
 
                         // Chunk Offset Box
                         int is_64_bit = 0;
-                        if (samples_count && sample[samples_count - 1].offset > 0xffffffff)
+                        if (samples_count && index_last(tr)->offset > 0xffffffff)
                             is_64_bit = 1;
                         if (!is_64_bit)
                         {
                             ATOM_FULL(BOX_stco, 0);
                             WRITE_4(samples_count);
-                            for (i = 0; i < samples_count; i++)
-                            {
-                                WRITE_4(sample[i].offset);
-                            }
+                            INDEX_TABLE(TABLE_STCO, (uint64_t)samples_count*4);
+                            END_ATOM_PLUS(samples_count*4);
                         } else
                         {
                             ATOM_FULL(BOX_co64, 0);
                             WRITE_4(samples_count);
-                            for (i = 0; i < samples_count; i++)
-                            {
-                                WRITE_4((sample[i].offset >> 32) & 0xffffffff);
-                                WRITE_4(sample[i].offset & 0xffffffff);
-                            }
+                            INDEX_TABLE(TABLE_CO64, (uint64_t)samples_count*8);
+                            END_ATOM_PLUS(samples_count*8);
                         }
-                        END_ATOM;
 
                         // Sync Sample Box
+                        if (tr->sync_count != samples_count)
                         {
-                            int ra_count = 0;
-                            for (i = 0; i < samples_count; i++)
-                            {
-                                ra_count += !!sample[i].flag_random_access;
-                            }
-                            if (ra_count != samples_count)
-                            {
-                                // If the sync sample box is not present, every sample is a random access point.
-                                ATOM_FULL(BOX_stss, 0);
-                                WRITE_4(ra_count);
-                                for (i = 0; i < samples_count; i++)
-                                {
-                                    if (sample[i].flag_random_access)
-                                    {
-                                        WRITE_4(i + 1);
-                                    }
-                                }
-                                END_ATOM;
-                            }
+                            // If the sync sample box is not present, every sample is a random access point.
+                            ATOM_FULL(BOX_stss, 0);
+                            WRITE_4(tr->sync_count);
+                            INDEX_TABLE(TABLE_STSS, (uint64_t)tr->sync_count*4);
+                            END_ATOM_PLUS(tr->sync_count*4);
                         }
-                    END_ATOM;
-                END_ATOM;
-            END_ATOM;
-        END_ATOM;
+#undef INDEX_TABLE
+                    END_ATOM_PLUS(track_tables_bytes);
+                END_ATOM_PLUS(track_tables_bytes);
+            END_ATOM_PLUS(track_tables_bytes);
+        END_ATOM_PLUS(track_tables_bytes);
+        tables_bytes += track_tables_bytes;
     } // tracks loop
 
     if (mux->text_comment)
@@ -1729,12 +2067,25 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
         }
         END_ATOM;
     }
-    END_ATOM;   // moov atom
+    END_ATOM_PLUS(tables_bytes);   // moov atom
 
     assert((unsigned)(p - base) <= index_bytes);
 
-    err = mux->write_callback(mux->write_pos, base, p - base, mux->token);
-    mux->write_pos += p - base;
+    // Boxes from the buffer, with each table streamed in where it belongs
+    err = MP4E_STATUS_OK;
+    for (i = 0; i <= ntables && !err; i++)
+    {
+        int end = i < ntables ? tables[i].pos : (int)(p - base);
+        if (end > written)
+        {
+            err = mux->write_callback(mux->write_pos, base + written, end - written, mux->token);
+            mux->write_pos += end - written;
+            written = end;
+        }
+        if (!err && i < ntables)
+            err = mp4e_write_table(mux, ((track_t*)mux->tracks.data) + tables[i].track, tables[i].table);
+    }
+    free(tables);
     free(base);
     return err;
 }
@@ -1745,18 +2096,26 @@ int MP4E_close(MP4E_mux_t *mux)
     unsigned ntr, ntracks;
     if (!mux)
         return MP4E_STATUS_BAD_ARGUMENTS;
+    ntracks = mux->tracks.bytes / sizeof(track_t);
     if (!mux->enable_fragmentation)
         err = mp4e_flush_index(mux);
+    else
+    {   // write fragments still being gathered
+        for (ntr = 0; ntr < ntracks && !err; ntr++)
+            err = mp4e_flush_fragment(mux, ntr);
+    }
     if (mux->text_comment)
         free(mux->text_comment);
-    ntracks = mux->tracks.bytes / sizeof(track_t);
     for (ntr = 0; ntr < ntracks; ntr++)
     {
         track_t *tr = ((track_t*)mux->tracks.data) + ntr;
         minimp4_vector_reset(&tr->vsps);
         minimp4_vector_reset(&tr->vpps);
-        minimp4_vector_reset(&tr->smpl);
+        minimp4_vector_reset(&tr->vvps);
+        index_reset(tr);
         minimp4_vector_reset(&tr->pending_sample);
+        minimp4_vector_reset(&tr->frag_smpl);
+        minimp4_vector_reset(&tr->frag_data);
     }
     minimp4_vector_reset(&mux->tracks);
     free(mux);
@@ -2250,6 +2609,11 @@ int mp4_h26x_write_init(mp4_h26x_writer_t *h, MP4E_mux_t *mux, int width, int he
     h->need_sps = 1;
     h->need_pps = 1;
     h->need_idr = 1;
+    h->prefix = NULL;
+    h->prefix_bytes = 0;
+    h->iov = NULL;
+    h->nal_sizes = NULL;
+    h->iov_capacity = 0;
 #if MINIMP4_TRANSCODE_SPS_ID
     memset(&h->sps_patcher, 0, sizeof(h264_sps_id_patcher_t));
 #endif
@@ -2272,59 +2636,214 @@ void mp4_h26x_write_close(mp4_h26x_writer_t *h)
             free(p->pps_cache[i]);
     }
 #endif
+    if (h->prefix)
+        free(h->prefix);
+    if (h->iov)
+        free(h->iov);
+    if (h->nal_sizes)
+        free(h->nal_sizes);
     memset(h, 0, sizeof(*h));
 }
 
-static int mp4_h265_write_nal(mp4_h26x_writer_t *h, const unsigned char *nal, int sizeof_nal, unsigned timeStamp90kHz_next)
+static int copy_items(minimp4_vector_t *dst, const minimp4_vector_t *src)
 {
-    int payload_type = (nal[0] >> 1) & 0x3f;
-    int is_intra = payload_type >= HEVC_NAL_BLA_W_LP && payload_type <= HEVC_NAL_CRA_NUT;
-    int err = MP4E_STATUS_OK;
-    //printf("payload_type=%d, intra=%d\n", payload_type, is_intra);
+    return !src->bytes || minimp4_vector_put(dst, src->data, src->bytes);
+}
+
+int mp4_h26x_write_switch(mp4_h26x_writer_t *h, MP4E_mux_t *mux, int width, int height)
+{
+    const track_t *src = ((const track_t*)h->mux->tracks.data) + h->mux_track_id;
+    track_t *dst;
+    MP4E_track_t tr;
+    int track_id;
+
+    memcpy(&tr, &src->info, sizeof(tr));
+    tr.u.v.width = width;
+    tr.u.v.height = height;
+    track_id = MP4E_add_track(mux, &tr);
+    if (track_id < 0)
+        return track_id;
+    dst = ((track_t*)mux->tracks.data) + track_id;
+    if (!copy_items(&dst->vvps, &src->vvps) || !copy_items(&dst->vsps, &src->vsps) || !copy_items(&dst->vpps, &src->vpps))
+        return MP4E_STATUS_NO_MEMORY;
 
-    if (is_intra && !h->need_sps && !h->need_pps && !h->need_vps)
-        h->need_idr = 0;
-    switch (payload_type)
+    h->need_vps = h->is_hevc && !dst->vvps.bytes;
+    h->need_sps = !dst->vsps.bytes;
+    h->need_pps = !dst->vpps.bytes;
+    h->need_idr = 1;
+    h->mux = mux;
+    h->mux_track_id = track_id;
+    return MP4E_STATUS_OK;
+}
+
+/**
+*   Append one NAL to the sample being gathered: its 4-byte length, then the NAL itself, in place
+*/
+static int mp4_h265_gather_nal(mp4_h26x_writer_t *h, int *iovcnt, const unsigned char *nal, int sizeof_nal)
+{
+    unsigned char *size;
+    int i;
+    if (*iovcnt + 2 > h->iov_capacity)
     {
-    case HEVC_NAL_VPS:
-        MP4E_set_vps(h->mux, h->mux_track_id, nal, sizeof_nal);
-        h->need_vps = 0;
-        break;
-    case HEVC_NAL_SPS:
-        MP4E_set_sps(h->mux, h->mux_track_id, nal, sizeof_nal);
-        h->need_sps = 0;
-        break;
-    case HEVC_NAL_PPS:
-        MP4E_set_pps(h->mux, h->mux_track_id, nal, sizeof_nal);
-        h->need_pps = 0;
-        break;
-    default:
-        if (h->need_vps || h->need_sps || h->need_pps || h->need_idr)
-            return MP4E_STATUS_BAD_ARGUMENTS;
+        int capacity = h->iov_capacity*2 + 16;
+        MP4E_iovec_t *iov = (MP4E_iovec_t *)realloc(h->iov, capacity*sizeof(MP4E_iovec_t));
+        if (!iov)
+            return MP4E_STATUS_NO_MEMORY;
+        h->iov = iov;
+        size = (unsigned char *)realloc(h->nal_sizes, capacity/2*4);
+        if (!size)
+            return MP4E_STATUS_NO_MEMORY;
+        h->nal_sizes = size;
+        h->iov_capacity = capacity;
+        for (i = 0; i < *iovcnt; i += 2)
+            h->iov[i].data = h->nal_sizes + i/2*4;   // length fields moved with nal_sizes
+    }
+    size = h->nal_sizes + *iovcnt/2*4;
+    size[0] = (unsigned char)(sizeof_nal >> 24);
+    size[1] = (unsigned char)(sizeof_nal >> 16);
+    size[2] = (unsigned char)(sizeof_nal >>  8);
+    size[3] = (unsigned char)(sizeof_nal);
+    h->iov[*iovcnt].data = size;
+    h->iov[*iovcnt].bytes = 4;
+    h->iov[*iovcnt + 1].data = nal;
+    h->iov[*iovcnt + 1].bytes = sizeof_nal;
+    *iovcnt += 2;
+    return MP4E_STATUS_OK;
+}
+
+/**
+*   Write the gathered NALs as one sample, held prefix NALs first
+*/
+static int mp4_h265_put_gathered(mp4_h26x_writer_t *h, int iovcnt, unsigned timeStamp90kHz_next, int sample_kind)
+{
+    int err;
+    if (h->prefix_bytes)
+    {   // iov[1] is kept free for the prefix held from the previous buffer
+        h->iov[1].data = h->prefix;
+        h->iov[1].bytes = h->prefix_bytes;
+        err = MP4E_put_sample_v(h->mux, h->mux_track_id, h->iov + 1, iovcnt - 1, timeStamp90kHz_next, sample_kind);
+        h->prefix_bytes = 0;
+        return err;
+    }
+    return MP4E_put_sample_v(h->mux, h->mux_track_id, h->iov + 2, iovcnt - 2, timeStamp90kHz_next, sample_kind);
+}
+
+/**
+*   Keep prefix NALs that end the buffer for the access unit continued by the next call
+*/
+static int mp4_h265_hold_prefix(mp4_h26x_writer_t *h, int iovcnt)
+{
+    int i, bytes = h->prefix_bytes;
+    unsigned char *prefix, *p;
+    for (i = 2; i < iovcnt; i++)
+        bytes += h->iov[i].bytes;
+    prefix = p = (unsigned char *)malloc(bytes);
+    if (!prefix)
+        return MP4E_STATUS_NO_MEMORY;
+    if (h->prefix_bytes)
+        memcpy(p, h->prefix, h->prefix_bytes);
+    p += h->prefix_bytes;
+    for (i = 2; i < iovcnt; i++)
+    {
+        memcpy(p, h->iov[i].data, h->iov[i].bytes);
+        p += h->iov[i].bytes;
+    }
+    if (h->prefix)
+        free(h->prefix);
+    h->prefix = prefix;
+    h->prefix_bytes = bytes;
+    return MP4E_STATUS_OK;
+}
+
+/**
+*   Write an Annex B buffer: each access unit in it becomes one sample, written
+*   from the buffer itself with MP4E_put_sample_v
+*/
+static int mp4_h265_write_nals(mp4_h26x_writer_t *h, const unsigned char *nal, int length, unsigned timeStamp90kHz_next)
+{
+    const unsigned char *eof = nal + length;
+    int sizeof_nal, iovcnt = 0, sample_kind = -1;
+
+    // iov[0..1] are a placeholder; mp4_h265_put_gathered puts a held prefix there
+    ERR(mp4_h265_gather_nal(h, &iovcnt, NULL, 0));
+
+    for (;;nal++)
+    {
+        int payload_type, is_intra;
+        nal = find_nal_unit(nal, (int)(eof - nal), &sizeof_nal);
+        if (!sizeof_nal)
+            break;
+        payload_type = (nal[0] >> 1) & 0x3f;
+        is_intra = payload_type >= HEVC_NAL_BLA_W_LP && payload_type <= HEVC_NAL_CRA_NUT;
+        //printf("payload_type=%d, intra=%d\n", payload_type, is_intra);
+
+        if (is_intra && !h->need_sps && !h->need_pps && !h->need_vps)
+            h->need_idr = 0;
+        switch (payload_type)
         {
-            unsigned char *tmp = (unsigned char *)malloc(4 + sizeof_nal);
-            if (!tmp)
-                return MP4E_STATUS_NO_MEMORY;
-            int sample_kind = MP4E_SAMPLE_DEFAULT;
-            tmp[0] = (unsigned char)(sizeof_nal >> 24);
-            tmp[1] = (unsigned char)(sizeof_nal >> 16);
-            tmp[2] = (unsigned char)(sizeof_nal >>  8);
-            tmp[3] = (unsigned char)(sizeof_nal);
-            memcpy(tmp + 4, nal, sizeof_nal);
-            if (is_intra)
-                sample_kind = MP4E_SAMPLE_RANDOM_ACCESS;
-            err = MP4E_put_sample(h->mux, h->mux_track_id, tmp, 4 + sizeof_nal, timeStamp90kHz_next, sample_kind);
-            free(tmp);
+        case HEVC_NAL_VPS:
+            MP4E_set_vps(h->mux, h->mux_track_id, nal, sizeof_nal);
+            h->need_vps = 0;
+            break;
+        case HEVC_NAL_SPS:
+            MP4E_set_sps(h->mux, h->mux_track_id, nal, sizeof_nal);
+            h->need_sps = 0;
+            break;
+        case HEVC_NAL_PPS:
+            MP4E_set_pps(h->mux, h->mux_track_id, nal, sizeof_nal);
+            h->need_pps = 0;
+            break;
+        case HEVC_NAL_AUD:
+        case HEVC_NAL_FD:
+            break;  // access unit delimiter, filler data: nothing to be done
+        default:
+            if (payload_type < HEVC_NAL_VPS)
+            {   // slice segment: first_slice_segment_in_pic_flag starts a sample, later slices extend it
+                int first_slice = sizeof_nal > 2 && (nal[2] & 0x80);
+                if (h->need_vps || h->need_sps || h->need_pps || h->need_idr)
+                    return MP4E_STATUS_BAD_ARGUMENTS;
+                if (first_slice && sample_kind >= 0)
+                {
+                    ERR(mp4_h265_put_gathered(h, iovcnt, timeStamp90kHz_next, sample_kind));
+                    iovcnt = 2;
+                }
+                if (first_slice)
+                    sample_kind = is_intra ? MP4E_SAMPLE_RANDOM_ACCESS : MP4E_SAMPLE_DEFAULT;
+                else if (sample_kind < 0)
+                    sample_kind = MP4E_SAMPLE_CONTINUATION;
+            } else if (h->need_vps || h->need_sps || h->need_pps || h->need_idr)
+            {
+                break;  // SEI etc. ahead of the first IRAP picture: dropped with it
+            } else if (payload_type == HEVC_NAL_SEI_PREFIX || (payload_type >= 41 && payload_type <= 44) ||
+                       (payload_type >= 48 && payload_type <= 55))
+            {   // prefix NAL: leads the access unit whose first slice follows
+                if (sample_kind >= 0)
+                {
+                    ERR(mp4_h265_put_gathered(h, iovcnt, timeStamp90kHz_next, sample_kind));
+                    iovcnt = 2;
+                    sample_kind = -1;
+                }
+            } else if (sample_kind < 0)
+            {   // suffix NAL (suffix SEI, end of sequence/bitstream): tail of the access unit written last
+                sample_kind = MP4E_SAMPLE_CONTINUATION;
+            }
+            ERR(mp4_h265_gather_nal(h, &iovcnt, nal, sizeof_nal));
+            break;
         }
-        break;
     }
-    return err;
+    if (sample_kind >= 0)
+        return mp4_h265_put_gathered(h, iovcnt, timeStamp90kHz_next, sample_kind);
+    if (iovcnt > 2)
+        return mp4_h265_hold_prefix(h, iovcnt);
+    return MP4E_STATUS_OK;
 }
 
 int mp4_h26x_write_nal(mp4_h26x_writer_t *h, const unsigned char *nal, int length, unsigned timeStamp90kHz_next)
 {
     const unsigned char *eof = nal + length;
     int payload_type, sizeof_nal, err = MP4E_STATUS_OK;
+    if (h->is_hevc)
+        return mp4_h265_write_nals(h, nal, length, timeStamp90kHz_next);
     for (;;nal++)
     {
 #if MINIMP4_TRANSCODE_SPS_ID
@@ -2333,11 +2852,6 @@ int mp4_h26x_write_nal(mp4_h26x_writer_t *h, const unsigned char *nal, int lengt
         nal = find_nal_unit(nal, (int)(eof - nal), &sizeof_nal);
         if (!sizeof_nal)
             break;
-        if (h->is_hevc)
-        {
-            ERR(mp4_h265_write_nal(h, nal, sizeof_nal, timeStamp90kHz_next));
-            continue;
-        }
         payload_type = nal[0] & 31;
         if (9 == payload_type)
             continue;  // access unit delimiter, nothing to be done